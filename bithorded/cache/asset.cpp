@@ -128,6 +128,15 @@ void bithorded::cache::CachingAsset::asyncRead(uint64_t offset, size_t size, uin
 	}
 }
 
+void bithorded::cache::CachingAsset::readAhead(uint64_t offset, uint64_t size, uint32_t timeout)
+{
+	auto cached_ = cached();
+	if (size && cached_ && (cached_->canRead(offset, size) == size))
+		return;
+	if (_upstream)
+		_upstream->readAhead(offset, size, timeout);
+}
+
 size_t bithorded::cache::CachingAsset::canRead(uint64_t offset, size_t size)
 {
 	if (_upstream)
@@ -138,6 +147,14 @@ size_t bithorded::cache::CachingAsset::canRead(uint64_t offset, size_t size)
 		return 0;
 }
 
+int bithorded::cache::CachingAsset::openLocalFile(uint64_t& offset, uint64_t& verified)
+{
+	if (auto cached_ = cached())
+		return cached_->openLocalFile(offset, verified);
+	else
+		return -1;
+}
+
 uint64_t bithorded::cache::CachingAsset::size()
 {
 	if (auto cached_ = cached())
@@ -164,7 +181,8 @@ void bithorded::cache::CachingAsset::upstreamDataArrived( IAsset::ReadCallback c
 {
 	auto cached_ = cached();
 	if (data->size() >= requested_size) {
-		if (cached_) {
+		// Coalesced reads upstream answer several reads with the same data, written only once
+		if (cached_ && (cached_->canRead(offset, data->size()) < data->size())) {
 			auto self = shared_from_this();
 			cached_->write(offset, data, [=]() {
 				if (cached_->hasRootHash())
@@ -66,8 +66,10 @@ public:
 	virtual void inspect(management::InfoList& target) const;
 
 	virtual void asyncRead(uint64_t offset, size_t size, uint32_t timeout, ReadCallback cb);
+	virtual void readAhead(uint64_t offset, uint64_t size, uint32_t timeout);
 
 	virtual size_t canRead(uint64_t offset, size_t size);
+	virtual int openLocalFile(uint64_t& offset, uint64_t& verified);
 
 	virtual uint64_t size();
 
@@ -40,6 +40,11 @@ public:
 
 	boost::asio::io_service& ioSvc() const { return _controller; }
 
+	/**
+	 * The io_service run by the workers, for posting work that completes on its own.
+	 */
+	boost::asio::io_service& jobService() { return _jobService; }
+
 	template<typename Job, typename CompletionHandler>
 	void submit(Job job, CompletionHandler handler) {
 		_jobService.post([=](){ runJob(job, handler); });
@@ -34,6 +34,10 @@ ssize_t IDataArray::write ( uint64_t offset, const string& buf ) {
 	return write(offset, buf.data(), buf.length());
 }
 
+int IDataArray::openReadOnly(uint64_t& offset) const {
+	return -1;
+}
+
 string bithorded::dataArrayToString ( const IDataArray& dataarray ) {
 	std::vector<byte> buf(dataarray.size());
 	dataarray.read(0, dataarray.size(), buf.data());
@@ -132,6 +136,18 @@ string RandomAccessFile::describe() {
 	return _path.string();
 }
 
+int RandomAccessFile::openReadOnly(uint64_t& offset) const
+{
+	if (_fd == -1)
+		return -1;
+	offset = 0;
+	// Through the open descriptor rather than the path, which may since lead to another file. Not
+	// dup(), which would share the write access of our own descriptor.
+	ostringstream fdPath;
+	fdPath << "/proc/self/fd/" << _fd;
+	return ::open(fdPath.str().c_str(), O_RDONLY|O_CLOEXEC);
+}
+
 const boost::filesystem::path& RandomAccessFile::path() const
 {
 	return _path;
@@ -167,6 +183,12 @@ ssize_t DataArraySlice::write ( uint64_t offset, const void* src, size_t size )
 	return _parent->write(_offset + offset, src, size);
 }
 
+int DataArraySlice::openReadOnly(uint64_t& offset) const {
+	auto fd = _parent->openReadOnly(offset);
+	offset += _offset;
+	return fd;
+}
+
 string DataArraySlice::describe() {
 	ostringstream buf;
 	buf << _parent->describe() << '[' << _offset << ':' << _size << ']';
@@ -54,6 +54,15 @@ public:
 	 * Describe the DataArray I.E. the name of the file
 	 */
 	virtual std::string describe() = 0;
+
+	/**
+	 * Opens a new read-only descriptor to the file backing the array, for handing out to local
+	 * clients. It reaches the same file as the array, even if renamed or replaced since. Returns -1
+	 * if the array is not backed by a plain file.
+	 *
+	 * @arg offset - set to where the array starts in the file
+	 */
+	virtual int openReadOnly(uint64_t& offset) const;
 };
 
 std::string dataArrayToString(const IDataArray& dataarray);
@@ -105,6 +114,7 @@ public:
 	virtual ssize_t read(uint64_t offset, size_t size, byte* buf) const;
 	virtual ssize_t write(uint64_t offset, const void* src, size_t size);
 	virtual std::string describe();
+	virtual int openReadOnly(uint64_t& offset) const;
 
 	/**
 	 * Return the path used to open the file
@@ -122,6 +132,7 @@ public:
 	virtual ssize_t read ( uint64_t offset, size_t size, byte* buf ) const;
 	virtual ssize_t write ( uint64_t offset, const void* src, size_t size );
     virtual std::string describe();
+	virtual int openReadOnly(uint64_t& offset) const;
 };
 
 }
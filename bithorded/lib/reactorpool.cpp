@@ -0,0 +1,44 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+
+#include "reactorpool.hpp"
+
+using namespace bithorded;
+
+ReactorPool::ReactorPool(boost::asio::io_service& controller, int reactors)
+	: _controller(controller), _next(0)
+{
+	for (int i = 0; i < reactors; ++i) {
+		_reactors.push_back(std::unique_ptr<Reactor>(new Reactor));
+		auto& ioSvc = _reactors.back()->ioSvc;
+		_threads.create_thread([&ioSvc]{ioSvc.run();});
+	}
+}
+
+ReactorPool::~ReactorPool() {
+	for (auto iter = _reactors.begin(); iter != _reactors.end(); iter++)
+		(*iter)->ioSvc.stop();
+	_threads.join_all();
+}
+
+boost::asio::io_service& ReactorPool::next() {
+	if (_reactors.empty())
+		return _controller;
+	auto& res = _reactors[_next]->ioSvc;
+	_next = (_next + 1) % _reactors.size();
+	return res;
+}
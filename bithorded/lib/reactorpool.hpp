@@ -0,0 +1,59 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+
+#ifndef BITHORDED_REACTORPOOL_HPP
+#define BITHORDED_REACTORPOOL_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <boost/thread.hpp>
+#include <memory>
+#include <vector>
+
+namespace bithorded {
+
+/**
+ * A set of event-loops, each run by a thread of its own, for connections to do their socket I/O,
+ * ciphering and parsing on. Each loop serializes the connections assigned to it, while decoded
+ * messages are still handled on the controller.
+ */
+class ReactorPool : boost::noncopyable
+{
+	struct Reactor {
+		boost::asio::io_service ioSvc;
+		boost::asio::io_service::work work;
+		Reactor() : work(ioSvc) {}
+	};
+
+	boost::asio::io_service& _controller;
+	std::vector< std::unique_ptr<Reactor> > _reactors;
+	boost::thread_group _threads;
+	std::size_t _next;
+public:
+	ReactorPool(boost::asio::io_service& controller, int reactors);
+	virtual ~ReactorPool();
+
+	std::size_t size() const { return _reactors.size(); }
+
+	/**
+	 * The io_service for the next connection, round-robin. The controller if there are no reactors.
+	 */
+	boost::asio::io_service& next();
+};
+
+}
+
+#endif // BITHORDED_REACTORPOOL_HPP
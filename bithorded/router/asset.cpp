@@ -19,6 +19,8 @@
 #include "asset.hpp"
 #include "router.hpp"
 
+#include <iomanip>
+#include <string.h>
 #include <utility>
 
 #include <lib/weak_fn.hpp>
@@ -27,21 +29,104 @@
 #include <lib/random.h>
 
 #include <bithorded/lib/log.hpp>
+#include <bithorded/server/server.hpp>
 
 using namespace bithorded::router;
 using namespace std;
 
-const int32_t DEFAULT_TIMEOUT_MS = 5000;
+const uint64_t RELAY_WINDOW = 8*1024*1024; // Bytes streamed from upstream ahead of the reader
 
 namespace bithorded { namespace router {
 	Logger assetLogger;
 } }
 
+std::string bithorded::router::describeCoalescing(const Counter& upstream, const Counter& downstream)
+{
+	ostringstream buf;
+	buf << upstream.autoScale() << " from upstream for " << downstream.autoScale() << " downstream";
+	if (downstream.value())
+		buf << ", " << setprecision(3) << ((double)upstream.value() / downstream.value()) << " per byte";
+	return buf.str();
+}
+
 void PendingRead::cancel()
 {
-	cb(offset, bithorde::NullBuffer::instance);
+	for (auto iter = waiters.begin(); iter != waiters.end(); iter++)
+		iter->cb(iter->offset, bithorde::NullBuffer::instance);
+}
+
+size_t PendingRead::complete(const std::shared_ptr<bithorde::IBuffer>& data)
+{
+	size_t passed = 0;
+	for (auto iter = waiters.begin(); iter != waiters.end(); iter++) {
+		auto skip = iter->offset - offset;
+		if (skip >= data->size()) {
+			iter->cb(iter->offset, bithorde::NullBuffer::instance);
+			continue;
+		}
+		auto size = std::min(iter->size, data->size() - skip);
+		if (size == data->size())
+			iter->cb(iter->offset, data);
+		else
+			iter->cb(iter->offset, std::make_shared<bithorde::BufferSlice>(data, **data + skip, size));
+		passed += size;
+	}
+	return passed;
 }
 
+namespace bithorded { namespace router {
+
+/**
+ * A downstream read spanning several PendingReads, answered once all parts have arrived, with as
+ * much of the range as arrived unbroken from its start.
+ */
+class ReadAssembly : public std::enable_shared_from_this<ReadAssembly> {
+	uint64_t _offset;
+	IAsset::ReadCallback _cb;
+	std::vector<size_t> _sizes;
+	std::vector< std::shared_ptr<bithorde::IBuffer> > _parts;
+	size_t _missing;
+public:
+	ReadAssembly(uint64_t offset, const IAsset::ReadCallback& cb, size_t parts) :
+		_offset(offset), _cb(cb), _sizes(parts), _parts(parts), _missing(parts)
+	{}
+
+	/**
+	 * The callback for part /i/, of /size/ bytes
+	 */
+	IAsset::ReadCallback part(size_t i, size_t size) {
+		_sizes[i] = size;
+		auto self = shared_from_this();
+		return [self, i](int64_t, const std::shared_ptr<bithorde::IBuffer>& data) {
+			self->_parts[i] = data;
+			if (--self->_missing == 0)
+				self->complete();
+		};
+	}
+
+private:
+	void complete() {
+		size_t size = 0, parts = 0;
+		while (parts < _parts.size()) {
+			auto got = _parts[parts]->size();
+			size += got;
+			if (got < _sizes[parts++])
+				break; // The rest would not follow on
+		}
+		if (!size)
+			return _cb(_offset, bithorde::NullBuffer::instance);
+		auto res = std::make_shared<bithorde::MemoryBuffer>(size);
+		auto dst = **res;
+		for (size_t i=0; i < parts; i++) {
+			memcpy(dst, **_parts[i], _parts[i]->size());
+			dst += _parts[i]->size();
+		}
+		_cb(_offset, res);
+	}
+};
+
+} }
+
 UpstreamBinding::UpstreamBinding(std::shared_ptr<ForwardedAsset> parent, std::string peerName, bithorded::Client::Ptr f, BitHordeIds ids) :
 	ReadAsset(f, ids)
 {
@@ -51,7 +136,7 @@ UpstreamBinding::UpstreamBinding(std::shared_ptr<ForwardedAsset> parent, std::st
 		if (auto p = parent_.lock()) { p->onUpstreamStatus(peerName, status); }
 	});
 	_dataConnection = dataArrived.connect([=](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag) {
-		if (auto p = parent_.lock()) { p->onData(offset, data, tag); }
+		if (auto p = parent_.lock()) { p->onData(peerName, offset, data, tag); }
 	});
 }
 
@@ -60,15 +145,29 @@ ForwardedAsset::ForwardedAsset(Router& router, const BitHordeIds& ids) :
 	_requestedIds(ids),
 	_reqParameters(NULL),
 	_size(-1),
+	_inconclusive(false),
 	_upstream(),
-	_pendingReads()
+	_pendingReads(),
+	_readSerial(0),
+	_largestRead(0),
+	_readTimer(router.server().timerSvc(), [this](const boost::posix_time::ptime& now) { onDue(now); }),
+	_sendFailed(false),
+	_upstreamBytes("bytes"),
+	_downstreamBytes("bytes")
 {
 }
 
 ForwardedAsset::~ForwardedAsset()
 {
 	for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); iter++)
-		iter->cancel();
+		iter->second.cancel();
+	for (auto iter=_relays.begin(); iter != _relays.end(); iter++) {
+		auto upstream = _upstream.find(iter->peername);
+		if (upstream != _upstream.end())
+			upstream->second.cancelStream(iter->tag);
+		for (auto waiter = iter->waiting.begin(); waiter != iter->waiting.end(); waiter++)
+			waiter->cb(waiter->offset, bithorde::NullBuffer::instance);
+	}
 }
 
 bool bithorded::router::ForwardedAsset::hasUpstream(const std::string peername)
@@ -87,16 +186,13 @@ void bithorded::router::ForwardedAsset::apply(const bithorded::AssetRequestParam
 	auto& friends = _router.connectedFriends();
 	_reqParameters = &current;
 
-	int32_t timeout(DEFAULT_TIMEOUT_MS);
-	if ((status->status() != bithorde::SUCCESS) && (!current.deadline.is_special())) {
-		timeout = (current.deadline - boost::posix_time::microsec_clock::universal_time()).total_milliseconds();
-	}
-
 	for (auto iter = friends.begin(); iter != friends.end(); iter++) {
 		auto f = iter->second;
 
-		if (old.isRequester(f) || current.isRequester(f))
+		if (old.isRequester(f) || current.isRequester(f)) {
+			_inconclusive = true; // Not searched, since asking for the asset itself
 			continue;
+		}
 
 		auto peername = f->peerName();
 		auto upstream = _upstream.find(peername);
@@ -108,7 +204,7 @@ void bithorded::router::ForwardedAsset::apply(const bithorded::AssetRequestParam
 				dropUpstream(peername);
 			}
 		} else if (bind_new) {
-			addUpstream(f, timeout, requesters_);
+			addUpstream(f, bindTimeout(f), requesters_);
 		}
 	}
 	updateStatus();
@@ -116,11 +212,15 @@ void bithorded::router::ForwardedAsset::apply(const bithorded::AssetRequestParam
 
 void ForwardedAsset::addUpstream(const bithorded::Client::Ptr& f)
 {
-	int32_t timeout(DEFAULT_TIMEOUT_MS);
-	if ((status->status() != bithorde::SUCCESS) && (!_reqParameters->deadline.is_special())) {
-		timeout = (_reqParameters->deadline - boost::posix_time::microsec_clock::universal_time()).total_milliseconds();
-	}
-	addUpstream(f, timeout, requestTrace(_reqParameters->requesters));
+	addUpstream(f, bindTimeout(f), requestTrace(_reqParameters->requesters));
+}
+
+int32_t ForwardedAsset::bindTimeout(const bithorded::Client::Ptr& f) const
+{
+	// Within the deadline of the downstream, if still searching. Otherwise as measured for the friend.
+	if ((status->status() != bithorde::SUCCESS) && (!_reqParameters->deadline.is_special()))
+		return (_reqParameters->deadline - boost::posix_time::microsec_clock::universal_time()).total_milliseconds();
+	return f->bindTimeout();
 }
 
 void bithorded::router::ForwardedAsset::addUpstream(const bithorded::Client::Ptr& f, int32_t timeout, const bithorde::RouteTrace requesters) {
@@ -130,8 +230,10 @@ void bithorded::router::ForwardedAsset::addUpstream(const bithorded::Client::Ptr
 	auto inserted = _upstream.emplace(std::piecewise_construct, std::make_tuple(peername), std::make_tuple	(shared_from_this(), peername, f, _requestedIds));
 	BOOST_ASSERT( inserted.second );
 
-	if ( !f->bind(inserted.first->second, timeout, requesters) )
+	if ( !f->bind(inserted.first->second, timeout, requesters) ) {
 		_upstream.erase(peername);
+		_inconclusive = true;
+	}
 }
 
 void bithorded::router::ForwardedAsset::onUpstreamStatus(const string& peername, const bithorde::AssetStatus& status)
@@ -142,14 +244,17 @@ void bithorded::router::ForwardedAsset::onUpstreamStatus(const string& peername,
 		}
 		if ( overlaps(_reqParameters->requesters, status.servers().begin(), status.servers().end()) ) {
 			BOOST_LOG_SEV(assetLogger, bithorded::debug) << idsToString(_requestedIds) << " Loop detected " << peername;
+			_inconclusive = true;
 			dropUpstream(peername);
 		} else {
 			BOOST_LOG_SEV(assetLogger, bithorded::debug) << idsToString(_requestedIds) << " Found upstream " << peername;
+			_router.found(_requestedIds);
 			if (status.has_size()) {
 				if (_size == -1) {
 					_size = status.size();
 				} else if (_size != (int64_t)status.size()) {
 					BOOST_LOG_SEV(assetLogger, bithorded::warning) << peername << " " << idsToString(_requestedIds) << " responded with mismatching size, ignoring...";
+					_inconclusive = true;
 					dropUpstream(peername);
 				}
 			} else if (status.ids().size()) {
@@ -158,11 +263,28 @@ void bithorded::router::ForwardedAsset::onUpstreamStatus(const string& peername,
 		}
 	} else {
 		BOOST_LOG_SEV(assetLogger, bithorded::debug) << idsToString(_requestedIds) << " Failed upstream " << peername;
+		if (status.status() == bithorde::Status::NOTFOUND)
+			_missingAt.insert(peername);
+		else
+			_inconclusive = true;
 		dropUpstream(peername);
+		if (_upstream.empty() && !_inconclusive && searchedAll())
+			_router.notFound(_requestedIds);
 	}
 	updateStatus();
 }
 
+bool ForwardedAsset::searchedAll() const
+{
+	// Every friend connected was asked, and answered it does not have the asset
+	auto& friends = _router.connectedFriends();
+	for (auto iter = friends.begin(); iter != friends.end(); iter++) {
+		if (!_missingAt.count(iter->first))
+			return false;
+	}
+	return true;
+}
+
 void bithorded::router::ForwardedAsset::updateStatus() {
 	bithorde::Status status = _upstream.empty() ? bithorde::Status::NOTFOUND : bithorde::Status::NONE;
 	for (auto iter=_upstream.begin(); iter!=_upstream.end(); iter++) {
@@ -200,40 +322,340 @@ size_t bithorded::router::ForwardedAsset::canRead(uint64_t offset, size_t size)
 	return size;
 }
 
-void bithorded::router::ForwardedAsset::asyncRead(uint64_t offset, size_t size, uint32_t timeout, ReadCallback cb)
+std::map<std::string, UpstreamBinding>::iterator ForwardedAsset::bestUpstream()
 {
-	if (_upstream.empty())
-		return cb(-1, bithorde::NullBuffer::instance);
-	auto chosen = _upstream.begin();
+	auto chosen = _upstream.end();
 	uint32_t current_best = 1000*60*60*24;
 	for (auto iter = _upstream.begin(); iter != _upstream.end(); iter++) {
 		auto& a = iter->second;
 		if (a.status != bithorde::SUCCESS)
 			continue;
-		if (current_best > a.readResponseTime.value()) {
+		if ((chosen == _upstream.end()) || (current_best > a.readResponseTime.value())) {
 			current_best = a.readResponseTime.value();
 			chosen = iter;
 		}
 	}
-	PendingRead read;
+	return chosen;
+}
+
+void bithorded::router::ForwardedAsset::asyncRead(uint64_t offset, size_t size, uint32_t timeout, ReadCallback cb)
+{
+	if (_upstream.empty())
+		return cb(-1, bithorde::NullBuffer::instance);
+	if (readStreamed(offset, size, cb))
+		return;
+	if ((_size > 0) && (offset < (uint64_t)_size))
+		size = std::min<uint64_t>(size, _size - offset);
+
+	// Ranges already on the way from upstream, by offset. None starts further back than the largest.
+	auto end = offset + size;
+	std::vector< std::map<ReadKey, PendingRead>::iterator > inFlight;
+	auto from = (offset > _largestRead) ? (offset - _largestRead) : 0;
+	for (auto iter = _pendingReads.lower_bound(ReadKey(from, 0, 0)); iter != _pendingReads.end(); iter++) {
+		if (iter->second.offset >= end)
+			break;
+		if (iter->second.offset + iter->second.size > offset)
+			inFlight.push_back(iter);
+	}
+	if (inFlight.empty())
+		return forward(offset, size, timeout, ReadWaiter{offset, size, cb});
+	auto parts = splitRange(offset, end, inFlight.begin(), inFlight.end(), [](std::map<ReadKey, PendingRead>::iterator read) {
+		return std::make_pair(read->second.offset, read->second.offset + read->second.size);
+	});
+	if ((parts.size() == 1) && (parts.front().second != inFlight.end()))
+		return (*parts.front().second)->second.waiters.push_back(ReadWaiter{offset, size, cb});
+
+	// Waits for the parts in flight, and fetches only the gaps between them
+	auto assembly = std::make_shared<ReadAssembly>(offset, cb, parts.size());
+	std::vector<ReadWaiter> gaps;
+	auto pos = offset;
+	for (size_t i=0; i < parts.size(); i++) {
+		size_t partSize = parts[i].first - pos;
+		ReadWaiter waiter{pos, partSize, assembly->part(i, partSize)};
+		if (parts[i].second != inFlight.end())
+			(*parts[i].second)->second.waiters.push_back(waiter);
+		else
+			gaps.push_back(waiter);
+		pos = parts[i].first;
+	}
+	// Only once attached, since forwarding may fail at once
+	for (auto iter = gaps.begin(); iter != gaps.end(); iter++)
+		forward(iter->offset, iter->size, timeout, *iter);
+}
+
+void ForwardedAsset::forward(uint64_t offset, size_t size, uint32_t timeout, const ReadWaiter& waiter)
+{
+	// Striped over all upstreams having the asset, by how soon each is expected to deliver it
+	auto chosen = leastLoaded(_upstream.begin(), _upstream.end(), size,
+		[](const std::pair<const std::string, UpstreamBinding>& upstream) {
+			return (upstream.second.status == bithorde::SUCCESS) ? &upstream.second.load : NULL;
+		});
+	if (chosen == _upstream.end())
+		chosen = _upstream.begin();
+	auto client = chosen->second.client();
+	if (client) {
+		size = std::min(size, client->maxChunkSize());
+		if (!timeout)
+			timeout = client->readTimeout();
+	}
+	_largestRead = std::max(_largestRead, size);
+
+	auto now = boost::posix_time::microsec_clock::universal_time();
+	ReadKey key(offset, size, _readSerial++);
+	auto& read = _pendingReads[key];
 	read.offset = offset;
 	read.size = size;
-	read.cb = cb;
-	_pendingReads.push_back(read);
-	chosen->second.aSyncRead(offset, size, timeout);
+	read.timeout = timeout;
+	read.waiters.push_back(waiter);
+	read.requested = now;
+	read.deadline = now + boost::posix_time::milliseconds(timeout);
+	read.due = _schedule.end();
+	auto& hedges = _router.hedges();
+	if (hedges.enabled()) {
+		// Sent to a second upstream as well, if slower than the chosen one usually is
+		if (auto delay = client ? hedgeDelay(client->readLatency) : 0)
+			read.hedgeAt = now + boost::posix_time::milliseconds(delay);
+		hedges.read();
+	}
+	schedule(read, key, read.hedgeAt.is_special() ? read.deadline : read.hedgeAt);
+	if (!send(read, key, chosen, false))
+		finish(_pendingReads.find(key), bithorde::NullBuffer::instance);
+}
+
+bool ForwardedAsset::send(PendingRead& read, const ReadKey& key, std::map<std::string, UpstreamBinding>::iterator upstream, bool hedge)
+{
+	auto& side = hedge ? read.hedge : read.upstream;
+	side.peername = upstream->first;
+	side.sent = boost::posix_time::microsec_clock::universal_time();
+	upstream->second.load.sent(read.size);
+
+	// A failure to send is passed to onData at once, before the tag is known
+	_sendingTo = upstream->first;
+	_sendFailed = false;
+	int32_t timeout = (read.deadline - side.sent).total_milliseconds();
+	auto tag = (timeout > 0) ? upstream->second.aSyncRead(read.offset, read.size, timeout) : -1;
+	_sendingTo.clear();
+	if ((tag < 0) || _sendFailed) {
+		upstream->second.load.arrived(read.size, 0, side.sent);
+		side = UpstreamRead();
+		return false;
+	}
+	side.tag = tag;
+	upstream->second.reads[tag] = key;
+	return true;
+}
+
+void ForwardedAsset::schedule(PendingRead& read, const ReadKey& key, const boost::posix_time::ptime& at)
+{
+	if (read.due != _schedule.end())
+		_schedule.erase(read.due);
+	read.due = _schedule.emplace(at, key);
+	_readTimer.arm(at);
+}
+
+void ForwardedAsset::withdraw(PendingRead& read, UpstreamRead& side)
+{
+	auto upstream = _upstream.find(side.peername);
+	if (upstream != _upstream.end()) {
+		upstream->second.cancelRead(side.tag);
+		upstream->second.reads.erase(side.tag);
+		upstream->second.load.arrived(read.size, 0, side.sent);
+	}
+	side = UpstreamRead();
+}
+
+void ForwardedAsset::finish(std::map<ReadKey, PendingRead>::iterator pending, const std::shared_ptr<bithorde::IBuffer>& data)
+{
+	// Out of the way before passed on, since waiters may read on
+	auto read = std::move(pending->second);
+	_pendingReads.erase(pending);
+	if (read.due != _schedule.end())
+		_schedule.erase(read.due);
+	if (data->size())
+		_router.readLatency.post((boost::posix_time::microsec_clock::universal_time() - read.requested).total_milliseconds());
+	else
+		_router.readLatency.timedOut();
+	auto passed = read.complete(data);
+	_downstreamBytes += passed;
+	_router.downstreamBytes += passed;
 }
 
-void bithorded::router::ForwardedAsset::onData( uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag ) {
-	for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); ) {
-		if (iter->offset == offset) {
-			iter->cb(offset, data);
-			iter = _pendingReads.erase(iter); // Will increase the iterator
+void ForwardedAsset::onDue(const boost::posix_time::ptime& now)
+{
+	while (!_schedule.empty() && (_schedule.begin()->first <= now)) {
+		auto pending = _pendingReads.find(_schedule.begin()->second);
+		_schedule.erase(_schedule.begin());
+		if (pending == _pendingReads.end())
+			continue;
+		auto& read = pending->second;
+		read.due = _schedule.end();
+		if (!read.hedgeAt.is_special()) {
+			read.hedgeAt = boost::posix_time::ptime();
+			hedge(read, pending->first, now);
+			schedule(read, pending->first, read.deadline);
 		} else {
-			iter++;	// Move to next
+			BOOST_LOG_SEV(assetLogger, bithorded::debug) << idsToString(_requestedIds) << ':' << read.upstream.peername << " read timed out at " << read.offset;
+			withdraw(read, read.upstream);
+			if (!read.hedge.peername.empty())
+				withdraw(read, read.hedge);
+			finish(pending, bithorde::NullBuffer::instance);
 		}
 	}
 }
 
+void ForwardedAsset::hedge(PendingRead& read, const ReadKey& key, const boost::posix_time::ptime& now)
+{
+	const auto& first = read.upstream.peername;
+	auto second = leastLoaded(_upstream.begin(), _upstream.end(), read.size,
+		[&](const std::pair<const std::string, UpstreamBinding>& upstream) {
+			return ((upstream.first != first) && (upstream.second.status == bithorde::SUCCESS)) ? &upstream.second.load : NULL;
+		});
+	if ((second != _upstream.end()) && _router.hedges().spend())
+		send(read, key, second, true);
+}
+
+bool ForwardedAsset::readStreamed(uint64_t offset, size_t size, IAsset::ReadCallback cb)
+{
+	for (auto relay = _relays.begin(); relay != _relays.end(); relay++) {
+		if (relay->consumed != offset)
+			continue;
+		auto chunk = _streamed.find(offset);
+		if (chunk != _streamed.end()) {
+			auto data = chunk->second;
+			_streamed.erase(chunk);
+			if (data->size() > size) {
+				_streamed[offset+size] = std::make_shared<bithorde::BufferSlice>(data, **data + size, data->size() - size);
+				data = std::make_shared<bithorde::BufferSlice>(data, **data, size);
+			}
+			relay->consumed = offset + data->size();
+			if (relay->consumed >= relay->end)
+				closeRelay(relay);
+			else
+				extendRelay(*relay);
+			_downstreamBytes += data->size();
+			_router.downstreamBytes += data->size();
+			cb(offset, data);
+			return true;
+		} else if (relay->position == offset) {
+			// Not yet arrived, served by onStreamData
+			relay->waiting.push_back(ReadWaiter{offset, size, cb});
+			return true;
+		}
+	}
+	return false;
+}
+
+void ForwardedAsset::readAhead(uint64_t offset, uint64_t size, uint32_t timeout)
+{
+	auto relay = _relays.begin();
+	while ((relay != _relays.end()) && (relay->consumed != offset))
+		relay++;
+
+	if (size == 0) {
+		if (relay != _relays.end())
+			closeRelay(relay);
+		return;
+	}
+
+	uint64_t end = offset + size;
+	if ((_size >= 0) && (end > (uint64_t)_size))
+		end = _size;
+	if (relay != _relays.end()) {
+		relay->end = std::max(relay->end, end);
+		extendRelay(*relay);
+		return;
+	}
+
+	auto upstream = bestUpstream();
+	if (upstream == _upstream.end())
+		return;
+	auto tag = upstream->second.aSyncStream(offset, std::min(end - offset, RELAY_WINDOW), timeout);
+	if (tag < 0)
+		return; // Upstream does not stream, reads are forwarded one by one
+	_relays.push_back(StreamRelay{upstream->first, tag, offset, offset, end, timeout});
+}
+
+void ForwardedAsset::extendRelay(StreamRelay& relay)
+{
+	auto upstream = _upstream.find(relay.peername);
+	if (upstream != _upstream.end())
+		upstream->second.extendStream(relay.tag, std::min(relay.end, relay.consumed + RELAY_WINDOW));
+}
+
+void ForwardedAsset::closeRelay(std::list<StreamRelay>::iterator relay)
+{
+	auto upstream = _upstream.find(relay->peername);
+	if (upstream != _upstream.end())
+		upstream->second.cancelStream(relay->tag);
+	_streamed.erase(_streamed.lower_bound(relay->consumed), _streamed.lower_bound(relay->position));
+	auto waiting = std::move(relay->waiting);
+	auto timeout = relay->timeout;
+	_relays.erase(relay);
+	// Reads waiting for the stream are forwarded one by one instead
+	for (auto iter=waiting.begin(); iter != waiting.end(); iter++)
+		asyncRead(iter->offset, iter->size, timeout, iter->cb);
+}
+
+void bithorded::router::ForwardedAsset::onData( const string& peername, uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag ) {
+	for (auto relay = _relays.begin(); relay != _relays.end(); relay++) {
+		if ((relay->peername == peername) && (relay->tag == tag))
+			return onStreamData(relay, offset, data);
+	}
+	if (!_sendingTo.empty() && (_sendingTo == peername)) {
+		_sendFailed = true; // Handled by send()
+		return;
+	}
+	auto upstream = _upstream.find(peername);
+	if (upstream == _upstream.end())
+		return;
+	auto key = upstream->second.reads.find(tag);
+	if (key == upstream->second.reads.end())
+		return; // Given up on
+	auto pending = _pendingReads.find(key->second);
+	upstream->second.reads.erase(key);
+	if (pending == _pendingReads.end())
+		return;
+	auto& read = pending->second;
+	_upstreamBytes += data->size();
+	_router.upstreamBytes += data->size();
+
+	bool hedged = (read.hedge.peername == peername) && (read.hedge.tag == tag);
+	auto& by = hedged ? read.hedge : read.upstream;
+	auto& other = hedged ? read.upstream : read.hedge;
+	upstream->second.load.arrived(read.size, data->size(), by.sent);
+	if (!other.peername.empty()) {
+		if (!data->size()) {
+			// Left to the other upstream
+			if (!hedged)
+				read.upstream = read.hedge;
+			read.hedge = UpstreamRead();
+			return;
+		}
+		withdraw(read, other);
+		if (hedged)
+			_router.hedges().won();
+	}
+	finish(pending, data);
+}
+
+void ForwardedAsset::onStreamData(std::list<StreamRelay>::iterator relay, uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data)
+{
+	if (data->size()) {
+		_upstreamBytes += data->size();
+		_router.upstreamBytes += data->size();
+		auto waiting = std::move(relay->waiting);
+		relay->waiting.clear();
+		relay->position = offset + data->size();
+		_streamed[offset] = data;
+		auto timeout = relay->timeout; // The relay may be closed by the reads
+		for (auto iter=waiting.begin(); iter != waiting.end(); iter++)
+			asyncRead(iter->offset, iter->size, timeout, iter->cb);
+	} else {
+		BOOST_LOG_SEV(assetLogger, bithorded::debug) << idsToString(_requestedIds) << ':' << relay->peername << " stream failed at " << relay->position;
+		closeRelay(relay);
+	}
+}
+
 uint64_t bithorded::router::ForwardedAsset::size()
 {
 	return _size;
@@ -242,6 +664,8 @@ uint64_t bithorded::router::ForwardedAsset::size()
 void ForwardedAsset::inspect(bithorded::management::InfoList& target) const
 {
 	target.append("type") << "forwarded";
+	target.append("coalescing") << describeCoalescing(_upstreamBytes, _downstreamBytes);
+	target.append("pendingReads") << _pendingReads.size();
 	inspect_upstreams(target);
 }
 
@@ -250,7 +674,14 @@ void ForwardedAsset::inspect_upstreams(bithorded::management::InfoList& target)
 	for (auto iter = _upstream.begin(); iter != _upstream.end(); iter++) {
 		ostringstream buf;
 		buf << "upstream_" << iter->first;
-		target.append(buf.str()) << bithorde::Status_Name(iter->second.status) << ", responseTime: " << iter->second.readResponseTime;
+		const auto& load = iter->second.load;
+		target.append(buf.str()) << bithorde::Status_Name(iter->second.status) << ", responseTime: " << iter->second.readResponseTime
+			<< ", throughput: " << TypedValue(load.throughput(), "B/s").autoScale() << ", inFlight: " << load.inFlight();
+	}
+	for (auto iter = _relays.begin(); iter != _relays.end(); iter++) {
+		ostringstream buf;
+		buf << "stream_" << iter->peername << '_' << iter->tag;
+		target.append(buf.str()) << iter->consumed << '-' << iter->end << ", " << (iter->position - iter->consumed) << " bytes ahead";
 	}
 }
 
@@ -258,6 +689,7 @@ void ForwardedAsset::dropUpstream(const string& peername)
 {
 	auto upstream = _upstream.find(peername);
 	if (upstream != _upstream.end()) {
+		// Fails relayed streams and their waiting reads, through onData
 		upstream->second.cancelRequests();
 		_upstream.erase(upstream);
 	}
@@ -19,10 +19,15 @@
 
 #include <map>
 #include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "../server/asset.hpp"
 #include "../server/client.hpp"
 #include <bithorded/lib/subscribable.hpp>
+#include "stripe.hpp"
 #include "../../lib/asset.h"
 #include "../../lib/client.h"
 
@@ -30,21 +35,81 @@ namespace bithorded {
 namespace router {
 class Router;
 
-struct PendingRead {
+/**
+ * A read sent to an upstream
+ */
+struct UpstreamRead {
+	std::string peername;
+	int tag = -1;
+	boost::posix_time::ptime sent;
+};
+
+/**
+ * A downstream read, of a part of a PendingRead
+ */
+struct ReadWaiter {
 	uint64_t offset;
 	size_t size;
 	IAsset::ReadCallback cb;
+};
+
+/**
+ * Orders reads in flight by (offset, size), and then by the order they were sent in
+ */
+typedef std::tuple<uint64_t, size_t, uint64_t> ReadKey;
+typedef std::multimap<boost::posix_time::ptime, ReadKey> ReadSchedule;
+
+/**
+ * A range requested from upstream, and the downstream reads waiting for it
+ */
+struct PendingRead {
+	uint64_t offset;
+	size_t size;
+	uint32_t timeout;
+	std::vector<ReadWaiter> waiters;
+	boost::posix_time::ptime requested;
+	boost::posix_time::ptime deadline; // When given up, if not answered
+	UpstreamRead upstream;
+	UpstreamRead hedge; // Without peername unless hedged
+	boost::posix_time::ptime hedgeAt; // When to hedge, if not yet done
+	ReadSchedule::iterator due; // The next of hedgeAt and deadline
 
 	void cancel();
+
+	/**
+	 * Passes each waiter its part of /data/, arrived from /offset/. Returns the bytes passed on.
+	 */
+	size_t complete(const std::shared_ptr<bithorde::IBuffer>& data);
+};
+
+/**
+ * A Read.Stream from an upstream, fetching ahead of a reader downstream
+ */
+struct StreamRelay {
+	std::string peername;
+	int tag;
+	uint64_t consumed; // Next offset to be read downstream
+	uint64_t position; // Next offset expected from upstream
+	uint64_t end; // End of the range hinted downstream
+	uint32_t timeout;
+	std::vector<ReadWaiter> waiting; // Reads of /position/, not yet arrived
 };
 
 class ForwardedAsset;
 
+/**
+ * Bytes fetched from upstream against bytes passed downstream, for inspection
+ */
+std::string describeCoalescing(const Counter& upstream, const Counter& downstream);
+
 class UpstreamBinding : public bithorde::ReadAsset {
     boost::signals2::scoped_connection _statusConnection;
     boost::signals2::scoped_connection _dataConnection;
 public:
     UpstreamBinding(std::shared_ptr<ForwardedAsset>, std::string, bithorded::Client::Ptr, BitHordeIds);
+
+    UpstreamLoad load; // Of the reads striped to this upstream
+    std::unordered_map<int, ReadKey> reads; // Pending, by tag
 };
 
 class ForwardedAsset : public bithorded::IAsset, public boost::noncopyable, public std::enable_shared_from_this<ForwardedAsset>
@@ -54,8 +119,19 @@ class ForwardedAsset : public bithorded::IAsset, public boost::noncopyable, publ
 	BitHordeIds _requestedIds;
 	const AssetRequestParameters* _reqParameters;
 	int64_t _size;
+	bool _inconclusive; // Whether any upstream failed other than by not having the asset
+	std::unordered_set<std::string> _missingAt; // Friends having answered NOTFOUND
 	std::map<std::string, UpstreamBinding> _upstream;
-	std::list<PendingRead> _pendingReads;
+	std::map<ReadKey, PendingRead> _pendingReads;
+	uint64_t _readSerial;
+	size_t _largestRead; // Of the reads ever forwarded, to bound searches for overlaps
+	ReadSchedule _schedule;
+	Timer _readTimer;
+	std::string _sendingTo; // Upstream being sent a read
+	bool _sendFailed; // Whether sending failed at once
+	std::list<StreamRelay> _relays;
+	std::map<uint64_t, std::shared_ptr<bithorde::IBuffer>> _streamed;
+	Counter _upstreamBytes, _downstreamBytes;
 public:
 	typedef std::shared_ptr<ForwardedAsset> Ptr;
 	typedef std::weak_ptr<ForwardedAsset> WeakPtr;
@@ -68,6 +144,7 @@ public:
 
 	virtual size_t canRead(uint64_t offset, size_t size);
 	virtual void asyncRead(uint64_t offset, size_t size, uint32_t timeout, bithorded::IAsset::ReadCallback cb);
+	virtual void readAhead(uint64_t offset, uint64_t size, uint32_t timeout);
 	virtual uint64_t size();
 
 	virtual void inspect(management::InfoList& target) const;
@@ -78,9 +155,23 @@ public:
 	void addUpstream(const bithorded::Client::Ptr& f);
 private:
 	void addUpstream(const bithorded::Client::Ptr& f, int32_t timeout, const bithorde::RouteTrace requesters);
+	int32_t bindTimeout(const bithorded::Client::Ptr& f) const;
 	void dropUpstream(const std::string& peername);
-	void onData(uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag);
+	std::map<std::string, UpstreamBinding>::iterator bestUpstream();
+	void forward(uint64_t offset, size_t size, uint32_t timeout, const ReadWaiter& waiter);
+	bool send(PendingRead& read, const ReadKey& key, std::map<std::string, UpstreamBinding>::iterator upstream, bool hedge);
+	void schedule(PendingRead& read, const ReadKey& key, const boost::posix_time::ptime& at);
+	void withdraw(PendingRead& read, UpstreamRead& side);
+	void finish(std::map<ReadKey, PendingRead>::iterator pending, const std::shared_ptr<bithorde::IBuffer>& data);
+	void onData(const std::string& peername, uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag);
+	void onDue(const boost::posix_time::ptime& now);
+	void hedge(PendingRead& read, const ReadKey& key, const boost::posix_time::ptime& now);
+	void onStreamData(std::list<StreamRelay>::iterator relay, uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data);
+	bool readStreamed(uint64_t offset, size_t size, bithorded::IAsset::ReadCallback cb);
+	void extendRelay(StreamRelay& relay);
+	void closeRelay(std::list<StreamRelay>::iterator relay);
 	void onUpstreamStatus(const std::string& peername, const bithorde::AssetStatus& status);
+	bool searchedAll() const;
 	bithorde::RouteTrace requestTrace(const std::unordered_set< uint64_t >& requesters) const;
 	void updateStatus();
 };
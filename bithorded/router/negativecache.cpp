@@ -0,0 +1,76 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "negativecache.hpp"
+
+using namespace bithorded::router;
+namespace ptime = boost::posix_time;
+
+NegativeCache::NegativeCache(std::size_t capacity, const ptime::time_duration& ttl) :
+	_capacity(capacity),
+	_ttl(ttl),
+	_hits(0),
+	_misses(0)
+{
+}
+
+void NegativeCache::add(const BinId& id, const ptime::ptime& now)
+{
+	if (id.empty() || !_capacity)
+		return;
+	erase(id);
+	_index[id] = _entries.insert(_entries.end(), std::make_pair(now + _ttl, id));
+	while (_index.size() > _capacity) {
+		_index.erase(_entries.front().second);
+		_entries.pop_front();
+	}
+}
+
+bool NegativeCache::contains(const BinId& id, const ptime::ptime& now)
+{
+	expire(now);
+	if (_index.count(id)) {
+		_hits++;
+		return true;
+	} else {
+		_misses++;
+		return false;
+	}
+}
+
+void NegativeCache::erase(const BinId& id)
+{
+	auto entry = _index.find(id);
+	if (entry != _index.end()) {
+		_entries.erase(entry->second);
+		_index.erase(entry);
+	}
+}
+
+void NegativeCache::clear()
+{
+	_entries.clear();
+	_index.clear();
+}
+
+void NegativeCache::expire(const ptime::ptime& now)
+{
+	// All have the same ttl, so the oldest expire first
+	while (!_entries.empty() && (_entries.front().first <= now)) {
+		_index.erase(_entries.front().second);
+		_entries.pop_front();
+	}
+}
@@ -0,0 +1,76 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef BITHORDED_ROUTER_NEGATIVECACHE_HPP
+#define BITHORDED_ROUTER_NEGATIVECACHE_HPP
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+#include "../../lib/hashes.h"
+
+namespace bithorded {
+namespace router {
+
+/**
+ * Assets recently searched for among friends and not found, so that binds polling for them can
+ * be answered at once instead of searching again. Holds at most /capacity/ ids, the oldest
+ * forgotten first, each for /ttl/.
+ */
+class NegativeCache {
+	typedef std::list< std::pair<boost::posix_time::ptime, BinId> > Entries; // Oldest first
+	std::size_t _capacity;
+	boost::posix_time::time_duration _ttl;
+	Entries _entries;
+	std::unordered_map<BinId, Entries::iterator> _index;
+	uint64_t _hits, _misses;
+public:
+	NegativeCache(std::size_t capacity, const boost::posix_time::time_duration& ttl);
+
+	/**
+	 * Remember /id/ as not found, as of /now/
+	 */
+	void add(const BinId& id, const boost::posix_time::ptime& now);
+
+	/**
+	 * Whether /id/ was not found within the ttl before /now/. Counted as a hit or miss.
+	 */
+	bool contains(const BinId& id, const boost::posix_time::ptime& now);
+
+	/**
+	 * Forget /id/, found after all
+	 */
+	void erase(const BinId& id);
+
+	/**
+	 * Forget all, since anything may be found now
+	 */
+	void clear();
+
+	std::size_t size() const { return _index.size(); }
+	uint64_t hits() const { return _hits; }
+	uint64_t misses() const { return _misses; }
+private:
+	void expire(const boost::posix_time::ptime& now);
+};
+
+}
+}
+
+#endif // BITHORDED_ROUTER_NEGATIVECACHE_HPP
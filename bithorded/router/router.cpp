@@ -35,6 +35,8 @@ using namespace bithorded::router;
 using namespace std;
 
 const ptime::seconds RECONNECT_INTERVAL(5);
+const size_t NEGATIVE_CACHE_SIZE(4096); // Assets remembered as not found
+const ptime::seconds NEGATIVE_CACHE_TTL(10);
 
 namespace bithorded { namespace router {
 	Logger routerLog;
@@ -43,6 +45,7 @@ namespace bithorded { namespace router {
 class bithorded::router::FriendConnector : public std::enable_shared_from_this<bithorded::router::FriendConnector> {
 	Server& _server;
 	Config::Friend _f;
+	boost::asio::io_service& _netSvc;
 	std::shared_ptr<boost::asio::ip::tcp::socket> _socket;
 	boost::asio::ip::tcp::resolver _resolver;
 	boost::asio::deadline_timer _timer;
@@ -52,7 +55,8 @@ public:
 	FriendConnector(Server& server, const bithorded::Config::Friend& cfg) :
 		_server(server),
 		_f(cfg),
-		_socket(std::make_shared<boost::asio::ip::tcp::socket>(server.ioSvc())),
+		_netSvc(server.nextReactor()),
+		_socket(std::make_shared<boost::asio::ip::tcp::socket>(_netSvc)),
 		_resolver(server.ioSvc()),
 		_timer(server.ioSvc()),
 		_q(cfg.addr, boost::lexical_cast<string>(cfg.port)),
@@ -88,8 +92,14 @@ private:
 				if (error) {
 					scheduleRestart();
 				} else if (!_cancelled) {
-					_socket->async_connect(iterator->endpoint(), [=](const boost::system::error_code& error) {
-						self->connectionDone(error);
+					auto endpoint = iterator->endpoint();
+					// The socket belongs to _netSvc, and may be in use by a previous connection
+					_netSvc.post([=]() {
+						_socket->async_connect(endpoint, [=](const boost::system::error_code& error) {
+							_server.ioSvc().post([=]() {
+								self->connectionDone(error);
+							});
+						});
 					});
 				}
 			});
@@ -100,14 +110,19 @@ private:
 		if (error) {
 			scheduleRestart();
 		} else if (!_cancelled) {
-			_server.hookup(_socket, _f);
+			_server.hookup(_socket, _netSvc, _f);
 			scheduleRestart(RECONNECT_INTERVAL * 2);
 		}
 	}
 };
 
 bithorded::router::Router::Router(Server& server)
-	: _server(server)
+	: _server(server),
+	_hedges(server.config().hedgeReads),
+	_notFound(NEGATIVE_CACHE_SIZE, NEGATIVE_CACHE_TTL),
+	readLatency("ms"),
+	upstreamBytes("bytes"),
+	downstreamBytes("bytes")
 {
 }
 
@@ -142,6 +157,9 @@ void Router::onConnected(const bithorded::Client::Ptr& client )
 			_connectors[peerName]->cancel();
 		_connectors.erase(peerName);
 		_connectedFriends[peerName] = client;
+		_notFound.clear(); // May be found with the new friend
+		bithorde::MessageBatch batch;
+		batch.add(client);
 		for (auto iter=_openAssets.begin(); iter != _openAssets.end(); iter++) {
 			if (auto forwardedAsset = iter->lock()) {
 				forwardedAsset->addUpstream(client);
@@ -168,6 +186,11 @@ UpstreamRequestBinding::Ptr Router::findAsset( const bithorde::BindRead& req )
 
 void Router::inspect(management::InfoList& target) const
 {
+	target.append("readLatency") << readLatency;
+	target.append("coalescing") << describeCoalescing(upstreamBytes, downstreamBytes);
+	target.append("notFoundCache") << _notFound.size() << " assets, " << _notFound.hits() << " hits, " << _notFound.misses() << " misses";
+	if (_hedges.enabled())
+		target.append("hedgedReads") << _hedges.hedged() << " of " << _hedges.reads() << ", " << _hedges.hedgesWon() << " answered first";
 	for (auto iter=_friends.begin(); iter!=_friends.end(); iter++) {
 		auto name = iter->first;
 		auto connectedIter = _connectedFriends.find(iter->first);
@@ -191,6 +214,9 @@ bithorded::IAsset::Ptr bithorded::router::Router::openAsset(const bithorde::Bind
 	if (_isBlacklisted(now, req.requesters()))
 		throw bithorded::BindError(bithorde::WOULD_LOOP);
 
+	if (_notFound.contains(findBithordeId(req.ids(), bithorde::TREE_TIGER), now))
+		throw bithorded::BindError(bithorde::NOTFOUND);
+
 	auto asset = std::make_shared<ForwardedAsset, Router&, const BitHordeIds&>(*this, req.ids());
 	_openAssets.insert(asset);
 
@@ -204,6 +230,16 @@ bithorded::IAsset::Ptr bithorded::router::Router::openAsset(const bithorde::Bind
 	return asset;
 }
 
+void Router::notFound(const BitHordeIds& ids)
+{
+	_notFound.add(findBithordeId(ids, bithorde::TREE_TIGER), ptime::microsec_clock::universal_time());
+}
+
+void Router::found(const BitHordeIds& ids)
+{
+	_notFound.erase(findBithordeId(ids, bithorde::TREE_TIGER));
+}
+
 void Router::_addToBlacklist(const ptime::ptime& deadline, uint64_t uid)
 {
 	_blacklist.insert(uid);
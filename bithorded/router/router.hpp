@@ -21,6 +21,7 @@
 #include <boost/asio/io_service.hpp>
 #include <map>
 #include <memory>
+#include <queue>
 #include <unordered_set>
 #include <vector>
 
@@ -30,6 +31,7 @@
 #include "../server/config.hpp"
 #include "../server/client.hpp"
 #include "asset.hpp"
+#include "negativecache.hpp"
 
 #include "bithorde.pb.h"
 
@@ -48,12 +50,24 @@ class Router : public AssetSessions, public management::DescriptiveDirectory, pu
 	std::unordered_set<uint64_t> _blacklist;
 	std::queue< std::pair<boost::posix_time::ptime,uint64_t> > _blacklistQueue;
 	bithorded::WeakSet<ForwardedAsset> _openAssets;
+	HedgeBudget _hedges;
+	NegativeCache _notFound;
 public:
+	LatencyHistogram readLatency; // Of reads forwarded, until answered by any upstream
+	Counter upstreamBytes, downstreamBytes; // Of forwarded assets, fetched and passed on
+
 	Router(Server& server);
 
 	void addFriend(const Config::Friend& f);
 
 	Server& server() { return _server; }
+	HedgeBudget& hedges() { return _hedges; }
+
+	/**
+	 * Records the outcome of searching all friends for /ids/, for binds to follow
+	 */
+	void notFound(const BitHordeIds& ids);
+	void found(const BitHordeIds& ids);
 
 	std::size_t friends() const;
 	std::size_t upstreams() const;
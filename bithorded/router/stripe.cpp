@@ -0,0 +1,94 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "stripe.hpp"
+
+#include <algorithm>
+
+#include "../../lib/client.h"
+
+using namespace bithorded::router;
+namespace ptime = boost::posix_time;
+
+const double THROUGHPUT_DECAY = 0.9; // Of the measured data and time, for each arrival
+const double HEDGE_BURST = 8; // Hedges saved up at most
+const float HEDGE_PERCENTILE = 0.95; // Of the read latency of an upstream, before hedging
+
+UpstreamLoad::UpstreamLoad() :
+	_inFlight(0),
+	_bytes(0),
+	_micros(0)
+{
+}
+
+void UpstreamLoad::sent(std::size_t bytes)
+{
+	_inFlight += bytes;
+}
+
+void UpstreamLoad::arrived(std::size_t requested, std::size_t bytes, const ptime::ptime& sentAt)
+{
+	_inFlight -= std::min<uint64_t>(requested, _inFlight);
+	if (!bytes)
+		return;
+	auto now = ptime::microsec_clock::universal_time();
+	auto since = (_lastArrival.is_special() || (sentAt > _lastArrival)) ? sentAt : _lastArrival;
+	_bytes = _bytes * THROUGHPUT_DECAY + bytes;
+	_micros = _micros * THROUGHPUT_DECAY + std::max<int64_t>((now - since).total_microseconds(), 1);
+	_lastArrival = now;
+}
+
+double UpstreamLoad::throughput() const
+{
+	return (_micros > 0) ? (_bytes * 1000000 / _micros) : 0;
+}
+
+double UpstreamLoad::expectedWait(std::size_t bytes, double rate) const
+{
+	auto measured = throughput();
+	return (_inFlight + bytes) / ((measured > 0) ? measured : rate);
+}
+
+HedgeBudget::HedgeBudget(double ratio) :
+	_ratio(std::max(ratio, 0.0)),
+	_tokens(0),
+	_reads(0),
+	_hedged(0),
+	_won(0)
+{
+}
+
+void HedgeBudget::read()
+{
+	_reads++;
+	_tokens = std::min(_tokens + _ratio, HEDGE_BURST);
+}
+
+bool HedgeBudget::spend()
+{
+	if (_tokens < 1)
+		return false;
+	_tokens -= 1;
+	_hedged++;
+	return true;
+}
+
+uint64_t bithorded::router::hedgeDelay(const LatencyHistogram& latency)
+{
+	if (latency.count() < bithorde::ADAPTIVE_TIMEOUT_SAMPLES)
+		return 0;
+	return std::max<uint64_t>(latency.percentile(HEDGE_PERCENTILE), 1);
+}
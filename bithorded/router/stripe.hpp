@@ -0,0 +1,177 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef BITHORDED_ROUTER_STRIPE_HPP
+#define BITHORDED_ROUTER_STRIPE_HPP
+
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "../../lib/counter.h"
+
+namespace bithorded {
+namespace router {
+
+/**
+ * The reads in flight to an upstream, and the rate it has delivered at while busy. Data arriving
+ * back to back is timed from the previous arrival, and otherwise from when it was requested, so
+ * that the rate follows the bandwidth of a busy link rather than its latency.
+ */
+class UpstreamLoad {
+	uint64_t _inFlight;
+	double _bytes, _micros; // Decaying sums of data arrived, and the busy time it took
+	boost::posix_time::ptime _lastArrival;
+public:
+	UpstreamLoad();
+
+	/**
+	 * Account /bytes/ requested
+	 */
+	void sent(std::size_t bytes);
+
+	/**
+	 * Account the arrival of /bytes/, of a read of /requested/ sent at /sentAt/. No data means the
+	 * read failed.
+	 */
+	void arrived(std::size_t requested, std::size_t bytes, const boost::posix_time::ptime& sentAt);
+
+	uint64_t inFlight() const { return _inFlight; }
+
+	/**
+	 * Bytes per second delivered while busy, 0 until measured
+	 */
+	double throughput() const;
+
+	/**
+	 * Seconds until /bytes/ more would have arrived, at /rate/ if not yet measured
+	 */
+	double expectedWait(std::size_t bytes, double rate) const;
+};
+
+/**
+ * Caps the reads hedged, sent to a second upstream when the first is slow to answer, to a
+ * /ratio/ of the reads forwarded. Each read forwarded earns /ratio/ of a hedge, saved up to a
+ * small burst. A ratio of 0 disables hedging.
+ */
+class HedgeBudget {
+	double _ratio;
+	double _tokens;
+	uint64_t _reads, _hedged, _won;
+public:
+	explicit HedgeBudget(double ratio);
+
+	bool enabled() const { return _ratio > 0; }
+
+	/**
+	 * Account a read forwarded
+	 */
+	void read();
+
+	/**
+	 * Takes a hedge from the budget, if any is left
+	 */
+	bool spend();
+
+	/**
+	 * Account a hedge answered before the read it hedged
+	 */
+	void won() { _won++; }
+
+	uint64_t reads() const { return _reads; }
+	uint64_t hedged() const { return _hedged; }
+	uint64_t hedgesWon() const { return _won; }
+};
+
+/**
+ * Milliseconds to wait for a read from an upstream of /latency/ before hedging it, or 0 if too
+ * little has been measured to tell a slow read.
+ */
+uint64_t hedgeDelay(const LatencyHistogram& latency);
+
+/**
+ * Of the upstreams in [begin, end), the one expected to deliver /bytes/ more the soonest, given
+ * the bytes already in flight to each and their throughput. Upstreams not yet measured are
+ * expected to be as fast as the fastest one, so they get tried. /load/ gives the UpstreamLoad of
+ * an upstream, or NULL to pass it by. Returns /end/ if all are passed by.
+ */
+template <typename Iter, typename LoadOf>
+Iter leastLoaded(Iter begin, Iter end, std::size_t bytes, LoadOf load)
+{
+	double fastest = 0;
+	for (auto iter = begin; iter != end; iter++) {
+		if (auto l = load(*iter))
+			fastest = std::max(fastest, l->throughput());
+	}
+	if (fastest <= 0)
+		fastest = 1; // Nothing measured, spread by the bytes in flight
+	auto chosen = end;
+	double soonest = 0;
+	for (auto iter = begin; iter != end; iter++) {
+		auto l = load(*iter);
+		if (!l)
+			continue;
+		auto wait = l->expectedWait(bytes, fastest);
+		if ((chosen == end) || (wait < soonest)) {
+			soonest = wait;
+			chosen = iter;
+		}
+	}
+	return chosen;
+}
+
+/**
+ * Splits [offset, end) into consecutive parts, each within one of the reads in flight in
+ * [begin, last), or between them. The reads must be sorted by offset, and /range/ gives the
+ * (offset, end) of a read. Returns the end of each part, with the read it is within or /last/
+ * for a gap. If a single read covers the whole range, that is the only part.
+ */
+template <typename Iter, typename RangeOf>
+std::vector< std::pair<uint64_t, Iter> > splitRange(uint64_t offset, uint64_t end, Iter begin, Iter last, RangeOf range)
+{
+	std::vector< std::pair<uint64_t, Iter> > parts;
+	for (auto iter = begin; iter != last; iter++) {
+		auto r = range(*iter);
+		if ((r.first <= offset) && (r.second >= end)) {
+			parts.emplace_back(end, iter);
+			return parts;
+		}
+	}
+	auto pos = offset;
+	for (auto iter = begin; (iter != last) && (pos < end); iter++) {
+		auto r = range(*iter);
+		if (r.first > pos) {
+			parts.emplace_back(std::min(r.first, end), last);
+			pos = r.first;
+		}
+		auto within = std::min(r.second, end);
+		if (within > pos) {
+			parts.emplace_back(within, iter);
+			pos = within;
+		}
+	}
+	if (pos < end)
+		parts.emplace_back(end, last);
+	return parts;
+}
+
+}
+}
+
+#endif // BITHORDED_ROUTER_STRIPE_HPP
@@ -130,6 +130,12 @@ public:
 	virtual void asyncRead(uint64_t offset, size_t size, uint32_t timeout, ReadCallback cb) = 0;
 	virtual uint64_t size() = 0;
 
+	/**
+	 * Hints that [offset, offset+size) is about to be read in order, so that assets reading from
+	 * elsewhere may fetch it ahead. A size of 0 withdraws the hint for a reader now at /offset/.
+	 */
+	virtual void readAhead(uint64_t offset, uint64_t size, uint32_t timeout) {}
+
 	/**
 	 * The 64-bit random id generated for this node in this session of the asset.
 	 */
@@ -147,6 +153,17 @@ public:
 	 */
 	virtual size_t canRead(uint64_t offset, size_t size) = 0;
 
+	/**
+	 * Opens a read-only descriptor to the local file holding the asset, for handing out to local
+	 * clients. Returns -1 if the asset has no such file, or nothing of it is verified yet. The
+	 * descriptor reaches the whole file; only /verified/ bytes of it may be trusted, and the client
+	 * is told to read no further.
+	 *
+	 * @arg offset - set to where the asset starts in the file
+	 * @arg verified - the verified prefix already known, extended to all of it now verified
+	 */
+	virtual int openLocalFile(uint64_t& offset, uint64_t& verified) { return -1; }
+
 	virtual void describe(management::Info& target) const;
 };
 
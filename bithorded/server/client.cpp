@@ -26,8 +26,8 @@
 #include <lib/random.h>
 #include <lib/buffer.hpp>
 
-const size_t MAX_ASSETS = 1024;
-const size_t MAX_CHUNK = 128*1024;
+const size_t MAX_READ_STREAMS = 64;
+const uint64_t MAX_READ_AHEAD = 64*1024*1024; // Hinted ahead of all Read.Streams of a client together
 
 using namespace std;
 namespace fs = boost::filesystem;
@@ -40,8 +40,15 @@ namespace bithorded {
 
 Client::Client( Server& server) :
 	bithorde::Client(server.ioSvc(), server.name()),
-	_server(server)
+	_server(server),
+	_pumpingStreams(false),
+	_pumpStreamsAgain(false)
 {
+	setCreditWindow(server.config().creditWindow);
+	setMaxChunkSize(server.config().maxChunkSize);
+	setAcceptReadStreams(true);
+	setAcceptSharedMemory(true);
+	writable.connect(std::bind(&Client::pumpStreams, this));
 }
 
 Client::Ptr Client::shared_from_this() {
@@ -60,19 +67,29 @@ size_t Client::serverAssets() const
 
 void Client::describe(management::Info& tgt) const
 {
+	auto rates = stats->currentRates();
 	tgt << '+' << clientAssets().size() << '-' << serverAssets()
-		<< ", incoming: " << stats->incomingBitrateCurrent.autoScale()
-		<< ", outgoing: " << stats->outgoingBitrateCurrent.autoScale();
+		<< ", incoming: " << rates.incomingBitrate.autoScale()
+		<< ", outgoing: " << rates.outgoingBitrate.autoScale();
 }
 
 void Client::inspect(management::InfoList& tgt) const
 {
-	tgt.append("incomingCurrent") << stats->incomingBitrateCurrent.autoScale() << ", " << stats->incomingMessagesCurrent.autoScale();
-	tgt.append("outgoingCurrent") << stats->outgoingBitrateCurrent.autoScale() << ", " << stats->outgoingMessagesCurrent.autoScale();
+	auto rates = stats->currentRates();
+	tgt.append("incomingCurrent") << rates.incomingBitrate.autoScale() << ", " << rates.incomingMessages.autoScale();
+	tgt.append("outgoingCurrent") << rates.outgoingBitrate.autoScale() << ", " << rates.outgoingMessages.autoScale();
 	tgt.append("incomingTotal") << stats->incomingBytes.autoScale() << ", " << stats->incomingMessages.autoScale();
 	tgt.append("outgoingTotal") << stats->outgoingBytes.autoScale() << ", " << stats->outgoingMessages.autoScale();
+	tgt.append("transport") << (sharedMemory() ? "shared memory" : "socket");
+	tgt.append("localFiles") << _localFiles.size();
+	tgt.append("roundTripTime") << stats->roundTripTime;
+	tgt.append("sendWindow") << stats->sendWindow.autoScale() << ", " << stats->sendBandwidth.autoScale();
 	tgt.append("assetResponseTime") << assetResponseTime;
+	tgt.append("bindLatency") << bindLatency << ", timeout: " << bindTimeout() << "ms";
+	tgt.append("readLatency") << readLatency << ", timeout: " << readTimeout() << "ms";
+	tgt.append("hopLatency") << hopLatency() << "ms";
 	tgt.append("bytesAllocated") << bytesAllocated();
+	tgt.append("readStreams") << _readStreams.size();
 	for (auto iter=clientAssets().begin(); iter != clientAssets().end(); iter++) {
 		ostringstream name;
 		name << '+' << iter->first;
@@ -181,6 +198,22 @@ void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithord
 	}
 }
 
+void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithorde::BindReadBatch > >& msgCtx )
+{
+	// Replies to the binds, and binds forwarded upstream, are batched
+	bithorde::MessageBatch batch;
+	_server.batch(batch);
+	bithorde::Client::onMessage(msgCtx);
+}
+
+void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithorde::AssetStatusBatch > >& msgCtx )
+{
+	// Statuses passed on downstream are batched
+	bithorde::MessageBatch batch;
+	_server.batch(batch);
+	bithorde::Client::onMessage(msgCtx);
+}
+
 void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithorde::Read::Request > >& msgCtx )
 {
 	const auto& msg = msgCtx->message();
@@ -188,8 +221,8 @@ void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithord
 	if (asset) {
 		uint64_t offset = msg.offset();
 		size_t size = msg.size();
-		if (size > MAX_CHUNK)
-			size = MAX_CHUNK;
+		if (size > maxChunkSize())
+			size = maxChunkSize();
 
 		if (offset < asset->size()) {
 			// Raw pointer to this should be fine here, since asset has ownership of this. (Through member Ptr client)
@@ -229,6 +262,55 @@ void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithord
 	return;
 }
 
+void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithorde::Read::Stream > >& msgCtx )
+{
+	const auto& msg = msgCtx->message();
+	auto existing = _readStreams.find(msg.reqid());
+	if (msg.size() == 0) {
+		closeStream(msg.reqid());
+		return;
+	} else if ((existing != _readStreams.end()) && (existing->second.handle == (bithorde::Asset::Handle)msg.handle())) {
+		// Moving the end of the stream
+		auto& stream = existing->second;
+		const AssetBinding& asset = getAsset(stream.handle);
+		if (asset && (msg.offset() + msg.size() > stream.end)) {
+			stream.end = std::min(msg.offset() + msg.size(), asset->size());
+			hintStream(stream, *asset);
+		}
+		pumpStreams();
+		return;
+	} else if (existing != _readStreams.end()) {
+		closeStream(msg.reqid());
+	}
+
+	bithorde::Read::Response resp;
+	resp.set_reqid(msg.reqid());
+	const AssetBinding& asset = getAsset(msg.handle());
+	if (!asset) {
+		resp.set_status(bithorde::INVALID_HANDLE);
+	} else if ((msg.offset() >= asset->size()) || (_readStreams.size() >= MAX_READ_STREAMS)) {
+		resp.set_status(bithorde::ERROR);
+	} else {
+		ReadStream stream;
+		stream.handle = msg.handle();
+		stream.position = msg.offset();
+		stream.end = std::min(msg.offset() + msg.size(), asset->size());
+		stream.hinted = stream.position;
+		stream.timeout = msg.timeout();
+		stream.reading = false;
+		hintStream(_readStreams[msg.reqid()] = stream, *asset);
+		pumpStreams();
+		return;
+	}
+	sendMessage(bithorde::Connection::ReadResponse, resp);
+}
+
+void Client::onMessage( const std::shared_ptr< bithorde::MessageContext< bithorde::Credit > >& msgCtx )
+{
+	bithorde::Client::onMessage( msgCtx );
+	pumpStreams();
+}
+
 void Client::setAuthenticated(const string peerName_)
 {
 	bithorde::Client::setAuthenticated(peerName_);
@@ -242,18 +324,105 @@ void Client::onReadResponse(const std::shared_ptr< bithorde::MessageContext<bith
 	bithorde::Read::Response resp;
 	resp.set_reqid( reqCtx->message().reqid());
 	auto size = data->size();
+	bool sent;
 	if ((offset >= 0) && (size > 0)) {
 		resp.set_status(bithorde::SUCCESS);
 		resp.set_offset(offset);
-		resp.set_content(**data, size);
+		// Content is passed by reference, and written straight from the buffer.
+		sent = sendReadResponse(reqCtx->message().handle(), resp, data, t);
 	} else {
 		resp.set_status(bithorde::NOTFOUND);
+		sent = sendMessage(bithorde::Connection::ReadResponse, resp, t);
 	}
-	if (!sendMessage(bithorde::Connection::ReadResponse, resp, t)) {
+	if (!sent) {
 		BOOST_LOG_SEV(clientLogger, bithorded::warning) << "Failed to write data chunk, (offset " << offset << ')';
 	}
 }
 
+void Client::pumpStreams()
+{
+	// Reads may complete synchronously, calling back in here
+	if (_pumpingStreams) {
+		_pumpStreamsAgain = true;
+		return;
+	}
+	_pumpingStreams = true;
+	do {
+		_pumpStreamsAgain = false;
+		for (auto iter = _readStreams.begin(); iter != _readStreams.end(); ) {
+			auto reqId = iter->first;
+			auto& stream = (iter++)->second;
+			if (stream.reading || (stream.position >= stream.end) || !canSendReadResponse(stream.handle))
+				continue;
+			const AssetBinding& asset = getAsset(stream.handle);
+			if (!asset) {
+				closeStream(reqId);
+				continue;
+			}
+			stream.reading = true;
+			size_t size = std::min<uint64_t>(maxChunkSize(), stream.end - stream.position);
+			// Raw pointer to this should be fine here, since asset has ownership of this. (Through member Ptr client)
+			asset->asyncRead(stream.position, size, stream.timeout,
+				std::bind(&Client::onStreamRead, this, reqId, stream.handle, stream.position, std::placeholders::_1, std::placeholders::_2));
+		}
+	} while (_pumpStreamsAgain);
+	_pumpingStreams = false;
+}
+
+void Client::onStreamRead(int reqId, bithorde::Asset::Handle handle, uint64_t position, int64_t offset, const std::shared_ptr< bithorde::IBuffer >& data)
+{
+	auto iter = _readStreams.find(reqId);
+	if ((iter == _readStreams.end()) || (iter->second.handle != handle) || (iter->second.position != position) || !iter->second.reading)
+		return; // Closed, or replaced, while reading
+	auto& stream = iter->second;
+	stream.reading = false;
+
+	bithorde::Read::Response resp;
+	resp.set_reqid(reqId);
+	auto deadline = bithorde::Message::in(stream.timeout);
+	if ((offset >= 0) && (data->size() > 0)) {
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(offset);
+		if (sendReadResponse(handle, resp, data, deadline)) {
+			stream.position = offset + data->size();
+			if (const AssetBinding& asset = getAsset(handle))
+				hintStream(stream, *asset);
+			return pumpStreams();
+		}
+		// Chunks must arrive in order, so none may be skipped. Read again once writable, if the
+		// queue filled while reading, or give up the stream for the peer to fall back to plain reads.
+		if (!canSendReadResponse(handle))
+			return;
+		BOOST_LOG_SEV(clientLogger, bithorded::warning) << "Failed to write streamed data chunk, (offset " << offset << ')';
+	}
+	resp.clear_offset();
+	resp.set_status(bithorde::NOTFOUND);
+	sendMessage(bithorde::Connection::ReadResponse, resp, deadline);
+	closeStream(reqId);
+}
+
+void Client::hintStream(ReadStream& stream, IAsset& asset)
+{
+	// Re-hinted as the stream moves, once half the share is read
+	auto share = MAX_READ_AHEAD / std::max<size_t>(_readStreams.size(), 1);
+	auto hint = std::min(stream.end, stream.position + share);
+	if ((hint <= stream.hinted) || ((stream.hinted > stream.position) && (stream.hinted - stream.position > share / 2)))
+		return;
+	stream.hinted = hint;
+	asset.readAhead(stream.position, hint - stream.position, stream.timeout);
+}
+
+void Client::closeStream(int reqId)
+{
+	auto iter = _readStreams.find(reqId);
+	if (iter == _readStreams.end())
+		return;
+	const AssetBinding& asset = getAsset(iter->second.handle);
+	if (asset)
+		asset->readAhead(iter->second.position, 0, 0);
+	_readStreams.erase(iter);
+}
+
 void Client::informAssetStatus(bithorde::Asset::Handle h, bithorde::Status s)
 {
 	size_t asset_idx = h;
@@ -264,7 +433,7 @@ void Client::informAssetStatus(bithorde::Asset::Handle h, bithorde::Status s)
 	bithorde::AssetStatus resp;
 	resp.set_handle(h);
 	resp.set_status(s);
-	sendMessage(bithorde::Connection::AssetStatus, resp, bithorde::Message::NEVER, true);
+	sendAssetStatus(resp);
 }
 
 void Client::informAssetStatusUpdate(bithorde::Asset::Handle h, const IAsset::Ptr& asset, const bithorde::AssetStatus& status)
@@ -290,22 +459,46 @@ void Client::informAssetStatusUpdate(bithorde::Asset::Handle h, const IAsset::Pt
 
 	BOOST_LOG_SEV(clientLogger, bithorded::debug) << peerName() << ':' << h << " new state " << bithorde::Status_Name(resp.status()) << " (" << idsToString(resp.ids()) << ") availability: " << resp.availability();
 
-	sendMessage(bithorde::Connection::AssetStatus, resp, bithorde::Message::NEVER, true);
+	sendAssetStatus(resp);
+	if (resp.status() == bithorde::SUCCESS)
+		handOutFile(h, asset);
+	else
+		_localFiles.erase(h);
+}
+
+void Client::handOutFile(bithorde::Asset::Handle h, const IAsset::Ptr& asset)
+{
+	if (!localFiles())
+		return;
+	auto& handedOut = _localFiles[h];
+	uint64_t offset = 0, verified = handedOut;
+	int fd = asset->openLocalFile(offset, verified);
+	if (fd < 0) {
+		if (!handedOut)
+			_localFiles.erase(h);
+		return;
+	}
+	auto file = std::make_shared<bithorde::FileRegion>(fd, offset, verified);
+	if ((verified > handedOut) && sendLocalFile(h, file)) {
+		BOOST_LOG_SEV(clientLogger, bithorded::debug) << peerName() << ':' << h << " handed out " << verified << " bytes as local file";
+		handedOut = verified;
+	}
 }
 
 void Client::assignAsset(bithorde::Asset::Handle handle_, const UpstreamRequestBinding::Ptr& a, const BitHordeIds& assetIds, const bithorde::RouteTrace& requesters, const boost::posix_time::ptime& deadline)
 {
 	size_t handle = handle_;
 	if (handle >= _assets.size()) {
-		if (handle >= MAX_ASSETS) {
-			BOOST_LOG_SEV(clientLogger, bithorded::error) << peerName() << ": handle larger than allowed limit (" << handle << " > " << MAX_ASSETS << ")";
+		const size_t maxAssets = _server.config().maxAssets;
+		if (handle >= maxAssets) {
+			BOOST_LOG_SEV(clientLogger, bithorded::error) << peerName() << ": handle larger than allowed limit (" << handle << " > " << maxAssets << ")";
 			informAssetStatus(handle_, bithorde::Status::INVALID_HANDLE);
 			return;
 		}
 		size_t old_size = _assets.size();
 		size_t new_size = _assets.size() + (handle - _assets.size() + 1) * 2;
-		if (new_size > MAX_ASSETS)
-			new_size = MAX_ASSETS;
+		if (new_size > maxAssets)
+			new_size = maxAssets;
 		_assets.resize(new_size);
 		auto self = bithorded::Client::shared_from_this();
 		for (auto i=old_size; i < new_size; i++) {
@@ -335,6 +528,12 @@ void Client::clearAssets()
 
 void Client::clearAsset(bithorde::Asset::Handle handle_)
 {
+	for (auto iter = _readStreams.begin(); iter != _readStreams.end(); ) {
+		if (iter->second.handle == handle_)
+			closeStream((iter++)->first);
+		else
+			iter++;
+	}
 	size_t handle = handle_;
 	if (handle < _assets.size()) {
 		if ( auto& a = _assets[handle] ) {
@@ -342,6 +541,8 @@ void Client::clearAsset(bithorde::Asset::Handle handle_)
 			BOOST_LOG_SEV(clientLogger, bithorded::debug) << peerName() << ':' << handle_ << " released";
 		}
 	}
+	_localFiles.erase(handle_);
+	releaseCredit(handle_);
 }
 
 const AssetBinding& Client::getAsset(bithorde::Asset::Handle handle_) const
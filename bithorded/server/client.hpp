@@ -30,6 +30,17 @@ class Client : public bithorde::Client, public management::DescriptiveDirectory
 {
 	Server& _server;
 	std::vector< AssetBinding > _assets;
+
+	struct ReadStream {
+		bithorde::Asset::Handle handle;
+		uint64_t position, end;
+		uint64_t hinted; // End of the range the asset was told to read ahead
+		uint32_t timeout;
+		bool reading;
+	};
+	std::map<int, ReadStream> _readStreams;
+	std::map<bithorde::Asset::Handle, uint64_t> _localFiles; // Verified prefix handed out per handle
+	bool _pumpingStreams, _pumpStreamsAgain;
 public:
 	typedef std::shared_ptr<Client> Ptr;
 	typedef std::weak_ptr<Client> WeakPtr;
@@ -54,14 +65,35 @@ protected:
 	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::HandShake> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::BindWrite> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::BindRead> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::BindReadBatch> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::AssetStatusBatch> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::Read::Request> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::DataSegment> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::Read::Stream> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr<bithorde::MessageContext<bithorde::Credit> >& msgCtx);
 
 	virtual void setAuthenticated(const std::string peerName);
 private:
 	void informAssetStatus(bithorde::Asset::Handle h, bithorde::Status s);
 	void informAssetStatusUpdate(bithorde::Asset::Handle h, const bithorded::IAsset::Ptr& asset, const bithorde::AssetStatus& status);
+	/**
+	 * Hands the local file of /asset/ to the peer, if it accepts them and more is verified than last handed out
+	 */
+	void handOutFile(bithorde::Asset::Handle h, const bithorded::IAsset::Ptr& asset);
 	void onReadResponse( const std::shared_ptr< bithorde::MessageContext< bithorde::Read::Request > >& reqCtx, int64_t offset, const std::shared_ptr< bithorde::IBuffer >& data, bithorde::Message::Deadline t );
+
+	/**
+	 * Reads the next chunk of each Read.Stream, as far as the connection and credit allows
+	 */
+	void pumpStreams();
+	void onStreamRead( int reqId, bithorde::Asset::Handle handle, uint64_t position, int64_t offset, const std::shared_ptr< bithorde::IBuffer >& data );
+	void closeStream( int reqId );
+
+	/**
+	 * Hints the asset of /stream/ to read ahead of it, by its share of MAX_READ_AHEAD. Bounds what
+	 * assets fetch ahead for this client, over all its streams.
+	 */
+	void hintStream( ReadStream& stream, bithorded::IAsset& asset );
 	void assignAsset( bithorde::Asset::Handle handle_, const bithorded::UpstreamRequestBinding::Ptr& a, const BitHordeIds& assetIds, const bithorde::RouteTrace& requesters, const boost::posix_time::ptime& deadline );
 	void clearAssets();
 	void clearAsset(bithorde::Asset::Handle handle);
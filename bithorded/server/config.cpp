@@ -26,6 +26,7 @@
 #include <boost/program_options.hpp>
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 #include <crypto++/base64.h>
 
@@ -37,7 +38,7 @@ using namespace std;
 namespace asio = boost::asio;
 namespace po = boost::program_options;
 
-po::options_description cli_options("Command-Line Options");
+std::unique_ptr<po::options_description> cli_options;
 
 class OptionGroup {
 	std::string _name;
@@ -145,7 +146,9 @@ bithorded::Config::Config(int argc, char* argv[])
 {
 	auto hardwareCores = sysconf( _SC_NPROCESSORS_ONLN );
 
-	cli_options.add_options()
+	// Anew for each Config, since bound to its members. Kept for printUsage().
+	cli_options.reset(new po::options_description("Command-Line Options"));
+	cli_options->add_options()
 		("version,v", "print version string")
 		("help", "produce help message")
 		("config,c", po::value<string>(&configPath)->default_value("/etc/bithorde.conf"),
@@ -165,7 +168,15 @@ bithorded::Config::Config(int argc, char* argv[])
 		("server.unixPerms", po::value<string>(&unixPerms)->default_value("0666"),
 			"Permissions for the created UNIX-socket.")
 		("server.parallel", po::value<uint16_t>(&parallel)->default_value(hardwareCores),
-			"How many workers to run for parallel job processing.")
+			"How many workers to run for parallel job processing, and how many threads to spread connection I/O over.")
+		("server.creditWindow", po::value<uint32_t>(&creditWindow)->default_value(1024*1024),
+			"Bytes in flight per asset from a peer, if it supports per-asset flow-control. 0 disables.")
+		("server.maxChunkSize", po::value<uint32_t>(&maxChunkSize)->default_value(1024*1024),
+			"Largest chunk to exchange with peers supporting large messages. At most 4MB, 0 keeps to 128KB.")
+		("server.maxAssets", po::value<uint32_t>(&maxAssets)->default_value(1024),
+			"Most assets each connected peer may have bound at once.")
+		("server.hedgeReads", po::value<double>(&hedgeReads)->default_value(0),
+			"Fraction of reads forwarded to friends that may also be sent to a second friend, when the first is slower to answer than it usually is. 0 disables.")
 	;
 
 	po::options_description cache_options("Cache Options");
@@ -176,10 +187,10 @@ bithorded::Config::Config(int argc, char* argv[])
 			"Max size of the cache, in MB.")
 	;
 
-	cli_options.add(server_options).add(cache_options);
+	cli_options->add(server_options).add(cache_options);
 
 	DynamicMap vm;
-	vm.store(po::parse_command_line(argc, argv, cli_options));
+	vm.store(po::parse_command_line(argc, argv, *cli_options));
 	notify(vm);
 
 	if (vm.count("version"))
@@ -243,5 +254,6 @@ bithorded::Config::Config(int argc, char* argv[])
 
 void bithorded::Config::printUsage(ostream& stream)
 {
-	stream << cli_options << endl;
+	if (cli_options)
+		stream << *cli_options << endl;
 }
@@ -71,6 +71,10 @@ struct Config
 
 	std::string nodeName;
 	uint16_t parallel;
+	uint32_t creditWindow;
+	uint32_t maxChunkSize;
+	uint32_t maxAssets;
+	double hedgeReads;
 
 	std::string cacheDir;
 	int cacheSizeMB;
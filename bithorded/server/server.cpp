@@ -64,6 +64,7 @@ bithorded::Config::Client null_client;
 Server::Server(asio::io_service& ioSvc, Config& cfg) :
 	GrandCentralDispatch(ioSvc, cfg.parallel),
 	_cfg(cfg),
+	_reactors(ioSvc, cfg.parallel),
 	_timerSvc(new TimerService(ioSvc)),
 	_tcpListener(ioSvc),
 	_localListener(ioSvc),
@@ -115,19 +116,21 @@ Server::Server(asio::io_service& ioSvc, Config& cfg) :
 
 void Server::waitForTCPConnection()
 {
-	std::shared_ptr<asio::ip::tcp::socket> sock = std::make_shared<asio::ip::tcp::socket>(ioSvc());
-	_tcpListener.async_accept(*sock, [=](const boost::system::error_code& error) {
+	auto& netSvc = _reactors.next();
+	std::shared_ptr<asio::ip::tcp::socket> sock = std::make_shared<asio::ip::tcp::socket>(netSvc);
+	_tcpListener.async_accept(*sock, [=, &netSvc](const boost::system::error_code& error) {
 		if (!error) {
-			hookup(sock, null_client);
+			hookup(sock, netSvc, null_client);
 			waitForTCPConnection();
 		}
 	});
 }
 
-void Server::hookup ( const std::shared_ptr< asio::ip::tcp::socket >& socket, const Config::Client& client)
+void Server::hookup ( const std::shared_ptr< asio::ip::tcp::socket >& socket, asio::io_service& netSvc, const Config::Client& client)
 {
 	bithorded::Client::Ptr c = bithorded::Client::create(*this);
-	auto conn = bithorde::Connection::create(ioSvc(), std::make_shared<bithorde::ConnectionStats>(_timerSvc), socket);
+	auto conn = bithorde::Connection::create(ioSvc(), netSvc, std::make_shared<bithorde::ConnectionStats>(_timerSvc), socket);
+	conn->setCipherWorkers(&jobService());
 	c->setSecurity(client.key, (bithorde::CipherType)client.cipher);
 	if (client.name.empty())
 		c->hookup(conn);
@@ -138,11 +141,12 @@ void Server::hookup ( const std::shared_ptr< asio::ip::tcp::socket >& socket, co
 
 void Server::waitForLocalConnection()
 {
-	std::shared_ptr<asio::local::stream_protocol::socket> sock = std::make_shared<asio::local::stream_protocol::socket>(ioSvc());
-	_localListener.async_accept(*sock, [=](const boost::system::error_code& error) {
+	auto& netSvc = _reactors.next();
+	std::shared_ptr<asio::local::stream_protocol::socket> sock = std::make_shared<asio::local::stream_protocol::socket>(netSvc);
+	_localListener.async_accept(*sock, [=, &netSvc](const boost::system::error_code& error) {
 		if (!error) {
 			bithorded::Client::Ptr c = bithorded::Client::create(*this);
-			c->hookup(bithorde::Connection::create(ioSvc(), std::make_shared<bithorde::ConnectionStats>(_timerSvc), sock));
+			c->hookup(bithorde::Connection::create(ioSvc(), netSvc, std::make_shared<bithorde::ConnectionStats>(_timerSvc), sock));
 			clientConnected(c);
 			waitForLocalConnection();
 		}
@@ -161,6 +165,14 @@ void Server::inspect(management::InfoList& target) const
 	}
 }
 
+void Server::batch(bithorde::MessageBatch& batch)
+{
+	for (auto iter = _connections.begin(); iter != _connections.end(); iter++) {
+		if (auto client = iter->second.lock())
+			batch.add(client);
+	}
+}
+
 void Server::clientConnected(const bithorded::Client::Ptr& client)
 {
 	Client::WeakPtr weak(client);
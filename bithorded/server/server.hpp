@@ -31,6 +31,7 @@
 #include "../http_server/server.hpp"
 #include "../lib/management.hpp"
 #include "../lib/grandcentraldispatch.hpp"
+#include "../lib/reactorpool.hpp"
 #include "../router/router.hpp"
 #include "../source/store.hpp"
 #include "bithorde.pb.h"
@@ -54,6 +55,7 @@ class ConnectionList : public WeakMap<std::string, bithorded::Client>, public ma
 class Server : public GrandCentralDispatch, public management::Directory
 {
 	Config &_cfg;
+	ReactorPool _reactors;
 	TimerService::Ptr _timerSvc;
 
 	boost::asio::ip::tcp::acceptor _tcpListener;
@@ -69,13 +71,29 @@ public:
 	Server(boost::asio::io_service& ioSvc, Config& cfg);
 
 	std::string name() { return _cfg.nodeName; }
+	const Config& config() const { return _cfg; }
 	const Config::Client& getClientConfig(const std::string& name);
+	TimerService& timerSvc() { return *_timerSvc; }
+	router::Router& router() { return _router; }
 
 	UpstreamRequestBinding::Ptr asyncLinkAsset(const boost::filesystem::path& filePath);
 	UpstreamRequestBinding::Ptr asyncFindAsset(const bithorde::BindRead& req);
 	UpstreamRequestBinding::Ptr prepareUpload(uint64_t size);
 
-	void hookup( const std::shared_ptr< boost::asio::ip::tcp::socket >& socket, const Config::Client& client);
+	/**
+	 * Adds all connected clients to /batch/
+	 */
+	void batch(bithorde::MessageBatch& batch);
+
+	/**
+	 * The event-loop to create the socket of the next connection on.
+	 */
+	boost::asio::io_service& nextReactor() { return _reactors.next(); }
+
+	/**
+	 * Sets up a Client for /socket/, created on /netSvc/.
+	 */
+	void hookup( const std::shared_ptr< boost::asio::ip::tcp::socket >& socket, boost::asio::io_service& netSvc, const Config::Client& client);
 
 	virtual void inspect(management::InfoList& target) const;
 private:
@@ -26,7 +26,7 @@
 #include <boost/shared_array.hpp>
 #include <stdexcept>
 
-const size_t MAX_CHUNK = 64*1024;
+const size_t MAX_CHUNK = bithorde::MAX_CHUNK_SIZE; // Largest read any peer may request
 const size_t PARALLEL_HASH_JOBS = 64;
 
 using namespace std;
@@ -86,6 +86,18 @@ size_t StoredAsset::canRead(uint64_t offset, size_t size)
 	return res;
 }
 
+int StoredAsset::openLocalFile(uint64_t& offset, uint64_t& verified)
+{
+	auto total = size();
+	while (verified < total) {
+		auto got = canRead(verified, std::min<uint64_t>(MAX_CHUNK, total - verified));
+		if (!got)
+			break;
+		verified += got;
+	}
+	return verified ? _data->openReadOnly(offset) : -1;
+}
+
 bool StoredAsset::hasRootHash()
 {
 	auto root = _hashTree.getRoot();
@@ -58,6 +58,8 @@ public:
 	 */
 	virtual size_t canRead(uint64_t offset, size_t size);
 
+	virtual int openLocalFile(uint64_t& offset, uint64_t& verified);
+
 	/**
 	 * Is the root hash known yet?
 	 */
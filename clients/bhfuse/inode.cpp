@@ -11,7 +11,7 @@ static const uint32_t ATTR_TIMEOUT = 2;
 static const uint32_t INODE_TIMEOUT = 4;
 static const uint32_t REBIND_INTERVAL_MS = 1000;
 static const uint32_t REBIND_RETRIES = 5;
-static const uint32_t READ_RETRIES = 5;
+static const size_t READ_AHEAD = 4*1024*1024;
 
 using namespace std;
 namespace asio = boost::asio;
@@ -61,28 +61,14 @@ bool INode::fuse_reply_stat(fuse_req_t req) {
 	return true;
 }
 
-BHReadOperation::BHReadOperation() :
-	req(NULL),
-	off(-1),
-	size(0),
-	retries(0)
-{}
-
-BHReadOperation::BHReadOperation(fuse_req_t req, off_t off, size_t size) :
-	req(req),
-	off(off),
-	size(size),
-	retries(0)
-{}
-
 FUSEAsset::FUSEAsset(BHFuse* fs, ino_t ino, std::shared_ptr< ReadAsset > asset) :
 	INode(fs, ino),
 	asset(asset),
 	_openCount(0),
 	_holdOpenTimer(fs->timerSvc(), std::bind(&FUSEAsset::closeOne, this)),
 	_rebindTimer(fs->timerSvc(), std::bind(&FUSEAsset::tryRebind, this)),
-	_connected(true),
-	_retries(0)
+	_retries(0),
+	_reader(*asset, READ_AHEAD)
 {
 	size = asset->size();
 	if (asset->isBound()) { // Schedule a delayed close of the initial reference.
@@ -90,7 +76,6 @@ FUSEAsset::FUSEAsset(BHFuse* fs, ino_t ino, std::shared_ptr< ReadAsset > asset)
 		_holdOpenTimer.arm(boost::posix_time::milliseconds(200));
 	}
 	_statusConnection = asset->statusUpdate.connect(Asset::StatusSignal::slot_type(&FUSEAsset::onStatusChanged, this, ASSET_ARG_STATUS));
-	_dataConnection = asset->dataArrived.connect(ReadAsset::DataSignal::slot_type(&FUSEAsset::onDataArrived, this, ASSET_ARG_OFFSET, ASSET_ARG_DATA, ASSET_ARG_TAG));
 }
 
 FUSEAsset::Ptr FUSEAsset::create(BHFuse* fs, ino_t ino, std::shared_ptr< ReadAsset > asset)
@@ -128,11 +113,12 @@ void FUSEAsset::fuse_reply_open(fuse_req_t req) {
 
 void FUSEAsset::read(fuse_req_t req, off_t off, size_t size)
 {
-	if (off >= (off_t)this->size) {
-		fuse_reply_buf(req, 0, 0);
-	} else {
-		queueRead(BHReadOperation(req,off,size));
-	}
+	_reader.read(off, size, [req](const byte* data, size_t size) {
+		if (data)
+			fuse_reply_buf(req, reinterpret_cast<const char*>(data), size);
+		else
+			fuse_reply_err(req, EIO);
+	});
 }
 
 void FUSEAsset::fill_stat_t(struct stat &s) {
@@ -150,15 +136,7 @@ void FUSEAsset::onStatusChanged(const bithorde::AssetStatus& s)
 	}
 	switch (s.status()) {
 	case bithorde::SUCCESS:
-		if (!_connected) {
-			_connected = true;
-			_retries = 0;
-			map<off_t, BHReadOperation> oldReads = _readOperations;
-			_readOperations.clear();
-			for (auto iter = oldReads.begin(); iter != oldReads.end(); iter++) {
-				queueRead(iter->second);
-			}
-		}
+		_retries = 0; // The reader resumes on its own
 		break;
 	case bithorde::NOTFOUND:
 	case bithorde::INVALID_HANDLE:
@@ -166,22 +144,8 @@ void FUSEAsset::onStatusChanged(const bithorde::AssetStatus& s)
 			_rebindTimer.arm(boost::posix_time::milliseconds(REBIND_INTERVAL_MS));
 		}
 	default:
-		_connected = false;
-	}
-}
-
-void FUSEAsset::queueRead(const BHReadOperation& read)
-{
-	int tag = 0;
-	if (_connected) {
-		tag = asset->aSyncRead(read.off, read.size);
-	} else {
-		do {
-			tag++;
-		} while (_readOperations.count(tag)); // Just find a tag to hook it on
+		break;
 	}
-	auto& op = _readOperations[tag] = read;
-	op.retries++;
 }
 
 void FUSEAsset::tryRebind()
@@ -193,42 +157,11 @@ void FUSEAsset::tryRebind()
 	}
 }
 
-void FUSEAsset::onDataArrived( uint64_t offset, const std::shared_ptr< IBuffer >& data, int tag ) {
-	if (_readOperations.count(tag)) {
-		BHReadOperation &op = _readOperations[tag];
-		if (_connected) {
-			op.res.append(reinterpret_cast<char*>(**data), data->size());
-			if ((data->size() < op.size) && ((off_t)(op.off + data->size()) < (off_t)asset->size())) {
-				BHReadOperation opCopy = op;
-				_readOperations.erase(tag);
-				if (op.retries < READ_RETRIES) {
-					opCopy.off += data->size();
-					opCopy.size -= data->size();
-					queueRead(opCopy);
-				} else {
-					fuse_reply_err(opCopy.req, EIO);
-				}
-			} else {
-				if ((off_t)offset == op.off)
-					fuse_reply_buf(op.req, (const char*)op.res.data(), op.res.size());
-				else
-					fuse_reply_err(op.req, EIO);
-				_readOperations.erase(tag);
-			}
-		} // else wait for reconnection
-	} else {
-		(cerr << "ERROR: got response for unknown request " << tag << endl).flush();
-	}
-}
-
 void FUSEAsset::closeOne()
 {
 	if ((--_openCount) <= 0) {
 		_rebindTimer.clear();
+		_reader.stop();
 		asset->close();
-		for (auto iter = _readOperations.begin(); iter != _readOperations.end(); iter++) {
-			fuse_reply_err(iter->second.req, EIO);
-		}
-		_readOperations.clear();
 	}
 }
@@ -1,10 +1,10 @@
 #ifndef INODE_H
 #define INODE_H
 
-#include <map>
 #include <sys/stat.h>
 
 #include "lib/asset.h"
+#include "lib/sequentialreader.h"
 #include "lib/timer.h"
 #include "lib/types.h"
 
@@ -39,17 +39,6 @@ protected:
 	virtual void fill_stat_t(struct stat & s) = 0;
 };
 
-struct BHReadOperation {
-	fuse_req_t req;
-	off_t off;
-	size_t size;
-	uint32_t retries;
-	std::string res;
-
-	BHReadOperation();
-	BHReadOperation(fuse_req_t req, off_t off, size_t size);
-};
-
 class FUSEAsset : public INode, public std::enable_shared_from_this<FUSEAsset> {
 	FUSEAsset(BHFuse* fs, ino_t ino, std::shared_ptr< bithorde::ReadAsset > asset);
 public:
@@ -67,9 +56,7 @@ public:
 protected:
 	virtual void fill_stat_t(struct stat & s);
 private:
-	void onDataArrived( uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag );
 	void onStatusChanged(const bithorde::AssetStatus& s);
-	void queueRead(const BHReadOperation& read);
 	void tryRebind();
 	void closeOne();
 private:
@@ -77,12 +64,12 @@ private:
 	int _openCount;
 	Timer _holdOpenTimer;
 	Timer _rebindTimer;
-	std::map<off_t, BHReadOperation> _readOperations;
-	bool _connected;
 	uint16_t _retries;
 
+	// Sequential reads are served from data read ahead, and others read as they come
+	bithorde::SequentialReader _reader;
+
 	boost::signals2::scoped_connection _statusConnection;
-	boost::signals2::scoped_connection _dataConnection;
 };
 
 #endif // INODE_H
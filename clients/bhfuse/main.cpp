@@ -13,7 +13,6 @@
 #include "lib/bithorde.h"
 
 const int RECONNECT_ATTEMPTS = 30;
-const int RECONNECT_INTERVAL_MS = 500;
 
 using namespace std;
 namespace asio = boost::asio;
@@ -62,6 +61,8 @@ int main(int argc, char *argv[])
 			"Blocksize in KB.")
 		("readahead", po::value< int >(&opts.readAheadKB)->default_value(-1),
 			"Amount to let the kernel pre-load, in KB. -1 means use automatic value")
+		("maxread", po::value< int >(&opts.maxReadKB)->default_value(128),
+			"Largest read to accept from the kernel, in KB. Reads larger than bithorded supports are split.")
 		("timeout", po::value< int >(&opts.assetTimeoutMs)->default_value(1000),
 			"How many millisecond to wait for assets to be found.")
 	;
@@ -84,11 +85,14 @@ int main(int argc, char *argv[])
 	}
 
 	opts.name = "bhfuse";
+	opts["max_read"] = std::to_string(opts.maxReadKB<<10);
 	if (vm.count("debug"))
 		opts.debug = true;
 
 	BHFuse fs(ioSvc, vm["url"].as<string>(), opts);
 
+	bithorde::FileWorkers fileWorkers(fs.client);
+
 	return ioSvc.run();
 }
 
@@ -113,6 +117,9 @@ BHFuse::BHFuse(asio::io_service& ioSvc, string bithorded, const BHFuseOptions& o
 	_ino_allocator(2)
 {
 	client = Client::create(ioSvc, "bhfuse");
+	client->setMaxChunkSize(opts.maxReadKB<<10);
+	client->setSharedMemory(bithorde::DEFAULT_RING_SIZE);
+	client->setAcceptLocalFiles(true);
 
 	client->authenticated.connect([=](bithorde::Client& c, std::string remoteName) {
 		if (remoteName.empty()) {
@@ -124,26 +131,14 @@ BHFuse::BHFuse(asio::io_service& ioSvc, string bithorded, const BHFuseOptions& o
 	});
 
 	client->disconnected.connect([=]() {
-		reconnect();
+		(cerr << "Disconnected, reconnecting..." << endl).flush();
+	});
+	client->connectFailed.connect([=]() {
+		(cerr << "Giving up." << endl).flush();
+		this->ioSvc.stop();
 	});
 
-	client->connect(bithorded);
-}
-
-void BHFuse::reconnect()
-{
-	cerr << "Disconnected, trying reconnect..." << endl;
-	for (int i=0; i < RECONNECT_ATTEMPTS; i++) {
-		usleep(RECONNECT_INTERVAL_MS * 1000);
-		try {
-			client->connect(bithorded);
-			return;
-		} catch (boost::system::system_error e) {
-			cerr << "Failed to reconnect, retrying..." << endl;
-		}
-	}
-	cerr << "Giving up." << endl;
-	ioSvc.stop();
+	client->connectAsync(bithorded, RECONNECT_ATTEMPTS);
 }
 
 void BHFuse::onConnected(bithorde::Client&, std::string remoteName) {
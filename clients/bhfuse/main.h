@@ -17,6 +17,7 @@ public:
 struct BHFuseOptions : public BoostAsioFilesystem_Options {
 	int assetTimeoutMs;
 	int readAheadKB;
+	int maxReadKB;
 	int blockSize;
 };
 
@@ -40,7 +41,6 @@ public:
 public:
 	void onConnected(bithorde::Client&, std::string remoteName);
 	FUSEAsset * registerAsset(std::shared_ptr< bithorde::ReadAsset > asset);
-	void reconnect();
 
 	TimerService& timerSvc();
 private:
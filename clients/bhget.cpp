@@ -4,7 +4,6 @@
 #include <iostream>
 #include <list>
 #include <sstream>
-#include <utility>
 
 #include <lib/buffer.hpp>
 
@@ -16,60 +15,9 @@ using namespace std;
 
 using namespace bithorde;
 
-const static size_t BLOCK_SIZE = (64*1024);
-const static size_t PARALLELL_BLOCKS = (4);
-const static size_t BLOCK_RETRIES = 5;
-
 asio::io_service ioSvc;
 
-struct OutQueue {
-	typedef pair<uint64_t, string> Chunk;
-	uint64_t position;
-	list<Chunk> _stored;
-
-	OutQueue() :
-		position(0)
-	{}
-
-	void send(uint64_t offset, const string& data) {
-		if (offset <= position) {
-			BOOST_ASSERT(offset == position);
-			_flush(data);
-			_dequeue();
-		} else {
-			_queue(offset, data);
-		}
-	}
-
-private:
-	void _queue(uint64_t offset, const string& data) {
-		list<Chunk>::iterator pos = _stored.begin();
-		while ((pos != _stored.end()) && (pos->first < offset))
-			pos++;
-		_stored.insert(pos, Chunk(offset, data));
-	}
-
-	void _dequeue() {
-		while (_stored.size()) {
-			Chunk& first = _stored.front();
-			if (first.first > position) {
-				break;
-			} else {
-				BOOST_ASSERT(first.first == position);
-				_flush(first.second);
-				_stored.pop_front();
-			}
-		}
-	}
-
-	void _flush(const string& data) {
-		ssize_t datasize = data.size();
-		if (write(1, data.data(), datasize) == datasize)
-			position += datasize;
-		else
-			(cerr << "ERROR: failed to write block" << endl).flush();
-	}
-};
+const unsigned CONNECT_ATTEMPTS = 10;
 
 BHGet::BHGet(po::variables_map& args) :
 	optMyName(args["name"].as<string>()),
@@ -88,6 +36,9 @@ int BHGet::main(const std::vector<std::string>& args) {
 	}
 
 	_client = Client::create(ioSvc, optMyName);
+	_client->setMaxChunkSize(MAX_CHUNK_SIZE);
+	_client->setSharedMemory(bithorde::DEFAULT_RING_SIZE);
+	_client->setAcceptLocalFiles(true);
 	_client->authenticated.connect([=](bithorde::Client& c, const std::string& peerName) {
 		if (peerName.empty()) {
 			cerr << "Failed authentication" << endl;
@@ -96,10 +47,18 @@ int BHGet::main(const std::vector<std::string>& args) {
 		if (optDebug)
 			cerr << "DEBUG: Connected to " << peerName << endl;
 		cerr.flush();
-		nextAsset();
+		if (!_asset) // Otherwise reconnected, and resumed by the client
+			nextAsset();
+	});
+	_client->connectFailed.connect([=]() {
+		cerr << "ERROR: Failed to connect to " << optConnectUrl << endl;
+		_res += 1;
+		ioSvc.stop();
 	});
 
-	_client->connect(optConnectUrl);
+	bithorde::FileWorkers fileWorkers(_client);
+
+	_client->connectAsync(optConnectUrl, CONNECT_ATTEMPTS);
 
 	ioSvc.run();
 
@@ -134,6 +93,7 @@ bool BHGet::queueAsset(const std::string& _uri) {
 }
 
 void BHGet::nextAsset() {
+	_reader.reset();
 	BitHordeIds ids;
 	while ((!ids.size()) && (!_assets.empty())) {
 		MagnetURI nextUri = _assets.front();
@@ -152,17 +112,8 @@ void BHGet::nextAsset() {
 			this->onStatusUpdate(status);
 		}
 	});
-	_asset->dataArrived.connect([=](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag) {
-		if (this->_asset.get() == asset) {
-			this->onDataChunk(offset, data, tag);
-		}
-	});
 
 	_client->bind(*_asset);
-
-	_outQueue = new OutQueue();
-	_currentOffset = 0;
-	_failures = 0;
 }
 
 void BHGet::onStatusUpdate(const bithorde::AssetStatus& status)
@@ -173,7 +124,12 @@ void BHGet::onStatusUpdate(const bithorde::AssetStatus& status)
 			if (status.handle()) {
 				if (optDebug)
 					cerr << "DEBUG: Downloading ..." << endl;
-				requestMore();
+				if (!_reader) {
+					_reader.reset(new SequentialReader(*_asset));
+					_reader->start(0, status.size(),
+						std::bind(&BHGet::onData, this, std::placeholders::_1, std::placeholders::_2),
+						std::bind(&BHGet::onFailed, this, std::placeholders::_1));
+				}
 			} else {
 				cerr << "WARNING: Broken response" << endl;
 				nextAsset();
@@ -191,35 +147,22 @@ void BHGet::onStatusUpdate(const bithorde::AssetStatus& status)
 	}
 }
 
-void BHGet::requestMore()
+void BHGet::onData(uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data)
 {
-	while (_currentOffset < (_outQueue->position + (BLOCK_SIZE*PARALLELL_BLOCKS)) &&
-		_currentOffset < _asset->size()) {
-		_asset->aSyncRead(_currentOffset, BLOCK_SIZE);
-		_currentOffset += BLOCK_SIZE;
+	ssize_t datasize = data->size();
+	if (write(1, **data, datasize) != datasize)
+		(cerr << "ERROR: failed to write block" << endl).flush();
+	if (offset + datasize >= _asset->size()) {
+		// Not from within the reader
+		ioSvc.post(std::bind(&BHGet::nextAsset, this));
 	}
 }
 
-void BHGet::onDataChunk(uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int tag)
+void BHGet::onFailed(uint64_t offset)
 {
-	if ((data->size() < BLOCK_SIZE) && ((offset+data->size()) < _asset->size())) {
-		cerr << "WARNING: got unexpectedly small data-block at offset " << offset << ", " << data->size() << " vs. " << BLOCK_SIZE << endl;
-		if (++_failures < BLOCK_RETRIES) {
-			cerr << "Retrying..." << endl;
-			_asset->aSyncRead(offset, BLOCK_SIZE);
-		} else {
-			cerr << "Too many retries, failing asset";
-			nextAsset();
-			return;
-		}
-	}
-	string buf(reinterpret_cast<char*>(**data), data->size());
-	_outQueue->send(offset, buf);
-	if (_outQueue->position < _asset->size()) {
-		requestMore();
-	} else {
-		nextAsset();
-	}
+	cerr << "ERROR: Too many retries at offset " << offset << ", failing asset" << endl;
+	_res += 1;
+	ioSvc.post(std::bind(&BHGet::nextAsset, this));
 }
 
 int main(int argc, char *argv[]) {
@@ -11,8 +11,6 @@
 
 #include "lib/bithorde.h"
 
-struct OutQueue;
-
 class BHGet {
 	// Options
 	std::string optMyName;
@@ -23,9 +21,7 @@ class BHGet {
 	std::list<MagnetURI> _assets;
 	bithorde::Client::Pointer _client;
 	std::unique_ptr<bithorde::ReadAsset> _asset;
-	uint64_t _currentOffset;
-	OutQueue * _outQueue;
-	uint32_t _failures;
+	std::unique_ptr<bithorde::SequentialReader> _reader;
 	int _res;
 public:
 	BHGet(boost::program_options::variables_map &map);
@@ -36,10 +32,10 @@ public:
 	bool optDebug;
 private:
 	void onStatusUpdate(const bithorde::AssetStatus&);
-	void onDataChunk( uint64_t offset, const std::shared_ptr< bithorde::IBuffer >& data, int tag );
+	void onData(uint64_t offset, const std::shared_ptr< bithorde::IBuffer >& data);
+	void onFailed(uint64_t offset);
 
 	void nextAsset();
-	void requestMore();
 };
 
 #endif
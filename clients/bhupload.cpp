@@ -40,6 +40,7 @@ int BHUpload::main(const std::vector<std::string>& args) {
 	}
 
 	_client = Client::create(_ioSvc, optMyName);
+	_client->setSharedMemory(bithorde::DEFAULT_RING_SIZE);
 
 	_client->authenticated.connect([=](bithorde::Client& c, std::string peerName) {
 		if (peerName.empty()) {
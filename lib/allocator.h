@@ -1,38 +1,141 @@
 #ifndef BITHORDE_ALLOCATOR_H
 #define BITHORDE_ALLOCATOR_H
 
-#include <queue>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
 
+/**
+ * Hands out ids, re-using freed ones in the order they were freed.
+ */
 template <typename T>
 struct CachedAllocator {
 private:
-	std::queue<T> _freed;
+	std::vector<T> _freed; // Power-of-two ring
+	std::size_t _head, _count;
 	T _init;
 	T _next;
 public:
 	CachedAllocator(T init) 
-		: _init(init), _next(init)
+		: _freed(16), _head(0), _count(0), _init(init), _next(init)
 	{}
 
 	T allocate() {
 		T res;
-		if (_freed.empty()) {
+		if (!_count) {
 			res = _next++;
 		} else {
-			res = _freed.front();
-			_freed.pop();
+			res = _freed[_head];
+			_head = (_head+1) & (_freed.size()-1);
+			_count--;
 		}
 		return res;
 	}
 
 	void free(T x) {
-		_freed.push(x);
+		if (_count == _freed.size()) {
+			std::vector<T> freed(_freed.size()*2);
+			for (std::size_t i=0; i < _count; i++)
+				freed[i] = _freed[(_head+i) & (_freed.size()-1)];
+			_freed.swap(freed);
+			_head = 0;
+		}
+		_freed[(_head+_count) & (_freed.size()-1)] = x;
+		_count++;
 	}
 
 	void reset() {
 		_next = _init;
-		_freed = std::queue<T>();
+		_head = 0;
+		_count = 0;
+	}
+};
+
+/**
+ * Recycles small blocks, by size. Meant for objects churned at a high rate, such as request-contexts and
+ * the nodes of the maps tracking them, so that they are not malloc:ed and freed each time. Blocks larger
+ * than MAX_BLOCK go straight to the heap. Not thread-safe.
+ */
+class SlabPool {
+public:
+	typedef std::shared_ptr<SlabPool> Ptr;
+	static const std::size_t ALIGN = 16;
+	static const std::size_t MAX_BLOCK = 1024;
+	static const std::size_t MAX_FREE = 4096; // Per block-size
+private:
+	std::vector< std::vector<void*> > _free; // Indexed by size in ALIGN units
+	std::size_t _drawn;
+public:
+	SlabPool() : _free(MAX_BLOCK / ALIGN + 1), _drawn(0) {}
+	SlabPool(const SlabPool&) = delete;
+	~SlabPool() {
+		for (auto size = _free.begin(); size != _free.end(); size++) {
+			for (auto iter = size->begin(); iter != size->end(); iter++)
+				::operator delete(*iter);
+		}
+	}
+
+	void* allocate(std::size_t size) {
+		const auto cls = (size + ALIGN - 1) / ALIGN;
+		if (cls < _free.size() && !_free[cls].empty()) {
+			void* res = _free[cls].back();
+			_free[cls].pop_back();
+			return res;
+		}
+		_drawn++;
+		return ::operator new(cls < _free.size() ? cls * ALIGN : size);
+	}
+
+	void deallocate(void* p, std::size_t size) {
+		const auto cls = (size + ALIGN - 1) / ALIGN;
+		if (cls < _free.size() && _free[cls].size() < MAX_FREE)
+			_free[cls].push_back(p);
+		else
+			::operator delete(p);
 	}
+
+	/**
+	 * Number of blocks drawn from the heap, for lack of a pooled one
+	 */
+	std::size_t drawn() const {
+		return _drawn;
+	}
+
+	/**
+	 * Number of blocks pooled, of all sizes
+	 */
+	std::size_t pooled() const {
+		std::size_t res = 0;
+		for (auto size = _free.begin(); size != _free.end(); size++)
+			res += size->size();
+		return res;
+	}
+};
+
+/**
+ * std-compatible allocator drawing from a SlabPool, keeping the pool alive while in use.
+ */
+template <typename T>
+struct SlabAllocator {
+	typedef T value_type;
+	SlabPool::Ptr pool;
+
+	SlabAllocator(const SlabPool::Ptr& pool) : pool(pool) {}
+	template <typename U>
+	SlabAllocator(const SlabAllocator<U>& other) : pool(other.pool) {}
+
+	T* allocate(std::size_t n) {
+		return static_cast<T*>(pool->allocate(n * sizeof(T)));
+	}
+	void deallocate(T* p, std::size_t n) {
+		pool->deallocate(p, n * sizeof(T));
+	}
+
+	template <typename U>
+	bool operator==(const SlabAllocator<U>& other) const { return pool == other.pool; }
+	template <typename U>
+	bool operator!=(const SlabAllocator<U>& other) const { return pool != other.pool; }
 };
 
 #endif // ALLOCATOR_H
@@ -1,9 +1,10 @@
 
 #include "asset.h"
 
-#include <boost/asio/placeholders.hpp>
 #include <boost/filesystem.hpp>
 #include <iostream>
+#include <string.h>
+#include <unistd.h>
 
 #include "buffer.hpp"
 #include "client.h"
@@ -91,17 +92,41 @@ void Asset::handleMessage(const bithorde::AssetStatus & msg)
 	statusUpdate(msg);
 }
 
+FileRegion::FileRegion(int fd, uint64_t offset, uint64_t size) :
+	_fd(fd),
+	_offset(offset),
+	_size(size)
+{}
+
+FileRegion::~FileRegion()
+{
+	::close(_fd);
+}
+
+ssize_t FileRegion::read(uint64_t offset, size_t size, byte* buf) const
+{
+	if (offset >= _size)
+		return 0;
+	size = std::min<uint64_t>(size, _size - offset);
+	ssize_t res;
+	do {
+		res = ::pread(_fd, buf, size, _offset + offset);
+	} while ((res < 0) && (errno == EINTR));
+	return res;
+}
+
 ReadRequestContext::ReadRequestContext(ReadAsset* asset, uint64_t offset, size_t size, int32_t timeout) :
 	_asset(asset),
 	_client(asset->client()),
-	_timer(asset->ioSvc()),
-	_requested_at(ptime::microsec_clock::universal_time())
+	_timer(*_client->_timerSvc, [this](const ptime::ptime&) { timer_callback(); }),
+	_requested_at(ptime::microsec_clock::universal_time()),
+	_abandoned(false)
 {
 	set_handle(asset->handle());
 	set_reqid(_client->allocRPCRequest(handle()));
 	set_offset(offset);
 	set_size(size);
-	set_timeout(timeout); // Assume 100ms latency on each link.
+	set_timeout(timeout);
 }
 ReadRequestContext::~ReadRequestContext() {
 	if (_asset)
@@ -109,22 +134,80 @@ ReadRequestContext::~ReadRequestContext() {
 }
 
 void ReadRequestContext::armTimer(int32_t timeout)
+{
+	_timer.arm(ptime::millisec(timeout));
+}
+
+void ReadRequestContext::readLocal(const FileRegion::Ptr& file)
 {
 	auto self = shared_from_this();
-	_timer.expires_from_now(boost::posix_time::millisec(timeout));
-	_timer.async_wait([=](const boost::system::error_code& ec){
-		self->timer_callback(ec);
-	});
+	auto& ioSvc = _client->_ioSvc;
+	auto data = std::make_shared<MemoryBuffer>(size());
+	// Read on the workers if there are any. The context is moved back with the result, so that it is
+	// only ever released on the io_service.
+	auto read = [self, file, data, &ioSvc]() mutable {
+		auto got = file->read(self->offset(), self->size(), **data);
+		auto err = errno;
+		ioSvc.post(std::bind(&ReadRequestContext::onLocalRead, std::move(self), std::move(data), got, err));
+	};
+	if (_client->_fileWorkers)
+		_client->_fileWorkers->post(read);
+	else
+		ioSvc.post(read);
+}
+
+void ReadRequestContext::onLocalRead(const std::shared_ptr<MemoryBuffer>& data, ssize_t got, int err)
+{
+	if (!_asset) // Cancelled
+		return;
+	if (got <= 0) {
+		cerr << "Warning: failed reading local file, " << (got ? strerror(err) : "at end") << endl;
+		if (resend())
+			return;
+		return cancel();
+	}
+	data->trim(got);
+	auto self = shared_from_this(); // Keep alive past clearRequest()
+	auto asset = _asset;
+	_asset = NULL;
+	_timer.clear();
+	_client->releaseRPCRequest(reqid());
+	asset->clearRequest(reqid());
+	if (!_abandoned)
+		asset->dataArrived(offset(), data, reqid());
+}
+
+void ReadRequestContext::suspend()
+{
+	_timer.clear();
+}
+
+bool ReadRequestContext::resend()
+{
+	if (_abandoned)
+		return false;
+	if (!_client->sendMessage(Connection::ReadRequest, *this))
+		return false;
+	_timer.clear();
+	armTimer(timeout());
+	return true;
 }
 
 void ReadRequestContext::cancel()
 {
+	_timer.clear();
 	if (_asset) {
 		auto asset = _asset;
 		_asset = NULL;
-		asset->dataArrived(offset(), NullBuffer::instance, reqid());
+		_client->lingerRPCRequest(reqid(), timeout());
+		if (!_abandoned)
+			asset->dataArrived(offset(), NullBuffer::instance, reqid());
 	}
-	_timer.cancel();
+}
+
+void ReadRequestContext::abandon()
+{
+	_abandoned = true;
 }
 
 void ReadRequestContext::callback(const std::shared_ptr< MessageContext<Read::Response> >& msgCtx)
@@ -132,9 +215,15 @@ void ReadRequestContext::callback(const std::shared_ptr< MessageContext<Read::Re
 	const auto& msg = msgCtx->message();
 	if (!_asset) // Cancelled
 		return;
+	_timer.clear();
 	auto asset = _asset;
 	_asset = NULL; // Handle circular triggers
-	asset->readResponseTime.post((ptime::microsec_clock::universal_time() - _requested_at).total_milliseconds());
+	auto elapsed = (ptime::microsec_clock::universal_time() - _requested_at).total_milliseconds();
+	asset->readResponseTime.post(elapsed);
+	if (msg.status() == bithorde::SUCCESS)
+		_client->readLatency.post(elapsed);
+	if (_abandoned)
+		return;
 	if (msg.status() == bithorde::SUCCESS) {
 		asset->dataArrived(msg.offset(), std::make_shared<ReadResponseCtxBuffer>(msgCtx), msg.reqid());
 	} else {
@@ -143,24 +232,147 @@ void ReadRequestContext::callback(const std::shared_ptr< MessageContext<Read::Re
 	}
 }
 
-void ReadRequestContext::timer_callback(const boost::system::error_code& error)
+void ReadRequestContext::timer_callback()
 {
-	if (!error) {
-		// Timeout occurred
-		if (_asset) {
-			auto asset = _asset;
-			_asset = NULL;
-			asset->readResponseTime.post((ptime::microsec_clock::universal_time() - _requested_at).total_milliseconds());
+	// Timeout occurred
+	if (_asset) {
+		auto self = shared_from_this(); // Keep alive past clearRequest()
+		auto asset = _asset;
+		_asset = NULL;
+		_client->lingerRPCRequest(reqid(), timeout());
+		auto elapsed = (ptime::microsec_clock::universal_time() - _requested_at).total_milliseconds();
+		asset->readResponseTime.post(elapsed);
+		_client->readLatency.timedOut();
+		if (!_abandoned)
 			asset->dataArrived(offset(), NullBuffer::instance, reqid());
-			asset->clearOffset(offset(), reqid());
-		}
+		asset->clearRequest(reqid());
+	}
+}
+
+ReadStreamContext::ReadStreamContext(ReadAsset* asset, uint64_t offset, uint64_t size, int32_t timeout, int32_t idleTimeout) :
+	_asset(asset),
+	_client(asset->client()),
+	_timer(*_client->_timerSvc, [this](const ptime::ptime&) { timer_callback(); }),
+	_idleTimeout(idleTimeout),
+	_position(offset)
+{
+	set_handle(asset->handle());
+	set_reqid(_client->allocRPCRequest(handle(), true));
+	set_offset(offset);
+	set_size(size);
+	set_timeout(timeout);
+}
+
+ReadStreamContext::~ReadStreamContext() {
+	if (_asset)
+		_client->releaseRPCRequest(reqid());
+}
+
+bool ReadStreamContext::send()
+{
+	return _client->sendMessage(Connection::ReadStream, *this);
+}
+
+bool ReadStreamContext::extend(uint64_t end)
+{
+	if (!_asset)
+		return false;
+	if (end > this->end()) {
+		bool covered = _position >= this->end();
+		set_size(end - offset());
+		send();
+		if (covered)
+			armTimer();
 	}
+	return true;
+}
+
+void ReadStreamContext::suspend()
+{
+	_timer.clear();
+}
+
+bool ReadStreamContext::resume()
+{
+	if (!_asset)
+		return false;
+	auto end = this->end();
+	set_offset(_position);
+	set_size(end - _position);
+	if (!size())
+		return true; // Nothing due until extended
+	if (!send())
+		return false;
+	armTimer();
+	return true;
+}
+
+void ReadStreamContext::armTimer()
+{
+	_timer.clear();
+	_timer.arm(ptime::millisec(_idleTimeout));
+}
+
+void ReadStreamContext::callback(const std::shared_ptr< MessageContext<Read::Response> >& msgCtx)
+{
+	const auto& msg = msgCtx->message();
+	if (!_asset) // Closed
+		return;
+	auto self = shared_from_this();
+	auto asset = _asset;
+	if (msg.status() == bithorde::SUCCESS) {
+		if (msg.offset() != _position) // Left over from an earlier stream with the same reqId
+			return;
+		auto data = std::make_shared<ReadResponseCtxBuffer>(msgCtx);
+		_position += data->size();
+		if (_position >= end())
+			_timer.clear(); // Nothing more due until extended
+		else
+			armTimer();
+		asset->dataArrived(msg.offset(), data, reqid());
+	} else {
+		cerr << "Error: failed read-stream, " << bithorde::Status_Name(msg.status()) << endl;
+		cancel();
+	}
+}
+
+void ReadStreamContext::timer_callback()
+{
+	// Timeout occurred
+	cancel();
+}
+
+void ReadStreamContext::cancel()
+{
+	if (auto asset = _asset) {
+		auto self = shared_from_this();
+		close();
+		asset->dataArrived(_position, NullBuffer::instance, reqid());
+	}
+}
+
+void ReadStreamContext::close()
+{
+	if (!_asset)
+		return;
+	auto self = shared_from_this();
+	auto asset = _asset;
+	_asset = NULL;
+	_timer.clear();
+
+	// Let the peer forget about the stream
+	bithorde::Read::Stream msg(*this);
+	msg.set_size(0);
+	_client->sendMessage(Connection::ReadStream, msg);
+	_client->lingerRPCRequest(reqid(), timeout());
+	asset->_streams.erase(reqid());
 }
 
 ReadAsset::ReadAsset(const bithorde::ReadAsset::ClientPointer& client, const BitHordeIds& requestIds) :
 	Asset(client),
 	readResponseTime(0.95, "ms"),
-	_requestIds(requestIds)
+	_requestIds(requestIds),
+	_resuming(false)
 {}
 
 ReadAsset::~ReadAsset()
@@ -169,10 +381,45 @@ ReadAsset::~ReadAsset()
 }
 
 void ReadAsset::cancelRequests() {
-	for (auto iter = _requestMap.begin(); iter != _requestMap.end(); iter++) {
+	// Cancel from aside, since new reads may be issued from dataArrived
+	RequestMap requests;
+	requests.swap(_requestMap);
+	for (auto iter = requests.begin(); iter != requests.end(); iter++) {
+		iter->second->cancel();
+	}
+	requests.clear();
+	if (_requestMap.empty())
+		_requestMap.swap(requests); // Keep the table allocated
+	auto streams = _streams;
+	for (auto iter = streams.begin(); iter != streams.end(); iter++) {
 		iter->second->cancel();
 	}
-	_requestMap.clear();
+}
+
+void ReadAsset::suspendRequests() {
+	for (auto iter = _requestMap.begin(); iter != _requestMap.end(); iter++)
+		iter->second->suspend();
+	for (auto iter = _streams.begin(); iter != _streams.end(); iter++)
+		iter->second->suspend();
+}
+
+void ReadAsset::resumeRequests() {
+	// Resend from aside, since failures are signalled through dataArrived
+	std::vector<ReadRequestContext::Ptr> requests;
+	for (auto iter = _requestMap.begin(); iter != _requestMap.end(); iter++)
+		requests.push_back(iter->second);
+	for (auto iter = requests.begin(); iter != requests.end(); iter++) {
+		auto& req = *iter;
+		if (!req->resend()) {
+			clearRequest(req->reqid());
+			req->cancel();
+		}
+	}
+	auto streams = _streams;
+	for (auto iter = streams.begin(); iter != streams.end(); iter++) {
+		if (!iter->second->resume())
+			iter->second->cancel();
+	}
 }
 
 const BitHordeIds& ReadAsset::requestIds() const
@@ -194,56 +441,119 @@ void ReadAsset::handleMessage(const bithorde::AssetStatus &msg)
 			// TODO: Application::instance().logger().warning("Peer tried to change asset-size.");
 		}
 	}
+	if (msg.status() != bithorde::SUCCESS)
+		_localFile.reset();
+	if (_resuming) {
+		// First status since the connection was re-established
+		_resuming = false;
+		if (msg.status() == bithorde::SUCCESS) {
+			resumeRequests();
+		} else {
+			Asset::handleMessage(msg);
+			return cancelRequests();
+		}
+	}
 	Asset::handleMessage(msg);
 }
 
 void ReadAsset::handleMessage( const std::shared_ptr< MessageContext< Read::Response > >& msgCtx ) {
 	const auto& msg = msgCtx->message();
-	auto it = _requestMap.lower_bound(msg.offset());
-	auto end = _requestMap.upper_bound(msg.offset());
-	while (it != end) {
-		auto next = it;
-		next++;
-		auto ctx = it->second;
-		_requestMap.erase(it);
+	auto stream = _streams.find(msg.reqid());
+	if (stream != _streams.end()) {
+		auto ctx = stream->second;
+		return ctx->callback(msgCtx);
+	}
+	auto req = _requestMap.find(msg.reqid());
+	if (req != _requestMap.end()) {
+		auto ctx = req->second;
+		_requestMap.erase(msg.reqid());
 		ctx->callback(msgCtx);
-		it = next;
 	}
 }
 
-void ReadAsset::clearOffset(ReadAsset::off_t offset, uint32_t reqid)
+void ReadAsset::clearRequest(int reqid)
 {
-	auto it = _requestMap.lower_bound(offset);
-	auto end = _requestMap.upper_bound(offset);
-	while (it != end) {
-		auto next = it;
-		next++;
-		if (it->second->reqid() == reqid)
-			_requestMap.erase(it);
-		it = next;
-	}
+	_requestMap.erase(reqid);
+}
+
+void ReadAsset::setLocalFile(const FileRegion::Ptr& file)
+{
+	_localFile = file;
 }
 
 int ReadAsset::aSyncRead(ReadAsset::off_t offset, ssize_t size, int32_t timeout)
 {
 	if (!_client || !_client->isConnected())
 		return -1;
-	auto _timeout = timeout - 100; // Assume 100ms latency on each link
+	if (!timeout)
+		timeout = _client->readTimeout();
+	auto _timeout = timeout - _client->hopLatency(); // Leave the peer time to answer
 	if (_timeout <= 0)
 		return -1;
 	int64_t maxSize = _size - offset;
 	if (size > maxSize)
 		size = maxSize;
-	auto req = std::make_shared<ReadRequestContext>(this, offset, size, _timeout);
-	if (_client->sendMessage(Connection::ReadRequest, *req)) {
+	if (size > (ssize_t)_client->maxChunkSize())
+		size = _client->maxChunkSize();
+	auto req = std::allocate_shared<ReadRequestContext>(SlabAllocator<ReadRequestContext>(_client->_slabs), this, offset, size, _timeout);
+	if (_localFile && (offset + size <= _localFile->size())) {
+		req->armTimer(timeout);
+		_requestMap[req->reqid()] = req;
+		req->readLocal(_localFile);
+	} else if (_client->sendMessage(Connection::ReadRequest, *req)) {
 		req->armTimer(timeout);
-		_requestMap.emplace(offset, req);
+		_requestMap[req->reqid()] = req;
 	} else {
 		req->cancel();
 	}
 	return req->reqid();
 }
 
+void ReadAsset::cancelRead(int tag)
+{
+	auto req = _requestMap.find(tag);
+	if (req != _requestMap.end())
+		req->second->abandon();
+}
+
+int ReadAsset::aSyncStream(ReadAsset::off_t offset, uint64_t size, int32_t timeout)
+{
+	if (!_client || !_client->isConnected() || !_client->readStreams())
+		return -1;
+	if (!timeout)
+		timeout = _client->readTimeout();
+	auto _timeout = timeout - _client->hopLatency(); // Leave the peer time to answer
+	if (_timeout <= 0)
+		return -1;
+	if ((_size >= 0) && (offset + size > (uint64_t)_size))
+		size = _size - offset;
+	auto stream = std::make_shared<ReadStreamContext>(this, offset, size, _timeout, timeout);
+	if (!stream->send())
+		return -1;
+	_streams[stream->reqid()] = stream;
+	stream->armTimer();
+	return stream->reqid();
+}
+
+bool ReadAsset::extendStream(int tag, ReadAsset::off_t end)
+{
+	auto stream = _streams.find(tag);
+	if (stream == _streams.end())
+		return false;
+	if ((_size >= 0) && (end > (uint64_t)_size))
+		end = _size;
+	return stream->second->extend(end);
+}
+
+void ReadAsset::cancelStream(int tag)
+{
+	auto stream = _streams.find(tag);
+	if (stream != _streams.end()) {
+		auto ctx = stream->second;
+		ctx->close();
+	}
+}
+
 UploadAsset::UploadAsset(const bithorde::Asset::ClientPointer& client, uint64_t size)
 	: Asset(client)
 {
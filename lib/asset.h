@@ -7,13 +7,15 @@
 #include <vector>
 #include <unordered_set>
 
-#include <boost/asio/deadline_timer.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/signals2.hpp>
 
+#include "allocator.h"
 #include "bithorde.pb.h"
 #include "counter.h"
+#include "flatmap.h"
 #include "hashes.h"
+#include "timer.h"
 #include "types.h"
 
 namespace bithorde {
@@ -21,6 +23,7 @@ namespace bithorde {
 class Client;
 class AssetBinding;
 class IBuffer;
+class MemoryBuffer;
 
 template <typename T>
 class MessageContext;
@@ -70,30 +73,147 @@ protected:
 	virtual void handleMessage( const std::shared_ptr< MessageContext< bithorde::Read::Response > >& msg ) = 0;
 };
 
+/**
+ * A region of an open file holding the data of an asset, as handed over by a local peer. Owns the
+ * descriptor, and closes it when destroyed. Reads are kept within the region, which is what the
+ * peer had verified when handing it over. The data is trusted as far as the peer is, since the
+ * descriptor is not checked against the hash-tree on this side.
+ */
+class FileRegion : boost::noncopyable {
+	int _fd;
+	uint64_t _offset, _size;
+public:
+	typedef std::shared_ptr<FileRegion> Ptr;
+
+	FileRegion(int fd, uint64_t offset, uint64_t size);
+	~FileRegion();
+
+	int fd() const { return _fd; }
+
+	/**
+	 * Where asset-data starts in the file
+	 */
+	uint64_t offset() const { return _offset; }
+
+	/**
+	 * Bytes of asset-data that may be read
+	 */
+	uint64_t size() const { return _size; }
+
+	/**
+	 * Reads up to /size/ bytes of asset-data from /offset/, returning the amount read, or -1 on error
+	 */
+	ssize_t read(uint64_t offset, size_t size, byte* buf) const;
+};
+
 static boost::arg<1> ASSET_ARG_OFFSET;
 static boost::arg<2> ASSET_ARG_DATA;
 static boost::arg<3> ASSET_ARG_TAG;
 
 class ReadAsset;
+
+/**
+ * A single outstanding Read.Request. Contexts are allocated from the slab-pool of the client, and
+ * time out through its TimerService, so that a read in the common case does not hit the heap.
+ */
 class ReadRequestContext : boost::noncopyable, public bithorde::Read_Request, public std::enable_shared_from_this<ReadRequestContext> {
 	ReadAsset* _asset;
 	Asset::ClientPointer _client;
-	boost::asio::deadline_timer _timer;
+	Timer _timer;
 	boost::posix_time::ptime _requested_at;
+	bool _abandoned;
 public:
 	typedef std::shared_ptr<ReadRequestContext> Ptr;
 	ReadRequestContext(bithorde::ReadAsset* asset, uint64_t offset, std::size_t size, int32_t timeout);
 	virtual ~ReadRequestContext();
 
 	void armTimer(int32_t timeout);
+
+	/**
+	 * Reads from /file/ instead of sending the request, on the file workers of the client, or else
+	 * posted to the io_service. Falls back to sending the request if the file could not be read.
+	 */
+	void readLocal(const FileRegion::Ptr& file);
+
+	/**
+	 * Stops the timeout while the connection is lost, until resend()
+	 */
+	void suspend();
+
+	/**
+	 * Sends the request again, over a re-established connection. Returns false if it could not be sent.
+	 */
+	bool resend();
 	void callback( const std::shared_ptr< bithorde::MessageContext< bithorde::Read::Response > >& msgCtx );
-	void timer_callback(const boost::system::error_code& error);
+	void timer_callback();
 	void cancel();
+
+	/**
+	 * Stops passing on the outcome of the request, while still waiting for it to complete
+	 */
+	void abandon();
+private:
+	/**
+	 * Back on the io_service, with /got/ bytes read into /data/ by readLocal(), or the errno /err/
+	 */
+	void onLocalRead(const std::shared_ptr<MemoryBuffer>& data, ssize_t got, int err);
+};
+
+/**
+ * A Read.Stream subscribed to by a ReadAsset. Chunks are passed on as they arrive. The stream
+ * stays open when the range is covered, so that it can be extended, until closed or until a
+ * chunk due fails to arrive within the timeout.
+ */
+class ReadStreamContext : boost::noncopyable, public bithorde::Read_Stream, public std::enable_shared_from_this<ReadStreamContext> {
+	ReadAsset* _asset;
+	Asset::ClientPointer _client;
+	Timer _timer;
+	int32_t _idleTimeout;
+	uint64_t _position;
+public:
+	typedef std::shared_ptr<ReadStreamContext> Ptr;
+	ReadStreamContext(bithorde::ReadAsset* asset, uint64_t offset, uint64_t size, int32_t timeout, int32_t idleTimeout);
+	virtual ~ReadStreamContext();
+
+	/**
+	 * Offset of the next chunk expected
+	 */
+	uint64_t position() const { return _position; }
+	uint64_t end() const { return offset() + size(); }
+
+	bool send();
+	bool extend(uint64_t end);
+
+	/**
+	 * Stops the timeout while the connection is lost, until resume()
+	 */
+	void suspend();
+
+	/**
+	 * Opens the stream again from the position reached, over a re-established connection. Returns
+	 * false if it could not be sent.
+	 */
+	bool resume();
+	void armTimer();
+	void callback( const std::shared_ptr< bithorde::MessageContext< bithorde::Read::Response > >& msgCtx );
+	void timer_callback();
+
+	/**
+	 * Closes the stream, signalling an empty chunk
+	 */
+	void cancel();
+
+	/**
+	 * Closes the stream silently
+	 */
+	void close();
 };
 
 class ReadAsset : public Asset, boost::noncopyable
 {
+	friend class Client;
 	friend class ReadRequestContext;
+	friend class ReadStreamContext;
 public:
 	typedef std::shared_ptr<Client> ClientPointer;
 	typedef std::shared_ptr<ReadAsset> Ptr;
@@ -105,10 +225,40 @@ public:
 	virtual ~ReadAsset();
 	void cancelRequests();
 
-	int aSyncRead(off_t offset, ssize_t size, int32_t timeout=10000);
+	/**
+	 * Requests /size/ bytes from /offset/, to arrive through dataArrived tagged with the returned id.
+	 * A /timeout/ of 0 means the client's readTimeout().
+	 */
+	int aSyncRead(off_t offset, ssize_t size, int32_t timeout=0);
+
+	/**
+	 * Drops the read /tag/, nothing more arrives for it. Its request id stays taken until the peer
+	 * answers or the read times out, so that a late answer is not mistaken for a later read.
+	 */
+	void cancelRead(int tag);
+
+	/**
+	 * Subscribes to /size/ bytes from /offset/, pushed by the peer in order through dataArrived,
+	 * tagged with the returned id. A chunk without data means the stream failed. The stream must
+	 * be cancelled when no longer needed. Returns -1 if not connected, or if the peer does not
+	 * support streams. A /timeout/ of 0 means the client's readTimeout().
+	 */
+	int aSyncStream(off_t offset, uint64_t size, int32_t timeout=0);
+
+	/**
+	 * Moves the end of the stream /tag/ to /end/. Returns false if the stream is already closed.
+	 */
+	bool extendStream(int tag, off_t end);
+	void cancelStream(int tag);
 	const BitHordeIds & requestIds() const;
 	const BitHordeIds & confirmedIds() const;
 
+	/**
+	 * The data of the asset in a local file, if handed over by the peer. Reads within it are served
+	 * from the file by aSyncRead, but it may also be read directly.
+	 */
+	const FileRegion::Ptr& localFile() const { return _localFile; }
+
 	typedef boost::signals2::signal<void (off_t offset, const std::shared_ptr<IBuffer>& data, int tag)> DataSignal;
 	DataSignal dataArrived;
 
@@ -116,13 +266,27 @@ public:
 protected:
 	virtual void handleMessage(const bithorde::AssetStatus &msg);
 	virtual void handleMessage( const std::shared_ptr< bithorde::MessageContext< bithorde::Read::Response > >& msgCtx );
-	void clearOffset(off_t offset, uint32_t reqid);
+	void clearRequest(int reqid);
+	void setLocalFile(const FileRegion::Ptr& file);
+
+	/**
+	 * Holds outstanding reads and streams without timing out, while the connection is re-established
+	 */
+	void suspendRequests();
+
+	/**
+	 * Sends outstanding reads and streams again, after the asset was bound again on a new connection
+	 */
+	void resumeRequests();
 
 private:
 	BitHordeIds _requestIds;
 	BitHordeIds _confirmedIds;
-	typedef std::multimap<off_t, ReadRequestContext::Ptr> RequestMap;
+	typedef FlatMap<int, ReadRequestContext::Ptr> RequestMap; // By reqId
 	RequestMap _requestMap;
+	std::map<int, ReadStreamContext::Ptr> _streams;
+	FileRegion::Ptr _localFile;
+	bool _resuming; // Reads are held over a lost connection, until bound again
 };
 
 class UploadAsset : public Asset
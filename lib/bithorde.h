@@ -5,6 +5,8 @@
 #include "client.h"
 #include "hashes.h"
 #include "magneturi.h"
+#include "sequentialreader.h"
+#include "sharedmemory.h"
 
 const uint16_t    BITHORDED_DEFAULT_INSPECT_PORT = 5000;
 const uint16_t    BITHORDED_DEFAULT_TCP_PORT     = 1337;
@@ -19,8 +19,18 @@
 
 #include "client.h"
 
+#include <string.h>
+
 using namespace bithorde;
 
+const size_t SEGMENT_PAGE_SIZE = 4096;
+const size_t MAX_SEGMENT_SLACK = 4; // Pooled segments serve requests needing down to 1/4 less
+const size_t SHARED_POOL_MAX_BYTES = 64*1024*1024;
+
+static size_t pageRound(size_t size) {
+	return std::max<size_t>((size + SEGMENT_PAGE_SIZE - 1) / SEGMENT_PAGE_SIZE, 1) * SEGMENT_PAGE_SIZE;
+}
+
 NullBuffer::NullBuffer() {
 }
 
@@ -52,16 +62,156 @@ size_t MemoryBuffer::size() const {
 	return _size;
 }
 
+BufferSlice::BufferSlice ( const IBuffer::Ptr& backing, byte* ptr, size_t size )
+	: _backing(backing), _ptr(ptr), _size(size)
+{
+	BOOST_ASSERT(ptr >= **backing);
+	BOOST_ASSERT(ptr+size <= **backing + backing->size());
+}
+
+byte* BufferSlice::operator*() const {
+	return _ptr;
+}
+
+size_t BufferSlice::size() const {
+	return _size;
+}
+
+const SegmentPool::Ptr& SegmentPool::shared() {
+	static const Ptr instance(std::make_shared<SegmentPool>(SHARED_POOL_MAX_BYTES));
+	return instance;
+}
+
+SegmentPool::SegmentPool(size_t maxPooledBytes)
+	: _pooledBytes(0), _maxPooledBytes(maxPooledBytes)
+{
+}
+
+SegmentPool::~SegmentPool() {
+	for (auto iter = _free.begin(); iter != _free.end(); iter++)
+		delete iter->second;
+}
+
+std::shared_ptr<MemoryBuffer> SegmentPool::acquire(size_t size) {
+	size = pageRound(size);
+	MemoryBuffer* segment = NULL;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto found = _free.lower_bound(size);
+		if ((found != _free.end()) && (found->first <= size + size / MAX_SEGMENT_SLACK)) {
+			segment = found->second;
+			_free.erase(found);
+			_pooledBytes -= segment->size();
+		}
+	}
+	if (!segment)
+		segment = new MemoryBuffer(size);
+	auto self = shared_from_this();
+	return std::shared_ptr<MemoryBuffer>(segment, [self](MemoryBuffer* segment) {
+		self->release(segment);
+	});
+}
+
+size_t SegmentPool::pooledBytes() const {
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _pooledBytes;
+}
+
+void SegmentPool::release(MemoryBuffer* segment) {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if ((_pooledBytes + segment->size()) <= _maxPooledBytes) {
+			_free.insert(std::make_pair(segment->size(), segment));
+			_pooledBytes += segment->size();
+			return;
+		}
+	}
+	delete segment;
+}
+
+ReceiveBuffer::ReceiveBuffer(const SegmentPool::Ptr& pool)
+	: _pool(pool), _size(0), _consumed(0)
+{
+}
+
+byte* ReceiveBuffer::allocate ( size_t amount ) {
+	if (!_segment || (_segment->size() - _size) < amount) {
+		auto left = this->left();
+		if (_segment && !pinned() && (_segment->size() - left) >= amount) {
+			memmove(**_segment, **_segment + _consumed, left);
+		} else {
+			auto segment = _pool->acquire(left + amount);
+			if (left)
+				memcpy(**segment, data(), left);
+			_segment = segment;
+		}
+		_size = left;
+		_consumed = 0;
+	}
+	return **_segment + _size;
+}
+
+void ReceiveBuffer::charge ( size_t amount ) {
+	BOOST_ASSERT(_segment && (_size + amount) <= _segment->size());
+	_size += amount;
+}
+
+byte* ReceiveBuffer::data() const {
+	return _segment ? **_segment + _consumed : NULL;
+}
+
+size_t ReceiveBuffer::left() const {
+	return _size - _consumed;
+}
+
+void ReceiveBuffer::consume ( size_t amount ) {
+	BOOST_ASSERT(amount <= left());
+	_consumed += amount;
+}
+
+void ReceiveBuffer::pop() {
+	if (!_consumed || pinned())
+		return;
+	if (_consumed == _size) {
+		_size = 0;
+		_consumed = 0;
+	}
+}
+
+void ReceiveBuffer::release() {
+	if (left())
+		return;
+	_segment.reset();
+	_size = 0;
+	_consumed = 0;
+}
+
+size_t ReceiveBuffer::capacity() const {
+	return _segment ? _segment->size() : 0;
+}
+
+IBuffer::Ptr ReceiveBuffer::slice ( const byte* ptr, size_t size ) const {
+	return std::make_shared<BufferSlice>(_segment, const_cast<byte*>(ptr), size);
+}
+
+bool ReceiveBuffer::pinned() const {
+	return _segment.use_count() > 1;
+}
+
 ReadResponseCtxBuffer::ReadResponseCtxBuffer ( const std::shared_ptr< MessageContext< Read_Response > > msgCtx )
 	: _msgCtx(msgCtx)
 {
 }
 
 byte* ReadResponseCtxBuffer::operator*() const {
+	if (const auto& payload = _msgCtx->payload())
+		return **payload;
 	return (byte*)_msgCtx->message().content().data();
 }
 
 size_t ReadResponseCtxBuffer::size() const {
+	if (const auto& payload = _msgCtx->payload())
+		return payload->size();
 	return _msgCtx->message().content().size();
 }
 
@@ -71,10 +221,14 @@ DataSegmentCtxBuffer::DataSegmentCtxBuffer ( const std::shared_ptr< MessageConte
 }
 
 byte* DataSegmentCtxBuffer::operator*() const {
+	if (const auto& payload = _msgCtx->payload())
+		return **payload;
 	return (byte*)_msgCtx->message().content().data();
 }
 
 size_t DataSegmentCtxBuffer::size() const {
+	if (const auto& payload = _msgCtx->payload())
+		return payload->size();
 	return _msgCtx->message().content().size();
 }
 
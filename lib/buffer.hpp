@@ -19,7 +19,10 @@
 #define BITHORDE_BUFFER_H
 
 #include <boost/shared_array.hpp>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "types.h"
 
@@ -51,6 +54,118 @@ public:
 	virtual size_t size() const;
 };
 
+/**
+ * A view into a part of another buffer, keeping the underlying buffer alive.
+ */
+class BufferSlice : public IBuffer {
+	IBuffer::Ptr _backing;
+	byte* _ptr;
+	size_t _size;
+public:
+	BufferSlice(const IBuffer::Ptr& backing, byte* ptr, size_t size);
+	virtual byte* operator*() const;
+	virtual size_t size() const;
+};
+
+/**
+ * Recycles receive-segments, sized in whole pages, between all connections. Segments return to the
+ * pool when the last reference is dropped, as long as no more than /maxPooledBytes/ are pooled, and
+ * are reused for requests needing at most MAX_SEGMENT_SLACK less.
+ * Thread-safe.
+ */
+class SegmentPool : public std::enable_shared_from_this<SegmentPool> {
+	mutable std::mutex _mutex;
+	std::multimap<size_t, MemoryBuffer*> _free; // By size
+	size_t _pooledBytes, _maxPooledBytes;
+public:
+	typedef std::shared_ptr<SegmentPool> Ptr;
+
+	/**
+	 * The pool shared by the process
+	 */
+	static const Ptr& shared();
+
+	explicit SegmentPool(size_t maxPooledBytes);
+	SegmentPool( const SegmentPool& ) = delete;
+	~SegmentPool();
+
+	/**
+	 * A segment of at least /size/ bytes, rounded up to whole pages
+	 */
+	std::shared_ptr<MemoryBuffer> acquire(size_t size);
+	size_t pooledBytes() const;
+private:
+	void release(MemoryBuffer* segment);
+};
+
+/**
+ * Receive-buffer for stream-parsing, handing out slices pinning the data they point into.
+ *
+ * Segments are drawn from a SegmentPool. Data is appended until the segment is full, and only then is
+ * the unconsumed remainder moved to the front, or into a fresh segment if some slice still pins the
+ * current one. Fully consumed segments start over from the front, and can be released to the pool
+ * while waiting for more data.
+ */
+class ReceiveBuffer {
+	SegmentPool::Ptr _pool;
+	std::shared_ptr<MemoryBuffer> _segment;
+	size_t _size, _consumed;
+public:
+	ReceiveBuffer(const SegmentPool::Ptr& pool=SegmentPool::shared());
+
+	/**
+	 * Allocate /amount/ bytes at the end of the buffer
+	 */
+	byte* allocate(size_t amount);
+
+	/**
+	 * Notify /amount/ bytes at the end of the buffer has been filled.
+	 */
+	void charge(size_t amount);
+
+	/**
+	 * First byte not yet consumed
+	 */
+	byte* data() const;
+
+	/**
+	 * Number of bytes not consumed in buffer
+	 */
+	size_t left() const;
+
+	/**
+	 * Mark bytes at the beginning of buffer as "consumed"
+	 * Still valid and present until pop() though
+	 */
+	void consume(size_t amount);
+
+	/**
+	 * Expunge consumed bytes, if not pinned by some slice. A remaining partial message is left in place.
+	 */
+	void pop();
+
+	/**
+	 * Give the segment back to the pool, if all of it is consumed.
+	 */
+	void release();
+
+	/**
+	 * Size of the current segment, 0 if none is held
+	 */
+	size_t capacity() const;
+
+	/**
+	 * Returns a view of /size/ bytes at /ptr/, which must be inside the unconsumed data.
+	 * The data will remain valid for as long as the view is referenced.
+	 */
+	IBuffer::Ptr slice(const byte* ptr, size_t size) const;
+
+	/**
+	 * True if any slice of the current segment is still referenced
+	 */
+	bool pinned() const;
+};
+
 template <typename T>
 class MessageContext;
 class Read_Response;
@@ -0,0 +1,173 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "cipher.h"
+
+#include <atomic>
+#include <boost/assert.hpp>
+#include <stdexcept>
+
+#define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
+
+#include <crypto++/arc4.h>
+#include <crypto++/aes.h>
+#include <crypto++/hmac.h>
+#include <crypto++/modes.h>
+#include <crypto++/sha.h>
+
+// Large segments of seekable ciphers are split into pieces of this size, to spread over workers
+const size_t PARALLEL_SEGMENT = 64*1024;
+
+using namespace std;
+using namespace bithorde;
+
+typedef CryptoPP::HMAC<CryptoPP::SHA256> HMAC_SHA256;
+
+StreamCipher::StreamCipher(CipherType type, const string& key, const string& iv) :
+	_type(type),
+	_key(key),
+	_iv(iv),
+	_position(0)
+{
+	_cipher.reset(create());
+}
+
+StreamCipher::~StreamCipher()
+{
+}
+
+CryptoPP::SymmetricCipher* StreamCipher::create() const
+{
+	CryptoPP::SymmetricCipher* res;
+	switch (_type) {
+		case bithorde::CipherType::AES_CTR:
+			res = new CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption();
+			res->SetKeyWithIV((const byte*)_key.data(), _key.size(), (const byte*)_iv.data(), _iv.size());
+			return res;
+		case bithorde::CipherType::RC4:
+			byte key_[HMAC_SHA256::DIGESTSIZE];
+			HMAC_SHA256((const byte*)_key.data(), _key.size()).CalculateDigest(key_, (const byte*)_iv.data(), _iv.size());
+			res = new CryptoPP::Weak1::ARC4::Encryption();
+			res->SetKey(key_, sizeof(key_));
+			return res;
+		case bithorde::CipherType::CLEARTEXT:
+		case bithorde::CipherType::XOR:
+		default:
+			throw std::runtime_error("Unsupported Cipher " + bithorde::CipherType_Name(_type));
+	}
+}
+
+CipherType StreamCipher::type() const
+{
+	return _type;
+}
+
+bool StreamCipher::seekable() const
+{
+	return _cipher->IsRandomAccess();
+}
+
+void StreamCipher::process(byte* dst, const byte* src, size_t size)
+{
+	_cipher->ProcessData(dst, src, size);
+	_position += size;
+}
+
+uint64_t StreamCipher::skip(size_t size)
+{
+	BOOST_ASSERT(seekable());
+	auto res = _position;
+	_position += size;
+	_cipher->Seek(_position);
+	return res;
+}
+
+void StreamCipher::processAt(uint64_t position, byte* dst, const byte* src, size_t size) const
+{
+	BOOST_ASSERT(seekable());
+	std::unique_ptr<CryptoPP::SymmetricCipher> cipher;
+	{
+		std::lock_guard<std::mutex> lock(_spareMutex);
+		if (!_spare.empty()) {
+			cipher = std::move(_spare.back());
+			_spare.pop_back();
+		}
+	}
+	if (!cipher)
+		cipher.reset(create());
+	cipher->Seek(position);
+	cipher->ProcessData(dst, src, size);
+
+	// At most one spare per thread processing at once
+	std::lock_guard<std::mutex> lock(_spareMutex);
+	_spare.push_back(std::move(cipher));
+}
+
+void StreamCipher::processOn(boost::asio::io_service& workers, boost::asio::io_service& ioSvc, const vector<StreamCipher::Segment>& segments, const function<void()>& done)
+{
+	if (segments.empty())
+		return ioSvc.post(done);
+
+	// The workers share /done/ through here, and the last one hands it back to ioSvc, so that
+	// whatever it holds is never released on a worker
+	struct Pending {
+		atomic<size_t> remaining;
+		function<void()> done;
+		void finish(boost::asio::io_service& ioSvc) {
+			if (--remaining)
+				return;
+			function<void()> f;
+			f.swap(done);
+			ioSvc.post(std::move(f));
+		}
+	};
+	auto pending = make_shared<Pending>();
+	pending->done = done;
+
+	auto self = shared_from_this();
+	if (!seekable()) {
+		pending->remaining = 1;
+		workers.post([self, &ioSvc, segments, pending]() {
+			for (auto iter = segments.begin(); iter != segments.end(); iter++)
+				self->process(iter->dst, iter->src, iter->size);
+			pending->finish(ioSvc);
+		});
+		return;
+	}
+
+	struct Job {
+		uint64_t position;
+		Segment segment;
+	};
+	vector<Job> jobs;
+	for (auto iter = segments.begin(); iter != segments.end(); iter++) {
+		for (size_t offset = 0; offset < iter->size; offset += PARALLEL_SEGMENT) {
+			auto size = std::min(iter->size - offset, PARALLEL_SEGMENT);
+			jobs.push_back(Job{skip(size), Segment{iter->dst + offset, iter->src + offset, size}});
+		}
+	}
+	if (jobs.empty())
+		return ioSvc.post(done);
+
+	pending->remaining = jobs.size();
+	for (auto iter = jobs.begin(); iter != jobs.end(); iter++) {
+		auto job = *iter;
+		workers.post([self, &ioSvc, job, pending]() {
+			self->processAt(job.position, job.segment.dst, job.segment.src, job.segment.size);
+			pending->finish(ioSvc);
+		});
+	}
+}
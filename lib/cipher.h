@@ -0,0 +1,101 @@
+/*
+    Copyright 2016 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+
+#ifndef BITHORDE_CIPHER_H
+#define BITHORDE_CIPHER_H
+
+#include <boost/asio/io_service.hpp>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "bithorde.pb.h"
+#include "types.h"
+
+namespace CryptoPP {
+	class SymmetricCipher;
+}
+
+namespace bithorde {
+
+/**
+ * One direction of an encrypted stream.
+ *
+ * Tracks the position in the keystream, so that seekable ciphers (AES_CTR) can process
+ * different parts of the stream out of order, on different threads. Other ciphers must
+ * process the stream strictly in order.
+ */
+class StreamCipher : public std::enable_shared_from_this<StreamCipher> {
+	CipherType _type;
+	std::string _key, _iv;
+	std::unique_ptr<CryptoPP::SymmetricCipher> _cipher;
+	uint64_t _position;
+
+	// Keyed ciphers for processAt(), reused to spare the key-schedule of every call
+	mutable std::mutex _spareMutex;
+	mutable std::vector< std::unique_ptr<CryptoPP::SymmetricCipher> > _spare;
+public:
+	typedef std::shared_ptr<StreamCipher> Ptr;
+
+	StreamCipher(CipherType type, const std::string& key, const std::string& iv);
+	~StreamCipher();
+
+	CipherType type() const;
+	bool seekable() const;
+
+	/**
+	 * Processes the next /size/ bytes of the stream, from /src/ into /dst/. They may be the same.
+	 */
+	void process(byte* dst, const byte* src, size_t size);
+
+	/**
+	 * Skips over the next /size/ bytes of the stream, returning the position where they start,
+	 * to be processed later with processAt(). Only for seekable() ciphers.
+	 */
+	uint64_t skip(size_t size);
+
+	/**
+	 * Processes /size/ bytes at /position/ of the stream. Does not move the StreamCipher,
+	 * and may run concurrently on several threads. Only for seekable() ciphers.
+	 */
+	void processAt(uint64_t position, byte* dst, const byte* src, size_t size) const;
+
+	/**
+	 * A part of the stream to process, from /src/ into /dst/.
+	 */
+	struct Segment {
+		byte* dst;
+		const byte* src;
+		size_t size;
+	};
+
+	/**
+	 * Processes /segments/ as the next part of the stream, on threads running /workers/, and posts
+	 * /done/ to /ioSvc/ when finished. Segments of seekable ciphers are positioned up front and
+	 * processed in parallel. Other ciphers process all segments in order in a single job, so the
+	 * stream must not be touched by the caller until /done/. /done/ is run and released on /ioSvc/,
+	 * never on the workers.
+	 */
+	void processOn(boost::asio::io_service& workers, boost::asio::io_service& ioSvc, const std::vector<Segment>& segments, const std::function<void()>& done);
+private:
+	CryptoPP::SymmetricCipher* create() const;
+};
+
+}
+
+#endif // BITHORDE_CIPHER_H
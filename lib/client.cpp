@@ -3,6 +3,8 @@
 #include "keepalive.hpp"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/placeholders.hpp>
 #include <boost/assert.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -21,6 +23,7 @@
 
 const static int LOTS_OF_MILLISECONDS(2^30);
 const size_t MAX_BYTES_ALLOCATED(512*1024);
+const size_t MAX_CREDITED_BYTES(64*1024*1024);
 
 using namespace std;
 namespace asio = boost::asio;
@@ -37,6 +40,140 @@ struct CipherConfig {
 	CipherConfig(CipherType type, const string& iv) :
 		type(type), iv(iv) {}
 };
+
+/**
+ * Connects a Client to a spec without blocking, and again with backoff whenever the attempt or the
+ * connection fails, until cancelled.
+ */
+class Reconnector : public std::enable_shared_from_this<Reconnector> {
+	Client::WeakPtr _client;
+	asio::io_service& _ioSvc;
+	const string _spec;
+	string _host, _port;
+	const unsigned _attempts;
+	unsigned _failures;
+	ptime::time_duration _backoff;
+	asio::ip::tcp::resolver _resolver;
+	asio::deadline_timer _timer;
+	bool _cancelled;
+public:
+	Reconnector(const Client::Pointer& client, const string& spec, unsigned attempts) :
+		_client(client),
+		_ioSvc(client->_ioSvc),
+		_spec(spec),
+		_attempts(attempts),
+		_failures(0),
+		_backoff(RECONNECT_MIN_BACKOFF),
+		_resolver(client->_ioSvc),
+		_timer(client->_ioSvc),
+		_cancelled(false)
+	{
+		if (spec.empty())
+			throw string("Failed to parse: " + spec);
+		if (spec[0] != '/') {
+			vector<string> host_port;
+			if (boost::algorithm::split(host_port, spec, boost::algorithm::is_any_of(":"), boost::algorithm::token_compress_on).size() != 2)
+				throw string("Failed to parse: " + spec);
+			_host = host_port[0];
+			_port = host_port[1];
+		}
+	}
+
+	bool cancelled() const {
+		return _cancelled;
+	}
+
+	void start() {
+		if (_cancelled)
+			return;
+		auto self = shared_from_this();
+		if (_host.empty()) {
+			auto socket = std::make_shared<asio::local::stream_protocol::socket>(_ioSvc);
+			socket->async_connect(asio::local::stream_protocol::endpoint(_spec), [self, socket](const boost::system::error_code& error) {
+				self->connectionDone(error, socket);
+			});
+		} else {
+			asio::ip::tcp::resolver::query q(_host, _port);
+			_resolver.async_resolve(q, [self](const boost::system::error_code& error, asio::ip::tcp::resolver::iterator iterator) {
+				if (error)
+					return self->failed(error);
+				auto socket = std::make_shared<asio::ip::tcp::socket>(self->_ioSvc);
+				asio::async_connect(*socket, iterator, [self, socket](const boost::system::error_code& error, asio::ip::tcp::resolver::iterator) {
+					self->connectionDone(error, socket);
+				});
+			});
+		}
+	}
+
+	/**
+	 * Starts over after the backoff, doubling it for the next time
+	 */
+	void retry() {
+		if (_cancelled)
+			return;
+		auto self = shared_from_this();
+		_timer.expires_from_now(_backoff);
+		_timer.async_wait([self](const boost::system::error_code& error) {
+			if (!error)
+				self->start();
+		});
+		_backoff = std::min<ptime::time_duration>(_backoff * 2, RECONNECT_MAX_BACKOFF);
+	}
+
+	/**
+	 * The peer authenticated, so the next loss starts over from the shortest backoff
+	 */
+	void succeeded() {
+		_failures = 0;
+		_backoff = RECONNECT_MIN_BACKOFF;
+	}
+
+	/**
+	 * The connection was lost before the peer authenticated, which counts as a failed attempt
+	 */
+	void rejected() {
+		if (_cancelled)
+			return;
+		cerr << "Handshake with " << _spec << " failed" << endl;
+		countFailure();
+	}
+
+	void cancel() {
+		_cancelled = true;
+		_timer.cancel();
+		_resolver.cancel();
+	}
+private:
+	template <typename Socket>
+	void connectionDone(const boost::system::error_code& error, const std::shared_ptr<Socket>& socket) {
+		if (error)
+			return failed(error);
+		auto client = _client.lock();
+		if (_cancelled || !client)
+			return;
+		client->stats.reset(new ConnectionStats(client->_timerSvc));
+		client->connect(Connection::create(_ioSvc, client->stats, socket));
+	}
+
+	void failed(const boost::system::error_code& error) {
+		if (_cancelled)
+			return;
+		cerr << "Failed to connect to " << _spec << ": " << error.message() << endl;
+		countFailure();
+	}
+
+	void countFailure() {
+		if (_attempts && (++_failures >= _attempts)) {
+			cancel();
+			if (auto client = _client.lock()) {
+				client->dropResuming();
+				client->connectFailed();
+			}
+		} else {
+			retry();
+		}
+	}
+};
 }
 
 AssetBinding::AssetBinding(Client* client, Asset* asset, Asset::Handle handle) :
@@ -83,6 +220,8 @@ void AssetBinding::orphaned()
 void AssetBinding::onTimeout()
 {
 	if (_asset) {
+		if (_client && (_asset->status == bithorde::Status::NONE))
+			_client->bindLatency.timedOut();
 		bithorde::AssetStatus msg;
 		msg.set_status(bithorde::Status::TIMEOUT);
 		_asset->handleMessage(msg);
@@ -100,14 +239,33 @@ void AssetBinding::onTimeout()
 Client::Client(asio::io_service& ioSvc, string myName) :
 	_ioSvc(ioSvc),
 	_timerSvc(new TimerService(ioSvc)),
+	_slabs(std::make_shared<SlabPool>()),
 	_state(Connecting),
 	_myName(myName),
 	_handleAllocator(1),
-	_rpcIdAllocator(1),
 	_protoVersion(0),
 	_bytesAllocated(0),
-	assetResponseTime(0.98, "ms")
+	_pingSerial(0),
+	_creditWindow(0),
+	_peerCreditWindow(0),
+	_creditedBytes(0),
+	_maxChunkSize(0),
+	_peerMaxChunkSize(0),
+	_acceptReadStreams(false),
+	_peerReadStreams(false),
+	_sharedMemoryRing(0),
+	_acceptSharedMemory(false),
+	_peerSharedMemory(false),
+	_acceptLocalFiles(false),
+	_peerLocalFiles(false),
+	_fileWorkers(NULL),
+	_peerBatches(false),
+	_batchDepth(0),
+	assetResponseTime(0.98, "ms"),
+	bindLatency("ms"),
+	readLatency("ms")
 {
+	writable.connect(std::bind(&Client::onWritable, this));
 }
 
 Client::~Client()
@@ -127,6 +285,11 @@ const TimerService::Ptr& Client::timerService()
 	return _timerSvc;
 }
 
+const SlabPool::Ptr& Client::slabs() const
+{
+	return _slabs;
+}
+
 void Client::setSecurity(const string& key, CipherType cipher)
 {
 	if (_state & (SaidHello | SentAuth | GotAuth) )
@@ -135,6 +298,81 @@ void Client::setSecurity(const string& key, CipherType cipher)
 	_sendCipher.reset(new CipherConfig(cipher, secureRandomBytes(key.size())));
 }
 
+void Client::setCreditWindow(uint32_t bytes)
+{
+	if (_state & SaidHello)
+		throw std::runtime_error("Client were in wrong state for setCreditWindow");
+	_creditWindow = bytes;
+}
+
+bool Client::flowControlled() const
+{
+	return _creditWindow && _peerCreditWindow;
+}
+
+void Client::setMaxChunkSize(uint32_t bytes)
+{
+	if (_state & SaidHello)
+		throw std::runtime_error("Client were in wrong state for setMaxChunkSize");
+	_maxChunkSize = std::min<size_t>(bytes, MAX_CHUNK_SIZE);
+}
+
+size_t Client::maxChunkSize() const
+{
+	if (_maxChunkSize && _peerMaxChunkSize)
+		return std::min<size_t>(std::min(_maxChunkSize, _peerMaxChunkSize), MAX_CHUNK_SIZE);
+	else
+		return LEGACY_CHUNK_SIZE;
+}
+
+void Client::setAcceptReadStreams(bool accept)
+{
+	if (_state & SaidHello)
+		throw std::runtime_error("Client were in wrong state for setAcceptReadStreams");
+	_acceptReadStreams = accept;
+}
+
+bool Client::readStreams() const
+{
+	return _peerReadStreams;
+}
+
+void Client::setSharedMemory(size_t ringSize)
+{
+	if (_state & SaidHello)
+		throw std::runtime_error("Client were in wrong state for setSharedMemory");
+	_sharedMemoryRing = ringSize;
+}
+
+void Client::setAcceptSharedMemory(bool accept)
+{
+	if (_state & SaidHello)
+		throw std::runtime_error("Client were in wrong state for setAcceptSharedMemory");
+	_acceptSharedMemory = accept;
+}
+
+bool Client::sharedMemory() const
+{
+	return _connection && _connection->sharedMemory();
+}
+
+void Client::setAcceptLocalFiles(bool accept)
+{
+	if (_state & SaidHello)
+		throw std::runtime_error("Client were in wrong state for setAcceptLocalFiles");
+	_acceptLocalFiles = accept;
+}
+
+void Client::setFileWorkers(asio::io_service* workers)
+{
+	_fileWorkers = workers;
+}
+
+bool Client::localFiles() const
+{
+	return _peerLocalFiles;
+}
+
 void Client::hookup(Connection::Pointer newConn)
 {
 	BOOST_ASSERT(!_connection);
@@ -143,10 +381,15 @@ void Client::hookup(Connection::Pointer newConn)
 
 	stats = newConn->stats();
 
-	_rpcIdAllocator.reset();
+	// Reads in flight are kept when resuming, to be sent again. Otherwise any late releases are told
+	// apart by generation.
+	if (!_reconnector) {
+		_requests.clear();
+		_releasedRequests.clear();
+	}
 	_connection = newConn;
 
-	_connection->setCallback(std::bind(&Client::onIncomingMessage, this, std::placeholders::_1, std::placeholders::_2));
+	_connection->setCallback(std::bind(&Client::onIncomingMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 	_writableConnection = _connection->writable.connect(writable);
 	_disconnectedConnection = _connection->disconnected.connect(Connection::VoidSignal::slot_type(&Client::onDisconnected, this));
 }
@@ -170,7 +413,9 @@ void Client::connect(asio::local::stream_protocol::endpoint& ep) {
 
 void Client::connect(const string& spec) {
 	vector<string> host_port;
-	if (spec[0] == '/') {
+	if (spec.empty()) {
+		throw string("Failed to parse: " + spec);
+	} else if (spec[0] == '/') {
 		asio::local::stream_protocol::endpoint ep(spec);
 		connect(ep);
 	} else if (boost::algorithm::split(host_port, spec, boost::algorithm::is_any_of(":"), boost::algorithm::token_compress_on).size() == 2) {
@@ -186,30 +431,99 @@ void Client::connect(const string& spec) {
 	}
 }
 
+void Client::connectAsync(const string& spec, unsigned attempts)
+{
+	if (_reconnector)
+		_reconnector->cancel();
+	_reconnector = std::make_shared<Reconnector>(shared_from_this(), spec, attempts);
+	_reconnector->start();
+}
+
 void Client::close()
+{
+	if (_reconnector) {
+		_reconnector->cancel();
+		_reconnector.reset();
+		// Backing off, so no disconnect will fail what was held for resuming
+		if (!_connection)
+			dropResuming();
+	}
+	disconnect();
+}
+
+void Client::disconnect()
 {
 	if (_connection)
 		_connection->close();
 }
 
 void Client::onDisconnected() {
+	bool wasAuthenticated = (_state == Authenticated);
 	_connection.reset();
 	_state = Connecting;
-	for (auto iter=_assetMap.begin(); iter != _assetMap.end();) {
-		auto current = iter++;
-		if (auto binding = current->second) {
+	_peerCreditWindow = 0;
+	_peerMaxChunkSize = 0;
+	_peerReadStreams = false;
+	_peerSharedMemory = false;
+	_peerLocalFiles = false;
+	_peerBatches = false;
+	_batchedBinds.clear();
+	_batchedStatuses.clear();
+	_sendCredit.clear();
+	_creditOwed.clear();
+	_pingsSent.clear();
+	std::vector<Asset::Handle> stale;
+	for (auto iter=_assetMap.begin(); iter != _assetMap.end(); iter++) {
+		if (auto binding = iter->second) {
 			binding->clearTimer();
-			if (auto asset = binding->readAsset()) {
+			if (!binding->readAsset())
+				stale.push_back(iter->first);
+		}
+	}
+	for (auto iter=stale.begin(); iter != stale.end(); iter++) {
+		_handleAllocator.free(*iter);
+		_assetMap.erase(*iter);
+	}
+	// Signal from a copy, since handlers may bind or release assets
+	std::vector<AssetPtr> bindings;
+	for (auto iter=_assetMap.begin(); iter != _assetMap.end(); iter++)
+		bindings.push_back(iter->second);
+	for (auto iter=bindings.begin(); iter != bindings.end(); iter++) {
+		if (auto asset = (*iter)->readAsset()) {
+			if (_reconnector) {
+				// Held bound, and resumed once bound again. Reads wait without timing out meanwhile.
+				asset->_resuming = true;
+				asset->suspendRequests();
+			} else {
 				bithorde::AssetStatus s;
 				s.set_status(bithorde::DISCONNECTED);
 				asset->statusUpdate(s);
-			} else {
-				_handleAllocator.free(current->first);
-				_assetMap.erase(current);
 			}
 		}
 	}
 	disconnected();
+	if (auto reconnector = _reconnector) { // Unless closed by a handler
+		if (wasAuthenticated)
+			reconnector->retry();
+		else
+			reconnector->rejected();
+	}
+}
+
+void Client::dropResuming() {
+	std::vector<AssetPtr> bindings;
+	for (auto iter=_assetMap.begin(); iter != _assetMap.end(); iter++)
+		bindings.push_back(iter->second);
+	for (auto iter=bindings.begin(); iter != bindings.end(); iter++) {
+		auto asset = (*iter)->readAsset();
+		if (asset && asset->_resuming) {
+			asset->_resuming = false;
+			asset->cancelRequests();
+			bithorde::AssetStatus s;
+			s.set_status(bithorde::DISCONNECTED);
+			asset->statusUpdate(s);
+		}
+	}
 }
 
 bool Client::isConnected()
@@ -235,20 +549,132 @@ bool Client::sendMessage(Connection::MessageType type, const google::protobuf::M
 		return false;
 }
 
-void Client::allocateBytes ( size_t bytes ) {
+bool Client::sendMessage(Connection::MessageType type, const google::protobuf::Message& msg, uint32_t payloadField, const IBuffer::Ptr& payload, const bithorde::Message::Deadline& expires, bool prioritized)
+{
+	if (_connection)
+		return _connection->sendMessage(type, msg, payloadField, payload, expires, prioritized);
+	else
+		return false;
+}
+
+bool Client::sendAssetStatus(const bithorde::AssetStatus& msg)
+{
+	if (!_connection)
+		return false;
+	if (_batchDepth && _peerBatches) {
+		_batchedStatuses.push_back(msg);
+		return true;
+	}
+	return sendMessage(Connection::MessageType::AssetStatus, msg, Message::NEVER, true);
+}
+
+bool Client::batches() const
+{
+	return _peerBatches;
+}
+
+bool Client::sendLocalFile(Asset::Handle handle, const FileRegion::Ptr& file)
+{
+	if (!_connection || !_peerLocalFiles)
+		return false;
+	bithorde::LocalFile msg;
+	msg.set_handle(handle);
+	msg.set_offset(file->offset());
+	msg.set_size(file->size());
+	return _connection->sendMessage(Connection::MessageType::LocalFile, msg, std::vector<int>{file->fd()}, file, Message::NEVER, false);
+}
+
+bool Client::sendReadResponse(Asset::Handle handle, const Read::Response& msg, const IBuffer::Ptr& payload, const Message::Deadline& expires)
+{
+	if (!flowControlled())
+		return sendMessage(Connection::MessageType::ReadResponse, msg, Read::Response::kContentFieldNumber, payload, expires);
+
+	auto iter = _sendCredit.find(handle);
+	if (iter == _sendCredit.end()) {
+		iter = _sendCredit.insert(make_pair(handle, HandleCredit())).first;
+		iter->second.available = _peerCreditWindow;
+		iter->second.heldBytes = 0;
+	}
+	auto& credit = iter->second;
+	// A peer reading on without ever granting credit must not have responses pile up here
+	if (credit.heldBytes + payload->size() > MAX_HELD_BYTES)
+		return false;
+	credit.held.push_back(HandleCredit::Held{msg, payload, expires});
+	credit.heldBytes += payload->size();
+	flushCredit(handle, credit);
+	return true;
+}
+
+void Client::flushCredit(Asset::Handle handle, HandleCredit& credit)
+{
+	auto now = Message::Clock::now();
+	while ((credit.available > 0) && !credit.held.empty()) {
+		const auto& next = credit.held.front();
+		if (now < next.expires) {
+			// Refused while the send-queue is full; kept, and retried once writable
+			if (!sendMessage(Connection::MessageType::ReadResponse, next.msg, Read::Response::kContentFieldNumber, next.payload, next.expires))
+				return;
+			credit.available -= next.msg.ByteSize() + next.payload->size();
+		}
+		credit.heldBytes -= next.payload->size();
+		credit.held.pop_front();
+	}
+}
+
+void Client::onWritable()
+{
+	for (auto iter = _sendCredit.begin(); iter != _sendCredit.end(); iter++) {
+		if (!iter->second.held.empty())
+			flushCredit(iter->first, iter->second);
+	}
+}
+
+void Client::releaseCredit(Asset::Handle handle)
+{
+	_sendCredit.erase(handle);
+}
+
+bool Client::canSendReadResponse(Asset::Handle handle) const
+{
+	if (!_connection || !_connection->canSend())
+		return false;
+	if (!flowControlled())
+		return true;
+	auto iter = _sendCredit.find(handle);
+	return (iter == _sendCredit.end()) || ((iter->second.available > 0) && iter->second.held.empty());
+}
+
+void Client::allocateBytes ( size_t bytes, Asset::Handle credited ) {
 	Client::WeakPtr self(shared_from_this());
-	_ioSvc.post(std::bind(boost::weak_fn(&Client::trackAllocation, self), bytes));
+	_ioSvc.post(std::bind(boost::weak_fn(&Client::trackAllocation, self), bytes, credited));
 }
 
-void Client::freeBytes ( size_t bytes ) {
+void Client::freeBytes ( size_t bytes, Asset::Handle credited ) {
 	Client::WeakPtr self(shared_from_this());
-	_ioSvc.post(std::bind(boost::weak_fn(&Client::trackAllocation, self), -bytes));
+	_ioSvc.post(std::bind(boost::weak_fn(&Client::trackAllocation, self), -bytes, credited));
 }
 
-void Client::trackAllocation ( ssize_t change ) {
+void Client::trackAllocation ( ssize_t change, Asset::Handle credited ) {
 	_bytesAllocated += change;
+	if (credited >= 0) {
+		_creditedBytes += change;
+		if (change < 0 && _connection && _assetMap.count(credited)) {
+			// Consumed, credit back to the sender once enough has accumulated. Nothing is owed
+			// for handles no longer bound.
+			auto& owed = _creditOwed[credited];
+			owed += static_cast<size_t>(-change);
+			if (owed >= _creditWindow / 4) {
+				bithorde::Credit credit;
+				credit.set_handle(credited);
+				credit.set_bytes(owed);
+				sendMessage(Connection::MessageType::Credit, credit);
+				_creditOwed.erase(credited);
+			}
+		}
+	}
 	if (_connection) {
-		_connection->setListening(_bytesAllocated < MAX_BYTES_ALLOCATED);
+		// Credited bytes are bounded by the sender per handle, and need not stall the whole connection
+		_connection->setListening(((_bytesAllocated - _creditedBytes) < MAX_BYTES_ALLOCATED) && (_creditedBytes < MAX_CREDITED_BYTES));
 	}
 }
 
@@ -262,6 +688,17 @@ void Client::sayHello() {
 	bithorde::HandShake h;
 	h.set_protoversion(2);
 	h.set_name(_myName);
+	if (_creditWindow)
+		h.set_creditwindow(_creditWindow);
+	if (_maxChunkSize)
+		h.set_maxchunksize(_maxChunkSize);
+	if (_acceptReadStreams)
+		h.set_readstreams(true);
+	if (_acceptSharedMemory && _connection->canPassFds())
+		h.set_sharedmemory(true);
+	if (_acceptLocalFiles && _connection->canPassFds())
+		h.set_localfiles(true);
+	h.set_batches(true);
 	_sentChallenge.clear();
 	if (_key.size()) {
 		_sentChallenge = secureRandomBytes(16);
@@ -271,7 +708,7 @@ void Client::sayHello() {
 	addStateFlag(SaidHello);
 }
 
-void Client::onIncomingMessage(Connection::MessageType type, const ::google::protobuf::Message& msg)
+void Client::onIncomingMessage(Connection::MessageType type, const ::google::protobuf::Message& msg, const IBuffer::Ptr& payload)
 {
 	if (_state == Authenticated) {
 		switch (type) {
@@ -281,14 +718,33 @@ void Client::onIncomingMessage(Connection::MessageType type, const ::google::pro
 			return onMessage(std::make_shared< MessageContext<bithorde::AssetStatus> >(shared_from_this(), (bithorde::AssetStatus&) msg));
 		case Connection::MessageType::ReadRequest:
 			return onMessage(std::make_shared< MessageContext<bithorde::Read::Request> >(shared_from_this(), (bithorde::Read::Request&) msg));
-		case Connection::MessageType::ReadResponse:
-			return onMessage(std::make_shared< MessageContext<bithorde::Read::Response> >(shared_from_this(), (bithorde::Read::Response&) msg));
+		case Connection::MessageType::ReadResponse: {
+			const auto& resp = (bithorde::Read::Response&) msg;
+			Asset::Handle credited = -1;
+			if (flowControlled() && payload) {
+				if (auto req = _requests.find(resp.reqid()))
+					credited = req->handle;
+			}
+			return onMessage(std::make_shared< MessageContext<bithorde::Read::Response> >(shared_from_this(), resp, payload, credited));
+		}
 		case Connection::MessageType::BindWrite:
 			return onMessage(std::make_shared< MessageContext<bithorde::BindWrite> >(shared_from_this(), (bithorde::BindWrite&) msg));
 		case Connection::MessageType::DataSegment:
-			return onMessage(std::make_shared< MessageContext<bithorde::DataSegment> >(shared_from_this(), (bithorde::DataSegment&) msg));
+			return onMessage(std::make_shared< MessageContext<bithorde::DataSegment> >(shared_from_this(), (bithorde::DataSegment&) msg, payload));
 		case Connection::MessageType::Ping:
 			return onMessage(std::make_shared< MessageContext<bithorde::Ping> >(shared_from_this(), (bithorde::Ping&) msg));
+		case Connection::MessageType::Credit:
+			return onMessage(std::make_shared< MessageContext<bithorde::Credit> >(shared_from_this(), (bithorde::Credit&) msg));
+		case Connection::MessageType::ReadStream:
+			return onMessage(std::make_shared< MessageContext<bithorde::Read::Stream> >(shared_from_this(), (bithorde::Read::Stream&) msg));
+		case Connection::MessageType::SharedMemory:
+			return onMessage(std::make_shared< MessageContext<bithorde::SharedMemory> >(shared_from_this(), (bithorde::SharedMemory&) msg));
+		case Connection::MessageType::LocalFile:
+			return onMessage(std::make_shared< MessageContext<bithorde::LocalFile> >(shared_from_this(), (bithorde::LocalFile&) msg));
+		case Connection::MessageType::BindReadBatch:
+			return onMessage(std::make_shared< MessageContext<bithorde::BindReadBatch> >(shared_from_this(), (bithorde::BindReadBatch&) msg));
+		case Connection::MessageType::AssetStatusBatch:
+			return onMessage(std::make_shared< MessageContext<bithorde::AssetStatusBatch> >(shared_from_this(), (bithorde::AssetStatusBatch&) msg));
 		default: break;
 		}
 	} else {
@@ -319,6 +775,14 @@ void Client::onMessage( const std::shared_ptr< MessageContext< HandShake > >& ms
 		return close();
 	}
 
+	_peerCreditWindow = msg.creditwindow();
+	_peerMaxChunkSize = msg.maxchunksize();
+	_peerReadStreams = msg.readstreams();
+	_peerSharedMemory = msg.sharedmemory();
+	_peerLocalFiles = msg.localfiles() && _connection->canPassFds();
+	_peerBatches = msg.batches();
+	_connection->setMaxChunkSize(maxChunkSize());
+
 	if (_peerName.empty()) {
 		_peerName = msg.name();
 		_connection->setLogTag(_peerName);
@@ -372,15 +836,26 @@ void Client::setAuthenticated(const std::string peerName)
 			_connection->setEncryption(_sendCipher->type, _key, _sendCipher->iv);
 		if (_recvCipher)
 			_connection->setDecryption(_recvCipher->type, _key, _recvCipher->iv);
-		for (auto iter = _assetMap.begin(); iter != _assetMap.end(); iter++) {
-			auto binding = iter->second;
-			BOOST_ASSERT(binding && binding->readAsset());
-			binding->setTimer(DEFAULT_ASSET_TIMEOUT);
-			informBound(*iter->second, DEFAULT_ASSET_TIMEOUT.total_milliseconds());
+		// Ahead of any bindings, so that they go through the rings
+		if (_sharedMemoryRing && _peerSharedMemory && !_connection->startSharedMemory(_sharedMemoryRing))
+			cerr << "Failed to offer shared memory to " << peerName << ", staying on the socket" << endl;
+		{
+			MessageBatch batch;
+			batch.add(shared_from_this());
+			for (auto iter = _assetMap.begin(); iter != _assetMap.end(); iter++) {
+				auto binding = iter->second;
+				BOOST_ASSERT(binding && binding->readAsset());
+				binding->setTimer(ptime::millisec(bindTimeout()));
+				informBound(*iter->second, bindTimeout());
+			}
 		}
 		_connection->setKeepalive(new Keepalive(*this));
+		if (_reconnector)
+			_reconnector->succeeded();
 	}
 	authenticated(*this, peerName);
+	if (peerName.empty() && _reconnector && _connection)
+		disconnect(); // Rejected, to be tried again
 }
 
 void Client::onMessage( const std::shared_ptr< MessageContext< BindRead > >& msgCtx ) {
@@ -396,15 +871,21 @@ void Client::onMessage( const std::shared_ptr< MessageContext< AssetStatus > >&
 	if (!msg.has_handle())
 		return;
 	Asset::Handle handle = msg.handle();
-	if (_assetMap.count(handle)) {
-		AssetBinding& a = *_assetMap[handle];
+	auto binding = _assetMap.find(handle);
+	if (binding != _assetMap.end()) {
+		AssetBinding& a = *binding->second;
 		a.clearTimer();
 		if (a && a->status != bithorde::Status::INVALID_HANDLE) {
-			if (a->status == bithorde::Status::NONE)
-				assetResponseTime.post((ptime::microsec_clock::universal_time() - a._opened_at).total_milliseconds());
+			if (a->status == bithorde::Status::NONE) {
+				auto elapsed = (ptime::microsec_clock::universal_time() - a._opened_at).total_milliseconds();
+				assetResponseTime.post(elapsed);
+				if (msg.status() == bithorde::Status::SUCCESS)
+					bindLatency.post(elapsed);
+			}
 			a->handleMessage( msg );
 		} else if ( msg.status() != bithorde::Status::SUCCESS) {
 			_assetMap.erase(handle);
+			_creditOwed.erase(handle);
 			_handleAllocator.free(handle);
 		}
 	} else if ( msg.ids_size()) {
@@ -412,6 +893,28 @@ void Client::onMessage( const std::shared_ptr< MessageContext< AssetStatus > >&
 	}
 }
 
+void Client::onMessage( const std::shared_ptr< MessageContext< BindReadBatch > >& msgCtx ) {
+	const auto& msg = msgCtx->message();
+	// Handled as separate BindReads, with the replies batched
+	MessageBatch batch;
+	batch.add(shared_from_this());
+	for (auto iter = msg.binds().begin(); iter != msg.binds().end(); iter++) {
+		BindRead req;
+		req.set_handle(iter->handle());
+		req.mutable_ids()->CopyFrom(iter->ids());
+		req.mutable_requesters()->CopyFrom(msg.requesters());
+		req.mutable_requesters()->MergeFrom(iter->requesters());
+		req.set_timeout(msg.timeout());
+		onMessage(std::make_shared< MessageContext<BindRead> >(shared_from_this(), req));
+	}
+}
+
+void Client::onMessage( const std::shared_ptr< MessageContext< AssetStatusBatch > >& msgCtx ) {
+	const auto& msg = msgCtx->message();
+	for (auto iter = msg.statuses().begin(); iter != msg.statuses().end(); iter++)
+		onMessage(std::make_shared< MessageContext<AssetStatus> >(shared_from_this(), *iter));
+}
+
 void Client::onMessage( const std::shared_ptr< MessageContext< Read::Request > >& msgCtx ) {
 	cerr << "unsupported: handling Read-Requests" << endl;
 	bithorde::Read::Response resp;
@@ -420,13 +923,56 @@ void Client::onMessage( const std::shared_ptr< MessageContext< Read::Request > >
 	sendMessage(Connection::MessageType::ReadResponse, resp);
 }
 
+void Client::onMessage( const std::shared_ptr< MessageContext< Read::Stream > >& msgCtx ) {
+	cerr << "unsupported: handling Read-Streams" << endl;
+	bithorde::Read::Response resp;
+	resp.set_reqid( msgCtx->message().reqid() );
+	resp.set_status(ERROR);
+	sendMessage(Connection::MessageType::ReadResponse, resp);
+}
+
+void Client::onMessage( const std::shared_ptr< MessageContext< bithorde::SharedMemory > >& msgCtx ) {
+	// Either an offer, if we accepted them, or the answer to our own
+	if (!(_acceptSharedMemory || (_sharedMemoryRing && _peerSharedMemory))
+			|| !_connection->onSharedMemory(msgCtx->message())) {
+		cerr << "ERROR " << peerName() << ": Failed to switch to shared memory, Disconnecting" << endl;
+		close();
+	}
+}
+
+void Client::onMessage( const std::shared_ptr< MessageContext< bithorde::LocalFile > >& msgCtx ) {
+	const auto& msg = msgCtx->message();
+	// Taken even if unwanted, to keep descriptors in step with their messages
+	auto fds = _connection->takeFds(1);
+	if (fds.size() != 1) {
+		cerr << "ERROR " << peerName() << ": LocalFile without descriptor, Disconnecting" << endl;
+		return close();
+	}
+	auto file = std::make_shared<FileRegion>(fds[0], msg.offset(), msg.size());
+	if (!_acceptLocalFiles)
+		return;
+	auto binding = _assetMap.find(msg.handle());
+	if (binding != _assetMap.end()) {
+		if (auto asset = binding->second->readAsset())
+			asset->setLocalFile(file);
+	}
+}
+
 void Client::onMessage( const std::shared_ptr< MessageContext< Read::Response > >& msgCtx ) {
 	const auto& msg = msgCtx->message();
-	if (_requestIdMap.count(msg.reqid())) {
-		Asset::Handle assetHandle = _requestIdMap[msg.reqid()];
-		releaseRPCRequest( msg.reqid());
-		if (_assetMap.count(assetHandle)) {
-			Asset* a = _assetMap[assetHandle]->asset();
+	if (auto req = _requests.find(msg.reqid())) {
+		if (req->released) {
+			// Late, and only credited back to the peer
+			if (!req->stream)
+				releaseRPCRequest(msg.reqid());
+			return;
+		}
+		Asset::Handle assetHandle = req->handle;
+		if (!req->stream)
+			releaseRPCRequest( msg.reqid());
+		auto binding = _assetMap.find(assetHandle);
+		if (binding != _assetMap.end()) {
+			Asset* a = binding->second->asset();
 			if (a) {
 				a->handleMessage( msgCtx );
 			} else {
@@ -470,13 +1016,56 @@ void Client::onMessage( const std::shared_ptr< MessageContext< HandShakeConfirme
 void Client::onMessage( const std::shared_ptr< MessageContext< Ping > >& msgCtx ) {
 	if (msgCtx->message().timeout()) {
 		bithorde::Ping reply;
+		if (msgCtx->message().has_id())
+			reply.set_id(msgCtx->message().id());
 		auto deadline =  boost::chrono::steady_clock::now() + boost::chrono::milliseconds(msgCtx->message().timeout());
 		sendMessage(Connection::MessageType::Ping, reply, deadline, false);
+	} else {
+		// Peers not echoing the id can only be timed while a single ping is outstanding
+		auto iter = msgCtx->message().has_id() ? _pingsSent.find(msgCtx->message().id()) :
+			(_pingsSent.size() == 1) ? _pingsSent.begin() : _pingsSent.end();
+		if (iter != _pingsSent.end()) {
+			_connection->onRoundTrip(boost::chrono::steady_clock::now() - iter->second);
+			_pingsSent.erase(iter);
+		}
+	}
+}
+
+void Client::onMessage( const std::shared_ptr< MessageContext< bithorde::Credit > >& msgCtx ) {
+	const auto& msg = msgCtx->message();
+	auto iter = _sendCredit.find(msg.handle());
+	if (iter != _sendCredit.end()) {
+		iter->second.available += msg.bytes();
+		flushCredit(iter->first, iter->second);
+	}
+}
+
+bool Client::ping(const boost::posix_time::time_duration& timeout, bool prioritized) {
+	bithorde::Ping ping;
+	ping.set_timeout(timeout.total_milliseconds());
+	ping.set_id(++_pingSerial);
+	if (!sendMessage(Connection::MessageType::Ping, ping, Message::NEVER, prioritized))
+		return false;
+
+	// Pings not answered within their timeout are lost, and never timed
+	auto now = boost::chrono::steady_clock::now();
+	auto lost = now - boost::chrono::milliseconds(timeout.total_milliseconds());
+	for (auto iter = _pingsSent.begin(); iter != _pingsSent.end(); ) {
+		if (iter->second < lost)
+			iter = _pingsSent.erase(iter);
+		else
+			iter++;
 	}
+	_pingsSent[ping.id()] = now;
+	return true;
+}
+
+bool Client::sending() const {
+	return _connection && _connection->sending();
 }
 
 bool Client::bind(ReadAsset &asset) {
-	return bind(asset, DEFAULT_ASSET_TIMEOUT.total_milliseconds());
+	return bind(asset, bindTimeout());
 }
 
 bool Client::bind(ReadAsset& asset, int timeout_ms)
@@ -488,7 +1077,7 @@ bool Client::bind(ReadAsset& asset, int timeout_ms)
 
 bool Client::bind(ReadAsset& asset, const RouteTrace& requesters)
 {
-	return bind(asset, DEFAULT_ASSET_TIMEOUT.total_milliseconds(), requesters);
+	return bind(asset, bindTimeout(), requesters);
 }
 
 bool Client::bind(ReadAsset& asset, int timeout_ms, const RouteTrace& requesters)
@@ -537,9 +1126,10 @@ bool Client::bind(UploadAsset & asset, int timeout_ms)
 bool Client::release(Asset & asset)
 {
 	BOOST_ASSERT(asset.isBound());
-	BOOST_ASSERT(_assetMap.find(asset._handle) != _assetMap.end());
+	auto found = _assetMap.find(asset._handle);
+	BOOST_ASSERT(found != _assetMap.end());
 
-	auto& binding = *_assetMap[asset._handle];
+	auto& binding = *found->second;
 
 	// Leave binding dangling, so it won't be reused until confirmation has been received from the other side.
 	binding.close();
@@ -566,21 +1156,184 @@ bool Client::informBound(const AssetBinding& asset, int timeout_ms)
 
 	if (auto readAsset = asset.readAsset()) {
 		msg.mutable_ids()->CopyFrom(readAsset->requestIds());
+		if (_batchDepth && _peerBatches) {
+			_batchedBinds.push_back(msg);
+			return true;
+		}
 		return sendMessage(Connection::MessageType::BindRead, msg, Message::in(timeout_ms), false);
 	} else {
 		return sendMessage(Connection::MessageType::BindRead, msg, Message::NEVER, true);
 	}
 }
 
-int Client::allocRPCRequest(Asset::Handle asset)
+void Client::beginBatch()
 {
-	int res = _rpcIdAllocator.allocate();
-	_requestIdMap[res] = asset;
-	return res;
+	_batchDepth++;
+}
+
+void Client::endBatch()
+{
+	BOOST_ASSERT(_batchDepth > 0);
+	if (--_batchDepth == 0)
+		flushBatch();
+}
+
+void Client::flushBatch()
+{
+	if (!_batchedStatuses.empty()) {
+		for (size_t i=0; i < _batchedStatuses.size(); i += MAX_BATCH) {
+			auto end = std::min(i + MAX_BATCH, _batchedStatuses.size());
+			if (end - i == 1) {
+				sendMessage(Connection::MessageType::AssetStatus, _batchedStatuses[i], Message::NEVER, true);
+				continue;
+			}
+			AssetStatusBatch msg;
+			for (auto j=i; j < end; j++)
+				msg.add_statuses()->Swap(&_batchedStatuses[j]);
+			sendMessage(Connection::MessageType::AssetStatusBatch, msg, Message::NEVER, true);
+		}
+		_batchedStatuses.clear();
+	}
+
+	// Consecutive binds with the same timeout share a BindReadBatch, each with its own requesters.
+	// Taken aside, since failures are signalled to the assets, whose handlers may bind again.
+	std::vector<BindRead> binds;
+	binds.swap(_batchedBinds);
+	std::vector<Asset::Handle> failed;
+	for (size_t i=0; i < binds.size(); ) {
+		auto timeout = binds[i].timeout();
+		auto end = i+1;
+		while ((end < binds.size()) && (end - i < MAX_BATCH) && (binds[end].timeout() == timeout))
+			end++;
+		bool sent;
+		if (end - i == 1) {
+			sent = sendMessage(Connection::MessageType::BindRead, binds[i], Message::in(timeout), false);
+		} else {
+			BindReadBatch msg;
+			for (auto j=i; j < end; j++) {
+				auto bind = msg.add_binds();
+				bind->set_handle(binds[j].handle());
+				bind->mutable_ids()->Swap(binds[j].mutable_ids());
+				bind->mutable_requesters()->Swap(binds[j].mutable_requesters());
+			}
+			msg.set_timeout(timeout);
+			sent = sendMessage(Connection::MessageType::BindReadBatch, msg, Message::in(timeout), false);
+		}
+		for (auto j=i; !sent && j < end; j++)
+			failed.push_back(binds[j].handle());
+		i = end;
+	}
+	if (_batchedBinds.empty())
+		_batchedBinds.swap(binds); // Keep the buffer allocated
+	_batchedBinds.clear();
+
+	// As for a bind not sent at once, except that bind() already returned
+	for (auto iter = failed.begin(); iter != failed.end(); iter++) {
+		auto binding = _assetMap.find(*iter);
+		if (binding == _assetMap.end())
+			continue;
+		auto keep = binding->second; // In case the handler releases it
+		if (auto asset = keep->readAsset()) {
+			keep->clearTimer();
+			bithorde::AssetStatus msg;
+			msg.set_status(bithorde::Status::NORESOURCES);
+			asset->handleMessage(msg);
+		}
+	}
+}
+
+MessageBatch::~MessageBatch()
+{
+	for (auto iter = _clients.begin(); iter != _clients.end(); iter++)
+		(*iter)->endBatch();
+}
+
+void MessageBatch::add(const Client::Pointer& client)
+{
+	client->beginBatch();
+	_clients.push_back(client);
+}
+
+FileWorkers::FileWorkers(const Client::Pointer& client)
+	: _client(client), _work(_workers)
+{
+	_thread.reset(new boost::thread([this]{ _workers.run(); }));
+	_client->setFileWorkers(&_workers);
+}
+
+FileWorkers::~FileWorkers()
+{
+	_client->setFileWorkers(NULL);
+	_workers.stop();
+	_thread->join();
+}
+
+static int32_t adaptiveTimeout(const LatencyHistogram& latency, const ptime::time_duration& default_, const ptime::time_duration& max)
+{
+	if (latency.count() < ADAPTIVE_TIMEOUT_SAMPLES)
+		return default_.total_milliseconds();
+	int64_t res = latency.percentile(0.99) * ADAPTIVE_TIMEOUT_FACTOR;
+	res = std::max(res, MIN_ADAPTIVE_TIMEOUT.total_milliseconds());
+	// With more than 1% timing out, the p99 lies beyond the answers measured
+	if (latency.timeouts() * 100 > latency.count() + latency.timeouts())
+		res = std::max(res, default_.total_milliseconds());
+	return std::min(res, max.total_milliseconds());
+}
+
+int32_t Client::bindTimeout() const
+{
+	return adaptiveTimeout(bindLatency, DEFAULT_ASSET_TIMEOUT, MAX_BIND_TIMEOUT);
+}
+
+int32_t Client::readTimeout() const
+{
+	return adaptiveTimeout(readLatency, DEFAULT_READ_TIMEOUT, MAX_READ_TIMEOUT);
+}
+
+int32_t Client::hopLatency() const
+{
+	auto rtt = stats ? stats->roundTripTime.value() : 0;
+	return rtt ? (2 * rtt) : DEFAULT_HOP_LATENCY.total_milliseconds();
+}
+
+int Client::allocRPCRequest(Asset::Handle asset, bool stream)
+{
+	forgetReleasedRequests();
+	RPCRequest req;
+	req.handle = asset;
+	req.stream = stream;
+	req.released = false;
+	return _requests.insert(req);
 }
 
 void Client::releaseRPCRequest(int reqId)
 {
-	if (_requestIdMap.erase(reqId))
-		_rpcIdAllocator.free(reqId);
+	_requests.erase(reqId);
+}
+
+void Client::lingerRPCRequest(int reqId, int32_t timeout)
+{
+	// The peer may already have sent payloads, which it took off the credit of the handle. Those
+	// arriving are credited back until nothing more is sent for the request; for the timeout the
+	// peer was given, and the time to get here.
+	auto req = _requests.find(reqId);
+	if (!req)
+		return;
+	if (!flowControlled())
+		return releaseRPCRequest(reqId);
+	req->released = true;
+	_releasedRequests.emplace_back(Message::in(timeout + hopLatency()), reqId);
+	forgetReleasedRequests();
+}
+
+void Client::forgetReleasedRequests()
+{
+	auto now = Message::Clock::now();
+	while (!_releasedRequests.empty() && (_releasedRequests.front().first <= now)) {
+		auto reqId = _releasedRequests.front().second;
+		auto req = _requests.find(reqId);
+		if (req && req->released)
+			releaseRPCRequest(reqId);
+		_releasedRequests.pop_front();
+	}
 }
@@ -1,17 +1,23 @@
 #ifndef BITHORDE_CLIENT_H
 #define BITHORDE_CLIENT_H
 
+#include <deque>
 #include <functional>
 #include <map>
+#include <set>
 #include <string>
 
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/local/stream_protocol.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/signals2.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "allocator.h"
 #include "asset.h"
 #include "connection.h"
+#include "flatmap.h"
+#include "slotmap.h"
 #include "timer.h"
 
 namespace bithorde {
@@ -19,10 +25,22 @@ namespace bithorde {
 const boost::posix_time::millisec DEFAULT_ASSET_TIMEOUT(1500);
 const boost::posix_time::millisec UPLOAD_ASSET_TIMEOUT(15000);
 const boost::posix_time::millisec CLOSE_TIMEOUT(DEFAULT_ASSET_TIMEOUT);
-const int MAX_ASSETS(1024);
+const boost::posix_time::millisec DEFAULT_READ_TIMEOUT(10000);
+const boost::posix_time::millisec MIN_ADAPTIVE_TIMEOUT(250);
+const boost::posix_time::millisec MAX_BIND_TIMEOUT(10000);
+const boost::posix_time::millisec MAX_READ_TIMEOUT(30000);
+const boost::posix_time::millisec DEFAULT_HOP_LATENCY(100);
+const unsigned ADAPTIVE_TIMEOUT_SAMPLES(16); // Before timeouts follow the measured latencies
+const unsigned ADAPTIVE_TIMEOUT_FACTOR(4); // Times the p99 latency
+const boost::posix_time::millisec RECONNECT_MIN_BACKOFF(100);
+const boost::posix_time::millisec RECONNECT_MAX_BACKOFF(5000);
+const int MAX_ASSETS(16384); // Handles a client may allocate; servers set their own limit
+const size_t MAX_HELD_BYTES(16*1024*1024); // Read.Responses held per handle, awaiting credit from the peer
+const size_t MAX_BATCH(1024); // Binds or statuses per BindReadBatch or AssetStatusBatch
 
 class Client;
 class ClientKeepalive;
+class Reconnector;
 
 class AssetBinding {
 	friend class Client;
@@ -77,13 +95,26 @@ private:
 	friend class Asset;
 	friend class ReadAsset;
 	friend class ReadRequestContext;
+	friend class ReadStreamContext;
+	friend class Reconnector;
 
 	typedef std::shared_ptr<AssetBinding> AssetPtr;
-	typedef std::map<Asset::Handle, AssetPtr> AssetMap;
+	typedef FlatMap<Asset::Handle, AssetPtr> AssetMap;
+
+	/**
+	 * An outstanding Read.Request or Read.Stream, under its reqId
+	 */
+	struct RPCRequest {
+		Asset::Handle handle;
+		bool stream; // Streams are released by the asset, when closed
+		bool released; // Given up on, but kept so that payloads still arriving are credited
+	};
 
 	boost::asio::io_service& _ioSvc;
 	TimerService::Ptr _timerSvc;
+	SlabPool::Ptr _slabs; // For the per-read state, such as request-contexts
 	Connection::Pointer _connection;
+	std::shared_ptr<Reconnector> _reconnector; // If connected through connectAsync()
 
 	State _state;
 
@@ -92,12 +123,49 @@ private:
 	std::unique_ptr<CipherConfig> _sendCipher, _recvCipher;
 
 	AssetMap _assetMap;
-	std::map<int, Asset::Handle> _requestIdMap;
+	SlotMap<RPCRequest> _requests;
+	std::deque< std::pair<Message::Deadline, int> > _releasedRequests; // By when each is forgotten
 	CachedAllocator<Asset::Handle> _handleAllocator;
-	CachedAllocator<int> _rpcIdAllocator;
 
 	uint8_t _protoVersion;
 	size_t _bytesAllocated;
+	uint32_t _pingSerial;
+	std::map<uint32_t, boost::chrono::steady_clock::time_point> _pingsSent; // By Ping.id, awaiting reply
+
+	/**
+	 * Per-handle flow-control, for handles bound by the peer. Read.Responses are held back
+	 * while the handle is out of credit, or the connection refuses them, up to MAX_HELD_BYTES.
+	 */
+	struct HandleCredit {
+		struct Held {
+			Read::Response msg;
+			IBuffer::Ptr payload;
+			Message::Deadline expires;
+		};
+		int64_t available;
+		size_t heldBytes;
+		std::deque<Held> held;
+	};
+	uint32_t _creditWindow, _peerCreditWindow;
+	std::map<Asset::Handle, HandleCredit> _sendCredit;
+	std::map<Asset::Handle, size_t> _creditOwed;
+	size_t _creditedBytes;
+
+	uint32_t _maxChunkSize, _peerMaxChunkSize;
+	bool _acceptReadStreams, _peerReadStreams;
+
+	size_t _sharedMemoryRing;
+	bool _acceptSharedMemory, _peerSharedMemory;
+	bool _acceptLocalFiles, _peerLocalFiles;
+	boost::asio::io_service* _fileWorkers;
+
+	/**
+	 * BindReads and AssetStatuses held back while batching, for a peer accepting batches
+	 */
+	bool _peerBatches;
+	unsigned _batchDepth;
+	std::vector<BindRead> _batchedBinds;
+	std::vector<AssetStatus> _batchedStatuses;
 public:
 	typedef std::shared_ptr<Client> Pointer;
 	typedef std::weak_ptr<Client> WeakPtr;
@@ -110,8 +178,78 @@ public:
 	State state();
 	const TimerService::Ptr& timerService();
 
+	/**
+	 * The pool of per-read state, such as request-contexts
+	 */
+	const SlabPool::Ptr& slabs() const;
+
 	void setSecurity(const std::string& key, CipherType cipher);
 
+	/**
+	 * Offers per-handle flow-control to the peer, granting /bytes/ of Read.Responses per handle.
+	 * 0 disables. Must be set before HandShake.
+	 */
+	void setCreditWindow(uint32_t bytes);
+
+	/**
+	 * True if per-handle flow-control was negotiated with the peer
+	 */
+	bool flowControlled() const;
+
+	/**
+	 * Offers to exchange chunks of up to /bytes/ with the peer, up to MAX_CHUNK_SIZE.
+	 * 0 keeps to LEGACY_CHUNK_SIZE. Must be set before HandShake.
+	 */
+	void setMaxChunkSize(uint32_t bytes);
+
+	/**
+	 * Largest Read.Response- or DataSegment-content agreed with the peer
+	 */
+	size_t maxChunkSize() const;
+
+	/**
+	 * Announces to the peer that Read.Stream is handled. Must be set before HandShake.
+	 */
+	void setAcceptReadStreams(bool accept);
+
+	/**
+	 * True if the peer accepts Read.Stream
+	 */
+	bool readStreams() const;
+
+	/**
+	 * Once authenticated over a local socket, offers to move the connection to shared-memory rings of
+	 * /ringSize/ bytes, if the peer accepts it. 0 disables. Must be set before HandShake.
+	 */
+	void setSharedMemory(size_t ringSize);
+
+	/**
+	 * Announces to the peer that a shared-memory transport is accepted. Must be set before HandShake.
+	 */
+	void setAcceptSharedMemory(bool accept);
+
+	/**
+	 * True if the connection has switched to shared memory
+	 */
+	bool sharedMemory() const;
+
+	/**
+	 * Announces to the peer that asset-data may be handed over as local files. Must be set before
+	 * HandShake.
+	 */
+	void setAcceptLocalFiles(bool accept);
+
+	/**
+	 * True if the peer accepts LocalFile
+	 */
+	bool localFiles() const;
+
+	/**
+	 * Reads local files handed over by the peer on threads running /workers/, so that a slow disk
+	 * does not stall the io_service of the client. Without, they are read on the io_service.
+	 */
+	void setFileWorkers(boost::asio::io_service* workers);
+
 	/**
 	 * Tries to parse spec either as HOST:PORT, or as /absolute/socket/path and connect to it.
 	 */
@@ -122,8 +260,25 @@ public:
 	void connect(Connection::Pointer newConn, const std::string& expectedPeer="");
 	void hookup(bithorde::Connection::Pointer newConn);
 
+	/**
+	 * Like connect(spec), but resolves and connects without blocking. Until close(), a lost connection
+	 * is re-established with backoff, doubling from RECONNECT_MIN_BACKOFF up to RECONNECT_MAX_BACKOFF.
+	 * Read-assets stay bound meanwhile, and reads in flight are sent again once their asset is bound
+	 * again, so a restart of the peer shows only as latency. After /attempts/ failures in a row, if
+	 * non-zero, reconnecting stops and connectFailed is signalled.
+	 */
+	void connectAsync(const std::string& spec, unsigned attempts=0);
+
+	/**
+	 * Closes the connection, and stops reconnecting
+	 */
 	void close();
 
+	/**
+	 * Closes the connection, to be re-established if connected through connectAsync()
+	 */
+	void disconnect();
+
 	bool isConnected();
 	const std::string& peerName();
 	const AssetMap& clientAssets() const;
@@ -135,9 +290,70 @@ public:
 	bool bind(UploadAsset & asset, int timeout_ms = 0);
 
 	bool sendMessage(bithorde::Connection::MessageType type, const google::protobuf::Message& msg, const bithorde::Message::Deadline& expires=Message::NEVER, bool prioritized=false);
+	bool sendMessage(bithorde::Connection::MessageType type, const google::protobuf::Message& msg, uint32_t payloadField, const IBuffer::Ptr& payload, const bithorde::Message::Deadline& expires=Message::NEVER, bool prioritized=false);
+
+	/**
+	 * Sends an AssetStatus for the peers handle, batched if within a MessageBatch
+	 */
+	bool sendAssetStatus(const bithorde::AssetStatus& msg);
+
+	/**
+	 * True if the peer accepts BindReadBatch and AssetStatusBatch
+	 */
+	bool batches() const;
+
+	/**
+	 * Hands /file/ over for the asset bound to /handle/ by the peer, if it accepts local files
+	 */
+	bool sendLocalFile(Asset::Handle handle, const FileRegion::Ptr& file);
+
+	/**
+	 * Sends a Read.Response for the peers /handle/ with /payload/ as content. If flow-controlled,
+	 * it is held back until /handle/ has credit.
+	 */
+	bool sendReadResponse(Asset::Handle handle, const bithorde::Read::Response& msg, const IBuffer::Ptr& payload, const bithorde::Message::Deadline& expires=Message::NEVER);
+
+	/**
+	 * Forget flow-control state of the peers /handle/, once released.
+	 */
+	void releaseCredit(Asset::Handle handle);
+
+	/**
+	 * True if a Read.Response for the peers /handle/ would be sent right away, and not be held
+	 * back or refused.
+	 */
+	bool canSendReadResponse(Asset::Handle handle) const;
+
+	/**
+	 * Sends a Ping, asking for a reply within /timeout/. Replies are timed to measure round-trip time.
+	 */
+	bool ping(const boost::posix_time::time_duration& timeout, bool prioritized);
+
+	/**
+	 * True while messages are queued for, or being written to, the peer
+	 */
+	bool sending() const;
 
-	void allocateBytes(size_t bytes);
-	void freeBytes(size_t bytes);
+	/**
+	 * Account for memory held by incoming messages. Bytes /credited/ to a handle are governed by
+	 * flow-control, and released bytes are credited back to the handle.
+	 */
+	void allocateBytes(size_t bytes, Asset::Handle credited=-1);
+
+	/**
+	 * Timeouts for binds and reads not given one explicitly. ADAPTIVE_TIMEOUT_FACTOR times the p99
+	 * latency measured from the peer, within MIN_ADAPTIVE_TIMEOUT and the max, or the default until
+	 * ADAPTIVE_TIMEOUT_SAMPLES have been measured. Not below the default while more than 1% time out.
+	 */
+	int32_t bindTimeout() const;
+	int32_t readTimeout() const;
+
+	/**
+	 * Time to allow for the link to the peer, when passing on a timeout. Twice the measured
+	 * round-trip time, or DEFAULT_HOP_LATENCY until measured.
+	 */
+	int32_t hopLatency() const;
+	void freeBytes(size_t bytes, Asset::Handle credited=-1);
 	size_t bytesAllocated() const;
 
 	/**
@@ -147,17 +363,26 @@ public:
 	boost::signals2::signal<void (Client&, const std::string&)> authenticated;
 	boost::signals2::signal<void ()> writable;
 	boost::signals2::signal<void ()> disconnected;
+	boost::signals2::signal<void ()> connectFailed;
 
 	ConnectionStats::Ptr stats;
 	InertialValue assetResponseTime;
 
+	// Of successful binds and reads, with those timing out counted aside
+	LatencyHistogram bindLatency, readLatency;
+
 protected:
 	Client(boost::asio::io_service& ioSvc, std::string myName);
 
 	void sayHello();
 
 	virtual void onDisconnected();
-	void onIncomingMessage( bithorde::Connection::MessageType type, const google::protobuf::Message& msg );
+
+	/**
+	 * Fails the read-assets held bound over a lost connection, once reconnecting gave up
+	 */
+	void dropResuming();
+	void onIncomingMessage( bithorde::Connection::MessageType type, const google::protobuf::Message& msg, const IBuffer::Ptr& payload );
 
 	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::HandShake> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::BindRead> >& msgCtx);
@@ -168,43 +393,94 @@ protected:
 	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::DataSegment> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::HandShakeConfirmed> >& msgCtx);
 	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::Ping> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::Credit> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::Read::Stream> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::SharedMemory> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::LocalFile> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::BindReadBatch> >& msgCtx);
+	virtual void onMessage(const std::shared_ptr< MessageContext<bithorde::AssetStatusBatch> >& msgCtx);
 
 	virtual void addStateFlag(State s);
 	virtual void setAuthenticated(const std::string peerName);
 private:
+	friend class MessageBatch;
+
 	bool release(Asset & a);
-	void trackAllocation(ssize_t change);
+	void trackAllocation(ssize_t change, Asset::Handle credited);
+	void flushCredit(Asset::Handle handle, HandleCredit& credit);
+	void onWritable();
 
 	boost::signals2::scoped_connection _messageConnection;
 	boost::signals2::scoped_connection _writableConnection;
 	boost::signals2::scoped_connection _disconnectedConnection;
 
 	bool informBound(const bithorde::AssetBinding& asset, int timeout_ms);
-	int allocRPCRequest(Asset::Handle asset);
+	void beginBatch();
+	void endBatch();
+	void flushBatch();
+	int allocRPCRequest(Asset::Handle asset, bool stream=false);
 	void releaseRPCRequest(int reqId);
+	void lingerRPCRequest(int reqId, int32_t timeout);
+	void forgetReleasedRequests();
+};
+
+/**
+ * Holds back the BindReads and AssetStatuses of the added clients while in scope, to send them as
+ * BindReadBatch and AssetStatusBatch to peers accepting batches. Scopes may nest; the batches are
+ * sent when the outermost scope holding a client ends.
+ */
+class MessageBatch : boost::noncopyable {
+	std::vector<Client::Pointer> _clients;
+public:
+	~MessageBatch();
+
+	void add(const Client::Pointer& client);
+};
+
+/**
+ * Reads the local files handed over to /client/ on a thread aside while in scope, so that a slow disk
+ * does not stall the connection. See Client::setFileWorkers().
+ */
+class FileWorkers : boost::noncopyable {
+	Client::Pointer _client;
+	boost::asio::io_service _workers;
+	boost::asio::io_service::work _work;
+	std::unique_ptr<boost::thread> _thread;
+public:
+	FileWorkers(const Client::Pointer& client);
+	~FileWorkers();
 };
 
 template <typename T>
 class MessageContext {
 	const Client::Pointer _client;
 	const T _msg;
+	const IBuffer::Ptr _payload;
+	const Asset::Handle _credited;
 public:
 	typedef std::shared_ptr< MessageContext<T> > Ptr;
 
-	MessageContext(const Client::Pointer& client, const T& msg) :
-		_client ( client ), _msg(msg)
+	MessageContext(const Client::Pointer& client, const T& msg, const IBuffer::Ptr& payload=IBuffer::Ptr(), Asset::Handle credited=-1) :
+		_client ( client ), _msg(msg), _payload(payload), _credited(credited)
 	{
-		_client->allocateBytes(_msg.ByteSize());
+		_client->allocateBytes(allocatedBytes(), _credited);
 	}
 
 	~MessageContext() {
-		_client->freeBytes(_msg.ByteSize());
+		_client->freeBytes(allocatedBytes(), _credited);
 	}
 
 	const T& message() const {
 		return _msg;
 	}
 
+	/**
+	 * The content-field of the message, when received separately from it.
+	 */
+	const IBuffer::Ptr& payload() const {
+		return _payload;
+	}
+
 	const std::shared_ptr<Client>& client() const {
 		return _client;
 	}
@@ -212,6 +488,11 @@ public:
 	operator T() {
 		return _msg;
 	}
+
+private:
+	size_t allocatedBytes() const {
+		return _msg.ByteSize() + (_payload ? _payload->size() : 0);
+	}
 };
 
 }
@@ -1,19 +1,17 @@
 #include "connection.h"
 
 #include "keepalive.hpp"
+#include "sharedmemory.h"
 #include "weak_fn.hpp"
 
 #include <boost/asio.hpp>
+#include <deque>
 #include <functional>
 #include <iostream>
-
-#define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
-
-#include <crypto++/arc4.h>
-#include <crypto++/aes.h>
-#include <crypto++/hmac.h>
-#include <crypto++/modes.h>
-#include <crypto++/sha.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <google/protobuf/wire_format_lite.h>
 #include <google/protobuf/wire_format_lite_inl.h>
@@ -21,12 +19,25 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
 const size_t K = 1024;
-const size_t MAX_MSG = 130*K;
+const size_t MSG_OVERHEAD = 2*K; // Framing and fields beside the content of a message
+const size_t MAX_MSG = bithorde::LEGACY_CHUNK_SIZE + MSG_OVERHEAD;
 const size_t MAX_ERRORS = 5;
-const size_t SEND_BUF = 1024*K;
-const size_t SEND_BUF_EMERGENCY = SEND_BUF + 256*K;
-const size_t SEND_BUF_LOW_WATER_MARK = SEND_BUF/4;
+const size_t SEND_BUF_DEFAULT = 1024*K;
+const size_t SEND_BUF_MIN = 2*MAX_MSG;
+const size_t SEND_BUF_MAX = 64*1024*K;
+const size_t SEND_BUF_EMERGENCY_EXTRA = 256*K;
 const size_t SEND_CHUNK_MS = 50;
+const double SEND_WINDOW_BDPS = 2.0; // Queue-limit in multiples of bandwidth-delay product
+const double BANDWIDTH_GAIN = 0.25;
+const double RTT_GAIN = 0.125;
+const auto BANDWIDTH_SAMPLE_TIME = boost::chrono::milliseconds(100);
+const size_t MAX_DEQUEUE_RESERVE = 256;
+const size_t MAX_POOLED_MESSAGES = 256;
+const size_t MAX_POOLED_MESSAGE_SIZE = 4*K;
+const size_t CIPHER_OFFLOAD_MIN = 32*K; // Smaller batches are cheaper to process in place
+const size_t IDLE_READ_WINDOW = 4*K; // Enough for most control-messages
+const size_t MAX_FDS_PER_READ = 16;
+const size_t MAX_PENDING_FDS = 64; // Received, but not yet taken by a message
 
 namespace asio = boost::asio;
 namespace chrono = boost::chrono;
@@ -34,19 +45,44 @@ using namespace std;
 
 using namespace bithorde;
 
-typedef CryptoPP::HMAC<CryptoPP::SHA256> HMAC_SHA256;
+template <typename F>
+void Connection::onNet(const F& f)
+{
+	if (threaded())
+		_netSvc.post(f);
+	else
+		f();
+}
+
+template <typename F>
+void Connection::onControl(const F& f)
+{
+	if (threaded())
+		_ioSvc.post(f);
+	else
+		f();
+}
 
 template <typename Protocol>
 class ConnectionImpl : public Connection {
+protected:
 	typedef typename Protocol::socket Socket;
 	typedef typename Protocol::endpoint EndPoint;
+	typedef std::function<void (const boost::system::error_code&, std::size_t)> WriteHandler;
+	/**
+	 * Messages being written. Only emptied on _ioSvc once written, so that the last reference to each
+	 * message, and to its payload, is always dropped there, whichever thread drops the list.
+	 */
+	typedef std::shared_ptr<MessageQueue::MessageList> Writing;
 
 	std::shared_ptr<Socket> _socket;
+	bool _open;
 
-	std::shared_ptr<CryptoPP::SymmetricCipher> _encryptor, _decryptor;
+	// Owned by _netSvc
+	StreamCipher::Ptr _encryptor, _decryptor;
 public:
 	ConnectionImpl(boost::asio::io_service& ioSvc, const ConnectionStats::Ptr& stats, const EndPoint& addr)
-		: Connection(ioSvc, stats), _socket(new Socket(ioSvc))
+		: Connection(ioSvc, ioSvc, stats), _socket(new Socket(ioSvc)), _open(true)
 	{
 		std::ostringstream buf;
 		buf << addr;
@@ -55,8 +91,8 @@ public:
 		_socket->connect(addr);
 	}
 
-	ConnectionImpl(boost::asio::io_service& ioSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr<Socket>& socket)
-		: Connection(ioSvc, stats)
+	ConnectionImpl(boost::asio::io_service& ioSvc, boost::asio::io_service& netSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr<Socket>& socket)
+		: Connection(ioSvc, netSvc, stats), _open(true)
 	{
 		std::ostringstream buf;
 		buf << socket->remote_endpoint();
@@ -70,96 +106,687 @@ public:
 	}
 
 	virtual void setEncryption(bithorde::CipherType t, const std::string& key, const std::string& iv) {
-		switch (t) {
-			case bithorde::CipherType::CLEARTEXT:
-				_encryptor.reset();
-				break;
-			case bithorde::CipherType::AES_CTR:
-				_encryptor.reset(new CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption());
-				_encryptor->SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)iv.data(), iv.size());
-				break;
-			case bithorde::CipherType::RC4:
-				byte key_[HMAC_SHA256::DIGESTSIZE];
-				HMAC_SHA256((const byte*)key.data(), key.size()).CalculateDigest(key_, (const byte*)iv.data(), iv.size());
-				_encryptor.reset(new CryptoPP::Weak1::ARC4::Encryption());
-				_encryptor->SetKey(key_, sizeof(key_));
-				break;
-			case bithorde::CipherType::XOR:
-			default:
-				throw std::runtime_error("Unsupported Cipher " + bithorde::CipherType_Name(t));
-		}
+		StreamCipher::Ptr encryptor;
+		if (t != bithorde::CipherType::CLEARTEXT)
+			encryptor = std::make_shared<StreamCipher>(t, key, iv);
+		auto self = std::static_pointer_cast<ConnectionImpl>(shared_from_this());
+		// Applies to everything sent after this, which is written on _netSvc in order
+		onNet([self, encryptor]() {
+			self->_encryptor = encryptor;
+		});
 	}
 
 	virtual void setDecryption(bithorde::CipherType t, const std::string& key, const std::string& iv) {
-		switch (t) {
-			case bithorde::CipherType::CLEARTEXT:
-				_decryptor.reset();
-				break;
-			case bithorde::CipherType::AES_CTR:
-				_decryptor.reset(new CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption());
-				_decryptor->SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)iv.data(), iv.size());
-				break;
-			case bithorde::CipherType::RC4:
-				byte key_[HMAC_SHA256::DIGESTSIZE];
-				HMAC_SHA256((const byte*)key.data(), key.size()).CalculateDigest(key_, (const byte*)iv.data(), iv.size());
-				_decryptor.reset(new CryptoPP::Weak1::ARC4::Decryption());
-				_decryptor->SetKey(key_, sizeof(key_));
-				break;
-			case bithorde::CipherType::XOR:
-			default:
-				throw std::runtime_error("Unsupported Cipher " + bithorde::CipherType_Name(t));
-		}
+		StreamCipher::Ptr decryptor;
+		if (t != bithorde::CipherType::CLEARTEXT)
+			decryptor = std::make_shared<StreamCipher>(t, key, iv);
+		auto self = std::static_pointer_cast<ConnectionImpl>(shared_from_this());
+		// Parsing is held after handshakes until dispatched, so nothing more is read until this has run
+		onNet([self, decryptor]() {
+			self->_decryptor = decryptor;
 
-		// Decrypt data already in buffer
-		decrypt(_rcvBuf.ptr+_rcvBuf.consumed, _rcvBuf.size-_rcvBuf.consumed);
+			// Decrypt data already in buffer
+			if (decryptor)
+				decryptor->process(self->_rcvBuf.data(), self->_rcvBuf.data(), self->_rcvBuf.left());
+		});
 	}
 
 	void trySend() {
 		_sendWaiting = 0;
-		auto queued = _sndQueue.dequeue(_stats->outgoingBitrateCurrent.value()/8, SEND_CHUNK_MS);
+		auto bandwidth = _sndWindow.bandwidth();
+		if (!bandwidth)
+			bandwidth = _stats->outgoingBitrateCurrent.value()/8;
+		auto queued = std::make_shared<MessageQueue::MessageList>(_sndQueue.dequeue(bandwidth, SEND_CHUNK_MS));
+		for (auto iter=queued->begin(); iter != queued->end(); iter++)
+			_sendWaiting += (*iter)->size();
+		BOOST_ASSERT(_sendWaiting || _sndQueue.empty());
+		if (!_sendWaiting)
+			return;
+
+		auto self = std::static_pointer_cast<ConnectionImpl>(shared_from_this());
+		onNet([self, queued]() {
+			self->write(queued);
+		});
+	}
+
+	void readSome() {
+		auto self = shared_from_this();
+		size_t windowSize = _readWindowSize;
+		boost::system::error_code ec;
+		if (!_rcvBuf.left() && !_socket->available(ec)) {
+			// Nothing pending, so don't hold a full window while waiting
+			_rcvBuf.release();
+			windowSize = IDLE_READ_WINDOW;
+		}
+		_readWindow = _rcvBuf.allocate(windowSize);
+		_socket->async_read_some(asio::buffer(_readWindow, windowSize),
+			[=](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+				self->onRead(ec, bytes_transferred);
+			}
+		);
+	}
+
+	virtual void decrypt(byte* buf, size_t size, const std::function<void()>& done) {
+		if (_decryptor && _cipherWorkers && (size >= CIPHER_OFFLOAD_MIN)) {
+			// No further reads are issued until done, so the keystream stays in order
+			std::vector<StreamCipher::Segment> segments{StreamCipher::Segment{buf, buf, size}};
+			_decryptor->processOn(*_cipherWorkers, _netSvc, segments, done);
+		} else {
+			if (_decryptor)
+				_decryptor->process(buf, buf, size);
+			done();
+		}
+	}
+
+	void close() {
+		if (_open) {
+			_open = false;
+			auto socket = _socket;
+			onNet([socket]() {
+				socket->close();
+			});
+			disconnected();
+		}
+		_keepAlive.reset(NULL);
+	}
+
+protected:
+	/**
+	 * Writes /buffers/ of /queued/, on _netSvc. /ends/ tells where the buffers of each message end.
+	 */
+	virtual void transmit(const std::vector<boost::asio::const_buffer>& buffers, const std::vector<size_t>& ends, const Writing& queued, const WriteHandler& done) {
+		boost::asio::async_write(*_socket, buffers, done);
+	}
+
+private:
+	/**
+	 * Encrypts and writes /queued/, on _netSvc
+	 */
+	void write(const Writing& queued) {
 		std::vector<boost::asio::const_buffer> buffers;
-		buffers.reserve(queued.size());
-		for (auto iter=queued.begin(); iter != queued.end(); iter++) {
+		std::vector<size_t> ends;
+		std::vector<IBuffer::Ptr> ciphertexts;
+		std::vector<StreamCipher::Segment> segments;
+		buffers.reserve(queued->size()*2);
+		ends.reserve(queued->size());
+		size_t bytes = 0;
+		for (auto iter=queued->begin(); iter != queued->end(); iter++) {
 			auto& buf = (*iter)->buf;
 			if (_encryptor)
-				_encryptor->ProcessString((byte*)buf.data(), buf.size());
+				segments.push_back(StreamCipher::Segment{(byte*)buf.data(), (const byte*)buf.data(), buf.size()});
 			buffers.push_back(boost::asio::buffer(buf));
-			_sendWaiting += buf.size();
+			if (auto& payload = (*iter)->payload) {
+				if (_encryptor) {
+					// Payload may be shared with other readers, so encrypt into a private buffer
+					auto ciphertext = std::make_shared<MemoryBuffer>(payload->size());
+					segments.push_back(StreamCipher::Segment{**ciphertext, **payload, payload->size()});
+					buffers.push_back(boost::asio::buffer(**ciphertext, ciphertext->size()));
+					ciphertexts.push_back(ciphertext);
+				} else {
+					buffers.push_back(boost::asio::buffer(**payload, payload->size()));
+				}
+			}
+			bytes += (*iter)->size();
+			ends.push_back(buffers.size());
 		}
-		if (_sendWaiting) {
-			auto self = shared_from_this();
-			boost::asio::async_write(*_socket, buffers,
-				[=](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-					self->onWritten(ec, bytes_transferred, queued);
+
+		auto self = std::static_pointer_cast<ConnectionImpl>(shared_from_this());
+		// ciphertexts are captured to be kept alive until written
+		auto write = [self, buffers, ends, queued, ciphertexts]() {
+			auto started = chrono::steady_clock::now();
+			self->transmit(buffers, ends, queued,
+				[self, queued, ciphertexts, started](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+					self->onControl([self, queued, ec, bytes_transferred, started]() {
+						MessageQueue::MessageList written;
+						written.swap(*queued);
+						self->onWritten(ec, bytes_transferred, written, started);
+					});
 				}
 			);
+		};
+		if (_encryptor && _cipherWorkers && (bytes >= CIPHER_OFFLOAD_MIN)) {
+			// _sendWaiting keeps further sends off until written, so the keystream stays in order
+			_encryptor->processOn(*_cipherWorkers, _netSvc, segments, write);
+		} else {
+			for (auto iter = segments.begin(); iter != segments.end(); iter++)
+				_encryptor->process(iter->dst, iter->src, iter->size);
+			write();
 		}
-		BOOST_ASSERT(_sendWaiting || _sndQueue.empty());
+	}
+};
+
+/**
+ * A connection over a local socket. Descriptors may be passed along with messages, and the connection
+ * may switch to a pair of byte-rings in shared memory, sparing the peers the copying and the system-calls
+ * of the socket. Once switched, the socket only carries descriptors, each set with a single marker-byte
+ * sent ahead of its message on the rings, and tells when the peer goes away.
+ */
+class LocalConnection : public ConnectionImpl<asio::local::stream_protocol> {
+	typedef ConnectionImpl<asio::local::stream_protocol> Base;
+
+	std::mutex _fdsMutex;
+	std::deque<int> _receivedFds; // In order received, until taken by the message they came with
+
+	// Owned by _ioSvc
+	SharedMemoryChannel::Ptr _offered; // Until answered by the peer
+	bool _switching;
+
+	std::atomic<bool> _shared;
+	std::atomic<bool> _rxShared; // Descriptors then come aside, on the socket
+
+	// Owned by _netSvc
+	SharedMemoryChannel::Ptr _channel;
+	bool _rxRing, _txRing;
+	MessageQueue::MessagePtr _switchAfter; // The last message on the socket
+	asio::posix::stream_descriptor _wake;
+	bool _wakeArmed;
+	bool _readWaiting;
+	std::function<void ()> _writeWaiting;
+
+	struct Write {
+		std::vector<asio::const_buffer> buffers;
+		std::vector< std::pair<size_t, std::vector<int> > > fds; // By the buffer they are sent with
+		size_t index, offset, nextFds, written;
+		WriteHandler done;
+	};
+public:
+	LocalConnection(asio::io_service& ioSvc, const ConnectionStats::Ptr& stats, const EndPoint& addr)
+		: Base(ioSvc, stats, addr), _switching(false), _shared(false), _rxShared(false), _rxRing(false), _txRing(false), _wake(ioSvc), _wakeArmed(false), _readWaiting(false)
+	{}
+
+	LocalConnection(asio::io_service& ioSvc, asio::io_service& netSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr<Socket>& socket)
+		: Base(ioSvc, netSvc, stats, socket), _switching(false), _shared(false), _rxShared(false), _rxRing(false), _txRing(false), _wake(netSvc), _wakeArmed(false), _readWaiting(false)
+	{}
+
+	~LocalConnection() {
+		for (auto iter = _receivedFds.begin(); iter != _receivedFds.end(); iter++)
+			::close(*iter);
+	}
+
+	virtual bool canPassFds() const {
+		return true;
+	}
+
+	virtual bool startSharedMemory(size_t ringSize) {
+		if (_switching || !_open)
+			return false;
+		auto channel = SharedMemoryChannel::create(ringSize);
+		if (!channel)
+			return false;
+		_switching = true;
+		_offered = channel;
+
+		bithorde::SharedMemory offer;
+		offer.set_ringsize(ringSize);
+		auto msg = _msgPool->acquire(Message::NEVER);
+		msg->encode(SharedMemory, offer);
+		msg->fds = channel->fds();
+		msg->fdOwner = channel;
+		switchAfter(msg, channel);
+		return true;
+	}
+
+	virtual bool onSharedMemory(const bithorde::SharedMemory& msg) {
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		if (_offered) {
+			// The answer to our offer. From here on, the socket only carries descriptors sent aside.
+			auto channel = _offered;
+			_offered.reset();
+			if (msg.ringsize() != channel->ringSize())
+				return false;
+			onNet([self, channel]() {
+				self->useChannel(channel);
+				self->dropMarkers();
+				self->_rxRing = true;
+				self->_rxShared = true;
+				self->_shared = self->_txRing;
+				self->watchSocket();
+			});
+			return true;
+		}
+		if (_switching)
+			return false;
+		_switching = true;
+
+		auto channel = SharedMemoryChannel::attach(takeFds(3), msg.ringsize());
+		if (!channel)
+			return false;
+		onNet([self, channel]() {
+			self->useChannel(channel);
+			self->dropMarkers();
+			self->_rxRing = true;
+			self->_rxShared = true;
+			self->watchSocket();
+		});
+		auto answer = _msgPool->acquire(Message::NEVER);
+		answer->encode(SharedMemory, msg);
+		switchAfter(answer, channel);
+		return true;
+	}
+
+	virtual bool sharedMemory() const {
+		return _shared;
+	}
+
+	virtual std::vector<int> takeFds(size_t count) {
+		std::lock_guard<std::mutex> lock(_fdsMutex);
+		// Sent aside ahead of the message, so already on the socket if not yet picked up
+		while (_rxShared && (_receivedFds.size() < count) && (receiveAside() > 0));
+		std::vector<int> res;
+		while (res.size() < count && !_receivedFds.empty()) {
+			res.push_back(_receivedFds.front());
+			_receivedFds.pop_front();
+		}
+		return res;
+	}
+
+	virtual void close() {
+		if (_open) {
+			auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+			onNet([self]() {
+				boost::system::error_code ec;
+				self->_wake.close(ec);
+			});
+		}
+		Base::close();
 	}
 
-	void tryRead() {
-		if (_listening && !_readWindow) {
-			auto self = shared_from_this();
-			_readWindow = _rcvBuf.allocate(MAX_MSG);
-			_socket->async_read_some(asio::buffer(_readWindow, MAX_MSG),
-				[=](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-					self->onRead(ec, bytes_transferred);
+	virtual void readSome() {
+		if (_rxRing)
+			return readRing();
+		if (!receive(true))
+			waitReadable();
+	}
+
+protected:
+	virtual void transmit(const std::vector<asio::const_buffer>& buffers, const std::vector<size_t>& ends, const Writing& queued, const WriteHandler& done) {
+		auto op = std::make_shared<Write>();
+		op->index = op->offset = op->nextFds = op->written = 0;
+		if (_txRing) {
+			op->buffers = buffers;
+			op->done = done;
+			if (!sendAside(*queued, 0))
+				return failWrite(op);
+			return writeRing(op);
+		}
+
+		// Up to and including _switchAfter on the socket, the rest through the rings
+		const auto& messages = *queued;
+		size_t cut = buffers.size(), following = messages.size();
+		bool switching = false;
+		for (size_t i=0; i < messages.size() && !switching; i++) {
+			if (!messages[i]->fds.empty())
+				op->fds.push_back(std::make_pair(i ? ends[i-1] : 0, messages[i]->fds));
+			if (messages[i] == _switchAfter) {
+				cut = ends[i];
+				following = i+1;
+				switching = true;
+			}
+		}
+		if (op->fds.empty() && !switching)
+			return boost::asio::async_write(*_socket, buffers, done);
+
+		op->buffers.assign(buffers.begin(), buffers.begin() + cut);
+		if (!switching) {
+			op->done = done;
+		} else {
+			auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+			auto rest = std::make_shared<Write>();
+			rest->buffers.assign(buffers.begin() + cut, buffers.end());
+			rest->index = rest->offset = rest->nextFds = rest->written = 0;
+			op->done = [self, rest, done, queued, following](const boost::system::error_code& ec, std::size_t written) {
+				if (ec)
+					return done(ec, written);
+				self->_txRing = true;
+				self->_shared = self->_rxRing;
+				self->_switchAfter.reset();
+				rest->done = [done, written](const boost::system::error_code& ec, std::size_t rest) {
+					done(ec, written + rest);
+				};
+				if (!self->sendAside(*queued, following))
+					return self->failWrite(rest);
+				self->writeRing(rest);
+			};
+		}
+		writeSocket(op);
+	}
+
+private:
+	/**
+	 * Sends /msg/ as the last message on the socket, with everything after it going through /channel/
+	 */
+	void switchAfter(const std::shared_ptr<Message>& msg, const SharedMemoryChannel::Ptr& channel) {
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		onNet([self, msg, channel]() {
+			self->useChannel(channel);
+			self->_switchAfter = msg;
+		});
+		enqueue(msg, MessageQueue::CONTROL);
+	}
+
+	void useChannel(const SharedMemoryChannel::Ptr& channel) {
+		if (_channel)
+			return;
+		_channel = channel;
+		boost::system::error_code ec;
+		_wake.assign(::dup(channel->wakeFd()), ec);
+		if (ec)
+			cerr << _logTag << ": Failed to wait for shared memory, " << ec.message() << endl;
+	}
+
+	/**
+	 * Drops what was read from the socket past the last message on it. The peer switched right after
+	 * it, so those are the marker-bytes of descriptors sent aside, which are already in _receivedFds.
+	 */
+	void dropMarkers() {
+		_rcvBuf.consume(_rcvBuf.left());
+	}
+
+	void waitReadable() {
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		_socket->async_wait(Socket::wait_read, [self](const boost::system::error_code& ec) {
+			if (ec)
+				self->onRead(ec, 0);
+			else if (!self->receive(false))
+				self->waitReadable();
+		});
+	}
+
+	/**
+	 * Reads what the socket has into _readWindow, keeping descriptors passed along. Returns false if
+	 * there was nothing to read. Unless /post/, the read is handled right away.
+	 */
+	bool receive(bool post) {
+		size_t windowSize = _readWindowSize;
+		boost::system::error_code ec;
+		if (!_rcvBuf.left() && !_socket->available(ec)) {
+			// Nothing pending, so don't hold a full window while waiting
+			_rcvBuf.release();
+			windowSize = IDLE_READ_WINDOW;
+		}
+		_readWindow = _rcvBuf.allocate(windowSize);
+
+		iovec iov = { _readWindow, windowSize };
+		union {
+			cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_READ)];
+		} control;
+		msghdr hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		hdr.msg_control = control.buf;
+		hdr.msg_controllen = sizeof(control.buf);
+		ssize_t res;
+		do {
+			res = ::recvmsg(_socket->native_handle(), &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		} while ((res < 0) && (errno == EINTR));
+		if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			return false;
+		if (res < 0)
+			ec = boost::system::error_code(errno, boost::system::system_category());
+		else
+			keepFds(hdr);
+
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		size_t count = res < 0 ? 0 : res;
+		if (post)
+			_netSvc.post([self, ec, count]() { self->onRead(ec, count); });
+		else
+			onRead(ec, count);
+		return true;
+	}
+
+	void keepFds(msghdr& hdr) {
+		std::lock_guard<std::mutex> lock(_fdsMutex);
+		keepFdsLocked(hdr);
+	}
+
+	void keepFdsLocked(msghdr& hdr) {
+		for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+			if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+				continue;
+			auto fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+			auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i=0; i < count; i++) {
+				if (_receivedFds.size() < MAX_PENDING_FDS) {
+					_receivedFds.push_back(fds[i]);
+				} else {
+					cerr << _logTag << ": Dropping descriptor not taken by any message" << endl;
+					::close(fds[i]);
 				}
-			);
+			}
+		}
+		if (hdr.msg_flags & MSG_CTRUNC)
+			cerr << _logTag << ": Descriptors truncated" << endl;
+	}
+
+	/**
+	 * Writes through sendmsg, passing descriptors along with the first byte of their message
+	 */
+	void writeSocket(const std::shared_ptr<Write>& op) {
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		while (op->index < op->buffers.size()) {
+			bool attach = (op->nextFds < op->fds.size()) && (op->fds[op->nextFds].first == op->index) && !op->offset;
+			size_t end = op->buffers.size();
+			auto following = op->nextFds + (attach ? 1 : 0);
+			if (following < op->fds.size())
+				end = op->fds[following].first;
+
+			std::vector<iovec> iov;
+			for (size_t i = op->index; (i < end) && (iov.size() < IOV_MAX); i++) {
+				size_t skip = (i == op->index) ? op->offset : 0;
+				auto data = const_cast<byte*>(asio::buffer_cast<const byte*>(op->buffers[i])) + skip;
+				iov.push_back(iovec{data, asio::buffer_size(op->buffers[i]) - skip});
+			}
+			msghdr hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_iov = iov.data();
+			hdr.msg_iovlen = iov.size();
+			std::vector<char> control;
+			if (attach) {
+				const auto& fds = op->fds[op->nextFds].second;
+				control.resize(CMSG_SPACE(sizeof(int) * fds.size()));
+				hdr.msg_control = control.data();
+				hdr.msg_controllen = control.size();
+				auto cmsg = CMSG_FIRSTHDR(&hdr);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_RIGHTS;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+				memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+			}
+
+			auto res = ::sendmsg(_socket->native_handle(), &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (res < 0) {
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+					_socket->async_wait(Socket::wait_write, [self, op](const boost::system::error_code& ec) {
+						if (ec)
+							op->done(ec, op->written);
+						else
+							self->writeSocket(op);
+					});
+					return;
+				}
+				boost::system::error_code ec(errno, boost::system::system_category());
+				_netSvc.post([op, ec]() { op->done(ec, op->written); });
+				return;
+			}
+			if (attach)
+				op->nextFds++;
+			advance(*op, res);
+		}
+		_netSvc.post([op]() { op->done(boost::system::error_code(), op->written); });
+	}
+
+	/**
+	 * Sends the descriptors of /queued/ from /first/ on over the socket, ahead of their messages on the
+	 * rings. Nothing else is sent on the socket, so it has room unless the peer stopped reading it.
+	 */
+	bool sendAside(const MessageQueue::MessageList& queued, size_t first) {
+		for (size_t i=first; i < queued.size(); i++) {
+			const auto& fds = queued[i]->fds;
+			if (fds.empty())
+				continue;
+			byte marker = 0;
+			iovec iov = { &marker, sizeof(marker) };
+			std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+			msghdr hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_iov = &iov;
+			hdr.msg_iovlen = 1;
+			hdr.msg_control = control.data();
+			hdr.msg_controllen = control.size();
+			auto cmsg = CMSG_FIRSTHDR(&hdr);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+			memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+			ssize_t res;
+			do {
+				res = ::sendmsg(_socket->native_handle(), &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+			} while ((res < 0) && (errno == EINTR));
+			if (res != sizeof(marker)) {
+				cerr << _logTag << ": Failed to pass descriptors, " << strerror(errno) << endl;
+				return false;
+			}
 		}
+		return true;
 	}
 
-	virtual void decrypt(byte* buf, size_t size) {
-		if (_decryptor)
-			_decryptor->ProcessString(buf, size);
+	/**
+	 * Receives what was sent aside on the socket, with _fdsMutex held. Returns the bytes received, 0
+	 * if the peer closed, or -1 if nothing is there.
+	 */
+	ssize_t receiveAside() {
+		byte markers[64];
+		iovec iov = { markers, sizeof(markers) };
+		union {
+			cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_READ)];
+		} control;
+		msghdr hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		hdr.msg_control = control.buf;
+		hdr.msg_controllen = sizeof(control.buf);
+		ssize_t res;
+		do {
+			res = ::recvmsg(_socket->native_handle(), &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		} while ((res < 0) && (errno == EINTR));
+		if (res > 0)
+			keepFdsLocked(hdr);
+		return res;
 	}
 
-	void close() {
-		if (_socket->is_open()) {
-			_socket->close();
-			disconnected();
+	void failWrite(const std::shared_ptr<Write>& op) {
+		auto ec = boost::system::error_code(EPIPE, boost::system::system_category());
+		_netSvc.post([op, ec]() { op->done(ec, op->written); });
+	}
+
+	void writeRing(const std::shared_ptr<Write>& op) {
+		auto& tx = _channel->tx();
+		while (op->index < op->buffers.size()) {
+			auto& buf = op->buffers[op->index];
+			auto left = asio::buffer_size(buf) - op->offset;
+			auto written = left ? tx.write(asio::buffer_cast<const byte*>(buf) + op->offset, left) : 0;
+			if (tx.corrupt()) {
+				cerr << _logTag << ": Shared memory corrupted by the peer, disconnecting" << endl;
+				return failWrite(op);
+			} else if (written || !left) {
+				advance(*op, written);
+				if (tx.wakeConsumer())
+					_channel->wakePeer();
+			} else if (tx.waitWritable()) {
+				auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+				_writeWaiting = [self, op]() {
+					self->writeRing(op);
+				};
+				return armWake();
+			}
 		}
-		_keepAlive.reset(NULL);
+		// Posted, since writing again may be triggered right away
+		_netSvc.post([op]() { op->done(boost::system::error_code(), op->written); });
+	}
+
+	static void advance(Write& op, size_t bytes) {
+		op.written += bytes;
+		bytes += op.offset;
+		while ((op.index < op.buffers.size()) && (bytes >= asio::buffer_size(op.buffers[op.index]))) {
+			bytes -= asio::buffer_size(op.buffers[op.index]);
+			op.index++;
+		}
+		op.offset = bytes;
+	}
+
+	void readRing() {
+		auto& rx = _channel->rx();
+		if (!rx.readable() && !rx.corrupt() && rx.waitReadable()) {
+			_readWaiting = true;
+			return armWake();
+		}
+		// Never more than the ring holds, whatever the window
+		auto windowSize = std::min(_readWindowSize, _channel->ringSize());
+		_readWindow = _rcvBuf.allocate(windowSize);
+		auto count = rx.read(_readWindow, windowSize);
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		if (rx.corrupt()) {
+			cerr << _logTag << ": Shared memory corrupted by the peer, disconnecting" << endl;
+			auto ec = boost::system::error_code(EPROTO, boost::system::system_category());
+			return _netSvc.post([self, ec]() { self->onRead(ec, 0); });
+		}
+		if (rx.wakeProducer())
+			_channel->wakePeer();
+		_netSvc.post([self, count]() {
+			self->onRead(boost::system::error_code(), count);
+		});
+	}
+
+	void armWake() {
+		if (_wakeArmed)
+			return;
+		_wakeArmed = true;
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		_wake.async_wait(asio::posix::stream_descriptor::wait_read, [self](const boost::system::error_code& ec) {
+			self->_wakeArmed = false;
+			if (ec)
+				return;
+			uint64_t wakeups;
+			if (::read(self->_wake.native_handle(), &wakeups, sizeof(wakeups)) < 0 && (errno != EAGAIN))
+				return self->onRead(boost::system::error_code(errno, boost::system::system_category()), 0);
+			if (self->_readWaiting) {
+				self->_readWaiting = false;
+				self->readRing();
+			}
+			if (auto resume = std::move(self->_writeWaiting)) {
+				self->_writeWaiting = nullptr;
+				resume();
+			}
+		});
+	}
+
+	/**
+	 * Nothing more should come on the socket, other than descriptors sent aside, or the peer closing it
+	 */
+	void watchSocket() {
+		auto self = std::static_pointer_cast<LocalConnection>(shared_from_this());
+		_socket->async_wait(Socket::wait_read, [self](const boost::system::error_code& ec) {
+			if (ec == asio::error::operation_aborted)
+				return;
+			if (ec)
+				return self->onRead(ec, 0);
+			ssize_t res;
+			{
+				std::lock_guard<std::mutex> lock(self->_fdsMutex);
+				while ((res = self->receiveAside()) > 0);
+			}
+			if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				self->watchSocket();
+			else
+				self->onRead(boost::system::error_code(res ? errno : 0, boost::system::system_category()), 0);
+		});
 	}
 };
 
@@ -174,19 +801,130 @@ Message::Message(Deadline expires) :
 {
 }
 
+void Message::encode(uint32_t tag, const google::protobuf::Message& msg)
+{
+	::google::protobuf::io::StringOutputStream of(&buf);
+	::google::protobuf::io::CodedOutputStream stream(&of);
+	stream.WriteTag(::google::protobuf::internal::WireFormatLite::MakeTag(tag, ::google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+	stream.WriteVarint32(msg.ByteSize());
+	BOOST_VERIFY( msg.SerializeToCodedStream(&stream) );
+}
+
+void Message::encode(uint32_t tag, const google::protobuf::Message& msg, uint32_t payloadField, const IBuffer::Ptr& payload)
+{
+	typedef ::google::protobuf::io::CodedOutputStream CodedOutputStream;
+	typedef ::google::protobuf::internal::WireFormatLite WireFormatLite;
+	auto payloadTag = WireFormatLite::MakeTag(payloadField, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+	uint32_t payloadSize = payload->size();
+	uint32_t msgSize = msg.ByteSize()
+		+ CodedOutputStream::VarintSize32(payloadTag)
+		+ CodedOutputStream::VarintSize32(payloadSize)
+		+ payloadSize;
+
+	::google::protobuf::io::StringOutputStream of(&buf);
+	::google::protobuf::io::CodedOutputStream stream(&of);
+	stream.WriteTag(WireFormatLite::MakeTag(tag, WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+	stream.WriteVarint32(msgSize);
+	BOOST_VERIFY( msg.SerializeToCodedStream(&stream) );
+	stream.WriteTag(payloadTag);
+	stream.WriteVarint32(payloadSize);
+	this->payload = payload;
+}
+
+size_t Message::size() const
+{
+	return buf.size() + (payload ? payload->size() : 0);
+}
+
+MessagePool::~MessagePool()
+{
+	for (auto iter=_free.begin(); iter != _free.end(); iter++)
+		delete *iter;
+}
+
+std::shared_ptr<Message> MessagePool::acquire(Message::Deadline expires)
+{
+	Message* msg = NULL;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_free.empty()) {
+			msg = _free.back();
+			_free.pop_back();
+		}
+	}
+	if (msg)
+		msg->expires = expires;
+	else
+		msg = new Message(expires);
+	auto self = shared_from_this();
+	return std::shared_ptr<Message>(msg, [self](Message* msg) {
+		self->release(msg);
+	});
+}
+
+size_t MessagePool::pooled() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _free.size();
+}
+
+void MessagePool::release(Message* msg)
+{
+	// Payloads may pin large buffers, drop them right away
+	msg->payload.reset();
+	msg->fds.clear();
+	msg->fdOwner.reset();
+	if (msg->buf.capacity() <= MAX_POOLED_MESSAGE_SIZE) {
+		msg->buf.clear();
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_free.size() < MAX_POOLED_MESSAGES) {
+			_free.push_back(msg);
+			return;
+		}
+	}
+	delete msg;
+}
+
+MessageQueue::Ring::Ring()
+	: _slots(16), _head(0), _count(0)
+{}
+
+void MessageQueue::Ring::push_back(const MessageQueue::MessagePtr& msg)
+{
+	if (_count == _slots.size()) {
+		std::vector< MessagePtr > slots(_slots.size()*2);
+		for (size_t i=0; i < _count; i++)
+			slots[i].swap(_slots[(_head+i) & (_slots.size()-1)]);
+		_slots.swap(slots);
+		_head = 0;
+	}
+	_slots[(_head+_count) & (_slots.size()-1)] = msg;
+	_count++;
+}
+
+MessageQueue::MessagePtr MessageQueue::Ring::pop_front()
+{
+	BOOST_ASSERT(_count > 0);
+	MessagePtr res;
+	res.swap(_slots[_head]);
+	_head = (_head+1) & (_slots.size()-1);
+	_count--;
+	return res;
+}
+
 MessageQueue::MessageQueue()
 	: _size(0)
 {}
 
 bool MessageQueue::empty() const
 {
-	return _queue.empty();
+	return _lanes[CONTROL].empty() && _lanes[BULK].empty();
 }
 
-void MessageQueue::enqueue(const MessageQueue::MessagePtr& msg)
+void MessageQueue::enqueue(const MessageQueue::MessagePtr& msg, MessageQueue::Lane lane)
 {
-	_size += msg->buf.size();
-	_queue.push_back(msg);
+	_size += msg->size();
+	_lanes[lane].push_back(msg);
 }
 
 MessageQueue::MessageList MessageQueue::dequeue(size_t bytes_per_sec, ushort millis)
@@ -195,17 +933,18 @@ MessageQueue::MessageList MessageQueue::dequeue(size_t bytes_per_sec, ushort mil
 	int32_t wanted(std::max(((bytes_per_sec*millis)/1000), static_cast<size_t>(1)));
 	auto now = chrono::steady_clock::now();
 	MessageList res;
-	res.reserve(_size);
-	while ((wanted > 0) && !_queue.empty()) {
-		auto next = _queue.front();
-		_queue.pop_front();
-		_size -= next->buf.size();
-		if (now < next->expires) {
-			wanted -= next->buf.size();
-			res.push_back(next);
+	res.reserve(std::min(_lanes[CONTROL].count() + _lanes[BULK].count(), MAX_DEQUEUE_RESERVE));
+	for (auto lane = &_lanes[CONTROL]; lane <= &_lanes[BULK]; lane++) {
+		while ((wanted > 0) && !lane->empty()) {
+			auto next = lane->pop_front();
+			_size -= next->size();
+			if (now < next->expires) {
+				wanted -= next->size();
+				res.push_back(next);
+			}
 		}
 	}
-	BOOST_ASSERT(_queue.empty() ? _size == 0 : _size > 0);
+	BOOST_ASSERT(empty() ? _size == 0 : _size > 0);
 	return res;
 }
 
@@ -214,26 +953,133 @@ size_t MessageQueue::size() const
 	return _size;
 }
 
+size_t MessageQueue::count(MessageQueue::Lane lane) const
+{
+	return _lanes[lane].count();
+}
+
 ConnectionStats::ConnectionStats(const TimerService::Ptr& ts) :
 	_ts(ts),
-	incomingMessagesCurrent(*_ts, "msgs/s", boost::posix_time::seconds(1), 0.2),
-	incomingBitrateCurrent(*_ts, "bit/s", boost::posix_time::seconds(1), 0.2),
-	outgoingMessagesCurrent(*_ts, "msgs/s", boost::posix_time::seconds(1), 0.2),
-	outgoingBitrateCurrent(*_ts, "bit/s", boost::posix_time::seconds(1), 0.2),
+	_sampler(StatsSampler::of(ts)),
+	incomingMessagesCurrent(_sampler, "msgs/s", 0.2),
+	incomingBitrateCurrent(_sampler, "bit/s", 0.2),
+	outgoingMessagesCurrent(_sampler, "msgs/s", 0.2),
+	outgoingBitrateCurrent(_sampler, "bit/s", 0.2),
 	incomingMessages("msgs"),
 	incomingBytes("bytes"),
 	outgoingMessages("msgs"),
-	outgoingBytes("bytes")
+	outgoingBytes("bytes"),
+	roundTripTime("ms"),
+	sendBandwidth("bit/s"),
+	sendWindow("bytes")
+{
+}
+
+ConnectionStats::Rates ConnectionStats::currentRates() const
+{
+	uint64_t values[4];
+	_sampler->read([&]() {
+		values[0] = incomingMessagesCurrent.value();
+		values[1] = incomingBitrateCurrent.value();
+		values[2] = outgoingMessagesCurrent.value();
+		values[3] = outgoingBitrateCurrent.value();
+	});
+	return Rates{
+		TypedValue(values[0], incomingMessagesCurrent.unit), TypedValue(values[1], incomingBitrateCurrent.unit),
+		TypedValue(values[2], outgoingMessagesCurrent.unit), TypedValue(values[3], outgoingBitrateCurrent.unit),
+	};
+}
+
+SendWindow::SendWindow(const ConnectionStats::Ptr& stats) :
+	_stats(stats),
+	_bandwidth(0),
+	_rtt(0),
+	_busyTime(0),
+	_busyBytes(0)
+{
+	publish();
+}
+
+void SendWindow::onWritten(size_t bytes, SendWindow::Clock::duration elapsed, bool backlogged)
+{
+	_busyTime += elapsed;
+	_busyBytes += bytes;
+	if (_busyTime < BANDWIDTH_SAMPLE_TIME) {
+		if (!backlogged) {
+			// Sender was idle, this says nothing about the link
+			_busyTime = Clock::duration(0);
+			_busyBytes = 0;
+		}
+		return;
+	}
+
+	double sample = _busyBytes / chrono::duration<double>(_busyTime).count();
+	if (!_bandwidth) {
+		_bandwidth = sample;
+	} else if (backlogged || sample > _bandwidth) {
+		_bandwidth += (sample - _bandwidth) * BANDWIDTH_GAIN;
+	}
+	_busyTime = Clock::duration(0);
+	_busyBytes = 0;
+	publish();
+}
+
+void SendWindow::onRoundTrip(SendWindow::Clock::duration rtt)
+{
+	double sample = chrono::duration<double>(rtt).count();
+	if (_rtt)
+		_rtt += (sample - _rtt) * RTT_GAIN;
+	else
+		_rtt = sample;
+	publish();
+}
+
+size_t SendWindow::bandwidth() const
+{
+	return _bandwidth;
+}
+
+size_t SendWindow::queueLimit() const
+{
+	if (!_bandwidth || !_rtt)
+		return SEND_BUF_DEFAULT;
+	size_t bdp = _bandwidth * _rtt * SEND_WINDOW_BDPS;
+	return std::min(std::max(bdp, SEND_BUF_MIN), SEND_BUF_MAX);
+}
+
+size_t SendWindow::emergencyLimit() const
+{
+	return queueLimit() + SEND_BUF_EMERGENCY_EXTRA;
+}
+
+size_t SendWindow::lowWaterMark() const
 {
+	return queueLimit() / 4;
 }
 
-Connection::Connection(asio::io_service & ioSvc, const ConnectionStats::Ptr& stats) :
+void SendWindow::publish()
+{
+	_stats->roundTripTime.set(_rtt * 1000);
+	_stats->sendBandwidth.set(_bandwidth * 8);
+	_stats->sendWindow.set(queueLimit());
+}
+
+Connection::Connection(asio::io_service & ioSvc, asio::io_service & netSvc, const ConnectionStats::Ptr& stats) :
 	_ioSvc(ioSvc),
+	_netSvc(netSvc),
 	_stats(stats),
 	_listening(true),
+	_reading(false),
 	_readWindow(NULL),
-	_sendWaiting(0),
-	_errors(0)
+	_readWindowSize(MAX_MSG),
+	_cipherWorkers(NULL),
+	_errors(0),
+	_received(std::make_shared<ReceivedList>()),
+	_receivedBytes(0),
+	_parsePending(false),
+	_msgPool(std::make_shared<MessagePool>()),
+	_sndWindow(stats),
+	_sendWaiting(0)
 {
 }
 
@@ -245,40 +1091,94 @@ Connection::Pointer Connection::create(asio::io_service& ioSvc, const Connection
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr< asio::ip::tcp::socket >& socket)
 {
-	Pointer c(new ConnectionImpl<asio::ip::tcp>(ioSvc, stats, socket));
+	return create(ioSvc, ioSvc, stats, socket);
+}
+
+Connection::Pointer Connection::create(asio::io_service& ioSvc, asio::io_service& netSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr< asio::ip::tcp::socket >& socket)
+{
+	Pointer c(new ConnectionImpl<asio::ip::tcp>(ioSvc, netSvc, stats, socket));
 	c->tryRead();
 	return c;
 }
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, const ConnectionStats::Ptr& stats, const asio::local::stream_protocol::endpoint& addr)  {
-	Pointer c(new ConnectionImpl<asio::local::stream_protocol>(ioSvc, stats, addr));
+	Pointer c(new LocalConnection(ioSvc, stats, addr));
 	c->tryRead();
 	return c;
 }
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr< asio::local::stream_protocol::socket >& socket)
 {
-	Pointer c(new ConnectionImpl<asio::local::stream_protocol>(ioSvc, stats, socket));
+	return create(ioSvc, ioSvc, stats, socket);
+}
+
+Connection::Pointer Connection::create(asio::io_service& ioSvc, asio::io_service& netSvc, const ConnectionStats::Ptr& stats, const std::shared_ptr< asio::local::stream_protocol::socket >& socket)
+{
+	Pointer c(new LocalConnection(ioSvc, netSvc, stats, socket));
 	c->tryRead();
 	return c;
 }
 
+void Connection::tryRead()
+{
+	if (_listening && !_reading) {
+		_reading = true;
+		auto self = shared_from_this();
+		onNet([self]() {
+			self->startRead();
+		});
+	}
+}
+
+void Connection::startRead()
+{
+	if (_parsePending) {
+		// Messages left in the buffer after a handshake
+		_parsePending = false;
+		parseReceived();
+	} else {
+		readSome();
+	}
+}
+
 void Connection::onRead(const boost::system::error_code& err, size_t count)
 {
 	if (err || (count == 0)) {
-		close();
-		return;
+		auto self = shared_from_this();
+		onControl([self]() {
+			self->close();
+		});
+	} else {
+		auto self = shared_from_this();
+		decrypt(_readWindow, count, [self, count]() {
+			self->onDecrypted(count);
+		});
+	}
+}
+
+void Connection::onDecrypted(size_t count)
+{
+	_rcvBuf.charge(count);
+	if (threaded()) {
+		_receivedBytes += count;
 	} else {
-		decrypt(_rcvBuf.ptr+_rcvBuf.size, count);
-		_rcvBuf.charge(count);
 		_stats->incomingBitrateCurrent += count*8;
 		_stats->incomingBytes += count;
 	}
+	parseReceived();
+}
 
-	google::protobuf::io::CodedInputStream stream((::google::protobuf::uint8*)_rcvBuf.ptr, _rcvBuf.size);
+/**
+ * Parses messages in _rcvBuf, on _netSvc. Unless threaded(), they are dispatched right away. Otherwise
+ * they are passed to deliver() in one batch, and reading resumes when it is done. The batch is cut after
+ * handshakes, since they may change the decryption of what follows.
+ */
+void Connection::parseReceived()
+{
+	google::protobuf::io::CodedInputStream stream((::google::protobuf::uint8*)_rcvBuf.data(), _rcvBuf.left());
 	bool res = true;
 	size_t msgs_processed(0);
-	while (res) {
+	while (res && !_parsePending) {
 		uint32_t tag = stream.ReadTag();
 		if (tag == 0)
 			break;
@@ -292,40 +1192,90 @@ void Connection::onRead(const boost::system::error_code& err, size_t count)
 		case ReadRequest:
 			res = dequeue<bithorde::Read::Request>(ReadRequest, stream); msgs_processed++; break;
 		case ReadResponse:
-			res = dequeue<bithorde::Read::Response>(ReadResponse, stream); msgs_processed++; break;
+			res = dequeue<bithorde::Read::Response>(ReadResponse, stream, bithorde::Read::Response::kContentFieldNumber); msgs_processed++; break;
 		case BindWrite:
 			res = dequeue<bithorde::BindWrite>(BindWrite, stream); msgs_processed++; break;
 		case DataSegment:
-			res = dequeue<bithorde::DataSegment>(DataSegment, stream); msgs_processed++; break;
+			res = dequeue<bithorde::DataSegment>(DataSegment, stream, bithorde::DataSegment::kContentFieldNumber); msgs_processed++; break;
 		case HandShakeConfirmed:
 			res = dequeue<bithorde::HandShakeConfirmed>(HandShakeConfirmed, stream); msgs_processed++; break;
 		case Ping:
 			res = dequeue<bithorde::Ping>(Ping, stream); msgs_processed++; break;
+		case Credit:
+			res = dequeue<bithorde::Credit>(Credit, stream); msgs_processed++; break;
+		case ReadStream:
+			res = dequeue<bithorde::Read::Stream>(ReadStream, stream); msgs_processed++; break;
+		case SharedMemory:
+			res = dequeue<bithorde::SharedMemory>(SharedMemory, stream); msgs_processed++; break;
+		case LocalFile:
+			res = dequeue<bithorde::LocalFile>(LocalFile, stream); msgs_processed++; break;
+		case BindReadBatch:
+			res = dequeue<bithorde::BindReadBatch>(BindReadBatch, stream); msgs_processed++; break;
+		case AssetStatusBatch:
+			res = dequeue<bithorde::AssetStatusBatch>(AssetStatusBatch, stream); msgs_processed++; break;
 		default:
 			cerr << _logTag << ": BitHorde protocol warning: unknown message tag" << endl;
 			if (++_errors > MAX_ERRORS) {
 				cerr << _logTag << ": Excessive errors. Closing." << endl;
-				return close();
+				auto self = shared_from_this();
+				return onControl([self]() {
+					self->close();
+				});
 			}
 			res = ::google::protobuf::internal::WireFormatLite::SkipMessage(&stream);
 		}
 	}
 
-	if (msgs_processed && _keepAlive) {
+	if (msgs_processed)
 		_errors = 0;
-		_keepAlive->reset();
-	}
 	_readWindow = NULL;
 	_rcvBuf.pop();
 
+	if (!threaded()) {
+		if (msgs_processed && _keepAlive)
+			_keepAlive->reset();
+		_reading = false;
+		tryRead();
+	} else if (_received->empty()) {
+		// Nothing complete yet, no need to bother the controller
+		readSome();
+	} else {
+		auto self = shared_from_this();
+		auto received = _received;
+		auto bytes = _receivedBytes;
+		_received = std::make_shared<ReceivedList>();
+		_receivedBytes = 0;
+		_ioSvc.post([self, received, bytes]() {
+			self->deliver(received, bytes);
+		});
+	}
+}
+
+/**
+ * Dispatches messages parsed on _netSvc, on _ioSvc
+ */
+void Connection::deliver(const std::shared_ptr<ReceivedList>& received, size_t bytes)
+{
+	_stats->incomingBitrateCurrent += bytes*8;
+	_stats->incomingBytes += bytes;
+	for (auto iter=received->begin(); iter != received->end(); iter++) {
+		_stats->incomingMessages += 1;
+		_stats->incomingMessagesCurrent += 1;
+		_dispatch(iter->type, *iter->msg, iter->payload);
+	}
+	if (_keepAlive)
+		_keepAlive->reset();
+	_reading = false;
 	tryRead();
-	return;
 }
 
 template <class T>
-bool Connection::dequeue(MessageType type, ::google::protobuf::io::CodedInputStream &stream) {
+bool Connection::dequeue(MessageType type, ::google::protobuf::io::CodedInputStream &stream, uint32_t payloadField) {
 	bool res;
-	T msg;
+	std::shared_ptr<T> parsed;
+	T local;
+	T& msg = threaded() ? *(parsed = std::make_shared<T>()) : local;
+	IBuffer::Ptr payload;
 
 	uint32_t length;
 	if (!stream.ReadVarint32(&length)) return false;
@@ -334,22 +1284,95 @@ bool Connection::dequeue(MessageType type, ::google::protobuf::io::CodedInputStr
 	int32_t leftInBuffer = bytesLeft-length;
 	if (leftInBuffer < 0) return false;
 
-	_stats->incomingMessages += 1;
-	_stats->incomingMessagesCurrent += 1;
-	::google::protobuf::io::CodedInputStream::Limit limit = stream.PushLimit(length);
-	if ((res = msg.MergePartialFromCodedStream(&stream))) {
+	if (payloadField) {
+		const void* start = NULL;
+		int available;
+		stream.GetDirectBufferPointer(&start, &available);
+		res = parse(msg, static_cast<const byte*>(start), length, payloadField, payload) && stream.Skip(length);
+	} else {
+		::google::protobuf::io::CodedInputStream::Limit limit = stream.PushLimit(length);
+		res = msg.MergePartialFromCodedStream(&stream);
+		stream.PopLimit(limit);
+	}
+	if (res) {
 		_rcvBuf.consume(_rcvBuf.left() - leftInBuffer);
-		_dispatch(type, msg);
+		if (parsed) {
+			_received->push_back(Received{type, parsed, payload});
+			_parsePending = (type == HandShake) || (type == HandShakeConfirmed);
+		} else {
+			_stats->incomingMessages += 1;
+			_stats->incomingMessagesCurrent += 1;
+			_dispatch(type, msg, payload);
+		}
 	}
-	stream.PopLimit(limit);
 
 	return res;
 }
 
+/**
+ * Parses /length/ bytes at /start/ into /msg/, except for the bytes-field /payloadField/, which
+ * is instead returned as a slice of _rcvBuf. Fields on either side of the payload are merged
+ * separately, which is equivalent to parsing them together.
+ */
+bool Connection::parse(::google::protobuf::Message& msg, const byte* start, uint32_t length, uint32_t payloadField, IBuffer::Ptr& payload)
+{
+	typedef ::google::protobuf::io::CodedInputStream CodedInputStream;
+	typedef ::google::protobuf::internal::WireFormatLite WireFormatLite;
+	const auto payloadTag = WireFormatLite::MakeTag(payloadField, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+
+	CodedInputStream scan(start, length);
+	while (true) {
+		const int fieldStart = scan.CurrentPosition();
+		const uint32_t tag = scan.ReadTag();
+		if (tag == 0) {
+			break;
+		} else if (tag == payloadTag) {
+			uint32_t payloadSize;
+			if (!scan.ReadVarint32(&payloadSize))
+				return false;
+			const int payloadStart = scan.CurrentPosition();
+			if (!scan.Skip(payloadSize))
+				return false;
+			const int payloadEnd = scan.CurrentPosition();
+
+			CodedInputStream head(start, fieldStart);
+			CodedInputStream tail(start + payloadEnd, length - payloadEnd);
+			if (!msg.MergePartialFromCodedStream(&head) || !msg.MergePartialFromCodedStream(&tail))
+				return false;
+			payload = _rcvBuf.slice(start + payloadStart, payloadSize);
+			return true;
+		} else if (!WireFormatLite::SkipField(&scan, tag)) {
+			return false;
+		}
+	}
+
+	// No payload present, parse as usual
+	CodedInputStream whole(start, length);
+	return msg.MergePartialFromCodedStream(&whole);
+}
+
 void Connection::setCallback(const Connection::Callback& cb) {
 	_dispatch = cb;
 }
 
+void Connection::setCipherWorkers(asio::io_service* workers)
+{
+	auto self = shared_from_this();
+	onNet([self, workers]() {
+		self->_cipherWorkers = workers;
+	});
+}
+
+void Connection::setMaxChunkSize(size_t bytes)
+{
+	// A whole message should fit in one window, or the receive-buffer is regrown for each read
+	auto windowSize = std::max(MAX_MSG, std::min(bytes, MAX_CHUNK_SIZE) + MSG_OVERHEAD);
+	auto self = shared_from_this();
+	onNet([self, windowSize]() {
+		self->_readWindowSize = windowSize;
+	});
+}
+
 void Connection::setKeepalive(Keepalive* value)
 {
 	_keepAlive.reset(value);
@@ -365,9 +1388,69 @@ void Connection::setLogTag(const std::string& tag)
 	_logTag = tag;
 }
 
+/**
+ * Bulk data goes in the bulk lane. Everything else is small, and latency-sensitive.
+ */
+static MessageQueue::Lane laneOf(Connection::MessageType type, bool prioritized)
+{
+	switch (type) {
+	case Connection::ReadResponse:
+	case Connection::DataSegment:
+		return prioritized ? MessageQueue::CONTROL : MessageQueue::BULK;
+	default:
+		return MessageQueue::CONTROL;
+	}
+}
+
 bool Connection::sendMessage(Connection::MessageType type, const google::protobuf::Message& msg, const Message::Deadline& expires, bool prioritized)
 {
-	size_t bufLimit = prioritized ? SEND_BUF_EMERGENCY : SEND_BUF;
+	if (!hasRoom(prioritized))
+		return false;
+
+	auto buf = _msgPool->acquire(expires);
+	buf->encode(type, msg);
+	enqueue(buf, laneOf(type, prioritized));
+	return true;
+}
+
+bool Connection::sendMessage(Connection::MessageType type, const google::protobuf::Message& msg, uint32_t payloadField, const IBuffer::Ptr& payload, const Message::Deadline& expires, bool prioritized)
+{
+	if (!hasRoom(prioritized))
+		return false;
+
+	auto buf = _msgPool->acquire(expires);
+	buf->encode(type, msg, payloadField, payload);
+	enqueue(buf, laneOf(type, prioritized));
+	return true;
+}
+
+bool Connection::sendMessage(Connection::MessageType type, const google::protobuf::Message& msg, const std::vector<int>& fds, const std::shared_ptr<const void>& fdOwner, const Message::Deadline& expires, bool prioritized)
+{
+	BOOST_ASSERT(canPassFds());
+	if (!hasRoom(prioritized))
+		return false;
+
+	auto buf = _msgPool->acquire(expires);
+	buf->encode(type, msg);
+	buf->fds = fds;
+	buf->fdOwner = fdOwner;
+	enqueue(buf, laneOf(type, prioritized));
+	return true;
+}
+
+bool Connection::canSend() const
+{
+	return _sndQueue.size() <= _sndWindow.queueLimit();
+}
+
+bool Connection::sending() const
+{
+	return _sendWaiting || !_sndQueue.empty();
+}
+
+bool Connection::hasRoom(bool prioritized)
+{
+	size_t bufLimit = prioritized ? _sndWindow.emergencyLimit() : _sndWindow.queueLimit();
 	if (_sndQueue.size() > bufLimit) {
 		if (prioritized) {
 			cerr << _logTag << ": Prioritized overflow. Closing." << endl;
@@ -375,17 +1458,12 @@ bool Connection::sendMessage(Connection::MessageType type, const google::protobu
 		}
 		return false;
 	}
+	return true;
+}
 
-	std::shared_ptr<Message> buf(new Message(expires));
-	// Encode
-	{
-		::google::protobuf::io::StringOutputStream of(&buf->buf);
-		::google::protobuf::io::CodedOutputStream stream(&of);
-		stream.WriteTag(::google::protobuf::internal::WireFormatLite::MakeTag(type, ::google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
-		stream.WriteVarint32(msg.ByteSize());
-		BOOST_VERIFY( msg.SerializeToCodedStream(&stream) );
-	}
-	_sndQueue.enqueue(buf);
+void Connection::enqueue(const std::shared_ptr<Message>& msg, MessageQueue::Lane lane)
+{
+	_sndQueue.enqueue(msg, lane);
 
 	_stats->outgoingMessages += 1;
 	_stats->outgoingMessagesCurrent += 1;
@@ -393,7 +1471,6 @@ bool Connection::sendMessage(Connection::MessageType type, const google::protobu
 	// Push out at once unless _queued;
 	if (_sendWaiting == 0)
 		trySend();
-	return true;
 }
 
 void Connection::setListening ( bool listening ) {
@@ -406,16 +1483,47 @@ void Connection::setListening ( bool listening ) {
 	}
 }
 
-void Connection::onWritten(const boost::system::error_code& err, size_t written, const MessageQueue::MessageList& queued) {
+void Connection::onRoundTrip(const chrono::steady_clock::duration& rtt)
+{
+	_sndWindow.onRoundTrip(rtt);
+}
+
+bool Connection::canPassFds() const
+{
+	return false;
+}
+
+std::vector<int> Connection::takeFds(size_t count)
+{
+	return std::vector<int>();
+}
+
+bool Connection::startSharedMemory(size_t ringSize)
+{
+	return false;
+}
+
+bool Connection::onSharedMemory(const bithorde::SharedMemory& msg)
+{
+	return false;
+}
+
+bool Connection::sharedMemory() const
+{
+	return false;
+}
+
+void Connection::onWritten(const boost::system::error_code& err, size_t written, const MessageQueue::MessageList& queued, const chrono::steady_clock::time_point& started) {
 	size_t queued_bytes(0);
 	for (auto iter=queued.begin(); iter != queued.end(); iter++) {
-		queued_bytes += (*iter)->buf.size();
+		queued_bytes += (*iter)->size();
 	}
 	if ((!err) && (written == queued_bytes) && (written>0)) {
 		_stats->outgoingBitrateCurrent += written*8;
 		_stats->outgoingBytes += written;
+		_sndWindow.onWritten(written, chrono::steady_clock::now() - started, !_sndQueue.empty());
 		trySend();
-		if (_sndQueue.size() < SEND_BUF_LOW_WATER_MARK)
+		if (_sndQueue.size() < _sndWindow.lowWaterMark())
 			writable();
 	} else {
 		if (err == boost::system::errc::broken_pipe) {
@@ -10,8 +10,12 @@
 #include <functional>
 #include <memory>
 #include <list>
+#include <mutex>
+#include <vector>
 
 #include "bithorde.pb.h"
+#include "buffer.hpp"
+#include "cipher.h"
 #include "counter.h"
 #include "timer.h"
 #include "types.h"
@@ -27,17 +31,83 @@ struct Message {
 	static Deadline in(int msec);
 
 	Message(Deadline expires);
+
+	/**
+	 * Encodes /msg/ as a length-delimited field /tag/ of the stream into buf.
+	 */
+	void encode(uint32_t tag, const ::google::protobuf::Message& msg);
+
+	/**
+	 * Like encode(tag, msg), but with /payload/ appended as the bytes-field /payloadField/
+	 * of /msg/. Only the framing is written into buf, the payload itself is sent by
+	 * reference and must not be modified until the message is written. /payloadField/
+	 * must be unset in /msg/, and should be its highest-numbered field.
+	 */
+	void encode(uint32_t tag, const ::google::protobuf::Message& msg, uint32_t payloadField, const IBuffer::Ptr& payload);
+
+	/**
+	 * Total bytes on the wire, framing and payload included.
+	 */
+	std::size_t size() const;
+
 	std::string buf; // TODO: test if ostringstream faster
+	IBuffer::Ptr payload;
+	std::vector<int> fds; // Passed along with the message over local sockets
+	std::shared_ptr<const void> fdOwner; // Keeps /fds/ open until the message is released
+
 	boost::chrono::steady_clock::time_point expires;
 };
 
+/**
+ * Recycles Message-objects, so that their encoding-buffers keep their allocated capacity.
+ * Messages are returned to the pool when the last reference is dropped. Connections see to that
+ * happening on the io_service sending them, as dropping payloads there is not thread-safe.
+ */
+class MessagePool : public std::enable_shared_from_this<MessagePool> {
+	mutable std::mutex _mutex;
+	std::vector<Message*> _free;
+public:
+	typedef std::shared_ptr<MessagePool> Ptr;
+
+	MessagePool() {}
+	MessagePool( const MessagePool& ) = delete;
+	~MessagePool();
+
+	std::shared_ptr<Message> acquire(Message::Deadline expires);
+	std::size_t pooled() const;
+private:
+	void release(Message* msg);
+};
+
 class MessageQueue {
 public:
 	MessageQueue( const MessageQueue& ) = delete;
 	typedef std::shared_ptr<const Message> MessagePtr;
 	typedef std::vector< MessagePtr > MessageList;
+
+	/**
+	 * Control-messages are always dequeued ahead of bulk-messages.
+	 */
+	enum Lane {
+		CONTROL = 0,
+		BULK = 1,
+	};
 private:
-	std::list< MessagePtr > _queue;
+	/**
+	 * FIFO of messages in a power-of-two ring, doubling when full.
+	 */
+	class Ring {
+		std::vector< MessagePtr > _slots;
+		std::size_t _head, _count;
+	public:
+		Ring();
+		bool empty() const { return _count == 0; }
+		std::size_t count() const { return _count; }
+		const MessagePtr& front() const { return _slots[_head]; }
+		void push_back(const MessagePtr& msg);
+		MessagePtr pop_front();
+	};
+	Ring _lanes[2];
 	std::size_t _size;
 public:
 	MessageQueue();
@@ -46,26 +116,101 @@ public:
 	/**
 	 * Note: queue takes ownership of the message
 	 */
-	void enqueue(const MessagePtr& msg);
+	void enqueue(const MessagePtr& msg, Lane lane=BULK);
 
 	/**
+	 * Dequeues roughly /millis/ worth of messages at /bytes_per_sec/, but at least one message unless
+	 * empty. Expired messages are dropped on the way.
+	 *
 	 * Note: relinquishes ownership of the messages
 	 */
 	MessageList dequeue(std::size_t bytes_per_sec, ushort millis);
+
+	/**
+	 * Queued bytes, in all lanes
+	 */
 	std::size_t size() const;
+
+	/**
+	 * Queued messages in /lane/
+	 */
+	std::size_t count(Lane lane) const;
 };
 
 class ConnectionStats {
 	TimerService::Ptr _ts;
+	StatsSampler::Ptr _sampler;
 public:
 	typedef std::shared_ptr<ConnectionStats> Ptr;
 
-	LazyCounter incomingMessagesCurrent, incomingBitrateCurrent;
-	LazyCounter outgoingMessagesCurrent, outgoingBitrateCurrent;
+	RateCounter incomingMessagesCurrent, incomingBitrateCurrent;
+	RateCounter outgoingMessagesCurrent, outgoingBitrateCurrent;
 	Counter incomingMessages, incomingBytes;
 	Counter outgoingMessages, outgoingBytes;
 
+	// Estimated by SendWindow
+	Gauge roundTripTime, sendBandwidth, sendWindow;
+
 	ConnectionStats(const TimerService::Ptr& ts);
+
+	struct Rates {
+		TypedValue incomingMessages, incomingBitrate;
+		TypedValue outgoingMessages, outgoingBitrate;
+	};
+
+	/**
+	 * The current rates, all from the same sample
+	 */
+	Rates currentRates() const;
+};
+
+/**
+ * Sizes the send-queue of a connection after its bandwidth-delay product.
+ *
+ * Bandwidth is measured over periods where the connection is backlogged, from the rate at
+ * which writes complete. Round-trip time is measured from Ping-replies. Until both are known,
+ * the limits default to what a 1MB send-buffer gives.
+ */
+class SendWindow {
+public:
+	typedef boost::chrono::steady_clock Clock;
+private:
+	ConnectionStats::Ptr _stats;
+	double _bandwidth; // bytes/s
+	double _rtt; // s
+	Clock::duration _busyTime;
+	std::size_t _busyBytes;
+public:
+	SendWindow(const ConnectionStats::Ptr& stats);
+
+	/**
+	 * A write of /bytes/ completed /elapsed/ after being started. If /backlogged/, more data was
+	 * waiting for the write to complete.
+	 */
+	void onWritten(std::size_t bytes, Clock::duration elapsed, bool backlogged);
+	void onRoundTrip(Clock::duration rtt);
+
+	/**
+	 * Estimated bytes/s, or 0 if unknown
+	 */
+	std::size_t bandwidth() const;
+
+	/**
+	 * Regular messages are refused when more than this many bytes are queued
+	 */
+	std::size_t queueLimit() const;
+
+	/**
+	 * Prioritized messages are refused when more than this many bytes are queued
+	 */
+	std::size_t emergencyLimit() const;
+
+	/**
+	 * The connection signals writable when queue drains below this
+	 */
+	std::size_t lowWaterMark() const;
+private:
+	void publish();
 };
 
 class Connection
@@ -82,21 +227,50 @@ public:
 		DataSegment = 8,
 		HandShakeConfirmed = 9,
 		Ping = 10,
+		Credit = 11,
+		ReadStream = 12,
+		SharedMemory = 13,
+		LocalFile = 14,
+		BindReadBatch = 15,
+		AssetStatusBatch = 16,
 	};
 
 	typedef std::shared_ptr<Connection> Pointer;
-	typedef std::function<void(MessageType, const ::google::protobuf::Message&)> Callback;
+	/**
+	 * Receives parsed messages. For ReadResponse and DataSegment, the content-field is left out of the
+	 * message, and passed as /payload/ instead; a view into the receive-buffer.
+	 */
+	typedef std::function<void(MessageType, const ::google::protobuf::Message&, const IBuffer::Ptr& payload)> Callback;
 
 	static Pointer create(boost::asio::io_service& ioSvc, const bithorde::ConnectionStats::Ptr& stats, const boost::asio::ip::tcp::endpoint& addr);
 	static Pointer create(boost::asio::io_service& ioSvc, const bithorde::ConnectionStats::Ptr& stats, const std::shared_ptr< boost::asio::ip::tcp::socket >& socket);
 	static Pointer create(boost::asio::io_service& ioSvc, const bithorde::ConnectionStats::Ptr& stats, const boost::asio::local::stream_protocol::endpoint& addr);
 	static Pointer create(boost::asio::io_service& ioSvc, const bithorde::ConnectionStats::Ptr& stats, const std::shared_ptr< boost::asio::local::stream_protocol::socket >& socket);
 
+	/**
+	 * Like above, but with /socket/ belonging to /netSvc/. Socket I/O, ciphering and parsing then runs
+	 * on /netSvc/, while messages are still sent and dispatched on /ioSvc/. /netSvc/ must be run by a
+	 * single thread.
+	 */
+	static Pointer create(boost::asio::io_service& ioSvc, boost::asio::io_service& netSvc, const bithorde::ConnectionStats::Ptr& stats, const std::shared_ptr< boost::asio::ip::tcp::socket >& socket);
+	static Pointer create(boost::asio::io_service& ioSvc, boost::asio::io_service& netSvc, const bithorde::ConnectionStats::Ptr& stats, const std::shared_ptr< boost::asio::local::stream_protocol::socket >& socket);
+
 	virtual void setEncryption(bithorde::CipherType t, const std::string& key, const std::string& iv) = 0;
 	virtual void setDecryption(bithorde::CipherType t, const std::string& key, const std::string& iv) = 0;
 	void setCallback(const Callback& cb);
 	void setKeepalive(Keepalive* keepalive);
 
+	/**
+	 * Offload encryption and decryption of larger batches to threads running /workers/.
+	 * NULL processes everything on the io_service of the socket.
+	 */
+	void setCipherWorkers(boost::asio::io_service* workers);
+
+	/**
+	 * Size the receive-window for messages with up to /bytes/ of content, as negotiated with the peer.
+	 */
+	void setMaxChunkSize(std::size_t bytes);
+
 	typedef boost::signals2::signal<void ()> VoidSignal;
 	VoidSignal disconnected;
 	VoidSignal writable;
@@ -105,36 +279,137 @@ public:
 	void setLogTag(const std::string& tag);
 
 	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, const Message::Deadline& expires, bool prioritized);
+	/**
+	 * Sends /msg/ with /payload/ as it's bytes-field /payloadField/, without copying the payload.
+	 */
+	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, uint32_t payloadField, const IBuffer::Ptr& payload, const Message::Deadline& expires, bool prioritized);
+	/**
+	 * Sends /msg/ with /fds/ passed along, kept open by /fdOwner/ until written. Requires canPassFds().
+	 */
+	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, const std::vector<int>& fds, const std::shared_ptr<const void>& fdOwner, const Message::Deadline& expires, bool prioritized);
+
+	/**
+	 * True if a regular message would currently be accepted by sendMessage
+	 */
+	bool canSend() const;
+
+	/**
+	 * True while messages are queued, or being written
+	 */
+	bool sending() const;
 
 	void setListening(bool listening);
 
+	/**
+	 * Feeds a measured round-trip time to the send-window
+	 */
+	void onRoundTrip(const boost::chrono::steady_clock::duration& rtt);
+
 	virtual void close() = 0;
 
+	/**
+	 * True if file-descriptors can be passed to the peer, as over local sockets
+	 */
+	virtual bool canPassFds() const;
+
+	/**
+	 * Takes /count/ descriptors passed by the peer, in the order received. Each message carrying
+	 * descriptors must take them as it is handled, or later messages get the wrong ones. Returns
+	 * fewer if not received.
+	 */
+	virtual std::vector<int> takeFds(std::size_t count);
+
+	/**
+	 * Offers the peer to switch to a shared-memory transport with rings of /ringSize/ bytes, through
+	 * a SharedMemory-message. Returns false if the transport could not be set up here.
+	 */
+	virtual bool startSharedMemory(std::size_t ringSize);
+
+	/**
+	 * Handles a SharedMemory-message from the peer; either an offer, which is set up and answered, or
+	 * the answer to our own offer. Returns false if it could not be handled, and the connection is
+	 * unusable.
+	 */
+	virtual bool onSharedMemory(const bithorde::SharedMemory& msg);
+
+	/**
+	 * True once both directions go through shared memory
+	 */
+	virtual bool sharedMemory() const;
+
 	void onRead(const boost::system::error_code& err, size_t count);
-	void onWritten(const boost::system::error_code& err, std::size_t written, const MessageQueue::MessageList& queued);
+	/**
+	 * /queued/ was written, as far as /written/, in a write started on _netSvc at /started/
+	 */
+	void onWritten(const boost::system::error_code& err, std::size_t written, const MessageQueue::MessageList& queued, const boost::chrono::steady_clock::time_point& started);
 
 protected:
-	Connection(boost::asio::io_service& ioSvc, const bithorde::ConnectionStats::Ptr& stats);
+	Connection(boost::asio::io_service& ioSvc, boost::asio::io_service& netSvc, const bithorde::ConnectionStats::Ptr& stats);
 
 	virtual void trySend() = 0;
-	virtual void tryRead() = 0;
-	virtual void decrypt(byte* buf, size_t size) = 0;
+	void tryRead();
+	/**
+	 * Issues a read into _readWindow, on _netSvc
+	 */
+	virtual void readSome() = 0;
+	/**
+	 * Decrypts /size/ received bytes in place, possibly on another thread, calling /done/ on
+	 * _netSvc when finished.
+	 */
+	virtual void decrypt(byte* buf, size_t size, const std::function<void()>& done) = 0;
+	void onDecrypted(size_t count);
+
+	/**
+	 * Runs /f/ on _netSvc, or on _ioSvc. Inline if already there.
+	 */
+	template <typename F> void onNet(const F& f);
+	template <typename F> void onControl(const F& f);
+	bool threaded() const { return &_netSvc != &_ioSvc; }
 
 protected:
 	boost::asio::io_service& _ioSvc;
+	boost::asio::io_service& _netSvc;
 	Callback _dispatch;
 	ConnectionStats::Ptr _stats;
 	std::unique_ptr<Keepalive> _keepAlive;
 	std::string _logTag;
 
 	bool _listening;
+	bool _reading;
+
+	// Owned by _netSvc
 	byte* _readWindow;
-	Buffer _rcvBuf;
+	size_t _readWindowSize;
+	boost::asio::io_service* _cipherWorkers;
+	ReceiveBuffer _rcvBuf;
+	uint32_t _errors;
+
+	/**
+	 * Messages parsed on _netSvc, waiting to be dispatched on _ioSvc
+	 */
+	struct Received {
+		MessageType type;
+		std::shared_ptr< ::google::protobuf::Message > msg;
+		IBuffer::Ptr payload;
+	};
+	typedef std::vector<Received> ReceivedList;
+	std::shared_ptr<ReceivedList> _received;
+	size_t _receivedBytes;
+	bool _parsePending;
+
+	MessagePool::Ptr _msgPool;
 	MessageQueue _sndQueue;
+	SendWindow _sndWindow;
 	size_t _sendWaiting;
-	uint32_t _errors;
 private:
-	template <class T> bool dequeue(MessageType type, ::google::protobuf::io::CodedInputStream &stream);
+	void startRead();
+	void parseReceived();
+	void deliver(const std::shared_ptr<ReceivedList>& received, size_t bytes);
+	template <class T> bool dequeue(MessageType type, ::google::protobuf::io::CodedInputStream &stream, uint32_t payloadField=0);
+	bool parse(::google::protobuf::Message& msg, const byte* start, uint32_t length, uint32_t payloadField, IBuffer::Ptr& payload);
+	bool hasRoom(bool prioritized);
+protected:
+	void enqueue(const std::shared_ptr<Message>& msg, MessageQueue::Lane lane);
 };
 
 }
@@ -16,12 +16,19 @@
 
 #include "counter.h"
 
+#include <algorithm>
+#include <cmath>
 #include <functional>
+#include <map>
 
 TypedValue::TypedValue(const std::string& unit)
 	: _value(0), unit(unit)
 {}
 
+TypedValue::TypedValue(uint64_t value, const std::string& unit)
+	: _value(value), unit(unit)
+{}
+
 uint64_t TypedValue::value() const
 {
 	return _value;
@@ -55,6 +62,15 @@ uint64_t Counter::reset()
 	return res;
 }
 
+Gauge::Gauge(const std::string& unit)
+	: TypedValue(unit)
+{}
+
+uint64_t Gauge::set(uint64_t value)
+{
+	return _value = value;
+}
+
 InertialValue::InertialValue(float inertia, const std::string& unit)
 	: TypedValue(unit), _inertia(inertia)
 {}
@@ -64,19 +80,166 @@ uint64_t InertialValue::post(uint64_t amount)
 	return _value = (amount * (1.0-_inertia)) + (_value * (_inertia));
 }
 
-LazyCounter::LazyCounter(TimerService& ts, const std::string& unit, const boost::posix_time::time_duration& granularity, float falloff)
-	: Counter(unit), _timer(ts, std::bind(&LazyCounter::tick, this), granularity), _value(falloff, unit)
+static std::size_t latencyBucket(uint64_t value)
+{
+	if (value < 4)
+		return value;
+	unsigned exp = 63 - __builtin_clzll(value);
+	auto res = 4*(exp-1) + ((value >> (exp-2)) & 3);
+	return std::min<std::size_t>(res, LatencyHistogram::BUCKETS-1);
+}
+
+static uint64_t latencyBucketCeiling(std::size_t bucket)
+{
+	if (bucket < 4)
+		return bucket;
+	unsigned exp = bucket/4 + 1;
+	return ((4 + bucket%4 + 1) << (exp-2)) - 1;
+}
+
+LatencyHistogram::LatencyHistogram(const std::string& unit, uint32_t halfLife)
+	: _count(0), _timeouts(0), _sinceDecay(0), _halfLife(halfLife), unit(unit)
+{
+	std::fill(_buckets, _buckets+BUCKETS, 0);
+}
+
+void LatencyHistogram::post(uint64_t value)
+{
+	_buckets[latencyBucket(value)]++;
+	_count++;
+	age();
+}
+
+void LatencyHistogram::timedOut()
+{
+	_timeouts++;
+	age();
+}
+
+void LatencyHistogram::age()
 {
+	if (++_sinceDecay >= _halfLife) {
+		_sinceDecay = 0;
+		_count = 0;
+		for (std::size_t i=0; i < BUCKETS; i++)
+			_count += (_buckets[i] /= 2);
+		_timeouts /= 2;
+	}
 }
 
-uint64_t LazyCounter::value() const
+uint64_t LatencyHistogram::percentile(float q) const
 {
-	return _value.value();
+	if (!_count)
+		return 0;
+	uint64_t rank = std::ceil(q * _count);
+	uint64_t seen = 0;
+	for (std::size_t i=0; i < BUCKETS; i++) {
+		seen += _buckets[i];
+		if (seen >= rank && seen)
+			return latencyBucketCeiling(i);
+	}
+	return latencyBucketCeiling(BUCKETS-1);
 }
 
-void LazyCounter::tick()
+uint32_t LatencyHistogram::count() const
 {
-	_value.post(reset());
+	return _count;
+}
+
+uint32_t LatencyHistogram::timeouts() const
+{
+	return _timeouts;
+}
+
+StatsSampler::StatsSampler(const TimerService::Ptr& ts, const boost::posix_time::time_duration& interval)
+	: _ts(ts), _timer(*ts, std::bind(&StatsSampler::tick, this), interval), _used(0), _seq(0)
+{
+}
+
+StatsSampler::Ptr StatsSampler::of(const TimerService::Ptr& ts)
+{
+	static std::mutex mutex;
+	static std::map< TimerService*, std::weak_ptr<StatsSampler> > samplers;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto iter = samplers.begin(); iter != samplers.end();) {
+		if (iter->second.expired())
+			iter = samplers.erase(iter);
+		else
+			iter++;
+	}
+	auto& slot = samplers[ts.get()];
+	auto res = slot.lock();
+	if (!res)
+		slot = res = std::make_shared<StatsSampler>(ts);
+	return res;
+}
+
+StatsSampler::Slot* StatsSampler::allocate(float falloff)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_free.empty()) {
+		_blocks.emplace_back(new Slot[BLOCK_SLOTS]);
+		auto block = _blocks.back().get();
+		for (auto i = BLOCK_SLOTS; i > 0; i--) {
+			block[i-1].used = false;
+			_free.push_back(&block[i-1]);
+		}
+	}
+	auto res = _free.back();
+	_free.pop_back();
+	res->pending.store(0, std::memory_order_relaxed);
+	res->rate.store(0, std::memory_order_relaxed);
+	res->falloff = falloff;
+	res->used = true;
+	_used++;
+	return res;
+}
+
+void StatsSampler::release(StatsSampler::Slot* slot)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	slot->used = false;
+	_free.push_back(slot);
+	_used--;
+}
+
+std::size_t StatsSampler::size() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _used;
+}
+
+void StatsSampler::tick()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto seq = _seq.load(std::memory_order_relaxed);
+	_seq.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (auto block = _blocks.begin(); block != _blocks.end(); block++) {
+		for (auto slot = block->get(); slot != block->get() + BLOCK_SLOTS; slot++) {
+			if (!slot->used)
+				continue;
+			auto amount = slot->pending.exchange(0, std::memory_order_relaxed);
+			auto rate = slot->rate.load(std::memory_order_relaxed);
+			slot->rate.store((amount * (1.0-slot->falloff)) + (rate * slot->falloff), std::memory_order_relaxed);
+		}
+	}
+	_seq.store(seq+2, std::memory_order_release);
+}
+
+RateCounter::RateCounter(const StatsSampler::Ptr& sampler, const std::string& unit, float falloff)
+	: TypedValue(unit), _sampler(sampler), _slot(sampler->allocate(falloff))
+{
+}
+
+RateCounter::~RateCounter()
+{
+	_sampler->release(_slot);
+}
+
+uint64_t RateCounter::value() const
+{
+	return _slot->rate.load(std::memory_order_relaxed);
 }
 
 std::ostream& operator<<(std::ostream& tgt, const TypedValue& v)
@@ -84,3 +247,9 @@ std::ostream& operator<<(std::ostream& tgt, const TypedValue& v)
 	tgt << v.value() << v.unit;
 	return tgt;
 }
+
+std::ostream& operator<<(std::ostream& tgt, const LatencyHistogram& h)
+{
+	tgt << "p50: " << h.percentile(0.5) << h.unit << ", p99: " << h.percentile(0.99) << h.unit << " (" << h.count() << " samples, " << h.timeouts() << " timed out)";
+	return tgt;
+}
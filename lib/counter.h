@@ -20,6 +20,8 @@
 
 #include "timer.h"
 
+#include <atomic>
+#include <mutex>
 #include <ostream>
 
 class TypedValue {
@@ -28,6 +30,8 @@ protected:
 public:
 	const std::string unit;
 	TypedValue(const std::string& unit);
+	TypedValue(uint64_t value, const std::string& unit);
+	virtual ~TypedValue() {}
 	virtual uint64_t value() const;
 	TypedValue autoScale() const;
 };
@@ -43,6 +47,16 @@ public:
 	uint64_t reset();
 };
 
+/**
+ * A value set directly, such as a measured or derived quantity.
+ */
+class Gauge : public TypedValue
+{
+public:
+	Gauge(const std::string& unit);
+	uint64_t set(uint64_t value);
+};
+
 class InertialValue : public TypedValue {
 	float _inertia; // How much is the current data wheighted
 	const std::string unit;
@@ -51,17 +65,126 @@ public:
 	uint64_t post(uint64_t amount);
 };
 
-class LazyCounter : public Counter
-{
+/**
+ * Distribution of latencies, in buckets spaced four to each power of two, so that percentiles are
+ * within 25% of the real value. Every /halfLife/ samples, all buckets are halved, so that the
+ * distribution follows a peer whose latency changes. Requests timing out are counted aside, since
+ * their latency is not known.
+ */
+class LatencyHistogram {
+public:
+	static const std::size_t BUCKETS = 64; // Values up to 128K
+private:
+	uint32_t _buckets[BUCKETS];
+	uint32_t _count;
+	uint32_t _timeouts;
+	uint32_t _sinceDecay;
+	const uint32_t _halfLife;
+public:
+	const std::string unit;
+	LatencyHistogram(const std::string& unit, uint32_t halfLife=1024);
+
+	void post(uint64_t value);
+
+	/**
+	 * Counts a request that got no answer in time, without posting a latency for it
+	 */
+	void timedOut();
+
+	/**
+	 * Upper bound of the bucket holding the /q/ quantile, or 0 if nothing has been posted
+	 */
+	uint64_t percentile(float q) const;
+
+	/**
+	 * Samples currently weighted into the distribution
+	 */
+	uint32_t count() const;
+
+	/**
+	 * Timeouts currently weighted in, decaying along with the samples
+	 */
+	uint32_t timeouts() const;
+private:
+	void age();
+};
+
+/**
+ * Samples all rate-counters sharing a TimerService on a single periodic tick, instead of one timer
+ * per counter. Counters are slots in a dense array, bumped lock-free from any thread, and folded
+ * into their inertial rate once per interval on the thread of the TimerService.
+ */
+class StatsSampler {
+public:
+	typedef std::shared_ptr<StatsSampler> Ptr;
+	struct Slot {
+		std::atomic<uint64_t> pending; // Since last tick
+		std::atomic<uint64_t> rate; // Per interval
+		float falloff;
+		bool used;
+	};
+private:
+	static const std::size_t BLOCK_SLOTS = 256;
+	TimerService::Ptr _ts;
 	PeriodicTimer _timer;
-	InertialValue _value;
+	mutable std::mutex _mutex; // Guards the slot-allocation, and the tick
+	std::vector< std::unique_ptr<Slot[]> > _blocks; // Blocks are never moved, once allocated
+	std::vector<Slot*> _free;
+	std::size_t _used;
+	std::atomic<uint64_t> _seq; // Odd while a tick is updating the rates
 public:
-	LazyCounter(TimerService& ts, const std::string& unit, const boost::posix_time::time_duration& granularity, float falloff);
-	virtual uint64_t value() const;
+	StatsSampler(const TimerService::Ptr& ts, const boost::posix_time::time_duration& interval=boost::posix_time::seconds(1));
+	StatsSampler(const StatsSampler&) = delete;
+
+	/**
+	 * The sampler shared by everything on /ts/, with one-second interval
+	 */
+	static Ptr of(const TimerService::Ptr& ts);
+
+	Slot* allocate(float falloff);
+	void release(Slot* slot);
+
+	/**
+	 * Number of counters registered
+	 */
+	std::size_t size() const;
+
+	/**
+	 * Runs /reader/ until it has seen rates all from the same tick. /reader/ may be run more than once.
+	 */
+	template <typename F>
+	void read(const F& reader) const {
+		uint64_t seq;
+		do {
+			seq = _seq.load(std::memory_order_acquire);
+			reader();
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while ((seq & 1) || (_seq.load(std::memory_order_relaxed) != seq));
+	}
 private:
 	void tick();
 };
 
+/**
+ * Rate of something counted, per sampling interval, as an inertial average. Increments are cheap and
+ * safe from any thread.
+ */
+class RateCounter : public TypedValue
+{
+	StatsSampler::Ptr _sampler;
+	StatsSampler::Slot* _slot;
+public:
+	RateCounter(const StatsSampler::Ptr& sampler, const std::string& unit, float falloff);
+	RateCounter(const RateCounter&) = delete;
+	virtual ~RateCounter();
+
+	void operator+=(uint64_t amount) {
+		_slot->pending.fetch_add(amount, std::memory_order_relaxed);
+	}
+	virtual uint64_t value() const;
+};
+
 std::ostream& operator<<(std::ostream& tgt, const TypedValue& c);
+std::ostream& operator<<(std::ostream& tgt, const LatencyHistogram& h);
 
 #endif // COUNTER_H
@@ -0,0 +1,177 @@
+#ifndef BITHORDE_FLATMAP_H
+#define BITHORDE_FLATMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+/**
+ * Map from integer keys, stored in a single array with open addressing and linear probing. Erasing
+ * shifts the rest of the probe-sequence back, instead of leaving tombstones, so lookups never have to
+ * step over dead entries.
+ *
+ * Iterators are invalidated by any insert or erase. To erase while iterating, collect the keys first.
+ */
+template <typename K, typename V>
+class FlatMap {
+public:
+	typedef K key_type;
+	typedef V mapped_type;
+	typedef std::pair<K, V> value_type;
+private:
+	struct Slot {
+		bool used;
+		value_type kv;
+		Slot() : used(false), kv() {}
+	};
+	std::vector<Slot> _slots; // Power-of-two sized
+	std::size_t _size;
+	unsigned _shift; // 64 - log2(_slots.size())
+
+	template <typename SlotT, typename ValueT>
+	class Iterator : public std::iterator<std::forward_iterator_tag, ValueT> {
+		friend class FlatMap;
+		template <typename, typename> friend class Iterator;
+		SlotT* _pos;
+		SlotT* _end;
+		void skip() {
+			while ((_pos != _end) && !_pos->used)
+				_pos++;
+		}
+	public:
+		Iterator(SlotT* pos, SlotT* end) : _pos(pos), _end(end) { skip(); }
+		template <typename S, typename T>
+		Iterator(const Iterator<S, T>& other) : _pos(other._pos), _end(other._end) {}
+		ValueT& operator*() const { return _pos->kv; }
+		ValueT* operator->() const { return &_pos->kv; }
+		Iterator& operator++() { _pos++; skip(); return *this; }
+		Iterator operator++(int) { auto res = *this; ++*this; return res; }
+		bool operator==(const Iterator& other) const { return _pos == other._pos; }
+		bool operator!=(const Iterator& other) const { return _pos != other._pos; }
+	};
+public:
+	typedef Iterator<Slot, value_type> iterator;
+	typedef Iterator<const Slot, const value_type> const_iterator;
+
+	FlatMap() : _size(0), _shift(64) {}
+
+	iterator begin() { return iterator(_slots.data(), _slots.data() + _slots.size()); }
+	iterator end() { return iterator(_slots.data() + _slots.size(), _slots.data() + _slots.size()); }
+	const_iterator begin() const { return const_iterator(_slots.data(), _slots.data() + _slots.size()); }
+	const_iterator end() const { return const_iterator(_slots.data() + _slots.size(), _slots.data() + _slots.size()); }
+
+	std::size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+	iterator find(const K& key) {
+		auto pos = lookup(key);
+		return (pos < _slots.size()) ? iterator(&_slots[pos], _slots.data() + _slots.size()) : end();
+	}
+	const_iterator find(const K& key) const {
+		auto pos = lookup(key);
+		return (pos < _slots.size()) ? const_iterator(&_slots[pos], _slots.data() + _slots.size()) : end();
+	}
+	std::size_t count(const K& key) const {
+		return lookup(key) < _slots.size() ? 1 : 0;
+	}
+
+	V& operator[](const K& key) {
+		auto pos = lookup(key);
+		if (pos < _slots.size())
+			return _slots[pos].kv.second;
+		if ((_size+1)*4 > _slots.size()*3)
+			grow();
+		auto& slot = _slots[probe(key)];
+		slot.used = true;
+		slot.kv.first = key;
+		_size++;
+		return slot.kv.second;
+	}
+
+	/**
+	 * Returns number of erased entries, 0 or 1
+	 */
+	std::size_t erase(const K& key) {
+		auto hole = lookup(key);
+		if (hole >= _slots.size())
+			return 0;
+		const auto mask = _slots.size() - 1;
+		for (auto pos = (hole+1) & mask; _slots[pos].used; pos = (pos+1) & mask) {
+			// Move back entries whose home is cyclically at or before the hole
+			auto home = bucket(_slots[pos].kv.first);
+			if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+				_slots[hole].kv = std::move(_slots[pos].kv);
+				hole = pos;
+			}
+		}
+		_slots[hole].used = false;
+		_slots[hole].kv = value_type();
+		_size--;
+		return 1;
+	}
+
+	void clear() {
+		for (auto iter = _slots.begin(); iter != _slots.end(); iter++) {
+			if (iter->used) {
+				iter->used = false;
+				iter->kv = value_type();
+			}
+		}
+		_size = 0;
+	}
+
+	void swap(FlatMap& other) {
+		_slots.swap(other._slots);
+		std::swap(_size, other._size);
+		std::swap(_shift, other._shift);
+	}
+private:
+	std::size_t bucket(const K& key) const {
+		// Fibonacci-hashing spreads the dense keys this is used with
+		return (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL) >> _shift;
+	}
+
+	/**
+	 * Position of /key/, or _slots.size() if missing
+	 */
+	std::size_t lookup(const K& key) const {
+		if (_slots.empty())
+			return 0;
+		const auto mask = _slots.size() - 1;
+		for (auto pos = bucket(key); _slots[pos].used; pos = (pos+1) & mask) {
+			if (_slots[pos].kv.first == key)
+				return pos;
+		}
+		return _slots.size();
+	}
+
+	/**
+	 * First free position in the probe-sequence of /key/
+	 */
+	std::size_t probe(const K& key) const {
+		const auto mask = _slots.size() - 1;
+		auto pos = bucket(key);
+		while (_slots[pos].used)
+			pos = (pos+1) & mask;
+		return pos;
+	}
+
+	void grow() {
+		std::vector<Slot> old(_slots.empty() ? 8 : _slots.size() * 2);
+		old.swap(_slots);
+		_shift = 64;
+		for (auto size = _slots.size(); size > 1; size >>= 1)
+			_shift--;
+		for (auto iter = old.begin(); iter != old.end(); iter++) {
+			if (iter->used) {
+				auto& slot = _slots[probe(iter->kv.first)];
+				slot.used = true;
+				slot.kv = std::move(iter->kv);
+			}
+		}
+	}
+};
+
+#endif // BITHORDE_FLATMAP_H
@@ -20,11 +20,15 @@
 
 const static boost::posix_time::seconds MINIMUM_PACKET_INTERVAL(90);
 const static boost::posix_time::seconds MAX_PING_RESPONSE_TIME(15);
+const static boost::posix_time::seconds RTT_PROBE_INTERVAL(10);
 
 using namespace std;
 
 bithorde::Keepalive::Keepalive(Client& client) :
-	_client(client), _timer(*client.timerService(), std::bind(&Keepalive::run, this)), _stale(false)
+	_client(client),
+	_timer(*client.timerService(), std::bind(&Keepalive::run, this)),
+	_probeTimer(*client.timerService(), std::bind(&Keepalive::probe, this), RTT_PROBE_INTERVAL),
+	_stale(false)
 {
 	reset();
 }
@@ -40,18 +44,22 @@ void bithorde::Keepalive::run()
 {
 	if (_stale) {
 		cerr << "WARNING: " << _client.peerName() << " did not respond to ping. Disconnecting..." << endl;
-		return _client.close();
+		return _client.disconnect();
 	} else {
-		Ping ping;
-		ping.set_timeout(MAX_PING_RESPONSE_TIME.total_milliseconds());
-
-		if (_client.sendMessage(Connection::Ping, ping, Message::NEVER, true)) {
+		if (_client.ping(MAX_PING_RESPONSE_TIME, true)) {
 			_stale = true;
 			_timer.clear();
 			_timer.arm(boost::posix_time::seconds(MAX_PING_RESPONSE_TIME.total_seconds() * 1.5));
 		} else {
 			cerr << "WARNING: " << _client.peerName() << " without input, failed to send prioritized ping. Disconnecting..." << endl;
-			return _client.close();
+			return _client.disconnect();
 		}
 	}
 }
+
+void bithorde::Keepalive::probe()
+{
+	// Idle connections need no send-window, and are pinged by run() when quiet for long
+	if (_client.sending())
+		_client.ping(MAX_PING_RESPONSE_TIME, false);
+}
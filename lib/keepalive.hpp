@@ -27,6 +27,7 @@ class Client;
 class Keepalive : boost::noncopyable {
 	Client& _client; // We are fully owned by client, so references to client should always be intact
 	Timer _timer;
+	PeriodicTimer _probeTimer;
 	bool _stale;
 public:
 	Keepalive(bithorde::Client& c);
@@ -34,6 +35,11 @@ public:
 	void reset();
 
 	void run();
+
+	/**
+	 * Pings regularly while data is queued, to keep round-trip time measured on busy connections
+	 */
+	void probe();
 };
 
 }
@@ -0,0 +1,512 @@
+#include "sequentialreader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "buffer.hpp"
+#include "client.h"
+
+using namespace std;
+
+using namespace bithorde;
+
+// Peers not negotiating larger chunks may serve no more than 64KB at a time from storage
+const static size_t LEGACY_BLOCK_SIZE = 64*1024;
+
+// Shortest interval to sample throughput over, when the latency is lower
+const static double MIN_SAMPLE_INTERVAL = 0.01;
+
+// Throughput still grows with the window, while samples increase by this much
+const static double GROWTH = 1.25;
+
+/**
+ * Copies /data/ out of the message it arrived in. Incoming messages count towards what the client may
+ * hold before it stops reading from the connection, so chunks held waiting for others must not keep
+ * them alive.
+ */
+static std::shared_ptr<IBuffer> detach(const std::shared_ptr<IBuffer>& data)
+{
+	auto copy = std::make_shared<MemoryBuffer>(data->size());
+	memcpy(**copy, **data, data->size());
+	return copy;
+}
+
+SequentialReader::SequentialReader(ReadAsset& asset, size_t maxWindow, size_t minWindow) :
+	_asset(asset),
+	_minWindow(minWindow),
+	_maxWindow(maxWindow),
+	_window(0),
+	_active(false),
+	_pull(false),
+	_stalled(asset.status != bithorde::SUCCESS),
+	_position(0),
+	_requested(0),
+	_consumed(0),
+	_end(0),
+	_stream(-1),
+	_streamFailed(false),
+	_bufferedFrom(0),
+	_readEnd(-1),
+	_sending(false),
+	_sendFailed(false),
+	_latency(0),
+	_throughput(0),
+	_growing(false),
+	_peakRate(0),
+	_flatSamples(0),
+	_sampleBytes(0)
+{
+	_dataConnection = asset.dataArrived.connect(ReadAsset::DataSignal::slot_type(&SequentialReader::onData, this, ASSET_ARG_OFFSET, ASSET_ARG_DATA, ASSET_ARG_TAG));
+	_statusConnection = asset.statusUpdate.connect(Asset::StatusSignal::slot_type(&SequentialReader::onStatus, this, ASSET_ARG_STATUS));
+}
+
+SequentialReader::~SequentialReader()
+{
+	if (_stream >= 0)
+		_asset.cancelStream(_stream);
+}
+
+void SequentialReader::start(uint64_t offset, uint64_t end, const DataCallback& onData, const FailedCallback& onFailed)
+{
+	restart(offset, std::min<uint64_t>(end, _asset.size()));
+	_pull = false;
+	_onData = onData;
+	_onFailed = onFailed;
+	requestMore();
+}
+
+void SequentialReader::read(uint64_t offset, size_t size, const ReadCallback& cb)
+{
+	uint64_t assetSize = _asset.size();
+	if (offset >= assetSize)
+		size = 0;
+	else if (size > assetSize - offset)
+		size = assetSize - offset;
+	if (!size) {
+		cb(reinterpret_cast<const byte*>(""), 0);
+		return;
+	}
+
+	bool sequential = (offset == _readEnd);
+	_readEnd = offset + size;
+	if (_active && _pull && !sequential)
+		endRun();
+
+	if (sequential && !(_active && !_pull)) {
+		if (!_active) {
+			restart(offset, assetSize);
+			_pull = true;
+		}
+		_reads.push_back(PendingRead{offset, size, cb});
+		serve();
+	} else {
+		issueOneOff(offset, size, cb);
+	}
+	requestMore();
+}
+
+void SequentialReader::stop()
+{
+	auto reads = std::move(_reads);
+	_reads.clear();
+	endRun();
+
+	std::vector< std::shared_ptr<OneOff> > ops;
+	for (auto iter = _blocks.begin(); iter != _blocks.end(); iter++)
+		ops.push_back(iter->second.op);
+	for (auto iter = _missing.begin(); iter != _missing.end(); iter++)
+		ops.push_back(iter->op);
+	_blocks.clear();
+	_missing.clear();
+
+	for (auto iter = reads.begin(); iter != reads.end(); iter++)
+		iter->cb(NULL, 0);
+	for (auto iter = ops.begin(); iter != ops.end(); iter++) {
+		auto& op = *iter;
+		if (op && !op->failed) {
+			op->failed = true;
+			op->cb(NULL, 0);
+		}
+	}
+}
+
+size_t SequentialReader::window() const
+{
+	size_t minWindow = _minWindow ? _minWindow : 2*blockSize();
+	return std::min(std::max(_window, minWindow), _maxWindow);
+}
+
+double SequentialReader::throughput() const
+{
+	return _throughput;
+}
+
+uint64_t SequentialReader::position() const
+{
+	return _position;
+}
+
+bool SequentialReader::streaming() const
+{
+	return _stream >= 0;
+}
+
+size_t SequentialReader::blockSize() const
+{
+	auto negotiated = _asset.client()->maxChunkSize();
+	return (negotiated > LEGACY_CHUNK_SIZE) ? negotiated : LEGACY_BLOCK_SIZE;
+}
+
+void SequentialReader::restart(uint64_t offset, uint64_t end)
+{
+	endRun();
+	_active = true;
+	_position = _requested = _consumed = _bufferedFrom = offset;
+	_end = end;
+	_streamFailed = false;
+
+	// Start from what earlier runs saw, or from the response-times of the asset
+	if (!_latency)
+		_latency = _asset.readResponseTime.value() / 1000.0;
+	_window = 2 * _throughput * _latency;
+	_growing = true;
+	_peakRate = 0;
+	_flatSamples = 0;
+	_sampleStart = Clock::now();
+	_sampleBytes = 0;
+}
+
+void SequentialReader::endRun()
+{
+	dropStream();
+
+	// Late responses for the run are ignored, once their blocks are forgotten
+	std::vector<int> stale;
+	for (auto iter = _blocks.begin(); iter != _blocks.end(); iter++) {
+		if (!iter->second.op)
+			stale.push_back(iter->first);
+	}
+	for (auto iter = stale.begin(); iter != stale.end(); iter++)
+		_blocks.erase(*iter);
+	_missing.erase(std::remove_if(_missing.begin(), _missing.end(), [](const Block& b) { return !b.op; }), _missing.end());
+
+	_arrived.clear();
+	_buffered.clear();
+	_active = false;
+
+	auto reads = std::move(_reads);
+	_reads.clear();
+	for (auto iter = reads.begin(); iter != reads.end(); iter++)
+		issueOneOff(iter->offset, iter->size, iter->cb);
+}
+
+void SequentialReader::dropStream()
+{
+	if (_stream >= 0) {
+		auto tag = _stream;
+		_stream = -1;
+		_asset.cancelStream(tag);
+		// Streams deliver in order, so nothing past _position has arrived
+		_requested = _position;
+	}
+	_issued.clear();
+}
+
+void SequentialReader::issueOneOff(uint64_t offset, size_t size, const ReadCallback& cb)
+{
+	auto op = std::make_shared<OneOff>();
+	op->offset = offset;
+	op->data.resize(size);
+	op->missing = size;
+	op->cb = cb;
+	op->failed = false;
+
+	auto blockSize = this->blockSize();
+	for (uint64_t pos = offset; pos < offset + size; pos += blockSize) {
+		Block block = {pos, (size_t)std::min<uint64_t>(blockSize, offset + size - pos), 0, op};
+		send(block);
+	}
+}
+
+bool SequentialReader::send(const Block& block)
+{
+	if (!_stalled) {
+		_sending = true;
+		_sendFailed = false;
+		int tag = _asset.aSyncRead(block.offset, block.size);
+		_sending = false;
+		if ((tag >= 0) && !_sendFailed) {
+			_blocks[tag] = block;
+			return true;
+		}
+		_stalled = true; // Until bound again
+	}
+	_missing.push_back(block);
+	return false;
+}
+
+void SequentialReader::requestMore()
+{
+	if (_stalled)
+		return;
+	for (auto count = _missing.size(); count && !_missing.empty(); count--) {
+		auto block = _missing.front();
+		_missing.pop_front();
+		if (!send(block))
+			return;
+	}
+	if (!_active)
+		return;
+
+	uint64_t target = std::min<uint64_t>(_consumed + window(), _end);
+	if (_requested >= target)
+		return;
+	auto now = Clock::now();
+	if ((_stream < 0) && !_streamFailed && (_requested == _position) && _asset.client()->readStreams()) {
+		_stream = _asset.aSyncStream(_requested, target - _requested);
+		if (_stream < 0)
+			_streamFailed = true;
+	} else if ((_stream >= 0) && !_asset.extendStream(_stream, target)) {
+		// Closed underneath, such as when the client was disconnected
+		_streamFailed = true;
+		dropStream();
+	}
+	if (_stream >= 0) {
+		_requested = target;
+		_issued.push_back(make_pair(_requested, now));
+		return;
+	}
+
+	auto blockSize = this->blockSize();
+	while (_requested < target) {
+		Block block = {_requested, (size_t)std::min<uint64_t>(blockSize, _end - _requested), 0, std::shared_ptr<OneOff>()};
+		_requested += block.size;
+		_issued.push_back(make_pair(_requested, now));
+		if (!send(block))
+			break;
+	}
+}
+
+void SequentialReader::onData(uint64_t offset, const std::shared_ptr<IBuffer>& data, int tag)
+{
+	if ((_stream >= 0) && (tag == _stream)) {
+		if (data->size()) {
+			store(offset, data);
+		} else {
+			// Fall back to block-reads
+			_streamFailed = true;
+			dropStream();
+		}
+		return requestMore();
+	}
+
+	auto found = _blocks.find(tag);
+	if (found == _blocks.end()) {
+		if (_sending)
+			_sendFailed = true;
+		return;
+	}
+	Block block = found->second;
+	_blocks.erase(tag);
+	if (!data->size() || (offset != block.offset)) {
+		failBlock(block);
+		return requestMore();
+	}
+
+	size_t got = std::min(data->size(), block.size);
+	if (got < block.size) {
+		// Served in smaller pieces, such as through a peer with smaller chunks
+		Block rest = block;
+		rest.offset += got;
+		rest.size -= got;
+		_missing.push_front(rest);
+	}
+	if (auto op = block.op) {
+		if (!op->failed) {
+			memcpy(&op->data[block.offset - op->offset], **data, got);
+			if (!(op->missing -= got))
+				op->cb(reinterpret_cast<const byte*>(op->data.data()), op->data.size());
+		}
+	} else if (got < data->size()) {
+		store(offset, std::make_shared<BufferSlice>(data, **data, got));
+	} else {
+		store(offset, data);
+	}
+	requestMore();
+}
+
+void SequentialReader::onStatus(const bithorde::AssetStatus& status)
+{
+	if (status.status() == bithorde::SUCCESS) {
+		if (_stalled) {
+			_stalled = false;
+			_sampleStart = Clock::now();
+			_sampleBytes = 0;
+			requestMore();
+		}
+	} else if (!_stalled) {
+		_stalled = true;
+		dropStream();
+
+		// Responses may never come for what is in flight, ask again once bound
+		std::vector<int> tags;
+		for (auto iter = _blocks.begin(); iter != _blocks.end(); iter++) {
+			tags.push_back(iter->first);
+			_missing.push_back(iter->second);
+		}
+		for (auto iter = tags.begin(); iter != tags.end(); iter++)
+			_blocks.erase(*iter);
+	}
+}
+
+void SequentialReader::failBlock(Block block)
+{
+	if (++block.retries <= MAX_RETRIES)
+		_missing.push_back(block);
+	else if (block.op)
+		failOneOff(block.op);
+	else
+		failRun();
+}
+
+void SequentialReader::failOneOff(const std::shared_ptr<OneOff>& op)
+{
+	op->failed = true;
+	std::vector<int> tags;
+	for (auto iter = _blocks.begin(); iter != _blocks.end(); iter++) {
+		if (iter->second.op == op)
+			tags.push_back(iter->first);
+	}
+	for (auto iter = tags.begin(); iter != tags.end(); iter++)
+		_blocks.erase(*iter);
+	_missing.erase(std::remove_if(_missing.begin(), _missing.end(), [&](const Block& b) { return b.op == op; }), _missing.end());
+	op->cb(NULL, 0);
+}
+
+void SequentialReader::failRun()
+{
+	auto reads = std::move(_reads);
+	_reads.clear();
+	auto position = _position;
+	auto onFailed = _onFailed;
+	bool pull = _pull;
+	endRun();
+	if (pull) {
+		for (auto iter = reads.begin(); iter != reads.end(); iter++)
+			iter->cb(NULL, 0);
+	} else if (onFailed) {
+		onFailed(position);
+	}
+}
+
+void SequentialReader::store(uint64_t offset, const std::shared_ptr<IBuffer>& data)
+{
+	if (offset + data->size() <= _position)
+		return; // Already have it
+	if (offset != _position) {
+		_arrived[offset] = detach(data);
+		return;
+	}
+	deliver(data);
+	while (_active && !_arrived.empty() && (_arrived.begin()->first <= _position)) {
+		auto next = _arrived.begin();
+		auto chunk = next->second;
+		bool inOrder = (next->first == _position);
+		_arrived.erase(next);
+		if (inOrder)
+			deliver(chunk);
+	}
+}
+
+void SequentialReader::deliver(const std::shared_ptr<IBuffer>& data)
+{
+	auto offset = _position;
+	_position += data->size();
+
+	// The lowest latency seen, since later requests queue behind earlier ones
+	auto now = Clock::now();
+	while (!_issued.empty() && (_issued.front().first <= _position)) {
+		double latency = boost::chrono::duration<double>(now - _issued.front().second).count();
+		if (!_latency || (latency < _latency))
+			_latency = latency;
+		_issued.pop_front();
+	}
+	adapt(data->size(), now);
+
+	if (_pull) {
+		_buffered.push_back(detach(data));
+		serve();
+	} else {
+		_consumed = _position;
+		auto onData = _onData;
+		onData(offset, data);
+	}
+}
+
+void SequentialReader::serve()
+{
+	while (!_reads.empty() && (_position >= _reads.front().offset + _reads.front().size)) {
+		auto read = std::move(_reads.front());
+		_reads.pop_front();
+		uint64_t end = read.offset + read.size;
+
+		while (!_buffered.empty() && (_bufferedFrom + _buffered.front()->size() <= read.offset)) {
+			_bufferedFrom += _buffered.front()->size();
+			_buffered.pop_front();
+		}
+		auto first = _buffered.front();
+		size_t skip = read.offset - _bufferedFrom;
+		std::string assembled;
+		if (skip + read.size > first->size()) {
+			assembled.reserve(read.size);
+			uint64_t pos = _bufferedFrom;
+			for (auto iter = _buffered.begin(); pos < end; pos += (*iter++)->size()) {
+				auto from = std::max(pos, read.offset);
+				auto to = std::min(pos + (*iter)->size(), end);
+				assembled.append(reinterpret_cast<const char*>(**(*iter) + (from - pos)), to - from);
+			}
+		}
+
+		_consumed = end;
+		while (!_buffered.empty() && (_bufferedFrom + _buffered.front()->size() <= end)) {
+			_bufferedFrom += _buffered.front()->size();
+			_buffered.pop_front();
+		}
+
+		if (assembled.empty())
+			read.cb(**first + skip, read.size);
+		else
+			read.cb(reinterpret_cast<const byte*>(assembled.data()), assembled.size());
+	}
+}
+
+void SequentialReader::adapt(size_t delivered, const Clock::time_point& now)
+{
+	// Grow by what arrives, doubling the window each round-trip, until the throughput stops growing
+	if (_growing)
+		_window = std::min(window() + delivered, _maxWindow);
+
+	_sampleBytes += delivered;
+	double elapsed = boost::chrono::duration<double>(now - _sampleStart).count();
+	if (elapsed < std::max(_latency, MIN_SAMPLE_INTERVAL))
+		return;
+
+	// Follow increases at once, but smooth decreases
+	double rate = _sampleBytes / elapsed;
+	_throughput = std::max(rate, (_throughput + rate) / 2);
+	_sampleStart = now;
+	_sampleBytes = 0;
+
+	// Samples lag the window by a round-trip, so allow one without growth
+	if (rate > GROWTH * _peakRate) {
+		_peakRate = rate;
+		_flatSamples = 0;
+	} else if (++_flatSamples >= 2) {
+		_growing = false;
+	}
+
+	// Then twice the bandwidth-delay product
+	if (!_growing)
+		_window = std::min<double>(2 * _throughput * _latency, _maxWindow);
+}
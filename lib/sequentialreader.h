@@ -0,0 +1,169 @@
+#ifndef BITHORDE_SEQUENTIALREADER_H
+#define BITHORDE_SEQUENTIALREADER_H
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/chrono.hpp>
+#include <boost/signals2.hpp>
+
+#include "asset.h"
+#include "flatmap.h"
+
+namespace bithorde {
+
+/**
+ * Reads a ReadAsset in order, keeping a window of data requested ahead of the reader. The window grows
+ * by what arrives, doubling each round-trip, until the throughput stops growing with it. It then
+ * follows twice the bandwidth-delay product, from the observed throughput and the lowest
+ * response-time seen.
+ *
+ * Data is requested through a Read.Stream if the peer supports it, and otherwise through pipelined
+ * block-reads, reordered as they arrive. Failed or short blocks are requested again, and requesting
+ * pauses while the asset is not bound.
+ *
+ * Either pushes a range through start(), or serves reads through read(), reading ahead once two reads
+ * in a row are sequential. Callbacks may stop() the reader, but not destroy it.
+ */
+class SequentialReader : boost::noncopyable {
+public:
+	typedef boost::chrono::steady_clock Clock;
+	typedef std::function<void (uint64_t offset, const std::shared_ptr<IBuffer>& data)> DataCallback;
+	typedef std::function<void (uint64_t offset)> FailedCallback;
+
+	/**
+	 * Called with the data read, or with NULL if the read failed
+	 */
+	typedef std::function<void (const byte* data, size_t size)> ReadCallback;
+
+	static const size_t DEFAULT_MAX_WINDOW = 16*1024*1024;
+	static const unsigned MAX_RETRIES = 5;
+
+	/**
+	 * A /minWindow/ of 0 means two blocks
+	 */
+	explicit SequentialReader(ReadAsset& asset, size_t maxWindow=DEFAULT_MAX_WINDOW, size_t minWindow=0);
+
+	/**
+	 * Closes the stream, if any. Reads not yet served are dropped without callback, use stop() first
+	 * to fail them.
+	 */
+	~SequentialReader();
+
+	/**
+	 * Reads [offset, end), passing it to /onData/ in order. /onFailed/ is called with the position
+	 * reached, if a block fails too many times.
+	 */
+	void start(uint64_t offset, uint64_t end, const DataCallback& onData, const FailedCallback& onFailed);
+
+	/**
+	 * Reads /size/ bytes from /offset/, clipped to the size of the asset.
+	 */
+	void read(uint64_t offset, size_t size, const ReadCallback& cb);
+
+	/**
+	 * Drops everything requested, failing reads not yet served
+	 */
+	void stop();
+
+	/**
+	 * Bytes currently kept requested ahead of the reader
+	 */
+	size_t window() const;
+
+	/**
+	 * Observed bytes/s
+	 */
+	double throughput() const;
+
+	/**
+	 * Offset up to which data has arrived in order
+	 */
+	uint64_t position() const;
+
+	/**
+	 * True if reading through a Read.Stream
+	 */
+	bool streaming() const;
+private:
+	struct OneOff {
+		uint64_t offset;
+		std::string data;
+		size_t missing;
+		ReadCallback cb;
+		bool failed;
+	};
+	struct Block {
+		uint64_t offset;
+		size_t size;
+		unsigned retries;
+		std::shared_ptr<OneOff> op; // If not part of the sequential run
+	};
+	struct PendingRead {
+		uint64_t offset;
+		size_t size;
+		ReadCallback cb;
+	};
+
+	ReadAsset& _asset;
+	size_t _minWindow, _maxWindow, _window;
+	bool _active; // A sequential run is being read
+	bool _pull;
+	bool _stalled; // Requests could not be sent, until the asset is bound again
+	DataCallback _onData;
+	FailedCallback _onFailed;
+
+	uint64_t _position; // Run-data up to here has arrived in order
+	uint64_t _requested; // Run-data up to here has been requested
+	uint64_t _consumed; // Run-data up to here has been passed on
+	uint64_t _end;
+
+	FlatMap<int, Block> _blocks; // In flight, by tag
+	std::deque<Block> _missing; // To be requested again
+	int _stream;
+	bool _streamFailed;
+	std::map< uint64_t, std::shared_ptr<IBuffer> > _arrived; // Ahead of _position
+
+	std::deque<PendingRead> _reads; // Waiting for the run
+	std::deque< std::shared_ptr<IBuffer> > _buffered; // Arrived in order, from _bufferedFrom up to _position
+	uint64_t _bufferedFrom;
+	uint64_t _readEnd; // Where the last read() ended
+
+	bool _sending, _sendFailed; // Read.Requests failing to send are signalled before aSyncRead returns
+
+	std::deque< std::pair<uint64_t, Clock::time_point> > _issued; // End of each request, and when
+	double _latency; // Lowest seen during the run, in seconds
+	double _throughput;
+	bool _growing; // Throughput has kept up with the window so far
+	double _peakRate;
+	unsigned _flatSamples;
+	Clock::time_point _sampleStart;
+	uint64_t _sampleBytes;
+
+	boost::signals2::scoped_connection _dataConnection;
+	boost::signals2::scoped_connection _statusConnection;
+
+	size_t blockSize() const;
+	void restart(uint64_t offset, uint64_t end);
+	void endRun();
+	void dropStream();
+	void issueOneOff(uint64_t offset, size_t size, const ReadCallback& cb);
+	bool send(const Block& block);
+	void requestMore();
+	void onData(uint64_t offset, const std::shared_ptr<IBuffer>& data, int tag);
+	void onStatus(const bithorde::AssetStatus& status);
+	void failBlock(Block block);
+	void failOneOff(const std::shared_ptr<OneOff>& op);
+	void failRun();
+	void store(uint64_t offset, const std::shared_ptr<IBuffer>& data);
+	void deliver(const std::shared_ptr<IBuffer>& data);
+	void serve();
+	void adapt(size_t delivered, const Clock::time_point& now);
+};
+
+}
+
+#endif // BITHORDE_SEQUENTIALREADER_H
@@ -0,0 +1,199 @@
+#include "sharedmemory.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+using namespace bithorde;
+
+const int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+static bool isRingSize(size_t size)
+{
+	return (size >= MIN_RING_SIZE) && (size <= MAX_RING_SIZE) && !(size & (size-1));
+}
+
+SharedRing::SharedRing() :
+	_hdr(NULL),
+	_data(NULL),
+	_mask(0),
+	_corrupt(false)
+{}
+
+void SharedRing::attach(byte* base, size_t size)
+{
+	_hdr = reinterpret_cast<Header*>(base);
+	_data = base + HEADER_SIZE;
+	_mask = size - 1;
+}
+
+size_t SharedRing::used(uint64_t head, uint64_t tail) const
+{
+	if (head - tail > _mask + 1)
+		_corrupt = true;
+	return _corrupt ? 0 : head - tail;
+}
+
+size_t SharedRing::write(const byte* data, size_t size)
+{
+	auto head = _hdr->head.load(std::memory_order_relaxed);
+	auto tail = _hdr->tail.load(std::memory_order_acquire);
+	auto used = this->used(head, tail);
+	if (_corrupt)
+		return 0;
+	size = std::min(size, _mask + 1 - used);
+	auto pos = head & _mask;
+	auto first = std::min(size, _mask + 1 - pos);
+	memcpy(_data + pos, data, first);
+	memcpy(_data, data + first, size - first);
+	_hdr->head.store(head + size, std::memory_order_seq_cst);
+	return size;
+}
+
+size_t SharedRing::read(byte* data, size_t size)
+{
+	auto tail = _hdr->tail.load(std::memory_order_relaxed);
+	auto head = _hdr->head.load(std::memory_order_acquire);
+	size = std::min(size, used(head, tail));
+	auto pos = tail & _mask;
+	auto first = std::min(size, _mask + 1 - pos);
+	memcpy(data, _data + pos, first);
+	memcpy(data + first, _data, size - first);
+	_hdr->tail.store(tail + size, std::memory_order_seq_cst);
+	return size;
+}
+
+size_t SharedRing::readable() const
+{
+	auto head = _hdr->head.load(std::memory_order_acquire);
+	return used(head, _hdr->tail.load(std::memory_order_relaxed));
+}
+
+size_t SharedRing::writable() const
+{
+	auto used = this->used(_hdr->head.load(std::memory_order_relaxed), _hdr->tail.load(std::memory_order_acquire));
+	return _corrupt ? 0 : _mask + 1 - used;
+}
+
+// The waiting side sets its flag before checking again, and the other side moves its position before
+// checking the flag. With both in sequential order, either the check sees the move, or the mover sees
+// the flag.
+
+bool SharedRing::waitReadable()
+{
+	_hdr->consumerWaiting.store(1, std::memory_order_seq_cst);
+	if (_hdr->head.load(std::memory_order_seq_cst) != _hdr->tail.load(std::memory_order_relaxed)) {
+		_hdr->consumerWaiting.store(0, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+bool SharedRing::waitWritable()
+{
+	_hdr->producerWaiting.store(1, std::memory_order_seq_cst);
+	if (writable()) {
+		_hdr->producerWaiting.store(0, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+bool SharedRing::wakeConsumer()
+{
+	return _hdr->consumerWaiting.exchange(0, std::memory_order_seq_cst);
+}
+
+bool SharedRing::wakeProducer()
+{
+	return _hdr->producerWaiting.exchange(0, std::memory_order_seq_cst);
+}
+
+SharedMemoryChannel::SharedMemoryChannel(int memfd, int wake0, int wake1, unsigned side, size_t ringSize) :
+	_memfd(memfd),
+	_side(side),
+	_ringSize(ringSize),
+	_map(NULL),
+	_mapSize(2 * (SharedRing::HEADER_SIZE + ringSize))
+{
+	_wakefds[0] = wake0;
+	_wakefds[1] = wake1;
+}
+
+SharedMemoryChannel::Ptr SharedMemoryChannel::create(size_t ringSize)
+{
+	if (!isRingSize(ringSize))
+		return Ptr();
+	Ptr res(new SharedMemoryChannel(
+		memfd_create("bithorde-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING),
+		eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+		eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+		0, ringSize));
+	if ((res->_memfd < 0) || (res->_wakefds[0] < 0) || (res->_wakefds[1] < 0)
+			|| (ftruncate(res->_memfd, res->_mapSize) < 0)
+			|| (fcntl(res->_memfd, F_ADD_SEALS, REQUIRED_SEALS) < 0) || !res->map()) {
+		cerr << "Failed to set up shared memory: " << strerror(errno) << endl;
+		return Ptr();
+	}
+	return res;
+}
+
+SharedMemoryChannel::Ptr SharedMemoryChannel::attach(const std::vector<int>& fds, size_t ringSize)
+{
+	if (fds.size() != 3) {
+		for (auto iter = fds.begin(); iter != fds.end(); iter++)
+			close(*iter);
+		return Ptr();
+	}
+	Ptr res(new SharedMemoryChannel(fds[0], fds[1], fds[2], 1, ringSize));
+	// Sealed, so that the peer cannot make our mapping fault by shrinking it
+	struct stat st;
+	if (!isRingSize(ringSize) || (fstat(res->_memfd, &st) < 0) || ((size_t)st.st_size != res->_mapSize)
+			|| ((fcntl(res->_memfd, F_GET_SEALS) & REQUIRED_SEALS) != REQUIRED_SEALS) || !res->map()) {
+		cerr << "Failed to attach shared memory of " << ringSize << " bytes" << endl;
+		return Ptr();
+	}
+	return res;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+	if (_map)
+		munmap(_map, _mapSize);
+	for (int fd : {_memfd, _wakefds[0], _wakefds[1]}) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+bool SharedMemoryChannel::map()
+{
+	void* map = mmap(NULL, _mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, _memfd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	_map = static_cast<byte*>(map);
+	byte* rings[2] = { _map, _map + SharedRing::HEADER_SIZE + _ringSize };
+	_tx.attach(rings[_side], _ringSize);
+	_rx.attach(rings[1 - _side], _ringSize);
+	return true;
+}
+
+std::vector<int> SharedMemoryChannel::fds() const
+{
+	return std::vector<int>{_memfd, _wakefds[0], _wakefds[1]};
+}
+
+void SharedMemoryChannel::wakePeer()
+{
+	uint64_t one = 1;
+	if (::write(_wakefds[1 - _side], &one, sizeof(one)) < 0 && (errno != EAGAIN))
+		cerr << "Failed to wake peer: " << strerror(errno) << endl;
+}
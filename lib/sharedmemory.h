@@ -0,0 +1,142 @@
+#ifndef BITHORDE_SHAREDMEMORY_H
+#define BITHORDE_SHAREDMEMORY_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "types.h"
+
+namespace bithorde {
+
+const size_t DEFAULT_RING_SIZE = 8*1024*1024;
+const size_t MIN_RING_SIZE = 64*1024;
+const size_t MAX_RING_SIZE = 256*1024*1024;
+
+/**
+ * A byte-ring with a single producer and a single consumer, possibly in different processes. Neither
+ * side blocks; when one can make no progress, it marks itself waiting, and the other side tells
+ * through wakeProducer()/wakeConsumer() when it should be woken. The header is writable by the
+ * peer, so positions further apart than the ring holds mark the ring corrupt(), after which
+ * nothing more is passed through it.
+ */
+class SharedRing {
+public:
+	/**
+	 * Placed first in the shared memory, ahead of the data. Positions count bytes ever passed, and
+	 * wrap around the ring by masking.
+	 */
+	struct Header {
+		std::atomic<uint64_t> head; // Written by the producer
+		std::atomic<uint32_t> consumerWaiting;
+		char _pad[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+		std::atomic<uint64_t> tail; // Written by the consumer
+		std::atomic<uint32_t> producerWaiting;
+	};
+	static const size_t HEADER_SIZE = 4096;
+
+	SharedRing();
+
+	/**
+	 * Uses /size/ bytes of data after the Header at /base/. /size/ must be a power of two.
+	 */
+	void attach(byte* base, size_t size);
+
+	/**
+	 * Copies as much of /data/ as fits, returning the amount copied
+	 */
+	size_t write(const byte* data, size_t size);
+
+	/**
+	 * Copies out up to /size/ bytes, returning the amount copied
+	 */
+	size_t read(byte* data, size_t size);
+	size_t readable() const;
+	size_t writable() const;
+
+	/**
+	 * True once the positions were found inconsistent, which is a protocol error of the peer
+	 */
+	bool corrupt() const { return _corrupt; }
+
+	/**
+	 * Marks the consumer as waiting for data. Returns false if data arrived meanwhile, so that there
+	 * is nothing to wait for.
+	 */
+	bool waitReadable();
+	bool waitWritable();
+
+	/**
+	 * After writing; true if the consumer was waiting and should be woken
+	 */
+	bool wakeConsumer();
+
+	/**
+	 * After reading; true if the producer was waiting and should be woken
+	 */
+	bool wakeProducer();
+private:
+	/**
+	 * Bytes between /head/ and /tail/, read once by the caller, or 0 if they are inconsistent
+	 */
+	size_t used(uint64_t head, uint64_t tail) const;
+
+	Header* _hdr;
+	byte* _data;
+	size_t _mask;
+	mutable bool _corrupt;
+};
+
+/**
+ * The two rings of a connection in one memfd, and an eventfd waking each side. The initiating side
+ * creates the channel and passes fds() to the other, which attaches to it. The initiator sends on
+ * the first ring and is woken through the first eventfd.
+ */
+class SharedMemoryChannel : boost::noncopyable {
+	int _memfd;
+	int _wakefds[2];
+	unsigned _side;
+	size_t _ringSize;
+	byte* _map;
+	size_t _mapSize;
+	SharedRing _tx, _rx;
+public:
+	typedef std::shared_ptr<SharedMemoryChannel> Ptr;
+
+	/**
+	 * Returns NULL if shared memory could not be set up, or /ringSize/ is not a power of two
+	 * within limits.
+	 */
+	static Ptr create(size_t ringSize);
+
+	/**
+	 * Attaches to a channel from fds() of the initiator, taking ownership of /fds/. Returns NULL if
+	 * they do not describe a channel of /ringSize/.
+	 */
+	static Ptr attach(const std::vector<int>& fds, size_t ringSize);
+	~SharedMemoryChannel();
+
+	/**
+	 * The memfd, and the eventfds of each side, for the peer
+	 */
+	std::vector<int> fds() const;
+	size_t ringSize() const { return _ringSize; }
+
+	SharedRing& tx() { return _tx; }
+	SharedRing& rx() { return _rx; }
+
+	/**
+	 * Becomes readable when this side should look at the rings again
+	 */
+	int wakeFd() const { return _wakefds[_side]; }
+	void wakePeer();
+private:
+	SharedMemoryChannel(int memfd, int wake0, int wake1, unsigned side, size_t ringSize);
+	bool map();
+};
+
+}
+
+#endif // BITHORDE_SHAREDMEMORY_H
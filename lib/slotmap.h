@@ -0,0 +1,99 @@
+#ifndef BITHORDE_SLOTMAP_H
+#define BITHORDE_SLOTMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Stores values in a dense array, under keys it hands out itself. A key is the index of the slot,
+ * tagged with a generation bumped each time the slot is freed, so that stale keys, such as the ids
+ * of requests already completed or timed out, are told apart from the current occupant.
+ *
+ * Keys are positive ints. Freed slots are reused most-recent first, to keep the array hot.
+ */
+template <typename V>
+class SlotMap {
+public:
+	typedef int Key;
+	static const unsigned INDEX_BITS = 20;
+	static const uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+	static const uint32_t MAX_GENERATION = (1u << (31 - INDEX_BITS)) - 1;
+private:
+	struct Slot {
+		uint32_t generation; // 1..MAX_GENERATION, so that keys are never 0
+		bool used;
+		V value;
+		Slot() : generation(1), used(false), value() {}
+	};
+	std::vector<Slot> _slots;
+	std::vector<uint32_t> _free;
+	std::size_t _size;
+
+	static Key key(uint32_t index, uint32_t generation) {
+		return static_cast<Key>((generation << INDEX_BITS) | index);
+	}
+
+	void release(uint32_t index) {
+		auto& slot = _slots[index];
+		slot.used = false;
+		slot.value = V();
+		slot.generation = (slot.generation < MAX_GENERATION) ? slot.generation + 1 : 1;
+		_free.push_back(index);
+		_size--;
+	}
+public:
+	SlotMap() : _size(0) {}
+
+	/**
+	 * Stores /value/, returning its key, or -1 if all slots are taken
+	 */
+	Key insert(const V& value) {
+		uint32_t index;
+		if (!_free.empty()) {
+			index = _free.back();
+			_free.pop_back();
+		} else if (_slots.size() <= INDEX_MASK) {
+			index = _slots.size();
+			_slots.emplace_back();
+		} else {
+			return -1;
+		}
+		auto& slot = _slots[index];
+		slot.used = true;
+		slot.value = value;
+		_size++;
+		return key(index, slot.generation);
+	}
+
+	/**
+	 * The value stored under /k/, or NULL if /k/ is unknown or stale
+	 */
+	V* find(Key k) {
+		auto index = static_cast<uint32_t>(k) & INDEX_MASK;
+		if ((k <= 0) || (index >= _slots.size()))
+			return NULL;
+		auto& slot = _slots[index];
+		if (!slot.used || (key(index, slot.generation) != k))
+			return NULL;
+		return &slot.value;
+	}
+
+	bool erase(Key k) {
+		if (!find(k))
+			return false;
+		release(static_cast<uint32_t>(k) & INDEX_MASK);
+		return true;
+	}
+
+	void clear() {
+		for (uint32_t i = 0; i < _slots.size(); i++) {
+			if (_slots[i].used)
+				release(i);
+		}
+	}
+
+	std::size_t size() const { return _size; }
+};
+
+#endif // BITHORDE_SLOTMAP_H
@@ -17,68 +17,227 @@
 
 #include "timer.h"
 
-TimerService::TimerService(boost::asio::io_service& ioSvc)
-	: _timer(ioSvc)
+#include <limits>
+
+namespace ptime = boost::posix_time;
+
+const uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+static void link(TimerEntry** head, TimerEntry* entry) {
+	entry->next = *head;
+	entry->pprev = head;
+	if (*head)
+		(*head)->pprev = &entry->next;
+	*head = entry;
+}
+
+static void unlink(TimerEntry* entry) {
+	*entry->pprev = entry->next;
+	if (entry->next)
+		entry->next->pprev = entry->pprev;
+}
+
+static void linkTimer(TimerEntry** head, TimerEntry* entry) {
+	entry->timerNext = *head;
+	entry->timerPprev = head;
+	if (*head)
+		(*head)->timerPprev = &entry->timerNext;
+	*head = entry;
+}
+
+static void unlinkTimer(TimerEntry* entry) {
+	*entry->timerPprev = entry->timerNext;
+	if (entry->timerNext)
+		entry->timerNext->timerPprev = entry->timerPprev;
+}
+
+TimerService::TimerService(boost::asio::io_service& ioSvc, ptime::time_duration tick, const Clock& clock)
+	: _timer(ioSvc),
+	  _clock(clock ? clock : Clock(&ptime::microsec_clock::universal_time)),
+	  _epoch(_clock()),
+	  _tick(tick),
+	  _current(0),
+	  _wakeTick(NEVER),
+	  _armed(0)
 {
+	for (unsigned level = 0; level < WHEEL_LEVELS; level++)
+		std::fill(_wheel[level], _wheel[level] + WHEEL_SLOTS, static_cast<TimerEntry*>(NULL));
 }
 
-void TimerService::arm(boost::posix_time::ptime deadline, Timer* t)
+TimerService::~TimerService()
 {
-	_timers.insert(std::pair<boost::posix_time::ptime,Timer*>(deadline, t));
-	enable();
+	for (unsigned level = 0; level < WHEEL_LEVELS; level++) {
+		for (uint64_t slot = 0; slot < WHEEL_SLOTS; slot++) {
+			while (auto entry = _wheel[level][slot]) {
+				unlink(entry);
+				unlinkTimer(entry);
+				delete entry;
+			}
+		}
+	}
+	for (auto iter = _free.begin(); iter != _free.end(); iter++)
+		delete *iter;
 }
 
-void TimerService::clear(const Timer* t)
+std::size_t TimerService::armed() const
 {
-	auto iter = _timers.begin();
-	while (iter != _timers.end()) {
-		auto current = iter++;
-		if (current->second == t)
-			_timers.erase(current);
+	return _armed;
+}
+
+ptime::ptime TimerService::now() const
+{
+	return _clock();
+}
+
+TimerEntry* TimerService::arm(ptime::ptime deadline, Timer* t)
+{
+	if (!_armed) {
+		// Nothing to cascade, so skip the wheel ahead instead of ticking through idle time
+		_current = std::max(_current, tickOf(now()));
 	}
+
+	TimerEntry* entry;
+	if (_free.empty()) {
+		entry = new TimerEntry;
+	} else {
+		entry = _free.back();
+		_free.pop_back();
+	}
+	entry->timer = t;
+	entry->deadline = deadline;
+	entry->tick = std::max(tickOf(deadline), _current);
+	insert(entry);
+	linkTimer(&t->_entries, entry);
+	_armed++;
+
+	if (entry->tick < _wakeTick)
+		schedule(entry->tick);
+	return entry;
+}
+
+void TimerService::clear(TimerEntry* entry)
+{
+	unlink(entry);
+	unlinkTimer(entry);
+	_armed--;
+	_free.push_back(entry);
 }
 
-void TimerService::enable()
+/**
+ * First tick at, or after, /t/
+ */
+uint64_t TimerService::tickOf(const ptime::ptime& t) const
 {
-	if (_timers.size() > 0) {
-		const auto& target_time = _timers.begin()->first;
-		if (target_time != _timer.expires_at()) {
-			auto self = shared_from_this();
-			_timer.expires_at(target_time);
-			_timer.async_wait([=](const boost::system::error_code& ec) {
-				self->invoke(ec);
-			});
+	auto offset = (t - _epoch).total_microseconds();
+	if (offset <= 0)
+		return 0;
+	auto tick = _tick.total_microseconds();
+	return (offset + tick - 1) / tick;
+}
+
+void TimerService::insert(TimerEntry* entry)
+{
+	const uint64_t tick = std::max(entry->tick, _current);
+	const uint64_t delta = tick - _current;
+	for (unsigned level = 0; level < WHEEL_LEVELS; level++) {
+		const unsigned shift = level * WHEEL_BITS;
+		if ((delta >> shift) < WHEEL_SLOTS) {
+			link(&_wheel[level][(tick >> shift) & WHEEL_MASK], entry);
+			return;
 		}
 	}
+	// Beyond the wheel, park it in the last slot of the top level, and take a new look on cascade
+	const unsigned shift = (WHEEL_LEVELS-1) * WHEEL_BITS;
+	link(&_wheel[WHEEL_LEVELS-1][((_current >> shift) - 1) & WHEEL_MASK], entry);
+}
+
+/**
+ * Re-insert the entries of the slot at _current in /level/, moving them down to finer levels
+ */
+void TimerService::cascade(unsigned level)
+{
+	auto& slot = _wheel[level][(_current >> (level * WHEEL_BITS)) & WHEEL_MASK];
+	TimerEntry* entries = slot;
+	slot = NULL;
+	if (entries)
+		entries->pprev = &entries;
+	while (auto entry = entries) {
+		unlink(entry);
+		insert(entry);
+	}
+}
+
+void TimerService::schedule(uint64_t tick)
+{
+	_wakeTick = tick;
+	auto self = shared_from_this();
+	_timer.expires_at(_epoch + _tick * tick);
+	_timer.async_wait([=](const boost::system::error_code& ec) {
+		self->invoke(ec);
+	});
+}
+
+/**
+ * Wake for the first tick due in this rotation of the finest level, or at the end of it to cascade.
+ */
+void TimerService::scheduleNext()
+{
+	_wakeTick = NEVER;
+	if (!_armed)
+		return;
+	const uint64_t rotationEnd = (_current | WHEEL_MASK) + 1;
+	for (uint64_t tick = _current; tick < rotationEnd; tick++) {
+		if (_wheel[0][tick & WHEEL_MASK])
+			return schedule(tick);
+	}
+	schedule(rotationEnd);
 }
 
 void TimerService::invoke(boost::system::error_code ec)
 {
 	if (ec) return;
-	auto now(boost::posix_time::microsec_clock::universal_time());
-	auto iter = _timers.begin();
-	while (iter != _timers.end() && iter->first <= now) {
-		auto deadline = iter->first;
-		auto timer = iter->second;
-		_timers.erase(iter);
-		timer->invoke(deadline, now);
-		iter = _timers.begin();
+	runDue();
+}
+
+void TimerService::runDue()
+{
+	auto now(this->now());
+	const auto elapsed = (now - _epoch).total_microseconds();
+	const uint64_t due = (elapsed < 0) ? 0 : (elapsed / _tick.total_microseconds()) + 1; // First tick not yet passed
+	while (_current < due) {
+		for (unsigned level = 1; level < WHEEL_LEVELS; level++) {
+			if ((_current & ((static_cast<uint64_t>(1) << (level * WHEEL_BITS)) - 1)) == 0)
+				cascade(level);
+			else
+				break;
+		}
+		auto& slot = _wheel[0][_current & WHEEL_MASK];
+		TimerEntry* entries = slot;
+		slot = NULL;
+		if (entries)
+			entries->pprev = &entries;
+		_current++;
+
+		// Timers armed from here on land in later ticks, and clearing unlinks from /entries/ as well
+		while (auto entry = entries) {
+			auto timer = entry->timer;
+			auto deadline = entry->deadline;
+			clear(entry);
+			timer->invoke(deadline, now);
+		}
 	}
-	enable();
+	scheduleNext();
 }
 
 Timer::Timer(TimerService& ts, const Timer::Target& target)
-	: _ts(&ts), _target(target)
+	: _ts(&ts), _target(target), _entries(NULL)
 {
 }
 
 Timer::Timer(const Timer& other) :
-	_ts(other._ts), _target(other._target)
+	_ts(other._ts), _target(other._target), _entries(NULL)
 {
-	for (auto iter = _ts->_timers.cbegin(); iter != _ts->_timers.cend(); iter++) {
-		if (iter->second == &other)
-			_ts->arm(iter->first, this);
-	}
+	copyDeadlines(other);
 }
 
 Timer::~Timer()
@@ -91,13 +250,15 @@ Timer& Timer::operator=(const Timer& other)
 	clear();
 	_ts = other._ts;
 	_target = other._target;
-	for (auto iter = _ts->_timers.cbegin(); iter != _ts->_timers.cend(); iter++) {
-		if (iter->second == &other)
-			_ts->arm(iter->first, this);
-	}
+	copyDeadlines(other);
 	return *this;
 }
 
+void Timer::copyDeadlines(const Timer& other)
+{
+	for (auto entry = other._entries; entry; entry = entry->timerNext)
+		_ts->arm(entry->deadline, this);
+}
 
 void Timer::arm(boost::posix_time::ptime deadline)
 {
@@ -106,14 +267,14 @@ void Timer::arm(boost::posix_time::ptime deadline)
 
 void Timer::arm(boost::posix_time::time_duration in)
 {
-	auto deadline = boost::posix_time::microsec_clock::universal_time() + in;
+	auto deadline = _ts->now() + in;
 	_ts->arm(deadline, this);
 }
 
 void Timer::clear() {
-	_ts->clear(this);
+	while (_entries)
+		_ts->clear(_entries);
 }
-
 void Timer::invoke(const boost::posix_time::ptime& scheduled_at, const boost::posix_time::ptime& now)
 {
 	_target(now);
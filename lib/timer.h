@@ -20,22 +20,80 @@
 
 #include <boost/asio/deadline_timer.hpp>
 #include <functional>
-#include <map>
+#include <memory>
+#include <vector>
 
 class Timer;
 
+/**
+ * A pending deadline of a Timer. Linked both into a slot of the wheel, and into the list of its Timer.
+ */
+struct TimerEntry {
+	TimerEntry* next;
+	TimerEntry** pprev;
+	TimerEntry* timerNext;
+	TimerEntry** timerPprev;
+	Timer* timer;
+	boost::posix_time::ptime deadline;
+	uint64_t tick;
+};
+
+/**
+ * Hierarchical timing-wheel, with WHEEL_LEVELS levels of 2^WHEEL_BITS slots. Deadlines are rounded up
+ * to whole ticks, and all timers due in the same tick are run from a single wakeup. Arming and clearing
+ * are O(1), timers far out are cascaded down to finer levels as they come closer.
+ *
+ * Time is read from a Clock, the system clock by default.
+ */
 class TimerService : public std::enable_shared_from_this<TimerService> {
 friend class Timer;
-	std::multimap<boost::posix_time::ptime, Timer*> _timers;
+public:
+	typedef std::function<boost::posix_time::ptime ()> Clock;
+private:
+	static const unsigned WHEEL_BITS = 8;
+	static const unsigned WHEEL_LEVELS = 4;
+	static const uint64_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+	static const uint64_t WHEEL_MASK = WHEEL_SLOTS - 1;
+
 	boost::asio::deadline_timer _timer;
+	Clock _clock;
+	boost::posix_time::ptime _epoch;
+	boost::posix_time::time_duration _tick;
+	uint64_t _current; // Next tick to run
+	uint64_t _wakeTick; // Tick _timer is set to expire at
+	std::size_t _armed;
+	TimerEntry* _wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+	std::vector<TimerEntry*> _free;
 public:
 	typedef std::shared_ptr<TimerService> Ptr;
-	TimerService(boost::asio::io_service& ioSvc);
+	TimerService(boost::asio::io_service& ioSvc, boost::posix_time::time_duration tick=boost::posix_time::milliseconds(1), const Clock& clock=Clock());
+	TimerService(const TimerService&) = delete;
+	~TimerService();
+
+	/**
+	 * Number of pending deadlines, over all timers
+	 */
+	std::size_t armed() const;
+
+	/**
+	 * The current time, by the Clock of the service
+	 */
+	boost::posix_time::ptime now() const;
+
+	/**
+	 * Runs the timers due by now(). Run by the service itself as deadlines pass on the system clock,
+	 * and by whoever drives a Clock of their own.
+	 */
+	void runDue();
 protected:
-	void arm(boost::posix_time::ptime deadline, Timer* t);
-	void clear(const Timer* t);
+	TimerEntry* arm(boost::posix_time::ptime deadline, Timer* t);
+	void clear(TimerEntry* entry);
 private:
-	void enable();
+	uint64_t tickOf(const boost::posix_time::ptime& t) const;
+	void insert(TimerEntry* entry);
+	void cascade(unsigned level);
+	void schedule(uint64_t tick);
+	void scheduleNext();
 	void invoke(boost::system::error_code ec);
 };
 
@@ -47,6 +105,7 @@ public:
 private:
 	TimerService* _ts;
 	Target _target;
+	TimerEntry* _entries;
 public:
 	Timer(TimerService& ts, const Target& target);
 
@@ -54,11 +113,20 @@ public:
 	virtual ~Timer();
 	Timer& operator=(const Timer& other);
 
+	/**
+	 * Schedule the timer to run at /deadline/. A timer may be armed several times, and then runs once
+	 * for each deadline.
+	 */
 	void arm(boost::posix_time::ptime deadline);
 	void arm(boost::posix_time::time_duration in);
+	/**
+	 * Drop all pending deadlines
+	 */
 	void clear();
 protected:
 	virtual void invoke(const boost::posix_time::ptime& scheduled_at, const boost::posix_time::ptime& now);
+private:
+	void copyDeadlines(const Timer& other);
 };
 
 class PeriodicTimer : public Timer {
@@ -45,6 +45,11 @@ struct Buffer {
 
 namespace bithorde {
 typedef ::google::protobuf::RepeatedField<uint64_t> RouteTrace;
+
+// Largest content of a Read.Response or DataSegment, peers may agree on in HandShake
+const size_t MAX_CHUNK_SIZE = 4*1024*1024;
+// Largest content of a Read.Response or DataSegment, for peers not negotiating chunk-size
+const size_t LEGACY_CHUNK_SIZE = 128*1024;
 }
 
 #endif // BITHORDE_TYPES_H
@@ -27,6 +27,12 @@ MSG_REV_MAP = {
     message.DataSegment:   8,
     message.HandShakeConfirmed: 9,
     message.Ping: 10,
+    message.Credit: 11,
+    message.Read.Stream: 12,
+    message.SharedMemory: 13,
+    message.LocalFile: 14,
+    message.BindReadBatch: 15,
+    message.AssetStatusBatch: 16,
 }
 DEFAULT_TIMEOUT=4000
 
@@ -0,0 +1,181 @@
+#include <cstring>
+
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/chrono.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "lib/cipher.h"
+#include "lib/connection.h"
+
+using namespace std;
+
+const string KEY("0123456789abcdef");
+const string IV("fedcba9876543210");
+const size_t BENCHMARK_BYTES = 64*1024*1024;
+
+/**
+ * io_service with worker threads, for the duration of a test
+ */
+struct Workers {
+	boost::asio::io_service ioSvc;
+	boost::asio::io_service::work work;
+	boost::thread_group threads;
+
+	Workers(int count) : work(ioSvc) {
+		for (int i=0; i < count; i++)
+			threads.create_thread([=]{ ioSvc.run(); });
+	}
+	~Workers() {
+		ioSvc.stop();
+		threads.join_all();
+	}
+};
+
+/**
+ * Runs /cipher/ over /segments/ on /workers/, waiting for completion
+ */
+static void processOn(bithorde::StreamCipher& cipher, Workers& workers, const vector<bithorde::StreamCipher::Segment>& segments) {
+	boost::asio::io_service ioSvc;
+	boost::asio::io_service::work work(ioSvc);
+	bool done = false;
+	cipher.processOn(workers.ioSvc, ioSvc, segments, [&]{
+		done = true;
+		ioSvc.stop();
+	});
+	ioSvc.run();
+	BOOST_REQUIRE( done );
+}
+
+static vector<byte> pattern(size_t size) {
+	vector<byte> res(size);
+	for (size_t i=0; i < size; i++)
+		res[i] = i % 251;
+	return res;
+}
+
+static void checkParallelMatchesSequential(bithorde::CipherType type) {
+	auto plaintext = pattern(1024*1024 + 17);
+	vector<byte> sequential(plaintext.size()), parallel(plaintext.size());
+
+	bithorde::StreamCipher reference(type, KEY, IV);
+	reference.process(sequential.data(), plaintext.data(), 100);
+	reference.process(sequential.data()+100, plaintext.data()+100, plaintext.size()-100);
+
+	// Mix of in-place processing and processing on workers, in odd segments
+	Workers workers(4);
+	auto cipher = make_shared<bithorde::StreamCipher>(type, KEY, IV);
+	memcpy(parallel.data(), plaintext.data(), plaintext.size());
+	cipher->process(parallel.data(), parallel.data(), 100);
+	vector<bithorde::StreamCipher::Segment> segments{
+		{parallel.data()+100, parallel.data()+100, 300*1024},
+		{parallel.data()+100+300*1024, plaintext.data()+100+300*1024, 0},
+		{parallel.data()+100+300*1024, plaintext.data()+100+300*1024, plaintext.size()-(100+300*1024+1000)},
+	};
+	processOn(*cipher, workers, segments);
+	cipher->process(parallel.data()+plaintext.size()-1000, plaintext.data()+plaintext.size()-1000, 1000);
+
+	BOOST_CHECK( sequential == parallel );
+	BOOST_CHECK( sequential != plaintext );
+}
+
+BOOST_AUTO_TEST_CASE( cipher_aes_parallel )
+{
+	BOOST_CHECK( bithorde::StreamCipher(bithorde::AES_CTR, KEY, IV).seekable() );
+	checkParallelMatchesSequential(bithorde::AES_CTR);
+}
+
+BOOST_AUTO_TEST_CASE( cipher_rc4_offloaded )
+{
+	BOOST_CHECK( !bithorde::StreamCipher(bithorde::RC4, KEY, IV).seekable() );
+	checkParallelMatchesSequential(bithorde::RC4);
+}
+
+BOOST_AUTO_TEST_CASE( cipher_connection_offloaded )
+{
+	typedef boost::asio::local::stream_protocol::socket Socket;
+	Workers workers(2);
+	boost::asio::io_service ioSvc;
+	auto ts = std::make_shared<TimerService>(ioSvc);
+	auto sendSocket = std::make_shared<Socket>(ioSvc);
+	auto recvSocket = std::make_shared<Socket>(ioSvc);
+	boost::asio::local::connect_pair(*sendSocket, *recvSocket);
+	auto sender = bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), sendSocket);
+	auto receiver = bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), recvSocket);
+	sender->setCipherWorkers(&workers.ioSvc);
+	receiver->setCipherWorkers(&workers.ioSvc);
+	sender->setEncryption(bithorde::AES_CTR, KEY, IV);
+	receiver->setDecryption(bithorde::AES_CTR, KEY, IV);
+
+	const size_t MESSAGES = 64;
+	size_t received = 0;
+	receiver->setCallback([&](bithorde::Connection::MessageType type, const google::protobuf::Message& msg, const bithorde::IBuffer::Ptr& payload) {
+		const auto& resp = dynamic_cast<const bithorde::Read::Response&>(msg);
+		BOOST_CHECK_EQUAL( resp.reqid(), received );
+		BOOST_REQUIRE( payload );
+		auto expected = pattern(payload->size());
+		BOOST_CHECK( memcmp(**payload, expected.data(), expected.size()) == 0 );
+		if (++received == MESSAGES)
+			ioSvc.stop();
+	});
+
+	auto content = pattern(64*1024);
+	auto chunk = std::make_shared<bithorde::MemoryBuffer>(content.size());
+	memcpy(**chunk, content.data(), content.size());
+	size_t sent = 0;
+	auto fill = [&]() {
+		// Send until the queue is full, and continue when it drains
+		while (sent < MESSAGES) {
+			bithorde::Read::Response resp;
+			resp.set_reqid(sent);
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(sent*chunk->size());
+			if (!sender->sendMessage(bithorde::Connection::ReadResponse, resp, bithorde::Read::Response::kContentFieldNumber, chunk, bithorde::Message::NEVER, false))
+				break;
+			sent++;
+		}
+	};
+	sender->writable.connect(fill);
+	fill();
+	ioSvc.run();
+
+	BOOST_CHECK_EQUAL( received, MESSAGES );
+	sender->close();
+	receiver->close();
+}
+
+BOOST_AUTO_TEST_CASE( cipher_benchmark )
+{
+	typedef boost::chrono::steady_clock Clock;
+	const size_t BATCH = 1024*1024;
+	auto plaintext = pattern(BATCH);
+	vector<byte> ciphertext(BATCH);
+	const int cores = std::max(boost::thread::hardware_concurrency(), 2u);
+
+	auto report = [&](const char* name, Clock::time_point start) {
+		auto elapsed = boost::chrono::duration<double>(Clock::now() - start).count();
+		BOOST_TEST_MESSAGE( "  " << name << (BENCHMARK_BYTES / elapsed / (1024*1024)) << " MB/s" );
+	};
+	BOOST_TEST_MESSAGE( "Stream cipher throughput, " << (BENCHMARK_BYTES/(1024*1024)) << "MB in " << (BATCH/1024) << "KB batches:" );
+
+	auto start = Clock::now();
+	for (size_t i=0; i < BENCHMARK_BYTES / BATCH; i++)
+		memcpy(ciphertext.data(), plaintext.data(), BATCH);
+	report("cleartext (copy):     ", start);
+
+	bithorde::CipherType types[] = { bithorde::AES_CTR, bithorde::RC4 };
+	for (auto type : types) {
+		auto cipher = make_shared<bithorde::StreamCipher>(type, KEY, IV);
+		start = Clock::now();
+		for (size_t i=0; i < BENCHMARK_BYTES / BATCH; i++)
+			cipher->process(ciphertext.data(), plaintext.data(), BATCH);
+		report((type == bithorde::AES_CTR) ? "AES_CTR, in place:     " : "RC4, in place:         ", start);
+
+		Workers workers(cores);
+		vector<bithorde::StreamCipher::Segment> segments{ {ciphertext.data(), plaintext.data(), BATCH} };
+		start = Clock::now();
+		for (size_t i=0; i < BENCHMARK_BYTES / BATCH; i++)
+			processOn(*cipher, workers, segments);
+		report((type == bithorde::AES_CTR) ? "AES_CTR, on workers:   " : "RC4, on workers:       ", start);
+	}
+}
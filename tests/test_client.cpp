@@ -0,0 +1,1390 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <new>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/asset.h"
+#include "lib/buffer.hpp"
+#include "lib/client.h"
+#include "lib/sequentialreader.h"
+#include "lib/sharedmemory.h"
+
+#include "test_client.hpp"
+
+using namespace std;
+
+const uint64_t STREAMED_ASSET_SIZE = 1024*1024;
+const size_t STREAM_CHUNK = 64*1024;
+
+/**
+ * Serves any bound asset as STREAMED_ASSET_SIZE bytes of the pattern, through Read.Stream only. Plain
+ * Read.Requests are refused.
+ */
+class StreamServer : public PatternServer {
+public:
+	typedef std::shared_ptr<StreamServer> Ptr;
+	boost::asio::io_service& loop;
+	std::map<int, uint64_t> streams; // reqId -> next offset to push
+	int closed;
+
+	static Ptr create(boost::asio::io_service& ioSvc) {
+		return Ptr(new StreamServer(ioSvc));
+	}
+protected:
+	StreamServer(boost::asio::io_service& ioSvc) :
+		PatternServer(ioSvc, STREAMED_ASSET_SIZE),
+		loop(ioSvc),
+		closed(0)
+	{
+		setAcceptReadStreams(true);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Read::Request> >& msgCtx) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(msgCtx->message().reqid());
+		resp.set_status(bithorde::NOTFOUND);
+		sendMessage(bithorde::Connection::ReadResponse, resp);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Read::Stream> >& msgCtx) {
+		const auto& msg = msgCtx->message();
+		if (msg.size() == 0) {
+			streams.erase(msg.reqid());
+			closed++;
+			loop.stop();
+			return;
+		}
+		auto& position = streams.insert(std::make_pair(msg.reqid(), msg.offset())).first->second;
+		auto end = std::min(msg.offset() + msg.size(), STREAMED_ASSET_SIZE);
+		for (; position < end; position += STREAM_CHUNK) {
+			auto chunk = patternChunk(position, std::min<uint64_t>(STREAM_CHUNK, end - position));
+			bithorde::Read::Response resp;
+			resp.set_reqid(msg.reqid());
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(position);
+			BOOST_CHECK( sendReadResponse(msg.handle(), resp, chunk) );
+		}
+	}
+};
+
+const uint64_t LATENCY_ASSET_SIZE = 8*1024*1024;
+
+/**
+ * Serves any bound asset as LATENCY_ASSET_SIZE bytes of the pattern, answering each Read.Request after
+ * a latency, plus up to /jitter/ more. Responses not fitting in the send-queue are held back until
+ * writable. Read.Stream is not supported.
+ */
+class LatencyServer : public PatternServer {
+public:
+	typedef std::shared_ptr<LatencyServer> Ptr;
+	boost::asio::io_service& loop;
+	boost::posix_time::time_duration latency;
+	int jitterUs;
+	size_t requests;
+	std::deque< std::pair<bithorde::Read::Request, bithorde::Read::Response> > held;
+
+	static Ptr create(boost::asio::io_service& ioSvc, const boost::posix_time::time_duration& latency, const boost::posix_time::time_duration& jitter) {
+		return Ptr(new LatencyServer(ioSvc, latency, jitter));
+	}
+protected:
+	LatencyServer(boost::asio::io_service& ioSvc, const boost::posix_time::time_duration& latency, const boost::posix_time::time_duration& jitter) :
+		PatternServer(ioSvc, LATENCY_ASSET_SIZE),
+		loop(ioSvc),
+		latency(latency),
+		jitterUs(jitter.total_microseconds()),
+		requests(0)
+	{
+		writable.connect([this]() {
+			while (!held.empty() && respond(held.front().first, held.front().second))
+				held.pop_front();
+		});
+	}
+
+	bool respond(const bithorde::Read::Request& req, const bithorde::Read::Response& resp) {
+		auto end = std::min(req.offset() + req.size(), LATENCY_ASSET_SIZE);
+		return sendReadResponse(req.handle(), resp, patternChunk(req.offset(), end - req.offset()));
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Read::Request> >& msgCtx) {
+		const auto msg = msgCtx->message();
+		requests++;
+		auto delay = latency + boost::posix_time::microseconds(jitterUs ? rand() % jitterUs : 0);
+		auto timer = std::make_shared<boost::asio::deadline_timer>(loop, delay);
+		auto self = shared_from_this();
+		timer->async_wait([this, self, timer, msg](const boost::system::error_code& ec) {
+			if (ec)
+				return;
+			bithorde::Read::Response resp;
+			resp.set_reqid(msg.reqid());
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(msg.offset());
+			if (!held.empty() || !respond(msg, resp))
+				held.push_back(std::make_pair(msg, resp));
+		});
+	}
+};
+
+/**
+ * Serves any bound asset as STREAMED_ASSET_SIZE bytes of the pattern. Read.Requests are kept, and
+ * answered only through answer(). Counts the Credit granted by the peer.
+ */
+class CreditServer : public PatternServer {
+public:
+	typedef std::shared_ptr<CreditServer> Ptr;
+	std::vector<bithorde::Read::Request> requests;
+	size_t credits, credited;
+
+	static Ptr create(boost::asio::io_service& ioSvc, uint32_t window) {
+		return Ptr(new CreditServer(ioSvc, window));
+	}
+
+	bool answer(const bithorde::Read::Request& req) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(req.reqid());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(req.offset());
+		return sendReadResponse(req.handle(), resp, patternChunk(req.offset(), req.size()));
+	}
+protected:
+	CreditServer(boost::asio::io_service& ioSvc, uint32_t window) :
+		PatternServer(ioSvc, STREAMED_ASSET_SIZE),
+		credits(0),
+		credited(0)
+	{
+		setCreditWindow(window);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Read::Request> >& msgCtx) {
+		requests.push_back(msgCtx->message());
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Credit> >& msgCtx) {
+		credits++;
+		credited += msgCtx->message().bytes();
+		bithorde::Client::onMessage(msgCtx);
+	}
+};
+
+/**
+ * Creates plain clients, offering /window/ bytes of credit per handle
+ */
+static std::function<bithorde::Client::Pointer(boost::asio::io_service&)> creditedClient(uint32_t window) {
+	return [window](boost::asio::io_service& ioSvc) {
+		auto client = bithorde::Client::create(ioSvc, "a");
+		client->setCreditWindow(window);
+		return client;
+	};
+}
+
+/**
+ * Client exposing its message-dispatch, to be fed responses directly
+ */
+class DispatchClient : public bithorde::Client {
+public:
+	typedef std::shared_ptr<DispatchClient> Ptr;
+
+	static Ptr create(boost::asio::io_service& ioSvc) {
+		return Ptr(new DispatchClient(ioSvc));
+	}
+
+	using bithorde::Client::onIncomingMessage;
+protected:
+	DispatchClient(boost::asio::io_service& ioSvc) :
+		bithorde::Client(ioSvc, "dispatch")
+	{}
+};
+
+/**
+ * Two clients, handshaking over a socket-pair with chunk-sizes /offerA/ and /offerB/
+ */
+struct ClientPair {
+	typedef boost::asio::local::stream_protocol::socket Socket;
+	boost::asio::io_service ioSvc;
+	bithorde::Client::Pointer a, b;
+
+	ClientPair(uint32_t offerA, uint32_t offerB) :
+		a(bithorde::Client::create(ioSvc, "a")),
+		b(bithorde::Client::create(ioSvc, "b"))
+	{
+		hookup(offerA, offerB);
+	}
+
+	ClientPair(const std::function<bithorde::Client::Pointer(boost::asio::io_service&)>& createB) :
+		a(bithorde::Client::create(ioSvc, "a")),
+		b(createB(ioSvc))
+	{
+		hookup(0, 0);
+	}
+
+	ClientPair(const std::function<bithorde::Client::Pointer(boost::asio::io_service&)>& createA,
+	           const std::function<bithorde::Client::Pointer(boost::asio::io_service&)>& createB) :
+		a(createA(ioSvc)),
+		b(createB(ioSvc))
+	{
+		hookup(0, 0);
+	}
+
+	void hookup(uint32_t offerA, uint32_t offerB) {
+		a->setMaxChunkSize(offerA);
+		b->setMaxChunkSize(offerB);
+
+		auto ts = std::make_shared<TimerService>(ioSvc);
+		auto socketA = std::make_shared<Socket>(ioSvc);
+		auto socketB = std::make_shared<Socket>(ioSvc);
+		boost::asio::local::connect_pair(*socketA, *socketB);
+
+		int authenticated = 0;
+		auto onAuthenticated = [&](bithorde::Client&, const std::string& peerName) {
+			BOOST_CHECK( !peerName.empty() );
+			if (++authenticated == 2)
+				ioSvc.stop();
+		};
+		a->authenticated.connect(onAuthenticated);
+		b->authenticated.connect(onAuthenticated);
+		a->connect(bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), socketA));
+		b->connect(bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), socketB));
+		ioSvc.run();
+		BOOST_REQUIRE_EQUAL( authenticated, 2 );
+	}
+
+	/**
+	 * Runs ioSvc until /done/, or for at most /ms/ milliseconds, even if stopped. Returns done().
+	 */
+	bool runUntil(const std::function<bool()>& done, int ms=2000) {
+		auto expired = std::make_shared<bool>(false);
+		boost::asio::deadline_timer timer(ioSvc, boost::posix_time::milliseconds(ms));
+		timer.async_wait([expired](const boost::system::error_code& err) { *expired = !err; });
+		while (!done() && !*expired) {
+			if (ioSvc.stopped())
+				ioSvc.reset();
+			ioSvc.run_one();
+		}
+		return done();
+	}
+
+	~ClientPair() {
+		a->close();
+		b->close();
+	}
+};
+
+BOOST_AUTO_TEST_CASE( chunk_size_negotiation )
+{
+	{
+		ClientPair pair(1024*1024, 4*1024*1024);
+		BOOST_CHECK_EQUAL( pair.a->maxChunkSize(), 1024*1024 );
+		BOOST_CHECK_EQUAL( pair.b->maxChunkSize(), 1024*1024 );
+	}
+	{
+		// Peer not offering keeps to the legacy limit
+		ClientPair pair(1024*1024, 0);
+		BOOST_CHECK_EQUAL( pair.a->maxChunkSize(), bithorde::LEGACY_CHUNK_SIZE );
+		BOOST_CHECK_EQUAL( pair.b->maxChunkSize(), bithorde::LEGACY_CHUNK_SIZE );
+	}
+	{
+		// Offers are capped
+		ClientPair pair(64*1024*1024, 64*1024*1024);
+		BOOST_CHECK_EQUAL( pair.a->maxChunkSize(), bithorde::MAX_CHUNK_SIZE );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( read_stream )
+{
+	StreamServer::Ptr server;
+	ClientPair pair([&](boost::asio::io_service& ioSvc) {
+		return server = StreamServer::create(ioSvc);
+	});
+	BOOST_CHECK( pair.a->readStreams() );
+	BOOST_CHECK( !pair.b->readStreams() );
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+
+	std::string received;
+	int chunks = 0;
+	uint64_t target = 0;
+	asset->dataArrived.connect([&](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		BOOST_REQUIRE_EQUAL( offset, received.size() );
+		BOOST_REQUIRE( data->size() > 0 );
+		received.append(reinterpret_cast<char*>(**data), data->size());
+		chunks++;
+		if (received.size() >= target)
+			pair.ioSvc.stop();
+	});
+
+	// One request, many chunks
+	target = 256*1024;
+	auto tag = asset->aSyncStream(0, target);
+	BOOST_REQUIRE( tag >= 0 );
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_CHECK_EQUAL( received.size(), target );
+	BOOST_CHECK_EQUAL( chunks, target / STREAM_CHUNK );
+
+	// Extending the range resumes the stream
+	target = 512*1024;
+	BOOST_CHECK( asset->extendStream(tag, target) );
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_CHECK_EQUAL( received.size(), target );
+	for (size_t i=0; i < received.size(); i++) {
+		if ((uint8_t)received[i] != i % 251)
+			BOOST_FAIL( "Streamed data mismatch at " << i );
+	}
+
+	// Cancelling closes it at the server
+	asset->cancelStream(tag);
+	BOOST_CHECK( !asset->extendStream(tag, STREAMED_ASSET_SIZE) );
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_CHECK_EQUAL( server->closed, 1 );
+	BOOST_CHECK( server->streams.empty() );
+}
+
+BOOST_AUTO_TEST_CASE( read_stream_unsupported )
+{
+	ClientPair pair(0, 0);
+	BOOST_CHECK( !pair.a->readStreams() );
+
+	auto ids = testIds();
+	bithorde::ReadAsset asset(pair.a, ids);
+	BOOST_CHECK_EQUAL( asset.aSyncStream(0, 1024), -1 );
+}
+
+BOOST_AUTO_TEST_CASE( closed_stream_returns_credit )
+{
+	const uint32_t WINDOW = 4*STREAM_CHUNK;
+	StreamServer::Ptr server;
+	ClientPair pair(creditedClient(WINDOW), [&](boost::asio::io_service& ioSvc) {
+		server = StreamServer::create(ioSvc);
+		server->setCreditWindow(WINDOW);
+		return server;
+	});
+	BOOST_REQUIRE( pair.a->flowControlled() );
+	BOOST_REQUIRE( server->flowControlled() );
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+	std::map<int, uint64_t> received; // By tag
+	asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int tag) {
+		received[tag] += data->size();
+	});
+
+	// Closed after the first chunk, while the server has pushed as much as the window allows
+	auto first = asset->aSyncStream(0, STREAMED_ASSET_SIZE);
+	BOOST_REQUIRE( first >= 0 );
+	BOOST_REQUIRE( pair.runUntil([&]() { return received[first] > 0; }) );
+	asset->cancelStream(first);
+	auto delivered = received[first];
+	BOOST_REQUIRE( pair.runUntil([&]() { return server->closed == 1; }) );
+	BOOST_CHECK_LT( delivered, STREAMED_ASSET_SIZE );
+
+	// The chunks in flight are credited back as they arrive, so the handle can be read again
+	auto second = asset->aSyncStream(0, STREAMED_ASSET_SIZE);
+	BOOST_REQUIRE( second >= 0 );
+	BOOST_CHECK( pair.runUntil([&]() { return received[second] == STREAMED_ASSET_SIZE; }) );
+	BOOST_CHECK_EQUAL( received[first], delivered );
+}
+
+BOOST_AUTO_TEST_CASE( credit_holds_responses_until_granted )
+{
+	const uint32_t WINDOW = 8*STREAM_CHUNK;
+	const size_t READS = 12;
+	CreditServer::Ptr server;
+	ClientPair pair(creditedClient(WINDOW), [&](boost::asio::io_service& ioSvc) {
+		return server = CreditServer::create(ioSvc, WINDOW);
+	});
+	BOOST_REQUIRE( server->flowControlled() );
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+	std::deque< std::shared_ptr<bithorde::IBuffer> > kept; // Not consumed, so not credited
+	size_t arrived = 0;
+	asset->dataArrived.connect([&](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		BOOST_CHECK_EQUAL( data->size(), STREAM_CHUNK );
+		BOOST_CHECK( PatternServer::matchesPattern(offset, **data, data->size()) );
+		kept.push_back(data);
+		arrived++;
+	});
+	for (size_t i=0; i < READS; i++)
+		BOOST_REQUIRE( asset->aSyncRead(i*STREAM_CHUNK, STREAM_CHUNK, 10000) >= 0 );
+	BOOST_REQUIRE( pair.runUntil([&]() { return server->requests.size() == READS; }) );
+
+	// All answered at once, but no more is sent than the window
+	auto handle = server->requests.front().handle();
+	for (auto iter = server->requests.begin(); iter != server->requests.end(); iter++)
+		BOOST_CHECK( server->answer(*iter) );
+	BOOST_CHECK( !server->canSendReadResponse(handle) );
+	BOOST_CHECK( !pair.runUntil([&]() { return arrived > WINDOW / STREAM_CHUNK; }, 200) );
+	BOOST_CHECK_EQUAL( arrived, WINDOW / STREAM_CHUNK );
+
+	// Credit is returned once a quarter of the window is consumed, and lets held responses through
+	kept.pop_front();
+	BOOST_CHECK( !pair.runUntil([&]() { return server->credits > 0; }, 200) );
+	kept.pop_front();
+	BOOST_REQUIRE( pair.runUntil([&]() { return server->credits == 1; }) );
+	BOOST_CHECK_GE( server->credited, WINDOW / 4 );
+	BOOST_CHECK( pair.runUntil([&]() { return arrived == WINDOW / STREAM_CHUNK + 2; }) );
+	BOOST_CHECK( !pair.runUntil([&]() { return arrived > WINDOW / STREAM_CHUNK + 2; }, 200) );
+
+	// Consuming everything lets the rest through
+	kept.clear();
+	BOOST_CHECK( pair.runUntil([&]() { kept.clear(); return arrived == READS; }) );
+	BOOST_CHECK( pair.runUntil([&]() { return server->canSendReadResponse(handle); }) );
+}
+
+BOOST_AUTO_TEST_CASE( credit_refuses_past_held_limit )
+{
+	const uint32_t WINDOW = 4*STREAM_CHUNK;
+	CreditServer::Ptr server;
+	ClientPair pair(creditedClient(WINDOW), [&](boost::asio::io_service& ioSvc) {
+		return server = CreditServer::create(ioSvc, WINDOW);
+	});
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+	BOOST_REQUIRE( asset->aSyncRead(0, STREAM_CHUNK, 10000) >= 0 );
+	BOOST_REQUIRE( pair.runUntil([&]() { return server->requests.size() == 1; }) );
+
+	// Without running the loop, no credit comes back. Past the window, responses are held up to the limit.
+	size_t accepted = 0;
+	while (server->answer(server->requests.front()) && (accepted < 1000))
+		accepted++;
+	BOOST_CHECK_EQUAL( accepted, (WINDOW + bithorde::MAX_HELD_BYTES) / STREAM_CHUNK );
+}
+
+BOOST_AUTO_TEST_CASE( credited_bytes_keep_connection_listening )
+{
+	// More than the connection may allocate uncredited, but within the window
+	const uint32_t WINDOW = 16*STREAM_CHUNK;
+	const size_t READS = 12;
+	CreditServer::Ptr server;
+	ClientPair pair(creditedClient(WINDOW), [&](boost::asio::io_service& ioSvc) {
+		return server = CreditServer::create(ioSvc, WINDOW);
+	});
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+	std::vector< std::shared_ptr<bithorde::IBuffer> > kept;
+	asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		kept.push_back(data);
+	});
+	for (size_t i=0; i < READS; i++)
+		BOOST_REQUIRE( asset->aSyncRead(i*STREAM_CHUNK, STREAM_CHUNK, 10000) >= 0 );
+	BOOST_REQUIRE( pair.runUntil([&]() { return server->requests.size() == READS; }) );
+	for (auto iter = server->requests.begin(); iter != server->requests.end(); iter++)
+		BOOST_CHECK( server->answer(*iter) );
+	BOOST_CHECK( pair.runUntil([&]() { return kept.size() == READS; }) );
+	BOOST_CHECK( pair.runUntil([&]() { return pair.a->bytesAllocated() >= READS*STREAM_CHUNK; }) );
+}
+
+BOOST_AUTO_TEST_CASE( timed_out_read_returns_credit )
+{
+	const uint32_t WINDOW = 4*STREAM_CHUNK;
+	CreditServer::Ptr server;
+	ClientPair pair(creditedClient(WINDOW), [&](boost::asio::io_service& ioSvc) {
+		return server = CreditServer::create(ioSvc, WINDOW);
+	});
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+	size_t failed = 0, arrived = 0;
+	asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		if (data->size())
+			arrived++;
+		else
+			failed++;
+	});
+	BOOST_REQUIRE( asset->aSyncRead(0, STREAM_CHUNK, 300) >= 0 );
+	BOOST_REQUIRE( pair.runUntil([&]() { return failed == 1; }) );
+
+	// Answered late, the response is dropped, but credited back to the server
+	BOOST_REQUIRE_EQUAL( server->requests.size(), 1 );
+	BOOST_CHECK( server->answer(server->requests.front()) );
+	BOOST_CHECK( pair.runUntil([&]() { return server->credits == 1; }) );
+	BOOST_CHECK_GE( server->credited, STREAM_CHUNK );
+	BOOST_CHECK_EQUAL( arrived, 0 );
+	BOOST_CHECK( server->canSendReadResponse(server->requests.front().handle()) );
+}
+
+/**
+ * Counts the heap-allocations of the current thread while in scope, for read_request_allocations.
+ * Outside any scope, operator new only forwards to malloc.
+ */
+struct CountAllocations {
+	static thread_local size_t* counter;
+	size_t count;
+
+	CountAllocations() : count(0) { counter = &count; }
+	~CountAllocations() { counter = NULL; }
+};
+
+thread_local size_t* CountAllocations::counter = NULL;
+
+void* operator new(std::size_t size) {
+	if (CountAllocations::counter)
+		(*CountAllocations::counter)++;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+BOOST_AUTO_TEST_CASE( read_request_allocations )
+{
+	StreamServer::Ptr server;
+	ClientPair pair([&](boost::asio::io_service& ioSvc) {
+		return server = StreamServer::create(ioSvc);
+	});
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+
+	size_t cancelled = 0;
+	asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		if (data->size() == 0)
+			cancelled++;
+	});
+
+	// Issues reads and cancels them, while the requests are written out and refused by the server,
+	// which is what releases the reqIds.
+	const size_t BATCH = 64, BATCHES = 256, READS = BATCH*BATCHES;
+	const auto& slabs = pair.a->slabs();
+	pair.ioSvc.reset();
+	auto round = [&]() {
+		size_t failed = 0, allocations = 0;
+		for (size_t batch = 0; batch < BATCHES; batch++) {
+			{
+				// Not while the requests are written out, only while issuing and cancelling
+				CountAllocations counted;
+				for (size_t i = 0; i < BATCH; i++) {
+					if (asset->aSyncRead((i % 1024) * 1024, 1024) < 0)
+						failed++;
+				}
+				asset->cancelRequests();
+				allocations += counted.count;
+			}
+			pair.ioSvc.poll();
+		}
+		BOOST_CHECK_EQUAL( failed, 0 );
+		return double(allocations) / READS;
+	};
+
+	round(); // Warm up the pools
+	const auto drawn = slabs->drawn();
+	auto perRead = round();
+	BOOST_TEST_MESSAGE( "read_request_allocations: " << perRead << " heap-allocations per read, "
+		<< drawn << " blocks drawn from the heap warming up, " << slabs->pooled() << " pooled" );
+	BOOST_CHECK_EQUAL( cancelled, 2*READS );
+	// Once warm, the per-read state is all recycled
+	BOOST_CHECK_GT( drawn, 0 );
+	BOOST_CHECK_EQUAL( slabs->drawn(), drawn );
+}
+
+BOOST_AUTO_TEST_CASE( read_response_dispatch )
+{
+	DispatchClient::Ptr client;
+	ClientPair pair([&](boost::asio::io_service& ioSvc) {
+		return client = DispatchClient::create(ioSvc);
+	}, [&](boost::asio::io_service& ioSvc) {
+		return StreamServer::create(ioSvc);
+	});
+
+	const size_t ASSETS = 64, OUTSTANDING = 4096, ROUNDS = 4;
+	auto ids = testIds();
+	std::vector< std::unique_ptr<bithorde::ReadAsset> > assets;
+	size_t bound = 0, delivered = 0;
+	for (size_t i=0; i < ASSETS; i++) {
+		assets.emplace_back(new bithorde::ReadAsset(pair.a, ids));
+		auto& asset = *assets.back();
+		asset.statusUpdate.connect([&](const bithorde::AssetStatus& s) {
+			if ((s.status() == bithorde::SUCCESS) && (++bound == ASSETS))
+				pair.ioSvc.stop();
+		});
+		asset.dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+			if (data->size() == 1024)
+				delivered++;
+		});
+		BOOST_REQUIRE( pair.a->bind(asset) );
+	}
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_REQUIRE_EQUAL( bound, ASSETS );
+
+	// The requests are left queued towards the server. Responses are fed straight to the client.
+	auto payload = std::make_shared<bithorde::MemoryBuffer>(1024);
+	std::vector<bithorde::Read::Response> responses(OUTSTANDING);
+	boost::chrono::steady_clock::duration elapsed(0);
+	for (size_t round = 0; round < ROUNDS; round++) {
+		for (size_t i=0; i < OUTSTANDING; i++) {
+			auto offset = (i % 1024) * 1024;
+			auto reqId = assets[i % ASSETS]->aSyncRead(offset, 1024);
+			BOOST_REQUIRE( reqId >= 0 );
+			responses[i].set_reqid(reqId);
+			responses[i].set_status(bithorde::SUCCESS);
+			responses[i].set_offset(offset);
+		}
+		std::random_shuffle(responses.begin(), responses.end());
+		auto start = boost::chrono::steady_clock::now();
+		for (auto iter = responses.begin(); iter != responses.end(); iter++)
+			client->onIncomingMessage(bithorde::Connection::ReadResponse, *iter, payload);
+		elapsed += boost::chrono::steady_clock::now() - start;
+	}
+	BOOST_CHECK_EQUAL( delivered, OUTSTANDING*ROUNDS );
+
+	auto seconds = boost::chrono::duration<double>(elapsed).count();
+	BOOST_TEST_MESSAGE( "read_response_dispatch: " << (OUTSTANDING*ROUNDS / seconds) << " responses/s, "
+		<< OUTSTANDING << " outstanding over " << ASSETS << " assets" );
+
+	// A response to a completed request is dropped, even once its reqId is reused
+	auto stale = responses.back(); // Its slot is the first reused
+	auto reused = assets[0]->aSyncRead(0, 1024);
+	BOOST_CHECK_NE( reused, (int)stale.reqid() );
+	client->onIncomingMessage(bithorde::Connection::ReadResponse, stale, payload);
+	BOOST_CHECK_EQUAL( delivered, OUTSTANDING*ROUNDS );
+}
+
+BOOST_AUTO_TEST_CASE( sequential_reader_throughput )
+{
+	// Reads the whole asset over 20ms of latency, returning bytes/s and the window reached. Timings
+	// are only reported, being up to the machine.
+	auto fetch = [&](const char* label, size_t maxWindow, size_t minWindow) {
+		LatencyServer::Ptr server;
+		ClientPair pair([&](boost::asio::io_service& ioSvc) {
+			return server = LatencyServer::create(ioSvc, boost::posix_time::milliseconds(20), boost::posix_time::milliseconds(2));
+		});
+		auto asset = bindAsset(pair.a, pair.ioSvc);
+
+		bithorde::SequentialReader reader(*asset, maxWindow, minWindow);
+		uint64_t received = 0;
+		bool intact = true, failed = false;
+		reader.start(0, asset->size(), [&](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data) {
+			intact = intact && (offset == received) && PatternServer::matchesPattern(offset, **data, data->size());
+			received += data->size();
+			if (received == LATENCY_ASSET_SIZE)
+				pair.ioSvc.stop();
+		}, [&](uint64_t) {
+			failed = true;
+			pair.ioSvc.stop();
+		});
+		auto start = boost::chrono::steady_clock::now();
+		pair.ioSvc.reset();
+		pair.ioSvc.run();
+		auto seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+
+		BOOST_CHECK( !failed );
+		BOOST_CHECK( intact );
+		BOOST_CHECK_EQUAL( received, LATENCY_ASSET_SIZE );
+		BOOST_CHECK( !reader.streaming() );
+		BOOST_TEST_MESSAGE( "sequential_reader_throughput: " << label << " " << (received / seconds / (1024*1024)) << " MB/s, "
+			<< server->requests << " requests, window " << (reader.window() / 1024) << " KB" );
+		return std::make_pair(received / seconds, reader.window());
+	};
+
+	auto fixed = fetch("fixed 256KB window", 256*1024, 256*1024);
+	auto adaptive = fetch("adaptive window", bithorde::SequentialReader::DEFAULT_MAX_WINDOW, 0);
+	BOOST_TEST_MESSAGE( "sequential_reader_throughput: adaptive at " << (adaptive.first / fixed.first) << " times the fixed rate" );
+	BOOST_CHECK_GT( adaptive.second, 256*1024 );
+}
+
+BOOST_AUTO_TEST_CASE( sequential_reader_stream )
+{
+	StreamServer::Ptr server;
+	ClientPair pair([&](boost::asio::io_service& ioSvc) {
+		return server = StreamServer::create(ioSvc);
+	});
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+
+	// Streamed from the middle, and closed at the server once stopped
+	const uint64_t START = 100*1000;
+	bithorde::SequentialReader reader(*asset);
+	uint64_t received = START;
+	bool intact = true;
+	reader.start(START, STREAMED_ASSET_SIZE, [&](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data) {
+		BOOST_CHECK( reader.streaming() );
+		intact = intact && (offset == received) && PatternServer::matchesPattern(offset, **data, data->size());
+		received += data->size();
+		if (received == STREAMED_ASSET_SIZE)
+			reader.stop();
+	}, [&](uint64_t) {
+		BOOST_FAIL( "Stream failed" );
+	});
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_CHECK( intact );
+	BOOST_CHECK_EQUAL( received, STREAMED_ASSET_SIZE );
+	BOOST_CHECK_EQUAL( server->closed, 1 );
+	BOOST_CHECK( !reader.streaming() );
+}
+
+BOOST_AUTO_TEST_CASE( timeouts_follow_latency )
+{
+	LatencyServer::Ptr server;
+	ClientPair pair([&](boost::asio::io_service& ioSvc) {
+		return server = LatencyServer::create(ioSvc, boost::posix_time::milliseconds(1), boost::posix_time::milliseconds(0));
+	});
+	BOOST_CHECK_EQUAL( pair.a->bindTimeout(), bithorde::DEFAULT_ASSET_TIMEOUT.total_milliseconds() );
+	BOOST_CHECK_EQUAL( pair.a->readTimeout(), bithorde::DEFAULT_READ_TIMEOUT.total_milliseconds() );
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+	BOOST_CHECK_EQUAL( pair.a->bindLatency.count(), 1 );
+
+	size_t done = 0;
+	asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		BOOST_CHECK( data->size() );
+		if (++done == bithorde::ADAPTIVE_TIMEOUT_SAMPLES)
+			pair.ioSvc.stop();
+	});
+	for (size_t i=0; i < bithorde::ADAPTIVE_TIMEOUT_SAMPLES; i++)
+		BOOST_REQUIRE_GE( asset->aSyncRead(i*1024, 1024), 0 );
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_REQUIRE_EQUAL( done, bithorde::ADAPTIVE_TIMEOUT_SAMPLES );
+
+	// A fast peer gets the shortest timeout for reads, while binds are not yet measured enough
+	BOOST_CHECK_EQUAL( pair.a->readLatency.count(), bithorde::ADAPTIVE_TIMEOUT_SAMPLES );
+	BOOST_CHECK_EQUAL( pair.a->readTimeout(), bithorde::MIN_ADAPTIVE_TIMEOUT.total_milliseconds() );
+	BOOST_CHECK_EQUAL( pair.a->bindTimeout(), bithorde::DEFAULT_ASSET_TIMEOUT.total_milliseconds() );
+
+	// Reads timing out post no latency, but keep the timeout from the shortest
+	pair.a->readLatency.timedOut();
+	BOOST_CHECK_EQUAL( pair.a->readLatency.count(), bithorde::ADAPTIVE_TIMEOUT_SAMPLES );
+	BOOST_CHECK_EQUAL( pair.a->readTimeout(), bithorde::DEFAULT_READ_TIMEOUT.total_milliseconds() );
+
+	// A slow one up to the max
+	for (int i=0; i < 100; i++)
+		pair.a->readLatency.post(20000);
+	BOOST_CHECK_EQUAL( pair.a->readTimeout(), bithorde::MAX_READ_TIMEOUT.total_milliseconds() );
+}
+
+BOOST_AUTO_TEST_CASE( sequential_reader_pull )
+{
+	LatencyServer::Ptr server;
+	ClientPair pair([&](boost::asio::io_service& ioSvc) {
+		return server = LatencyServer::create(ioSvc, boost::posix_time::milliseconds(1), boost::posix_time::milliseconds(1));
+	});
+
+	auto asset = bindAsset(pair.a, pair.ioSvc);
+
+	// One read at a time, as through FUSE. Sizes not matching the blocks read ahead.
+	const size_t READ = 100*1000, TOTAL = 2*1024*1024;
+	bithorde::SequentialReader reader(*asset);
+	uint64_t offset = 0;
+	bool intact = true;
+	std::function<void ()> next = [&]() {
+		reader.read(offset, READ, [&](const byte* data, size_t size) {
+			BOOST_REQUIRE( data );
+			BOOST_REQUIRE_EQUAL( size, READ );
+			intact = intact && PatternServer::matchesPattern(offset, data, size);
+			offset += size;
+			if (offset < TOTAL)
+				next();
+			else
+				pair.ioSvc.stop();
+		});
+	};
+	next();
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_CHECK( intact );
+	BOOST_CHECK_GE( offset, TOTAL );
+	BOOST_CHECK_GE( reader.position(), offset );
+	BOOST_CHECK_GT( reader.throughput(), 0 );
+
+	// Elsewhere, read as it comes
+	std::string oneOff;
+	bool served = false;
+	reader.read(LATENCY_ASSET_SIZE - 1000, 4000, [&](const byte* data, size_t size) {
+		BOOST_REQUIRE( data );
+		served = true;
+		oneOff.assign(reinterpret_cast<const char*>(data), size);
+		pair.ioSvc.stop();
+	});
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_REQUIRE( served );
+	BOOST_CHECK_EQUAL( oneOff.size(), 1000 );
+	BOOST_CHECK( PatternServer::matchesPattern(LATENCY_ASSET_SIZE - 1000, reinterpret_cast<const byte*>(oneOff.data()), oneOff.size()) );
+
+	// Past the end
+	served = false;
+	reader.read(LATENCY_ASSET_SIZE, 10, [&](const byte* data, size_t size) {
+		served = data && !size;
+	});
+	BOOST_CHECK( served );
+
+	// Reads not yet served fail when stopped
+	bool failed = false;
+	reader.read(0, 1000, [&](const byte* data, size_t) {
+		failed = !data;
+	});
+	reader.stop();
+	BOOST_CHECK( failed );
+}
+
+/**
+ * Serves LatencyServer:s on a unix-socket, one for each connection accepted, until stopped
+ */
+struct UnixSocketServer {
+	typedef boost::asio::local::stream_protocol Protocol;
+	boost::asio::io_service& ioSvc;
+	std::string path;
+	TimerService::Ptr ts;
+	std::unique_ptr<Protocol::acceptor> acceptor;
+	LatencyServer::Ptr server;
+	int accepted;
+
+	UnixSocketServer(boost::asio::io_service& ioSvc, const std::string& path) :
+		ioSvc(ioSvc),
+		path(path),
+		ts(std::make_shared<TimerService>(ioSvc)),
+		accepted(0)
+	{}
+
+	void start() {
+		acceptor.reset(new Protocol::acceptor(ioSvc, Protocol::endpoint(path)));
+		accept();
+	}
+
+	void accept() {
+		auto socket = std::make_shared<Protocol::socket>(ioSvc);
+		acceptor->async_accept(*socket, [=](const boost::system::error_code& ec) {
+			if (ec)
+				return;
+			accepted++;
+			server = LatencyServer::create(ioSvc, boost::posix_time::milliseconds(200), boost::posix_time::milliseconds(0));
+			server->connect(bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), socket));
+			accept();
+		});
+	}
+
+	/**
+	 * Drops the connection and the socket, as if restarted
+	 */
+	void stop() {
+		acceptor.reset();
+		boost::filesystem::remove(path);
+		if (server)
+			server->close();
+	}
+
+	~UnixSocketServer() {
+		stop();
+	}
+};
+
+BOOST_AUTO_TEST_CASE( reconnect_resumes_reads )
+{
+	boost::asio::io_service ioSvc;
+	auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bhtest-%%%%%%%%.sock")).string();
+	UnixSocketServer server(ioSvc, path);
+	server.start();
+
+	auto client = bithorde::Client::create(ioSvc, "client");
+	auto ids = testIds();
+	bithorde::ReadAsset asset(client, ids);
+
+	// Timing out within the outage, unless held meanwhile
+	const size_t READS = 8, READ = 64*1024, TIMEOUT = 400;
+	int authenticated = 0;
+	bool failedStatus = false;
+	size_t done = 0;
+	bool intact = true;
+	boost::asio::deadline_timer restart(ioSvc), deadline(ioSvc, boost::posix_time::seconds(10));
+	deadline.async_wait([&](const boost::system::error_code& ec) { if (!ec) ioSvc.stop(); });
+
+	client->authenticated.connect([&](bithorde::Client&, const std::string& peerName) {
+		BOOST_CHECK( !peerName.empty() );
+		if (++authenticated == 1)
+			BOOST_REQUIRE( client->bind(asset) );
+	});
+	asset.statusUpdate.connect([&](const bithorde::AssetStatus& status) {
+		if (status.status() != bithorde::SUCCESS) {
+			failedStatus = true;
+			return;
+		}
+		if (authenticated > 1)
+			return;
+		for (size_t i=0; i < READS; i++)
+			BOOST_REQUIRE_GE( asset.aSyncRead(i*READ, READ, TIMEOUT), 0 );
+
+		// Restart the server while the reads are in flight
+		restart.expires_from_now(boost::posix_time::milliseconds(50));
+		restart.async_wait([&](const boost::system::error_code& ec) {
+			if (ec)
+				return;
+			server.stop();
+			restart.expires_from_now(boost::posix_time::milliseconds(600));
+			restart.async_wait([&](const boost::system::error_code& ec) {
+				if (!ec)
+					server.start();
+			});
+		});
+	});
+	asset.dataArrived.connect([&](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		intact = intact && (data->size() == READ) && PatternServer::matchesPattern(offset, **data, data->size());
+		if (++done == READS)
+			ioSvc.stop();
+	});
+
+	client->connectAsync(path);
+	ioSvc.run();
+
+	BOOST_CHECK_EQUAL( done, READS );
+	BOOST_CHECK( intact );
+	BOOST_CHECK( !failedStatus );
+	BOOST_CHECK_EQUAL( authenticated, 2 );
+	BOOST_CHECK_EQUAL( server.accepted, 2 );
+	client->close();
+}
+
+BOOST_AUTO_TEST_CASE( close_while_reconnecting )
+{
+	boost::asio::io_service ioSvc;
+	auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bhtest-%%%%%%%%.sock")).string();
+	UnixSocketServer server(ioSvc, path);
+	server.start();
+
+	auto client = bithorde::Client::create(ioSvc, "client");
+	auto ids = testIds();
+	bithorde::ReadAsset asset(client, ids);
+
+	const size_t READS = 4, READ = 64*1024;
+	size_t failed = 0;
+	bool disconnected = false;
+	boost::asio::deadline_timer stop(ioSvc), deadline(ioSvc, boost::posix_time::seconds(10));
+	deadline.async_wait([&](const boost::system::error_code& ec) { if (!ec) ioSvc.stop(); });
+
+	client->authenticated.connect([&](bithorde::Client&, const std::string&) {
+		BOOST_REQUIRE( client->bind(asset) );
+	});
+	asset.statusUpdate.connect([&](const bithorde::AssetStatus& status) {
+		if (status.status() == bithorde::DISCONNECTED) {
+			disconnected = true;
+			return;
+		}
+		if (status.status() != bithorde::SUCCESS)
+			return;
+		for (size_t i=0; i < READS; i++)
+			BOOST_REQUIRE_GE( asset.aSyncRead(i*READ, READ), 0 );
+
+		// Gone for good while the reads are in flight, and closed while backing off
+		stop.expires_from_now(boost::posix_time::milliseconds(50));
+		stop.async_wait([&](const boost::system::error_code& ec) {
+			if (ec)
+				return;
+			server.stop();
+			stop.expires_from_now(bithorde::RECONNECT_MIN_BACKOFF / 2);
+			stop.async_wait([&](const boost::system::error_code& ec) {
+				if (ec)
+					return;
+				BOOST_CHECK( !client->isConnected() );
+				client->close();
+			});
+		});
+	});
+	asset.dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+		if (!data->size() && (++failed == READS))
+			ioSvc.stop();
+	});
+
+	client->connectAsync(path);
+	ioSvc.run();
+
+	BOOST_CHECK_EQUAL( failed, READS );
+	BOOST_CHECK( disconnected );
+}
+
+BOOST_AUTO_TEST_CASE( connect_async_gives_up )
+{
+	boost::asio::io_service ioSvc;
+	auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bhtest-%%%%%%%%.sock")).string();
+	auto client = bithorde::Client::create(ioSvc, "client");
+	bool failed = false;
+	client->connectFailed.connect([&]() {
+		failed = true;
+		ioSvc.stop();
+	});
+	boost::asio::deadline_timer deadline(ioSvc, boost::posix_time::seconds(10));
+	deadline.async_wait([&](const boost::system::error_code& ec) { if (!ec) ioSvc.stop(); });
+
+	client->connectAsync(path, 3);
+	ioSvc.run();
+	BOOST_CHECK( failed );
+	BOOST_CHECK( !client->isConnected() );
+
+	BOOST_CHECK_THROW( client->connectAsync(""), std::string );
+}
+
+BOOST_AUTO_TEST_CASE( connect_async_counts_rejected_handshakes )
+{
+	// Connections accepted, but closed before any handshake
+	typedef boost::asio::local::stream_protocol Protocol;
+	boost::asio::io_service ioSvc;
+	auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bhtest-%%%%%%%%.sock")).string();
+	Protocol::acceptor acceptor(ioSvc, Protocol::endpoint(path));
+	Protocol::socket socket(ioSvc);
+	int accepted = 0;
+	std::function<void()> accept = [&]() {
+		acceptor.async_accept(socket, [&](const boost::system::error_code& ec) {
+			if (ec)
+				return;
+			accepted++;
+			socket.close();
+			accept();
+		});
+	};
+	accept();
+
+	auto client = bithorde::Client::create(ioSvc, "client");
+	bool failed = false;
+	client->connectFailed.connect([&]() {
+		failed = true;
+		ioSvc.stop();
+	});
+	boost::asio::deadline_timer deadline(ioSvc, boost::posix_time::seconds(10));
+	deadline.async_wait([&](const boost::system::error_code& ec) { if (!ec) ioSvc.stop(); });
+
+	client->connectAsync(path, 3);
+	ioSvc.run();
+	BOOST_CHECK( failed );
+	BOOST_CHECK_EQUAL( accepted, 3 );
+	acceptor.close();
+	boost::filesystem::remove(path);
+}
+
+const size_t BULK_CHUNK = 251*512; // Keeps to the pattern at every chunk, within LEGACY_CHUNK_SIZE
+const size_t BULK_CHUNKS = 8192;
+
+/**
+ * Serves any bound asset as BULK_CHUNKS chunks of the pattern, answering Read.Requests of whole chunks
+ * from one shared buffer. Accepts shared memory if /acceptShm/, and hands out /file/ after binding, if
+ * set. Counts the BindReadBatches received, and the requesters of all binds.
+ */
+class BulkServer : public PatternServer {
+public:
+	typedef std::shared_ptr<BulkServer> Ptr;
+	std::shared_ptr<bithorde::MemoryBuffer> chunk;
+	std::deque<bithorde::Read::Request> held;
+	bithorde::FileRegion::Ptr file;
+	size_t served = 0;
+	size_t bindBatches = 0;
+	std::set<uint64_t> requesters;
+
+	static Ptr create(boost::asio::io_service& ioSvc, bool acceptShm) {
+		return Ptr(new BulkServer(ioSvc, acceptShm));
+	}
+protected:
+	BulkServer(boost::asio::io_service& ioSvc, bool acceptShm) :
+		PatternServer(ioSvc, BULK_CHUNK*BULK_CHUNKS),
+		chunk(patternChunk(0, BULK_CHUNK))
+	{
+		setAcceptSharedMemory(acceptShm);
+		writable.connect([this]() {
+			while (!held.empty() && respond(held.front()))
+				held.pop_front();
+		});
+	}
+
+	bool respond(const bithorde::Read::Request& req) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(req.reqid());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(req.offset());
+		return sendReadResponse(req.handle(), resp, chunk);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::BindRead> >& msgCtx) {
+		const auto& msg = msgCtx->message();
+		requesters.insert(msg.requesters().begin(), msg.requesters().end());
+		bindSuccess(msg);
+		if (file && localFiles())
+			BOOST_CHECK( sendLocalFile(msg.handle(), file) );
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::BindReadBatch> >& msgCtx) {
+		bindBatches++;
+		bithorde::Client::onMessage(msgCtx);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Read::Request> >& msgCtx) {
+		const auto& msg = msgCtx->message();
+		BOOST_REQUIRE_EQUAL( msg.offset() % BULK_CHUNK, 0 );
+		BOOST_REQUIRE_EQUAL( msg.size(), BULK_CHUNK );
+		served++;
+		if (!held.empty() || !respond(msg))
+			held.push_back(msg);
+	}
+};
+
+/**
+ * A client reading from a BulkServer, over shared memory if /shm/ and the server accepts it, and
+ * from local files if /localFiles/
+ */
+struct BulkPair : public ClientPair {
+	BulkServer::Ptr server;
+
+	BulkPair(bool shm, bool acceptShm, bool localFiles=false) : ClientPair([=](boost::asio::io_service& ioSvc) {
+		auto client = bithorde::Client::create(ioSvc, "a");
+		if (shm)
+			client->setSharedMemory(bithorde::DEFAULT_RING_SIZE);
+		client->setAcceptLocalFiles(localFiles);
+		return client;
+	}, [=](boost::asio::io_service& ioSvc) {
+		return BulkServer::create(ioSvc, acceptShm);
+	}), server(std::static_pointer_cast<BulkServer>(b)) {}
+
+	/**
+	 * Reads /chunks/ chunks of /asset/, with /window/ of them requested at a time. Returns bytes/s.
+	 */
+	double read(bithorde::ReadAsset& asset, size_t chunks, size_t window, bool& intact) {
+		size_t requested = 0, received = 0;
+		auto request = [&]() {
+			BOOST_REQUIRE_GE( asset.aSyncRead(requested++ * BULK_CHUNK, BULK_CHUNK), 0 );
+		};
+		auto conn = asset.dataArrived.connect([&](uint64_t offset, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+			intact = intact && (data->size() == BULK_CHUNK) && !memcmp(**data, **server->chunk, BULK_CHUNK);
+			if (++received == chunks)
+				ioSvc.stop();
+			else if (requested < chunks)
+				request();
+		});
+		while (requested < std::min(window, chunks))
+			request();
+		auto start = boost::chrono::steady_clock::now();
+		ioSvc.reset();
+		ioSvc.run();
+		auto seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+		conn.disconnect();
+		BOOST_CHECK_EQUAL( received, chunks );
+		return received * BULK_CHUNK / seconds;
+	}
+};
+
+BOOST_AUTO_TEST_CASE( shared_memory_negotiation )
+{
+	for (int accept = 0; accept < 2; accept++) {
+		BulkPair pair(true, accept);
+		auto asset = bindAsset(pair.a, pair.ioSvc);
+
+		// Switched before the binding was answered, and read through
+		BOOST_CHECK_EQUAL( pair.a->sharedMemory(), (bool)accept );
+		BOOST_CHECK_EQUAL( pair.server->sharedMemory(), (bool)accept );
+		bool intact = true;
+		pair.read(*asset, 64, 4, intact);
+		BOOST_CHECK( intact );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( shared_memory_closes_with_peer )
+{
+	BulkPair pair(true, true);
+	bool disconnected = false;
+	pair.a->disconnected.connect([&]() {
+		disconnected = true;
+		pair.ioSvc.stop();
+	});
+	pair.ioSvc.reset();
+	while (!(pair.a->sharedMemory() && pair.server->sharedMemory()) && pair.ioSvc.run_one());
+	BOOST_REQUIRE( pair.a->sharedMemory() );
+
+	pair.server->close();
+	pair.ioSvc.reset();
+	pair.ioSvc.run();
+	BOOST_CHECK( disconnected );
+}
+
+BOOST_AUTO_TEST_CASE( shared_memory_throughput )
+{
+	// Sequential reads of a GB, over the socket and over shared memory
+	auto fetch = [&](const char* label, bool shm) {
+		BulkPair pair(shm, true);
+		auto asset = bindAsset(pair.a, pair.ioSvc);
+		BOOST_REQUIRE_EQUAL( pair.a->sharedMemory(), shm );
+
+		bool intact = true;
+		auto rate = pair.read(*asset, BULK_CHUNKS, 64, intact);
+		BOOST_CHECK( intact );
+		BOOST_TEST_MESSAGE( "shared_memory_throughput: " << label << " " << (rate / (1024*1024)) << " MB/s" );
+		return rate;
+	};
+
+	auto socket = fetch("socket", false);
+	auto shm = fetch("shared memory", true);
+	BOOST_TEST_MESSAGE( "shared_memory_throughput: " << (shm / socket) << "x the socket" );
+}
+
+BOOST_AUTO_TEST_CASE( local_file_handoff )
+{
+	// Four chunks after a header, of which the first two are handed out as verified
+	const size_t HEADER = 100, CHUNKS = 4, VERIFIED = 2;
+	auto path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	{
+		std::vector<char> content(HEADER + CHUNKS*BULK_CHUNK, 'h');
+		for (size_t i=0; i < CHUNKS*BULK_CHUNK; i++)
+			content[HEADER + i] = (i % BULK_CHUNK) % 251;
+		std::ofstream f(path.string(), std::ios::binary);
+		f.write(content.data(), content.size());
+	}
+
+	// Over shared memory, the file is read on a worker thread
+	struct FileWorker {
+		boost::asio::io_service ioSvc;
+		boost::asio::io_service::work work;
+		std::thread thread;
+		FileWorker() : work(ioSvc), thread([this]() { ioSvc.run(); }) {}
+		~FileWorker() {
+			ioSvc.stop();
+			thread.join();
+		}
+	} worker;
+
+	for (int shm = 0; shm < 2; shm++) {
+		for (int accept = 0; accept < 2; accept++) {
+			BulkPair pair(shm, true, accept);
+			pair.a->setFileWorkers(shm ? &worker.ioSvc : NULL);
+			pair.server->file = std::make_shared<bithorde::FileRegion>(::open(path.c_str(), O_RDONLY), HEADER, VERIFIED*BULK_CHUNK);
+			auto asset = bindAsset(pair.a, pair.ioSvc);
+			BOOST_REQUIRE_EQUAL( pair.a->sharedMemory(), (bool)shm );
+			BOOST_CHECK_EQUAL( pair.server->localFiles(), (bool)accept );
+
+			// The file follows the status
+			pair.ioSvc.reset();
+			while (accept && !asset->localFile() && pair.ioSvc.run_one());
+			BOOST_CHECK_EQUAL( (bool)asset->localFile(), (bool)accept );
+
+			// Only what was not handed out is read through the server
+			bool intact = true;
+			pair.read(*asset, CHUNKS, 1, intact);
+			BOOST_CHECK( intact );
+			BOOST_CHECK_EQUAL( pair.server->served, accept ? (CHUNKS - VERIFIED) : CHUNKS );
+		}
+	}
+	boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE( local_file_right_after_switch )
+{
+	// A chunk handed out as a file, and one more read through the server
+	auto path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	{
+		std::ofstream f(path.string(), std::ios::binary);
+		std::vector<char> content(BULK_CHUNK, 'f');
+		f.write(content.data(), content.size());
+	}
+
+	// Bound ahead of the handshake, so that the binding follows the offer of shared memory at once. The
+	// descriptor of the file may then come aside in the same read as the answer to the offer.
+	for (int round = 0; round < 16; round++) {
+		std::unique_ptr<bithorde::ReadAsset> asset;
+		BulkServer::Ptr server;
+		ClientPair pair([&](boost::asio::io_service& ioSvc) {
+			auto client = bithorde::Client::create(ioSvc, "a");
+			client->setSharedMemory(bithorde::DEFAULT_RING_SIZE);
+			client->setAcceptLocalFiles(true);
+			asset.reset(new bithorde::ReadAsset(client, testIds()));
+			client->bind(*asset);
+			return client;
+		}, [&](boost::asio::io_service& ioSvc) {
+			server = BulkServer::create(ioSvc, true);
+			server->file = std::make_shared<bithorde::FileRegion>(::open(path.c_str(), O_RDONLY), 0, BULK_CHUNK);
+			return server;
+		});
+		BOOST_REQUIRE( pair.runUntil([&]() { return asset->localFile() && pair.a->sharedMemory(); }) );
+		BOOST_CHECK_EQUAL( asset->status, bithorde::SUCCESS );
+
+		bool intact = false;
+		asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int) {
+			intact = (data->size() == BULK_CHUNK) && !memcmp(**data, **server->chunk, BULK_CHUNK);
+		});
+		BOOST_REQUIRE( asset->aSyncRead(BULK_CHUNK, BULK_CHUNK) >= 0 );
+		BOOST_CHECK( pair.runUntil([&]() { return intact; }) );
+		BOOST_CHECK_EQUAL( server->served, 1 );
+	}
+	boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE( batched_bind_throughput )
+{
+	// Binding many small assets, one BindRead each, and batched
+	const size_t ASSETS = 10000;
+	auto bindAll = [&](const char* label, bool batched) {
+		BulkPair pair(false, false);
+		BOOST_REQUIRE( pair.a->batches() );
+		std::vector< std::unique_ptr<bithorde::ReadAsset> > assets;
+		size_t answered = 0, found = 0;
+		for (size_t i=0; i < ASSETS; i++) {
+			BitHordeIds ids;
+			auto id = ids.Add();
+			id->set_type(bithorde::TREE_TIGER);
+			id->set_id(std::to_string(i) + std::string(24, 'x'));
+			assets.emplace_back(new bithorde::ReadAsset(pair.a, ids));
+			assets.back()->statusUpdate.connect([&](const bithorde::AssetStatus& status) {
+				found += (status.status() == bithorde::SUCCESS);
+				if (++answered == ASSETS)
+					pair.ioSvc.stop();
+			});
+		}
+
+		auto start = boost::chrono::steady_clock::now();
+		{
+			bithorde::MessageBatch batch;
+			if (batched)
+				batch.add(pair.a);
+			for (auto iter = assets.begin(); iter != assets.end(); iter++)
+				BOOST_REQUIRE( pair.a->bind(**iter) );
+		}
+		pair.ioSvc.reset();
+		pair.ioSvc.run();
+		auto seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+
+		BOOST_CHECK_EQUAL( answered, ASSETS );
+		BOOST_CHECK_EQUAL( found, ASSETS );
+		BOOST_CHECK_EQUAL( pair.server->bindBatches, batched ? (ASSETS + bithorde::MAX_BATCH - 1) / bithorde::MAX_BATCH : 0 );
+		BOOST_CHECK_EQUAL( pair.server->requesters.size(), ASSETS ); // Batched or not, each its own
+		auto rate = answered / seconds;
+		BOOST_TEST_MESSAGE( "batched_bind_throughput: " << label << " " << rate << " binds/s" );
+		return rate;
+	};
+
+	auto single = bindAll("one by one", false);
+	auto batched = bindAll("batched", true);
+	BOOST_TEST_MESSAGE( "batched_bind_throughput: " << (batched / single) << "x one by one" );
+}
+
+BOOST_AUTO_TEST_CASE( batched_bind_send_failure )
+{
+	BulkPair pair(false, false);
+	bithorde::ReadAsset a(pair.a, testIds()), b(pair.a, testIds());
+	std::vector<bithorde::Status> statuses;
+	auto onStatus = [&](const bithorde::AssetStatus& status) { statuses.push_back(status.status()); };
+	a.statusUpdate.connect(onStatus);
+	b.statusUpdate.connect(onStatus);
+
+	// With the send-queue full, the batch cannot be sent once the binds were accepted
+	bithorde::Ping ping;
+	ping.set_timeout(0);
+	size_t queued = 0;
+	while (pair.a->sendMessage(bithorde::Connection::Ping, ping) && (queued < 1000000))
+		queued++;
+	{
+		bithorde::MessageBatch batch;
+		batch.add(pair.a);
+		BOOST_CHECK( pair.a->bind(a) );
+		BOOST_CHECK( pair.a->bind(b) );
+		BOOST_CHECK( statuses.empty() );
+	}
+	BOOST_CHECK_EQUAL( statuses.size(), 2 );
+	BOOST_CHECK( std::count(statuses.begin(), statuses.end(), bithorde::NORESOURCES) == 2 );
+}
@@ -0,0 +1,89 @@
+#ifndef TEST_CLIENT_HPP
+#define TEST_CLIENT_HPP
+
+#include <memory>
+#include <string>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/signals2/connection.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/asset.h"
+#include "lib/buffer.hpp"
+#include "lib/client.h"
+
+/**
+ * Ids of the asset served by the test servers, which serve whatever is bound
+ */
+inline BitHordeIds testIds() {
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id(std::string(24, 'x'));
+	return ids;
+}
+
+/**
+ * Binds testIds() through /client/, running /ioSvc/ until the first status. Requires it to succeed.
+ */
+inline std::unique_ptr<bithorde::ReadAsset> bindAsset(const bithorde::Client::Pointer& client, boost::asio::io_service& ioSvc) {
+	std::unique_ptr<bithorde::ReadAsset> asset(new bithorde::ReadAsset(client, testIds()));
+	boost::signals2::scoped_connection status = asset->statusUpdate.connect([&](const bithorde::AssetStatus&) { ioSvc.stop(); });
+	BOOST_REQUIRE( client->bind(*asset) );
+	ioSvc.reset();
+	ioSvc.run();
+	BOOST_REQUIRE_EQUAL( asset->status, bithorde::SUCCESS );
+	return asset;
+}
+
+/**
+ * A test server, serving any bound asset as /size/ bytes where each byte is its offset modulo 251
+ */
+class PatternServer : public bithorde::Client {
+public:
+	const uint64_t assetSize;
+
+	/**
+	 * /size/ bytes of the pattern, starting at /offset/
+	 */
+	static std::shared_ptr<bithorde::MemoryBuffer> patternChunk(uint64_t offset, size_t size) {
+		auto chunk = std::make_shared<bithorde::MemoryBuffer>(size);
+		for (size_t i=0; i < size; i++)
+			(**chunk)[i] = (offset + i) % 251;
+		return chunk;
+	}
+
+	/**
+	 * Whether the /size/ bytes at /data/ are the pattern, starting at /offset/
+	 */
+	static bool matchesPattern(uint64_t offset, const byte* data, size_t size) {
+		for (size_t i=0; i < size; i++) {
+			if (data[i] != (offset + i) % 251)
+				return false;
+		}
+		return true;
+	}
+protected:
+	PatternServer(boost::asio::io_service& ioSvc, uint64_t size, const std::string& name="server") :
+		bithorde::Client(ioSvc, name),
+		assetSize(size)
+	{}
+
+	/**
+	 * Answers /msg/ with SUCCESS, and the size of the asset
+	 */
+	void bindSuccess(const bithorde::BindRead& msg) {
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.mutable_ids()->CopyFrom(msg.ids());
+		resp.set_size(assetSize);
+		sendAssetStatus(resp);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::BindRead> >& msgCtx) {
+		bindSuccess(msgCtx->message());
+	}
+};
+
+#endif // TEST_CLIENT_HPP
@@ -0,0 +1,18 @@
+#ifndef TEST_CLOCK_HPP
+#define TEST_CLOCK_HPP
+
+#include <memory>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+/**
+ * A Clock for a TimerService, moved only by the test
+ */
+struct ManualClock {
+	std::shared_ptr<boost::posix_time::ptime> time;
+	ManualClock() : time(std::make_shared<boost::posix_time::ptime>(boost::gregorian::date(2016, 1, 1))) {}
+	boost::posix_time::ptime operator()() const { return *time; }
+	void advance(const boost::posix_time::time_duration& d) { *time += d; }
+};
+
+#endif // TEST_CLOCK_HPP
@@ -0,0 +1,121 @@
+#include "../lib/counter.h"
+
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "test_clock.hpp"
+
+namespace ptime = boost::posix_time;
+
+/**
+ * Moves /clock/ ahead by /duration/, running the timers due on the way
+ */
+static void runFor(ManualClock& clock, TimerService& ts, const ptime::time_duration& duration) {
+	clock.advance(duration);
+	ts.runDue();
+}
+
+BOOST_AUTO_TEST_CASE( rate_counters_sampled_on_one_tick )
+{
+	boost::asio::io_service ioSvc;
+	ManualClock clock;
+	auto ts = std::make_shared<TimerService>(ioSvc, ptime::millisec(1), clock);
+	auto sampler = std::make_shared<StatsSampler>(ts, ptime::millisec(20));
+	{
+		std::vector< std::unique_ptr<RateCounter> > counters;
+		for (int i=0; i < 1000; i++) {
+			counters.emplace_back(new RateCounter(sampler, "things", 0.0));
+			*counters.back() += i;
+		}
+		BOOST_CHECK_EQUAL( sampler->size(), 1000 );
+		BOOST_CHECK_EQUAL( ts->armed(), 1 );
+
+		runFor(clock, *ts, ptime::millisec(19));
+		for (int i=0; i < 1000; i++)
+			BOOST_REQUIRE_EQUAL( counters[i]->value(), 0 );
+		runFor(clock, *ts, ptime::millisec(1));
+		for (int i=0; i < 1000; i++)
+			BOOST_REQUIRE_EQUAL( counters[i]->value(), i );
+
+		// Nothing counted in the next interval
+		runFor(clock, *ts, ptime::millisec(20));
+		for (int i=0; i < 1000; i++)
+			BOOST_REQUIRE_EQUAL( counters[i]->value(), 0 );
+	}
+	BOOST_CHECK_EQUAL( sampler->size(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( rate_counters_from_threads )
+{
+	boost::asio::io_service ioSvc;
+	ManualClock clock;
+	auto ts = std::make_shared<TimerService>(ioSvc, ptime::millisec(1), clock);
+	auto sampler = std::make_shared<StatsSampler>(ts, ptime::millisec(20));
+	RateCounter counter(sampler, "things", 0.5);
+
+	// The clock stands still while counting, so the count all lands in one interval
+	runFor(clock, *ts, ptime::millisec(20));
+	const int THREADS = 4, COUNT = 100000;
+	std::vector<std::thread> threads;
+	for (int i=0; i < THREADS; i++) {
+		threads.emplace_back([&]() {
+			for (int j=0; j < COUNT; j++)
+				counter += 1;
+		});
+	}
+	for (auto iter = threads.begin(); iter != threads.end(); iter++)
+		iter->join();
+	runFor(clock, *ts, ptime::millisec(20));
+
+	uint64_t value;
+	sampler->read([&]() { value = counter.value(); });
+	BOOST_CHECK_EQUAL( value, THREADS*COUNT/2 );
+}
+
+BOOST_AUTO_TEST_CASE( stats_sampler_shared_per_timer_service )
+{
+	boost::asio::io_service ioSvc;
+	auto ts = std::make_shared<TimerService>(ioSvc);
+	auto other = std::make_shared<TimerService>(ioSvc);
+	auto sampler = StatsSampler::of(ts);
+	BOOST_CHECK_EQUAL( StatsSampler::of(ts), sampler );
+	BOOST_CHECK( StatsSampler::of(other) != sampler );
+}
+
+BOOST_AUTO_TEST_CASE( latency_histogram_percentiles )
+{
+	LatencyHistogram h("ms", 1000);
+	BOOST_CHECK_EQUAL( h.percentile(0.99), 0 );
+	for (int i=0; i < 990; i++)
+		h.post(10);
+	for (int i=0; i < 10; i++)
+		h.post(3000);
+	BOOST_CHECK_EQUAL( h.count(), 500 ); // Halved on the 1000th
+	BOOST_CHECK_EQUAL( h.percentile(0.5), 11 ); // Upper bound of [10,11]
+	BOOST_CHECK_EQUAL( h.percentile(0.99), 11 );
+	BOOST_CHECK_GE( h.percentile(1.0), 3000 );
+	BOOST_CHECK_LE( h.percentile(1.0), 3000*5/4 );
+
+	// Old samples fade, so that a slower peer moves the percentiles
+	for (int i=0; i < 2000; i++)
+		h.post(200);
+	BOOST_CHECK_GE( h.percentile(0.5), 200 );
+	BOOST_CHECK_LE( h.percentile(0.5), 250 );
+	BOOST_CHECK_LT( h.count(), 1000 );
+
+	// Timeouts are counted aside, leaving the percentiles to the answers
+	auto count = h.count();
+	auto p99 = h.percentile(0.99);
+	for (int i=0; i < 10; i++)
+		h.timedOut();
+	BOOST_CHECK_EQUAL( h.timeouts(), 10 );
+	BOOST_CHECK_EQUAL( h.count(), count );
+	BOOST_CHECK_EQUAL( h.percentile(0.99), p99 );
+
+	h.post(1000*1000); // Clamped to the last bucket
+	BOOST_CHECK_EQUAL( h.percentile(1.0), 128*1024-1 );
+}
@@ -0,0 +1,279 @@
+#include <cstring>
+
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/chrono.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "lib/buffer.hpp"
+#include "lib/connection.h"
+
+using namespace std;
+
+const size_t CHUNK_SIZE = 128*1024;
+const size_t BENCHMARK_BYTES = 256*1024*1024;
+
+static std::shared_ptr<bithorde::MemoryBuffer> makeChunk(size_t size) {
+	auto chunk = std::make_shared<bithorde::MemoryBuffer>(size);
+	for (size_t i=0; i < size; i++)
+		(**chunk)[i] = i % 251;
+	return chunk;
+}
+
+static string flatten(const bithorde::Message& msg) {
+	string res(msg.buf);
+	if (msg.payload)
+		res.append(reinterpret_cast<char*>(**msg.payload), msg.payload->size());
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE( payload_encoding_matches_serialized )
+{
+	auto chunk = makeChunk(CHUNK_SIZE);
+
+	bithorde::Read::Response resp;
+	resp.set_reqid(17);
+	resp.set_status(bithorde::SUCCESS);
+	resp.set_offset(1<<20);
+
+	bithorde::Message byReference(bithorde::Message::NEVER);
+	byReference.encode(bithorde::Connection::ReadResponse, resp, bithorde::Read::Response::kContentFieldNumber, chunk);
+
+	resp.set_content(**chunk, chunk->size());
+	bithorde::Message copied(bithorde::Message::NEVER);
+	copied.encode(bithorde::Connection::ReadResponse, resp);
+
+	BOOST_CHECK_EQUAL( byReference.size(), copied.size() );
+	BOOST_CHECK( flatten(byReference) == copied.buf );
+	BOOST_CHECK_LT( byReference.buf.size(), 32 );
+}
+
+BOOST_AUTO_TEST_CASE( payload_encoding_benchmark )
+{
+	typedef boost::chrono::steady_clock Clock;
+	auto chunk = makeChunk(CHUNK_SIZE);
+	const size_t rounds = BENCHMARK_BYTES / CHUNK_SIZE;
+
+	bithorde::Read::Response resp;
+	resp.set_reqid(17);
+	resp.set_status(bithorde::SUCCESS);
+	resp.set_offset(0);
+
+	// Previous path; content copied into the protobuf, and then serialized into Message::buf
+	size_t copiedBytes = 0;
+	auto start = Clock::now();
+	for (size_t i=0; i < rounds; i++) {
+		bithorde::Read::Response withContent(resp);
+		withContent.set_content(**chunk, chunk->size());
+		bithorde::Message msg(bithorde::Message::NEVER);
+		msg.encode(bithorde::Connection::ReadResponse, withContent);
+		copiedBytes += withContent.content().size() + msg.buf.size();
+	}
+	auto copyTime = boost::chrono::duration_cast<boost::chrono::microseconds>(Clock::now() - start);
+
+	// Scatter/gather path; only framing encoded, payload passed by reference
+	size_t framedBytes = 0;
+	start = Clock::now();
+	for (size_t i=0; i < rounds; i++) {
+		bithorde::Message msg(bithorde::Message::NEVER);
+		msg.encode(bithorde::Connection::ReadResponse, resp, bithorde::Read::Response::kContentFieldNumber, chunk);
+		framedBytes += msg.buf.size();
+	}
+	auto refTime = boost::chrono::duration_cast<boost::chrono::microseconds>(Clock::now() - start);
+
+	const double gbServed = static_cast<double>(rounds * CHUNK_SIZE) / (1024*1024*1024);
+	BOOST_TEST_MESSAGE( "Read.Response encoding, " << rounds << " x " << CHUNK_SIZE << " bytes:" );
+	BOOST_TEST_MESSAGE( "  copying:   " << copyTime.count() << "us, " << (copiedBytes / gbServed / (1024*1024)) << " MB copied per served GB" );
+	BOOST_TEST_MESSAGE( "  reference: " << refTime.count() << "us, " << (framedBytes / gbServed / (1024*1024)) << " MB copied per served GB" );
+
+	BOOST_CHECK_LT( framedBytes, copiedBytes / 1000 );
+}
+
+BOOST_AUTO_TEST_CASE( receive_buffer_slices_are_pinned )
+{
+	bithorde::ReceiveBuffer rcvBuf;
+	auto window = rcvBuf.allocate(CHUNK_SIZE);
+	for (size_t i=0; i < CHUNK_SIZE; i++)
+		window[i] = i % 251;
+	rcvBuf.charge(CHUNK_SIZE);
+
+	// Slice out the first half, leaving a partial "message" in the buffer
+	auto slice = rcvBuf.slice(rcvBuf.data(), CHUNK_SIZE/2);
+	BOOST_CHECK( rcvBuf.pinned() );
+	BOOST_CHECK_EQUAL( **slice, window );
+	rcvBuf.consume(CHUNK_SIZE/2);
+	rcvBuf.pop();
+
+	// Pinned data must survive while more data is received
+	for (int round=0; round < 8; round++) {
+		auto next = rcvBuf.allocate(CHUNK_SIZE);
+		memset(next, 0xff, CHUNK_SIZE);
+		rcvBuf.charge(CHUNK_SIZE);
+		rcvBuf.consume(CHUNK_SIZE);
+		rcvBuf.pop();
+	}
+	BOOST_CHECK_EQUAL( rcvBuf.left(), CHUNK_SIZE/2 );
+	BOOST_CHECK_EQUAL( rcvBuf.data()[0], 0xff );
+	for (size_t i=0; i < slice->size(); i++) {
+		if ((**slice)[i] != i % 251)
+			BOOST_FAIL( "Pinned data modified at " << i );
+	}
+
+	// Once released, consumed data is compacted in place again
+	slice.reset();
+	BOOST_CHECK( !rcvBuf.pinned() );
+	rcvBuf.consume(CHUNK_SIZE/4);
+	rcvBuf.pop();
+	BOOST_CHECK_EQUAL( rcvBuf.left(), CHUNK_SIZE/4 );
+}
+
+BOOST_AUTO_TEST_CASE( receive_buffer_segments_pooled )
+{
+	auto pool = std::make_shared<bithorde::SegmentPool>(16*CHUNK_SIZE);
+	bithorde::ReceiveBuffer rcvBuf(pool);
+
+	// A partial message is left in place, until the segment runs out of room
+	auto window = rcvBuf.allocate(CHUNK_SIZE);
+	BOOST_CHECK_EQUAL( rcvBuf.capacity(), CHUNK_SIZE );
+	rcvBuf.charge(CHUNK_SIZE);
+	rcvBuf.consume(CHUNK_SIZE - 100);
+	rcvBuf.pop();
+	BOOST_CHECK( rcvBuf.data() == window + CHUNK_SIZE - 100 );
+	BOOST_CHECK_EQUAL( rcvBuf.left(), 100 );
+	BOOST_CHECK( rcvBuf.allocate(CHUNK_SIZE/2) == window + 100 );
+	BOOST_CHECK( rcvBuf.data() == window );
+
+	// Released when drained, and reused on next allocation, also if somewhat smaller
+	rcvBuf.consume(100);
+	rcvBuf.pop();
+	const auto capacity = rcvBuf.capacity();
+	rcvBuf.release();
+	BOOST_CHECK_EQUAL( rcvBuf.capacity(), 0 );
+	BOOST_CHECK_EQUAL( pool->pooledBytes(), capacity );
+	BOOST_CHECK( rcvBuf.allocate(CHUNK_SIZE - 8192) == window );
+	BOOST_CHECK_EQUAL( pool->pooledBytes(), 0 );
+
+	// Pinned segments return once the last slice is dropped
+	rcvBuf.charge(CHUNK_SIZE);
+	auto slice = rcvBuf.slice(rcvBuf.data(), 16);
+	rcvBuf.consume(CHUNK_SIZE);
+	rcvBuf.pop();
+	rcvBuf.release();
+	BOOST_CHECK_EQUAL( pool->pooledBytes(), 0 );
+	slice.reset();
+	BOOST_CHECK_EQUAL( pool->pooledBytes(), capacity );
+
+	// Sized in whole pages, not doubled
+	BOOST_CHECK_EQUAL( pool->acquire(CHUNK_SIZE + 1)->size(), CHUNK_SIZE + 4096 );
+}
+
+BOOST_AUTO_TEST_CASE( payload_received_as_view )
+{
+	typedef boost::asio::local::stream_protocol::socket Socket;
+	boost::asio::io_service ioSvc;
+	auto ts = std::make_shared<TimerService>(ioSvc);
+	auto sendSocket = std::make_shared<Socket>(ioSvc);
+	auto recvSocket = std::make_shared<Socket>(ioSvc);
+	boost::asio::local::connect_pair(*sendSocket, *recvSocket);
+	auto sender = bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), sendSocket);
+	auto receiver = bithorde::Connection::create(ioSvc, std::make_shared<bithorde::ConnectionStats>(ts), recvSocket);
+
+	bithorde::Read::Response received;
+	bithorde::IBuffer::Ptr payload;
+	receiver->setCallback([&](bithorde::Connection::MessageType type, const google::protobuf::Message& msg, const bithorde::IBuffer::Ptr& p) {
+		BOOST_CHECK_EQUAL( type, bithorde::Connection::ReadResponse );
+		received.CopyFrom(msg);
+		payload = p;
+		ioSvc.stop();
+	});
+
+	auto chunk = makeChunk(CHUNK_SIZE);
+	bithorde::Read::Response resp;
+	resp.set_reqid(17);
+	resp.set_status(bithorde::SUCCESS);
+	resp.set_offset(1<<20);
+	BOOST_CHECK( sender->sendMessage(bithorde::Connection::ReadResponse, resp, bithorde::Read::Response::kContentFieldNumber, chunk, bithorde::Message::NEVER, false) );
+	ioSvc.run();
+
+	BOOST_CHECK_EQUAL( received.reqid(), 17 );
+	BOOST_CHECK_EQUAL( received.offset(), 1<<20 );
+	BOOST_CHECK( !received.has_content() );
+	BOOST_REQUIRE( payload );
+	BOOST_CHECK_EQUAL( payload->size(), CHUNK_SIZE );
+	BOOST_CHECK( memcmp(**payload, **chunk, CHUNK_SIZE) == 0 );
+	BOOST_CHECK( std::dynamic_pointer_cast<bithorde::BufferSlice>(payload) );
+
+	sender->close();
+	receiver->close();
+}
+
+BOOST_AUTO_TEST_CASE( messages_dispatched_from_reactor )
+{
+	typedef boost::asio::local::stream_protocol::socket Socket;
+	const uint32_t MESSAGES = 256;
+	const std::string KEY(16, 'k'), IV(16, 'i');
+	boost::asio::io_service ioSvc, sendSvc, recvSvc;
+	boost::asio::io_service::work work(ioSvc), sendWork(sendSvc), recvWork(recvSvc);
+	boost::thread sendThread([&]{ sendSvc.run(); });
+	boost::thread recvThread([&]{ recvSvc.run(); });
+	boost::asio::io_service cipherSvc;
+	boost::asio::io_service::work cipherWork(cipherSvc);
+	boost::thread cipherThread([&]{ cipherSvc.run(); });
+
+	auto ts = std::make_shared<TimerService>(ioSvc);
+	auto sendSocket = std::make_shared<Socket>(sendSvc);
+	auto recvSocket = std::make_shared<Socket>(recvSvc);
+	boost::asio::local::connect_pair(*sendSocket, *recvSocket);
+	auto sender = bithorde::Connection::create(ioSvc, sendSvc, std::make_shared<bithorde::ConnectionStats>(ts), sendSocket);
+	auto receiver = bithorde::Connection::create(ioSvc, recvSvc, std::make_shared<bithorde::ConnectionStats>(ts), recvSocket);
+	sender->setCipherWorkers(&cipherSvc);
+	receiver->setCipherWorkers(&cipherSvc);
+	sender->setEncryption(bithorde::AES_CTR, KEY, IV);
+	receiver->setDecryption(bithorde::AES_CTR, KEY, IV);
+
+	const auto controlThread = boost::this_thread::get_id();
+	uint32_t received = 0;
+	bool ordered = true, intact = true, onControl = true;
+	receiver->setCallback([&](bithorde::Connection::MessageType type, const google::protobuf::Message& msg, const bithorde::IBuffer::Ptr& payload) {
+		auto& resp = dynamic_cast<const bithorde::Read::Response&>(msg);
+		onControl &= (boost::this_thread::get_id() == controlThread);
+		ordered &= (resp.reqid() == received);
+		intact &= payload && (payload->size() == CHUNK_SIZE) && ((**payload)[1] == (resp.reqid()+1) % 251);
+		if (++received == MESSAGES)
+			ioSvc.stop();
+	});
+
+	// Queue up more than the send-window, and keep refilling from the control thread as it drains
+	uint32_t sent = 0;
+	auto chunk = makeChunk(CHUNK_SIZE);
+	std::function<void()> fill = [&]() {
+		while ((sent < MESSAGES) && sender->canSend()) {
+			bithorde::Read::Response resp;
+			resp.set_reqid(sent);
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(0);
+			auto payload = std::make_shared<bithorde::MemoryBuffer>(CHUNK_SIZE);
+			memcpy(**payload, **chunk, CHUNK_SIZE);
+			(**payload)[1] = (sent+1) % 251;
+			BOOST_REQUIRE( sender->sendMessage(bithorde::Connection::ReadResponse, resp, bithorde::Read::Response::kContentFieldNumber, payload, bithorde::Message::NEVER, false) );
+			sent++;
+		}
+	};
+	sender->writable.connect(fill);
+	fill();
+	ioSvc.run();
+
+	BOOST_CHECK_EQUAL( received, MESSAGES );
+	BOOST_CHECK( ordered );
+	BOOST_CHECK( intact );
+	BOOST_CHECK( onControl );
+
+	sender->close();
+	receiver->close();
+	sendSvc.stop();
+	recvSvc.stop();
+	cipherSvc.stop();
+	sendThread.join();
+	recvThread.join();
+	cipherThread.join();
+}
@@ -1,5 +1,7 @@
+#include <list>
 #include <vector>
 
+#include <boost/chrono.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include "lib/connection.h"
@@ -42,3 +44,148 @@ BOOST_AUTO_TEST_CASE( message_queue )
 	BOOST_ASSERT( !the_lot.empty() );
 	BOOST_ASSERT( mq.empty() );
 }
+
+static std::shared_ptr<bithorde::Message> makeMessage(bithorde::Message::Deadline expires, size_t size, char fill) {
+	std::shared_ptr<bithorde::Message> msg(new bithorde::Message(expires));
+	msg->buf.insert(0, size, fill);
+	return msg;
+}
+
+BOOST_AUTO_TEST_CASE( message_queue_lanes )
+{
+	bithorde::MessageQueue mq;
+	auto now = boost::chrono::steady_clock::now();
+	auto later = now + boost::chrono::seconds(15);
+
+	for (auto i = 0; i < 64; i++ )
+		mq.enqueue(makeMessage(later, 1024, 'B'), bithorde::MessageQueue::BULK);
+	mq.enqueue(makeMessage(now, 16, 'X'), bithorde::MessageQueue::CONTROL); // Already expired
+	mq.enqueue(makeMessage(later, 16, 'C'), bithorde::MessageQueue::CONTROL);
+	BOOST_CHECK_EQUAL( mq.count(bithorde::MessageQueue::BULK), 64 );
+	BOOST_CHECK_EQUAL( mq.count(bithorde::MessageQueue::CONTROL), 2 );
+	BOOST_CHECK_EQUAL( mq.size(), 64*1024 + 2*16 );
+
+	// Control-message should jump ahead of bulk, with the expired one dropped
+	auto dequeued = mq.dequeue(1024, 1000);
+	BOOST_REQUIRE_EQUAL( dequeued.size(), 2 );
+	BOOST_CHECK_EQUAL( dequeued[0]->buf[0], 'C' );
+	BOOST_CHECK_EQUAL( dequeued[1]->buf[0], 'B' );
+	BOOST_CHECK_EQUAL( mq.count(bithorde::MessageQueue::CONTROL), 0 );
+	BOOST_CHECK_EQUAL( mq.size(), 63*1024 );
+
+	// Wraps around and grows the ring without reordering
+	for (auto i = 0; i < 64; i++ )
+		mq.enqueue(makeMessage(later, 1024, 'b'), bithorde::MessageQueue::BULK);
+	auto the_lot = mq.dequeue(1024*1024, 1000);
+	BOOST_REQUIRE_EQUAL( the_lot.size(), 127 );
+	BOOST_CHECK_EQUAL( the_lot[62]->buf[0], 'B' );
+	BOOST_CHECK_EQUAL( the_lot[63]->buf[0], 'b' );
+	BOOST_CHECK( mq.empty() );
+	BOOST_CHECK_EQUAL( mq.size(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( message_pool )
+{
+	auto pool = std::make_shared<bithorde::MessagePool>();
+	auto payload = std::make_shared<bithorde::MemoryBuffer>(1024);
+
+	auto msg = pool->acquire(bithorde::Message::NEVER);
+	msg->buf.assign(64, 'X');
+	msg->payload = payload;
+	bithorde::Message* raw = msg.get();
+	msg.reset();
+
+	BOOST_CHECK_EQUAL( pool->pooled(), 1 );
+	BOOST_CHECK_EQUAL( payload.use_count(), 1 ); // Payload released with the message
+
+	auto now = boost::chrono::steady_clock::now();
+	msg = pool->acquire(now);
+	BOOST_CHECK_EQUAL( msg.get(), raw );
+	BOOST_CHECK( msg->buf.empty() );
+	BOOST_CHECK( !msg->payload );
+	BOOST_CHECK( msg->expires == now );
+	BOOST_CHECK_EQUAL( pool->pooled(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( message_queue_benchmark )
+{
+	typedef boost::chrono::steady_clock Clock;
+	const size_t ROUNDS = 20000;
+	const size_t BURST = 64;
+	auto later = Clock::now() + boost::chrono::seconds(60);
+	auto payload = std::make_shared<bithorde::MemoryBuffer>(16*1024);
+
+	// Baseline; the previous list-based queue, allocating every message
+	auto start = Clock::now();
+	for (size_t round = 0; round < ROUNDS; round++) {
+		std::list< std::shared_ptr<const bithorde::Message> > queue;
+		size_t size = 0;
+		for (size_t i = 0; i < BURST; i++) {
+			auto msg = makeMessage(later, 24, 'X');
+			msg->payload = payload;
+			size += msg->size();
+			queue.push_back(msg);
+		}
+		std::vector< std::shared_ptr<const bithorde::Message> > res;
+		res.reserve(size);
+		while (!queue.empty()) {
+			res.push_back(queue.front());
+			queue.pop_front();
+		}
+	}
+	auto listTime = boost::chrono::duration_cast<boost::chrono::nanoseconds>(Clock::now() - start);
+
+	auto pool = std::make_shared<bithorde::MessagePool>();
+	bithorde::MessageQueue mq;
+	start = Clock::now();
+	for (size_t round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < BURST; i++) {
+			auto msg = pool->acquire(later);
+			msg->buf.assign(24, 'X');
+			msg->payload = payload;
+			mq.enqueue(msg, (i % 8) ? bithorde::MessageQueue::BULK : bithorde::MessageQueue::CONTROL);
+		}
+		auto res = mq.dequeue(BURST*payload->size(), 1000);
+		BOOST_REQUIRE_EQUAL( res.size(), BURST );
+	}
+	auto ringTime = boost::chrono::duration_cast<boost::chrono::nanoseconds>(Clock::now() - start);
+
+	const size_t msgs = ROUNDS * BURST;
+	BOOST_TEST_MESSAGE( "MessageQueue, " << msgs << " messages in bursts of " << BURST << ":" );
+	BOOST_TEST_MESSAGE( "  list:          " << (listTime.count() / msgs) << "ns/msg" );
+	BOOST_TEST_MESSAGE( "  pooled lanes:  " << (ringTime.count() / msgs) << "ns/msg" );
+}
+
+BOOST_AUTO_TEST_CASE( send_window )
+{
+	boost::asio::io_service ioSvc;
+	auto ts = std::make_shared<TimerService>(ioSvc);
+	auto stats = std::make_shared<bithorde::ConnectionStats>(ts);
+	bithorde::SendWindow window(stats);
+
+	const auto defaultLimit = window.queueLimit();
+	BOOST_CHECK_EQUAL( window.bandwidth(), 0 );
+	BOOST_CHECK_EQUAL( window.lowWaterMark(), defaultLimit / 4 );
+	BOOST_CHECK_GT( window.emergencyLimit(), defaultLimit );
+
+	// Idle writes completing quickly says nothing about the link
+	window.onWritten(64*1024, boost::chrono::microseconds(50), false);
+	BOOST_CHECK_EQUAL( window.bandwidth(), 0 );
+
+	// 10GbE with 40ms RTT should grow the window well past the default
+	window.onRoundTrip(boost::chrono::milliseconds(40));
+	for (auto i = 0; i < 10; i++)
+		window.onWritten(25*1024*1024, boost::chrono::milliseconds(20), true);
+	BOOST_CHECK_CLOSE( (double)window.bandwidth(), 1250*1024*1024, 1.0 );
+	BOOST_CHECK_GT( window.queueLimit(), 50*defaultLimit );
+	BOOST_CHECK_EQUAL( stats->roundTripTime.value(), 40 );
+	BOOST_CHECK_EQUAL( stats->sendWindow.value(), window.queueLimit() );
+
+	// Slow link should shrink it well below the default
+	bithorde::SendWindow slow(stats);
+	slow.onRoundTrip(boost::chrono::milliseconds(100));
+	for (auto i = 0; i < 10; i++)
+		slow.onWritten(64*1024, boost::chrono::milliseconds(500), true);
+	BOOST_CHECK_LT( slow.queueLimit(), defaultLimit / 2 );
+	BOOST_CHECK_LT( slow.lowWaterMark(), slow.queueLimit() );
+}
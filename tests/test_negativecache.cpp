@@ -0,0 +1,54 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bithorded/router/negativecache.hpp"
+
+using namespace bithorded::router;
+namespace ptime = boost::posix_time;
+
+static BinId idOf(int i) {
+	return BinId::fromRaw(std::string(23, 'x') + char(i));
+}
+
+BOOST_AUTO_TEST_CASE( negative_cache_expires )
+{
+	auto now = ptime::microsec_clock::universal_time();
+	NegativeCache cache(16, ptime::seconds(10));
+	BOOST_CHECK( !cache.contains(idOf(1), now) );
+	cache.add(idOf(1), now);
+	cache.add(idOf(2), now + ptime::seconds(5));
+	BOOST_CHECK( cache.contains(idOf(1), now + ptime::seconds(9)) );
+	BOOST_CHECK( !cache.contains(idOf(3), now + ptime::seconds(9)) );
+
+	// Each for the ttl after last found missing
+	BOOST_CHECK( !cache.contains(idOf(1), now + ptime::seconds(10)) );
+	BOOST_CHECK( cache.contains(idOf(2), now + ptime::seconds(10)) );
+	cache.add(idOf(2), now + ptime::seconds(10));
+	BOOST_CHECK( cache.contains(idOf(2), now + ptime::seconds(19)) );
+	BOOST_CHECK_EQUAL( cache.size(), 1 );
+	BOOST_CHECK_EQUAL( cache.hits(), 3 );
+	BOOST_CHECK_EQUAL( cache.misses(), 3 );
+
+	// Nothing kept of an asset without a tiger id
+	cache.add(BinId(), now);
+	BOOST_CHECK_EQUAL( cache.size(), 1 );
+}
+
+BOOST_AUTO_TEST_CASE( negative_cache_bounded )
+{
+	auto now = ptime::microsec_clock::universal_time();
+	NegativeCache cache(100, ptime::seconds(10));
+	for (int i=0; i < 150; i++)
+		cache.add(idOf(i), now);
+	BOOST_CHECK_EQUAL( cache.size(), 100 );
+	BOOST_CHECK( !cache.contains(idOf(0), now) );
+	BOOST_CHECK( !cache.contains(idOf(49), now) );
+	BOOST_CHECK( cache.contains(idOf(50), now) );
+	BOOST_CHECK( cache.contains(idOf(149), now) );
+
+	// Forgotten once found, or when anything may be found
+	cache.erase(idOf(149));
+	BOOST_CHECK( !cache.contains(idOf(149), now) );
+	cache.clear();
+	BOOST_CHECK_EQUAL( cache.size(), 0 );
+	BOOST_CHECK( !cache.contains(idOf(50), now) );
+}
@@ -0,0 +1,209 @@
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "bithorded/router/asset.hpp"
+#include "bithorded/router/router.hpp"
+#include "lib/buffer.hpp"
+#include "lib/client.h"
+
+#include "test_client.hpp"
+#include "test_router.hpp"
+
+using namespace std;
+using namespace bithorded::router;
+
+const size_t ROUTED_CHUNK = 64*1024;
+const uint64_t ROUTED_SIZE = 32*ROUTED_CHUNK;
+
+typedef std::map< std::pair<uint64_t, size_t>, std::shared_ptr<bithorde::IBuffer> > Answers;
+
+/**
+ * Reads /size/ bytes at /offset/ of /asset/ within /timeout/ ms, into /answers/ by offset and size
+ */
+void readInto(ForwardedAsset& asset, uint64_t offset, size_t size, uint32_t timeout, Answers& answers) {
+	asset.asyncRead(offset, size, timeout, [&answers, offset, size](int64_t, const std::shared_ptr<bithorde::IBuffer>& data) {
+		BOOST_CHECK_MESSAGE( !answers.count(std::make_pair(offset, size)), "answered twice" );
+		answers[std::make_pair(offset, size)] = data;
+	});
+}
+
+BOOST_AUTO_TEST_CASE( forwarded_reads_keep_own_deadlines )
+{
+	RouterFixture router({"up0"});
+	auto upstream = router.connect("up0", ROUTED_SIZE);
+	bithorded::AssetBinding downstream;
+	auto asset = router.bind(downstream);
+	BOOST_REQUIRE( router.runUntil([&]() { return asset->status->status() == bithorde::SUCCESS; }) );
+	upstream->holding = true;
+
+	// Each given up at its own deadline, while the other is still waited for
+	Answers answers;
+	readInto(*asset, 0, ROUTED_CHUNK, 200, answers);
+	readInto(*asset, ROUTED_CHUNK, ROUTED_CHUNK, 600, answers);
+	BOOST_CHECK( !router.runUntil([&]() { return !answers.empty(); }, 100) );
+	BOOST_REQUIRE( router.runUntil([&]() { return !answers.empty(); }) );
+	BOOST_REQUIRE_EQUAL( answers.size(), 1 );
+	BOOST_CHECK_EQUAL( answers.begin()->first.first, 0 );
+	BOOST_CHECK_EQUAL( answers.begin()->second->size(), 0 );
+	BOOST_CHECK_EQUAL( inspected(*asset, "pendingReads"), "1" );
+	BOOST_REQUIRE( router.runUntil([&]() { return answers.size() == 2; }) );
+	BOOST_CHECK_EQUAL( answers[std::make_pair(ROUTED_CHUNK, ROUTED_CHUNK)]->size(), 0 );
+	BOOST_CHECK_EQUAL( router.router().readLatency.timeouts(), 2 );
+
+	// Cleaned up, so that the late answers are not passed on, nor counted as in flight
+	BOOST_CHECK_EQUAL( inspected(*asset, "pendingReads"), "0" );
+	upstream->release();
+	BOOST_CHECK( !router.runUntil([&]() { return answers.size() > 2; }, 100) );
+	BOOST_CHECK_EQUAL( upstream->served, 2 );
+	auto load = inspected(*asset, "upstream_up0");
+	BOOST_CHECK_MESSAGE( load.find("inFlight: 0") != std::string::npos, load );
+
+	// Later reads are answered as usual
+	upstream->holding = false;
+	readInto(*asset, 2*ROUTED_CHUNK, ROUTED_CHUNK, 5000, answers);
+	BOOST_REQUIRE( router.runUntil([&]() { return answers.size() == 3; }) );
+	auto answer = answers[std::make_pair(2*ROUTED_CHUNK, ROUTED_CHUNK)];
+	BOOST_CHECK_EQUAL( answer->size(), ROUTED_CHUNK );
+	BOOST_CHECK( PatternServer::matchesPattern(2*ROUTED_CHUNK, **answer, answer->size()) );
+}
+
+BOOST_AUTO_TEST_CASE( forwarded_read_fails_at_once_if_unsent )
+{
+	RouterFixture router({"up0"});
+	auto upstream = router.connect("up0", ROUTED_SIZE);
+	bithorded::AssetBinding downstream;
+	auto asset = router.bind(downstream);
+	BOOST_REQUIRE( router.runUntil([&]() { return asset->status->status() == bithorde::SUCCESS; }) );
+
+	// With the send-queue to the friend full, the read fails before anything runs
+	router.saturate("up0");
+	Answers answers;
+	readInto(*asset, 0, ROUTED_CHUNK, 5000, answers);
+	BOOST_REQUIRE_EQUAL( answers.size(), 1 );
+	BOOST_CHECK_EQUAL( answers.begin()->second->size(), 0 );
+	BOOST_CHECK_EQUAL( inspected(*asset, "pendingReads"), "0" );
+	auto load = inspected(*asset, "upstream_up0");
+	BOOST_CHECK_MESSAGE( load.find("inFlight: 0") != std::string::npos, load );
+
+	// Once the queue drains, the same read is sent and answered
+	router.runUntil([]() { return false; }, 200);
+	BOOST_CHECK( upstream->requested.empty() );
+	answers.clear();
+	readInto(*asset, 0, ROUTED_CHUNK, 5000, answers);
+	BOOST_REQUIRE( router.runUntil([&]() { return !answers.empty(); }) );
+	BOOST_CHECK_EQUAL( answers.begin()->second->size(), ROUTED_CHUNK );
+	BOOST_CHECK_EQUAL( upstream->requested.size(), 1 );
+}
+
+BOOST_AUTO_TEST_CASE( same_offset_reads_stay_distinct )
+{
+	RouterFixture router({"up0"});
+	auto upstream = router.connect("up0", ROUTED_SIZE);
+	bithorded::AssetBinding downstream;
+	auto asset = router.bind(downstream);
+	BOOST_REQUIRE( router.runUntil([&]() { return asset->status->status() == bithorde::SUCCESS; }) );
+	upstream->holding = true;
+
+	// A smaller read waits for the larger one in flight, and a larger one fetches only the rest
+	Answers answers;
+	const uint64_t second = 16*ROUTED_CHUNK;
+	readInto(*asset, 0, ROUTED_CHUNK, 5000, answers);
+	readInto(*asset, 0, ROUTED_CHUNK/4, 5000, answers);
+	readInto(*asset, second, ROUTED_CHUNK/4, 5000, answers);
+	readInto(*asset, second, ROUTED_CHUNK, 5000, answers);
+	BOOST_REQUIRE( router.runUntil([&]() { return upstream->held() == 3; }) );
+	typedef std::vector< std::pair<uint64_t, size_t> > Requested;
+	BOOST_CHECK( upstream->requested == (Requested{{0, ROUTED_CHUNK}, {second, ROUTED_CHUNK/4}, {second + ROUTED_CHUNK/4, ROUTED_CHUNK*3/4}}) );
+
+	// Each answered with as much as it asked for
+	upstream->release();
+	BOOST_REQUIRE( router.runUntil([&]() { return answers.size() == 4; }) );
+	for (auto iter = answers.begin(); iter != answers.end(); iter++) {
+		BOOST_CHECK_EQUAL( iter->second->size(), iter->first.second );
+		BOOST_CHECK( PatternServer::matchesPattern(iter->first.first, **iter->second, iter->second->size()) );
+	}
+	BOOST_CHECK_EQUAL( inspected(*asset, "pendingReads"), "0" );
+}
+
+/**
+ * A router with the friends /up0/ and /up1/, neither of which has the asset
+ */
+struct NotFoundRouter {
+	RouterFixture router;
+	StubUpstream::Ptr up0, up1;
+
+	NotFoundRouter() :
+		router({"up0", "up1"})
+	{
+		up0 = router.connect("up0", ROUTED_SIZE);
+		up1 = router.connect("up1", ROUTED_SIZE);
+		up0->bindStatus = up1->bindStatus = bithorde::NOTFOUND;
+	}
+
+	/**
+	 * Binds the asset by /downstream/ until not found, and releases it. Returns whether the router
+	 * remembers it as not found, answering the next bind at once.
+	 */
+	bool search(bithorded::AssetBinding& downstream) {
+		auto asset = router.bind(downstream);
+		BOOST_REQUIRE( router.runUntil([&]() { return asset->status->status() == bithorde::NOTFOUND; }) );
+		downstream.reset();
+		asset.reset();
+		bithorde::BindRead req;
+		req.mutable_ids()->CopyFrom(testIds());
+		try {
+			router.router().findAsset(req);
+			return false;
+		} catch (const bithorded::BindError& e) {
+			BOOST_CHECK_EQUAL( e.status, bithorde::NOTFOUND );
+			return true;
+		}
+	}
+};
+
+BOOST_AUTO_TEST_CASE( not_found_remembered_once_every_friend_answered )
+{
+	NotFoundRouter notFound;
+	bithorded::AssetBinding downstream;
+	BOOST_CHECK( notFound.search(downstream) );
+	BOOST_CHECK_EQUAL( notFound.up0->binds, 1 );
+	BOOST_CHECK_EQUAL( notFound.up1->binds, 1 );
+	BOOST_CHECK_EQUAL( inspected(notFound.router.router(), "notFoundCache").compare(0, 8, "1 assets"), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( not_found_forgotten_if_a_friend_was_not_searched )
+{
+	// Not asked for the asset, since it is the one asking
+	NotFoundRouter notFound;
+	bithorded::AssetBinding downstream;
+	downstream.setClient(notFound.router.friendClient("up1"));
+	BOOST_CHECK( !notFound.search(downstream) );
+	BOOST_CHECK_EQUAL( notFound.up0->binds, 1 );
+	BOOST_CHECK_EQUAL( notFound.up1->binds, 0 );
+
+	// Searched anew, on the next bind from elsewhere
+	bithorded::AssetBinding other;
+	BOOST_CHECK( notFound.search(other) );
+	BOOST_CHECK_EQUAL( notFound.up0->binds, 2 );
+	BOOST_CHECK_EQUAL( notFound.up1->binds, 1 );
+}
+
+BOOST_AUTO_TEST_CASE( not_found_forgotten_if_a_bind_was_not_sent )
+{
+	// The bind to up1 cannot be sent, with the send-queue to it full
+	NotFoundRouter notFound;
+	notFound.router.saturate("up1");
+	bithorded::AssetBinding downstream;
+	BOOST_CHECK( !notFound.search(downstream) );
+	BOOST_CHECK_EQUAL( notFound.up0->binds, 1 );
+	BOOST_CHECK_EQUAL( notFound.up1->binds, 0 );
+
+	// Searched anew, once the queue has drained
+	notFound.router.runUntil([]() { return false; }, 200);
+	BOOST_CHECK( notFound.search(downstream) );
+	BOOST_CHECK_EQUAL( notFound.up0->binds, 2 );
+	BOOST_CHECK_EQUAL( notFound.up1->binds, 1 );
+}
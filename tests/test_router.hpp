@@ -0,0 +1,239 @@
+#ifndef TEST_ROUTER_HPP
+#define TEST_ROUTER_HPP
+
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "bithorded/lib/management.hpp"
+#include "bithorded/router/asset.hpp"
+#include "bithorded/router/router.hpp"
+#include "bithorded/server/config.hpp"
+#include "bithorded/server/server.hpp"
+#include "lib/buffer.hpp"
+#include "lib/client.h"
+
+#include "test_client.hpp"
+
+/**
+ * A friend of the router under test, having testIds() as an asset of /size/ bytes of the pattern.
+ * Reads are answered one at a time, each after the time it takes at /rate/ bytes/s, at once if
+ * /rate/ is 0, or kept until release() while /holding/.
+ */
+class StubUpstream : public PatternServer {
+	boost::asio::deadline_timer _timer;
+	std::deque<bithorde::Read::Request> _queue;
+	std::vector<bithorde::Read::Request> _held;
+public:
+	typedef std::shared_ptr<StubUpstream> Ptr;
+
+	const std::string name;
+	bithorde::Status bindStatus = bithorde::SUCCESS;
+	double rate = 0;
+	bool holding = false;
+	size_t binds = 0;
+	size_t served = 0;
+	std::vector< std::pair<uint64_t, size_t> > requested; // Offset and size of each Read.Request
+
+	static Ptr create(boost::asio::io_service& ioSvc, const std::string& name, uint64_t size) {
+		return Ptr(new StubUpstream(ioSvc, name, size));
+	}
+
+	size_t held() const { return _held.size(); }
+
+	/**
+	 * Answers the reads kept while holding
+	 */
+	void release() {
+		auto held = std::move(_held);
+		_held.clear();
+		for (auto iter = held.begin(); iter != held.end(); iter++)
+			answer(*iter);
+	}
+protected:
+	StubUpstream(boost::asio::io_service& ioSvc, const std::string& name, uint64_t size) :
+		PatternServer(ioSvc, size, name),
+		_timer(ioSvc),
+		name(name)
+	{}
+
+	void answer(const bithorde::Read::Request& req) {
+		auto size = (req.offset() < assetSize) ? std::min<uint64_t>(req.size(), assetSize - req.offset()) : 0;
+		bithorde::Read::Response resp;
+		resp.set_reqid(req.reqid());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(req.offset());
+		sendReadResponse(req.handle(), resp, patternChunk(req.offset(), size));
+		served++;
+	}
+
+	void next() {
+		auto delay = boost::posix_time::microseconds((int64_t)(_queue.front().size() * 1e6 / rate));
+		_timer.expires_from_now(delay);
+		_timer.async_wait([this](const boost::system::error_code& err) {
+			if (err)
+				return;
+			answer(_queue.front());
+			_queue.pop_front();
+			if (!_queue.empty())
+				next();
+		});
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::BindRead> >& msgCtx) {
+		const auto& msg = msgCtx->message();
+		if (msg.ids_size()) {
+			binds++;
+			if (bindStatus == bithorde::SUCCESS)
+				return bindSuccess(msg);
+		}
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		if (msg.ids_size()) {
+			resp.set_status(bindStatus);
+			resp.mutable_ids()->CopyFrom(msg.ids());
+		} else {
+			resp.set_status(bithorde::NOTFOUND);
+		}
+		sendAssetStatus(resp);
+	}
+
+	virtual void onMessage(const std::shared_ptr< bithorde::MessageContext<bithorde::Read::Request> >& msgCtx) {
+		const auto& req = msgCtx->message();
+		requested.emplace_back(req.offset(), req.size());
+		if (holding) {
+			_held.push_back(req);
+		} else if (rate > 0) {
+			_queue.push_back(req);
+			if (_queue.size() == 1)
+				next();
+		} else {
+			answer(req);
+		}
+	}
+};
+
+/**
+ * A bithorded Server without listeners or sources, whose router forwards to StubUpstreams
+ * connected as the friends named. Everything runs on /ioSvc/, in the thread of the test.
+ */
+struct RouterFixture {
+	boost::asio::io_service ioSvc;
+	boost::filesystem::path configPath;
+	std::unique_ptr<bithorded::Config> config;
+	std::unique_ptr<bithorded::Server> server;
+	std::vector<StubUpstream::Ptr> upstreams;
+
+	/**
+	 * /options/ are lines of the [server] section of the config
+	 */
+	RouterFixture(const std::vector<std::string>& friends, const std::string& options="") :
+		configPath(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bithorded-%%%%-%%%%.conf"))
+	{
+		{
+			std::ofstream cfg(configPath.string());
+			cfg << "[server]\nname = router\nparallel = 0\ntcpPort = 0\ninspectPort = 0\nunixSocket =\n" << options << '\n';
+			for (auto iter = friends.begin(); iter != friends.end(); iter++)
+				cfg << "[friend." << *iter << "]\ncipher = plain\n";
+		}
+		std::string arg0("bithorded"), arg1("-c"), arg2(configPath.string());
+		char* argv[] = { &arg0[0], &arg1[0], &arg2[0] };
+		config.reset(new bithorded::Config(3, argv));
+		server.reset(new bithorded::Server(ioSvc, *config));
+	}
+
+	~RouterFixture() {
+		for (auto iter = upstreams.begin(); iter != upstreams.end(); iter++)
+			(*iter)->close();
+		runUntil([this]() { return router().connectedFriends().empty(); }, 1000);
+		server.reset();
+		boost::filesystem::remove(configPath);
+	}
+
+	bithorded::router::Router& router() { return server->router(); }
+
+	/**
+	 * The client of the router, talking to the friend /name/
+	 */
+	bithorded::Client::Ptr friendClient(const std::string& name) {
+		return router().connectedFriends().at(name);
+	}
+
+	/**
+	 * Connects a StubUpstream as the friend /name/, like a FriendConnector would
+	 */
+	StubUpstream::Ptr connect(const std::string& name, uint64_t size) {
+		using boost::asio::ip::tcp;
+		tcp::acceptor acceptor(ioSvc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+		auto near = std::make_shared<tcp::socket>(ioSvc), far = std::make_shared<tcp::socket>(ioSvc);
+		near->connect(acceptor.local_endpoint());
+		acceptor.accept(*far);
+
+		auto upstream = StubUpstream::create(ioSvc, name, size);
+		auto stats = std::make_shared<bithorde::ConnectionStats>(std::make_shared<TimerService>(ioSvc));
+		upstream->connect(bithorde::Connection::create(ioSvc, stats, far));
+		server->hookup(near, ioSvc, server->getClientConfig(name));
+		BOOST_REQUIRE( runUntil([&]() { return router().connectedFriends().count(name) > 0; }) );
+		upstreams.push_back(upstream);
+		return upstream;
+	}
+
+	/**
+	 * Fills the send-queue to the friend /name/ with Pings, until nothing more can be sent to it
+	 */
+	void saturate(const std::string& name) {
+		auto client = friendClient(name);
+		bithorde::Ping ping;
+		ping.set_timeout(0);
+		size_t queued = 0;
+		while (client->sendMessage(bithorde::Connection::Ping, ping) && (queued < 1000000))
+			queued++;
+	}
+
+	/**
+	 * Opens testIds() through the router, and binds it by /downstream/ as a client would
+	 */
+	bithorded::router::ForwardedAsset::Ptr bind(bithorded::AssetBinding& downstream) {
+		bithorde::BindRead req;
+		req.mutable_ids()->CopyFrom(testIds());
+		auto asset = router().findAsset(req);
+		BOOST_REQUIRE( asset );
+		BOOST_REQUIRE( downstream.bind(asset, testIds(), bithorde::RouteTrace(), boost::posix_time::neg_infin) );
+		return std::dynamic_pointer_cast<bithorded::router::ForwardedAsset>(asset->shared());
+	}
+
+	/**
+	 * Runs ioSvc until /done/, or for at most /ms/ milliseconds. Returns done().
+	 */
+	bool runUntil(const std::function<bool()>& done, int ms=2000) {
+		auto expired = std::make_shared<bool>(false);
+		boost::asio::deadline_timer timer(ioSvc, boost::posix_time::milliseconds(ms));
+		timer.async_wait([expired](const boost::system::error_code& err) { *expired = !err; });
+		ioSvc.reset();
+		while (!done() && !*expired && ioSvc.run_one());
+		return done();
+	}
+};
+
+/**
+ * The value inspected for /key/ of /dir/, or empty if none
+ */
+inline std::string inspected(const bithorded::management::Directory& dir, const std::string& key) {
+	bithorded::management::InfoList info;
+	dir.inspect(info);
+	for (auto iter = info.begin(); iter != info.end(); iter++) {
+		if (iter->name == key)
+			return iter->str();
+	}
+	return std::string();
+}
+
+#endif // TEST_ROUTER_HPP
@@ -0,0 +1,142 @@
+#include "../lib/sharedmemory.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace bithorde;
+
+/**
+ * Attaches a second side to /channel/, as the peer would from the passed descriptors
+ */
+static SharedMemoryChannel::Ptr attachPeer(const SharedMemoryChannel::Ptr& channel) {
+	std::vector<int> fds;
+	for (auto fd : channel->fds())
+		fds.push_back(dup(fd));
+	return SharedMemoryChannel::attach(fds, channel->ringSize());
+}
+
+static bool woken(int fd) {
+	uint64_t count = 0;
+	return (read(fd, &count, sizeof(count)) == sizeof(count)) && count;
+}
+
+BOOST_AUTO_TEST_CASE( shared_ring_wraps )
+{
+	auto a = SharedMemoryChannel::create(MIN_RING_SIZE);
+	BOOST_REQUIRE( a );
+	auto b = attachPeer(a);
+	BOOST_REQUIRE( b );
+
+	// Chunks not dividing the ring, so that writes and reads wrap at every offset
+	const size_t CHUNK = 1000, TOTAL = 1000*CHUNK;
+	std::vector<byte> out(CHUNK), in(CHUNK);
+	size_t written = 0, consumed = 0;
+	bool intact = true;
+	while (consumed < TOTAL) {
+		while (written < TOTAL && a->tx().writable() >= CHUNK) {
+			for (size_t i=0; i < CHUNK; i++)
+				out[i] = (written + i) % 251;
+			BOOST_REQUIRE_EQUAL( a->tx().write(out.data(), CHUNK), CHUNK );
+			written += CHUNK;
+		}
+		BOOST_REQUIRE_LE( b->rx().readable(), MIN_RING_SIZE );
+		auto got = b->rx().read(in.data(), CHUNK);
+		for (size_t i=0; i < got; i++)
+			intact = intact && (in[i] == (consumed + i) % 251);
+		consumed += got;
+	}
+	BOOST_CHECK( intact );
+	BOOST_CHECK_EQUAL( b->rx().readable(), 0 );
+
+	// The other direction is independent
+	BOOST_CHECK_EQUAL( b->tx().writable(), MIN_RING_SIZE );
+	BOOST_CHECK_EQUAL( a->rx().readable(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( shared_ring_wakeups )
+{
+	auto a = SharedMemoryChannel::create(MIN_RING_SIZE);
+	BOOST_REQUIRE( a );
+	auto b = attachPeer(a);
+	BOOST_REQUIRE( b );
+	byte data[64] = {0};
+
+	// An empty ring is waited on, and the consumer woken by the next write
+	BOOST_CHECK( b->rx().waitReadable() );
+	BOOST_CHECK( !woken(b->wakeFd()) );
+	a->tx().write(data, sizeof(data));
+	BOOST_CHECK( a->tx().wakeConsumer() );
+	a->wakePeer();
+	BOOST_CHECK( woken(b->wakeFd()) );
+	BOOST_CHECK( !woken(a->wakeFd()) );
+
+	// Once woken, further writes do not wake again
+	a->tx().write(data, sizeof(data));
+	BOOST_CHECK( !a->tx().wakeConsumer() );
+
+	// Nothing to wait for with data in the ring
+	BOOST_CHECK( !b->rx().waitReadable() );
+	BOOST_CHECK( !a->tx().wakeConsumer() );
+
+	// A full ring is waited on, and the producer woken by the next read
+	while (a->tx().writable())
+		a->tx().write(data, std::min(sizeof(data), a->tx().writable()));
+	BOOST_CHECK( a->tx().waitWritable() );
+	b->rx().read(data, sizeof(data));
+	BOOST_CHECK( b->rx().wakeProducer() );
+	BOOST_CHECK( !a->tx().waitWritable() );
+}
+
+BOOST_AUTO_TEST_CASE( shared_memory_checks_peer )
+{
+	BOOST_CHECK( !SharedMemoryChannel::create(MIN_RING_SIZE + 1) );
+	BOOST_CHECK( !SharedMemoryChannel::create(MIN_RING_SIZE / 2) );
+
+	// The peer must attach with the size offered
+	auto a = SharedMemoryChannel::create(MIN_RING_SIZE);
+	BOOST_REQUIRE( a );
+	std::vector<int> fds;
+	for (auto fd : a->fds())
+		fds.push_back(dup(fd));
+	BOOST_CHECK( !SharedMemoryChannel::attach(fds, 2*MIN_RING_SIZE) );
+	BOOST_CHECK( !SharedMemoryChannel::attach(std::vector<int>{dup(a->fds()[0])}, MIN_RING_SIZE) );
+}
+
+BOOST_AUTO_TEST_CASE( shared_ring_rejects_scribbled_header )
+{
+	auto a = SharedMemoryChannel::create(MIN_RING_SIZE);
+	BOOST_REQUIRE( a );
+	auto b = attachPeer(a);
+	BOOST_REQUIRE( b );
+	byte data[1024] = {0};
+	BOOST_REQUIRE_EQUAL( a->tx().write(data, sizeof(data)), sizeof(data) );
+
+	// The header of the first ring, as mapped by a peer of its own
+	auto size = 2 * (SharedRing::HEADER_SIZE + MIN_RING_SIZE);
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, a->fds()[0], 0);
+	BOOST_REQUIRE( map != MAP_FAILED );
+	auto hdr = static_cast<SharedRing::Header*>(map);
+
+	// A head claiming more than the ring holds is not read from
+	hdr->head += 2*MIN_RING_SIZE;
+	BOOST_CHECK_EQUAL( b->rx().readable(), 0 );
+	BOOST_CHECK_EQUAL( b->rx().read(data, sizeof(data)), 0 );
+	BOOST_CHECK( b->rx().corrupt() );
+
+	// Nor written to, once it is back in place, nor with a tail passed the head
+	hdr->head -= 2*MIN_RING_SIZE;
+	BOOST_CHECK_EQUAL( b->rx().read(data, sizeof(data)), 0 );
+	hdr->tail = hdr->head + 1;
+	BOOST_CHECK_EQUAL( a->tx().writable(), 0 );
+	BOOST_CHECK_EQUAL( a->tx().write(data, sizeof(data)), 0 );
+	BOOST_CHECK( a->tx().corrupt() );
+
+	// The other ring is unaffected
+	BOOST_CHECK( !b->tx().corrupt() );
+	BOOST_CHECK_EQUAL( b->tx().write(data, sizeof(data)), sizeof(data) );
+	BOOST_CHECK_EQUAL( a->rx().read(data, sizeof(data)), sizeof(data) );
+	munmap(map, size);
+}
@@ -2,6 +2,8 @@
 #include <vector>
 #include <ctime>
 #include <crypto++/tiger.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -111,6 +113,8 @@ BOOST_FIXTURE_TEST_CASE( open_fully_cached_v2_asset, TestData )
 	auto asset = cache::CachedAsset::open(gcd, assets/".bh_meta"/"assets"/"v2_cached");
 	BOOST_CHECK_EQUAL(asset->hasRootHash(), true);
 	BOOST_CHECK_EQUAL(asset->canRead(asset->size()-1024, 1024), 1024);
+	// Whole asset is larger than legacy chunks
+	BOOST_CHECK_EQUAL(asset->canRead(0, asset->size()), asset->size());
 }
 
 BOOST_FIXTURE_TEST_CASE( open_v2_linked_asset, TestData )
@@ -142,3 +146,32 @@ BOOST_FIXTURE_TEST_CASE( open_v2_linked_asset, TestData )
 	BOOST_CHECK_EQUAL( asset->status->status(), bithorde::Status::NONE );
 	fs::remove_all(assets_folder/asset->id());
 }
+
+BOOST_AUTO_TEST_CASE( read_only_descriptor_follows_file )
+{
+	auto path = fs::temp_directory_path() / fs::unique_path("bhtest-raf-%%%%-%%%%");
+	std::string original(1024, 'a'), replacement(1024, 'b');
+	RandomAccessFile f(path, RandomAccessFile::READWRITE, 1024);
+	BOOST_REQUIRE_EQUAL( f.write(0, original.data(), original.size()), 1024 );
+
+	// Replaced at the path, after the file was opened
+	auto moved = path.string() + ".old";
+	fs::rename(path, moved);
+	{
+		RandomAccessFile other(path, RandomAccessFile::READWRITE, 1024);
+		other.write(0, replacement.data(), replacement.size());
+	}
+
+	uint64_t offset = 1;
+	int fd = f.openReadOnly(offset);
+	BOOST_REQUIRE_GE( fd, 0 );
+	BOOST_CHECK_EQUAL( offset, 0 );
+	char c = 0;
+	BOOST_CHECK_EQUAL( ::pread(fd, &c, 1, 0), 1 );
+	BOOST_CHECK_EQUAL( c, 'a' );
+	BOOST_CHECK( (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY );
+	BOOST_CHECK_LT( ::write(fd, &c, 1), 0 );
+	::close(fd);
+	fs::remove(path);
+	fs::remove(moved);
+}
@@ -0,0 +1,323 @@
+#include <functional>
+#include <map>
+
+#include <boost/chrono.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "bithorded/router/stripe.hpp"
+#include "lib/asset.h"
+#include "lib/buffer.hpp"
+#include "lib/client.h"
+
+#include "test_client.hpp"
+#include "test_router.hpp"
+
+using namespace std;
+using namespace bithorded::router;
+namespace ptime = boost::posix_time;
+
+BOOST_AUTO_TEST_CASE( stripe_by_throughput )
+{
+	// Measured at about 4:1, by the same amount arriving in a quarter of the time
+	auto now = ptime::microsec_clock::universal_time();
+	std::vector<UpstreamLoad> loads(3);
+	loads[0].sent(10000);
+	loads[0].arrived(10000, 10000, now - ptime::milliseconds(10));
+	loads[1].sent(10000);
+	loads[1].arrived(10000, 10000, now - ptime::milliseconds(40));
+	BOOST_CHECK_EQUAL( loads[0].inFlight(), 0 );
+	BOOST_CHECK_GT( loads[0].throughput(), 3*loads[1].throughput() );
+	BOOST_CHECK_EQUAL( loads[2].throughput(), 0 );
+
+	// Not yet measured, so expected as fast as the fastest, and tried once that is busy
+	auto pick = [&]() {
+		return leastLoaded(loads.begin(), loads.end(), 1000, [](UpstreamLoad& l) { return &l; });
+	};
+	BOOST_CHECK( pick() == loads.begin() );
+	loads[0].sent(1000);
+	BOOST_CHECK( pick() == loads.begin() + 2 );
+	loads[0].arrived(1000, 0, now);
+
+	// Reads in flight spread by throughput, passing by the unmeasured
+	auto measured = [](UpstreamLoad& l) { return l.throughput() ? &l : NULL; };
+	for (int i=0; i < 100; i++)
+		leastLoaded(loads.begin(), loads.end(), 1000, measured)->sent(1000);
+	BOOST_CHECK_EQUAL( loads[0].inFlight() + loads[1].inFlight(), 100*1000 );
+	BOOST_CHECK_GT( loads[0].inFlight(), 3*loads[1].inFlight() );
+	BOOST_CHECK_LT( loads[0].inFlight(), 5*loads[1].inFlight() );
+
+	// A failed read is no longer in flight, but not measured
+	auto before = loads[1].throughput();
+	loads[1].arrived(loads[1].inFlight(), 0, now);
+	BOOST_CHECK_EQUAL( loads[1].inFlight(), 0 );
+	BOOST_CHECK_EQUAL( loads[1].throughput(), before );
+}
+
+const size_t STRIPE_CHUNK = 64*1024;
+const size_t STRIPE_CHUNKS = 128;
+const double UPSTREAM_RATE = 16*1024*1024; // Bytes/s, per upstream
+
+/**
+ * A router with friends serving the asset at /rates/, and the asset bound through it
+ */
+struct StripedRouter {
+	RouterFixture router;
+	bithorded::AssetBinding downstream;
+	ForwardedAsset::Ptr asset;
+
+	StripedRouter(const std::vector<double>& rates, const std::string& options="") :
+		router(names(rates.size()), options)
+	{
+		for (size_t i=0; i < rates.size(); i++)
+			router.connect(names(rates.size())[i], STRIPE_CHUNK*STRIPE_CHUNKS)->rate = rates[i];
+		asset = router.bind(downstream);
+		BOOST_REQUIRE( router.runUntil([&]() { return found() == rates.size(); }) );
+	}
+
+	static std::vector<std::string> names(size_t count) {
+		std::vector<std::string> res;
+		for (size_t i=0; i < count; i++)
+			res.push_back("up" + std::to_string(i));
+		return res;
+	}
+
+	/**
+	 * Upstreams having answered the bind with the asset
+	 */
+	size_t found() const {
+		size_t res = 0;
+		for (auto iter = router.upstreams.begin(); iter != router.upstreams.end(); iter++) {
+			if (inspected(*asset, "upstream_" + (*iter)->name).compare(0, 7, "SUCCESS") == 0)
+				res++;
+		}
+		return res;
+	}
+
+	/**
+	 * Reads all chunks through the router, with /window/ of them in flight at a time. Returns bytes/s.
+	 */
+	double read(size_t window, bool& intact) {
+		size_t requested = 0, received = 0;
+		std::function<void()> request = [&]() {
+			uint64_t offset = requested++ * STRIPE_CHUNK;
+			asset->asyncRead(offset, STRIPE_CHUNK, 0, [&, offset](int64_t, const std::shared_ptr<bithorde::IBuffer>& data) {
+				intact = intact && (data->size() == STRIPE_CHUNK) && PatternServer::matchesPattern(offset, **data, data->size());
+				received++;
+				if (requested < STRIPE_CHUNKS)
+					request();
+			});
+		};
+		auto start = boost::chrono::steady_clock::now();
+		while (requested < std::min(window, STRIPE_CHUNKS))
+			request();
+		router.runUntil([&]() { return received == STRIPE_CHUNKS; }, 30000);
+		auto seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+		BOOST_CHECK_EQUAL( received, STRIPE_CHUNKS );
+		BOOST_CHECK_EQUAL( inspected(*asset, "pendingReads"), "0" );
+		return received * STRIPE_CHUNK / seconds;
+	}
+};
+
+BOOST_AUTO_TEST_CASE( striped_read_throughput )
+{
+	// The same asset from one to three upstreams of equal bandwidth, each sent its share of the chunks
+	std::vector<double> rates;
+	for (int upstreams = 1; upstreams <= 3; upstreams++) {
+		rates.push_back(UPSTREAM_RATE);
+		StripedRouter striped(rates);
+		bool intact = true;
+		auto rate = striped.read(16, intact);
+		BOOST_CHECK( intact );
+		size_t served = 0;
+		for (auto iter = striped.router.upstreams.begin(); iter != striped.router.upstreams.end(); iter++) {
+			BOOST_CHECK_GT( (*iter)->served, STRIPE_CHUNKS / (2*upstreams) );
+			served += (*iter)->served;
+		}
+		BOOST_CHECK_EQUAL( served, STRIPE_CHUNKS );
+		BOOST_TEST_MESSAGE( "striped_read_throughput: " << upstreams << " upstreams " << (rate / (1024*1024)) << " MB/s" );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( striped_read_follows_bandwidth )
+{
+	// One upstream four times as fast as the other gets most of the reads
+	StripedRouter striped(std::vector<double>{UPSTREAM_RATE, UPSTREAM_RATE/4});
+	bool intact = true;
+	auto rate = striped.read(16, intact);
+	BOOST_CHECK( intact );
+	auto fast = striped.router.upstreams[0]->served, slow = striped.router.upstreams[1]->served;
+	BOOST_TEST_MESSAGE( "striped_read_follows_bandwidth: " << fast << ':' << slow << " chunks, " << (rate / (1024*1024)) << " MB/s" );
+	BOOST_CHECK_EQUAL( fast + slow, STRIPE_CHUNKS );
+	BOOST_CHECK_GT( fast, 2*slow );
+}
+
+BOOST_AUTO_TEST_CASE( hedge_within_budget )
+{
+	BOOST_CHECK( !HedgeBudget(0).enabled() );
+
+	// One hedge per twenty reads
+	HedgeBudget budget(0.05);
+	BOOST_CHECK( budget.enabled() );
+	for (int i=0; i < 19; i++)
+		budget.read();
+	BOOST_CHECK( !budget.spend() );
+	budget.read();
+	BOOST_CHECK( budget.spend() );
+	BOOST_CHECK( !budget.spend() );
+
+	// Saved up only to a small burst
+	for (int i=0; i < 1000; i++)
+		budget.read();
+	int hedged = 0;
+	while (budget.spend())
+		hedged++;
+	BOOST_CHECK_GT( hedged, 1 );
+	BOOST_CHECK_LT( hedged, 50 );
+	BOOST_CHECK_EQUAL( budget.hedged(), hedged + 1 );
+	BOOST_CHECK_EQUAL( budget.reads(), 1020 );
+
+	// Only once the upstream is measured, and then past most of its reads
+	LatencyHistogram latency("ms");
+	for (int i=0; i < 10; i++)
+		latency.post(10);
+	BOOST_CHECK_EQUAL( hedgeDelay(latency), 0 );
+	for (int i=0; i < 90; i++)
+		latency.post(10);
+	for (int i=0; i < 3; i++)
+		latency.post(500);
+	BOOST_CHECK_GE( hedgeDelay(latency), 10 );
+	BOOST_CHECK_LT( hedgeDelay(latency), 500 );
+
+	// Reads timing out are not taken for slow answers
+	auto delay = hedgeDelay(latency);
+	for (int i=0; i < 10; i++)
+		latency.timedOut();
+	BOOST_CHECK_EQUAL( hedgeDelay(latency), delay );
+}
+
+BOOST_AUTO_TEST_CASE( cancelled_read_stays_quiet )
+{
+	RouterFixture router({"up0"});
+	auto upstream = router.connect("up0", STRIPE_CHUNK*STRIPE_CHUNKS);
+	auto client = router.friendClient("up0");
+	auto asset = bindAsset(client, router.ioSvc);
+	std::vector<int> arrived;
+	boost::signals2::scoped_connection c = asset->dataArrived.connect([&](uint64_t, const std::shared_ptr<bithorde::IBuffer>& data, int tag) {
+		BOOST_CHECK_EQUAL( data->size(), STRIPE_CHUNK );
+		arrived.push_back(tag);
+	});
+
+	// The answer to the cancelled read is taken, but not passed on, nor its id reused meanwhile
+	auto cancelled = asset->aSyncRead(0, STRIPE_CHUNK);
+	asset->cancelRead(cancelled);
+	auto wanted = asset->aSyncRead(STRIPE_CHUNK, STRIPE_CHUNK);
+	BOOST_CHECK_NE( cancelled, wanted );
+	BOOST_CHECK( router.runUntil([&]() { return (upstream->served == 2) && !arrived.empty(); }) );
+	BOOST_REQUIRE_EQUAL( arrived.size(), 1 );
+	BOOST_CHECK_EQUAL( arrived.front(), wanted );
+	BOOST_CHECK( router.runUntil([&]() { return client->readLatency.count() == 2; }) );
+}
+
+BOOST_AUTO_TEST_CASE( hedged_read_withdraws_the_slower )
+{
+	StripedRouter striped(std::vector<double>{0, 0}, "hedgeReads = 1");
+	auto& router = striped.router;
+
+	// Both friends measured answering within a millisecond, until they hold on to their reads
+	for (auto iter = router.upstreams.begin(); iter != router.upstreams.end(); iter++) {
+		auto client = router.friendClient((*iter)->name);
+		for (unsigned i=0; i < 2*bithorde::ADAPTIVE_TIMEOUT_SAMPLES; i++)
+			client->readLatency.post(1);
+		(*iter)->holding = true;
+	}
+	auto held = [&]() { return router.upstreams[0]->held() + router.upstreams[1]->held(); };
+
+	std::vector< std::shared_ptr<bithorde::IBuffer> > answers;
+	striped.asset->asyncRead(0, STRIPE_CHUNK, 5000, [&](int64_t offset, const std::shared_ptr<bithorde::IBuffer>& data) {
+		BOOST_CHECK_EQUAL( offset, 0 );
+		answers.push_back(data);
+	});
+	BOOST_REQUIRE( router.runUntil([&]() { return held() == 1; }) );
+	auto first = router.upstreams[0]->held() ? router.upstreams[0] : router.upstreams[1];
+	auto second = (first == router.upstreams[0]) ? router.upstreams[1] : router.upstreams[0];
+
+	// Sent to the other friend as well, whose answer is taken, while the first is withdrawn
+	BOOST_REQUIRE( router.runUntil([&]() { return held() == 2; }) );
+	BOOST_CHECK_EQUAL( router.router().hedges().hedged(), 1 );
+	second->release();
+	BOOST_REQUIRE( router.runUntil([&]() { return !answers.empty(); }) );
+	BOOST_CHECK_EQUAL( answers.front()->size(), STRIPE_CHUNK );
+	BOOST_CHECK( PatternServer::matchesPattern(0, **answers.front(), answers.front()->size()) );
+	BOOST_CHECK_EQUAL( router.router().hedges().hedgesWon(), 1 );
+
+	// The late answer of the first is not passed on, nor counted as in flight
+	first->release();
+	BOOST_CHECK( !router.runUntil([&]() { return answers.size() > 1; }, 100) );
+	BOOST_CHECK_EQUAL( inspected(*striped.asset, "pendingReads"), "0" );
+	for (auto iter = router.upstreams.begin(); iter != router.upstreams.end(); iter++) {
+		auto load = inspected(*striped.asset, "upstream_" + (*iter)->name);
+		BOOST_CHECK_MESSAGE( load.find("inFlight: 0") != std::string::npos, load );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( overlapping_reads_share_upstream_reads )
+{
+	StripedRouter striped(std::vector<double>{0});
+	auto& router = striped.router;
+	auto upstream = router.upstreams.front();
+	upstream->holding = true;
+
+	std::map<uint64_t, std::shared_ptr<bithorde::IBuffer>> answers;
+	auto read = [&](uint64_t offset, size_t size) {
+		striped.asset->asyncRead(offset, size, 5000, [&, offset](int64_t, const std::shared_ptr<bithorde::IBuffer>& data) {
+			answers[offset] = data;
+		});
+	};
+
+	// Within the first read, waiting for it. Partly within it, fetching only the rest.
+	read(0, STRIPE_CHUNK);
+	read(STRIPE_CHUNK/4, STRIPE_CHUNK/2);
+	read(STRIPE_CHUNK/2, 2*STRIPE_CHUNK);
+	BOOST_REQUIRE( router.runUntil([&]() { return upstream->held() == 2; }) );
+	BOOST_CHECK( !router.runUntil([&]() { return upstream->held() > 2; }, 50) );
+	typedef std::vector< std::pair<uint64_t, size_t> > Requested;
+	BOOST_CHECK( upstream->requested == (Requested{{0, STRIPE_CHUNK}, {STRIPE_CHUNK, STRIPE_CHUNK*3/2}}) );
+
+	// Each answered with its own range, from the single response for each part
+	upstream->release();
+	BOOST_REQUIRE( router.runUntil([&]() { return answers.size() == 3; }) );
+	BOOST_CHECK_EQUAL( answers[0]->size(), STRIPE_CHUNK );
+	BOOST_CHECK_EQUAL( answers[STRIPE_CHUNK/4]->size(), STRIPE_CHUNK/2 );
+	BOOST_CHECK_EQUAL( answers[STRIPE_CHUNK/2]->size(), 2*STRIPE_CHUNK );
+	for (auto iter = answers.begin(); iter != answers.end(); iter++)
+		BOOST_CHECK( PatternServer::matchesPattern(iter->first, **iter->second, iter->second->size()) );
+	BOOST_CHECK_EQUAL( router.router().upstreamBytes.value(), STRIPE_CHUNK*5/2 );
+	BOOST_CHECK_EQUAL( router.router().downstreamBytes.value(), STRIPE_CHUNK*7/2 );
+	BOOST_CHECK_EQUAL( inspected(*striped.asset, "pendingReads"), "0" );
+}
+
+BOOST_AUTO_TEST_CASE( split_range_by_reads_in_flight )
+{
+	typedef std::vector< std::pair<uint64_t, uint64_t> > Ranges;
+	auto split = [](uint64_t offset, uint64_t end, const Ranges& inFlight) {
+		// Ends of the parts, and the read each is within or -1
+		std::vector< std::pair<uint64_t, int> > res;
+		auto parts = splitRange(offset, end, inFlight.begin(), inFlight.end(), [](const std::pair<uint64_t, uint64_t>& r) { return r; });
+		for (auto iter = parts.begin(); iter != parts.end(); iter++)
+			res.emplace_back(iter->first, (iter->second == inFlight.end()) ? -1 : (iter->second - inFlight.begin()));
+		return res;
+	};
+	typedef std::vector< std::pair<uint64_t, int> > Parts;
+
+	// Within a single read, even when an earlier one overlaps only partly
+	Ranges inFlight{{0, 25}, {5, 100}};
+	BOOST_CHECK( split(20, 40, inFlight) == (Parts{{40, 1}}) );
+	BOOST_CHECK( split(0, 25, inFlight) == (Parts{{25, 0}}) );
+
+	// Only the bytes not on the way are left to fetch
+	BOOST_CHECK( split(50, 150, inFlight) == (Parts{{100, 1}, {150, -1}}) );
+	inFlight = Ranges{{100, 200}, {300, 400}};
+	BOOST_CHECK( split(50, 350, inFlight) == (Parts{{100, -1}, {200, 0}, {300, -1}, {350, 1}}) );
+	BOOST_CHECK( split(150, 250, inFlight) == (Parts{{200, 0}, {250, -1}}) );
+	BOOST_CHECK( split(200, 300, inFlight) == (Parts{{300, -1}}) );
+}